@@ -18,6 +18,10 @@ int do_create(const char* filename, struct pictdb_file* db_file)
     if (strlen(filename) == 0 || strlen(filename) > MAX_DB_NAME) {
         return ERR_INVALID_FILENAME;
     }
+    const uint32_t nb_tiers = db_file->header.nb_tiers;
+    if (nb_tiers > MAX_NB_RES - NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
 
     // Open stream and check for errors
     db_file->fpdb = fopen(filename, "wb+");
@@ -32,12 +36,21 @@ int do_create(const char* filename, struct pictdb_file* db_file)
     // Initialize header
     db_file->header.db_version = 0;
     db_file->header.num_files = 0;
+    // The encodings follow the metadata, then the tier extension
+    db_file->header.tiers_offset = sizeof(struct pictdb_header)
+                                   + (uint64_t) db_file->header.max_files
+                                   * sizeof(struct pict_metadata)
+                                   + sizeof(db_file->encodings);
 
     // Dynamically allocates memory to the metadata
     db_file->metadata = calloc(db_file->header.max_files,
                                sizeof(struct pict_metadata));
+    db_file->variants = nb_tiers == 0 ? NULL :
+                        calloc((size_t) db_file->header.max_files * nb_tiers,
+                               sizeof(struct tier_variant));
     // Check for allocation error
-    if (db_file->metadata == NULL) {
+    if (db_file->metadata == NULL
+        || (nb_tiers > 0 && db_file->variants == NULL)) {
         do_close(db_file);
         remove(filename);
         return ERR_OUT_OF_MEMORY;
@@ -49,7 +62,19 @@ int do_create(const char* filename, struct pictdb_file* db_file)
     size_t metadata_ctrl = fwrite(db_file->metadata,
                                   sizeof(struct pict_metadata),
                                   db_file->header.max_files, db_file->fpdb);
-    if (header_ctrl != 1 || metadata_ctrl != db_file->header.max_files) {
+    const size_t encodings_ctrl = fwrite(db_file->encodings,
+                                         sizeof(db_file->encodings), 1,
+                                         db_file->fpdb);
+    const size_t nb_variants = (size_t) db_file->header.max_files * nb_tiers;
+    const int tiers_ok = nb_tiers == 0
+                         || (fwrite(db_file->tiers, sizeof(struct pictdb_tier),
+                                    nb_tiers, db_file->fpdb) == nb_tiers
+                             && fwrite(db_file->variants,
+                                       sizeof(struct tier_variant),
+                                       nb_variants, db_file->fpdb)
+                             == nb_variants);
+    if (header_ctrl != 1 || metadata_ctrl != db_file->header.max_files
+        || encodings_ctrl != 1 || !tiers_ok) {
         fprintf(stderr, "Error : cannot create database %s\n",
                 db_file->header.db_name);
         do_close(db_file);
@@ -40,6 +40,8 @@ int do_gbcollect(struct pictdb_file* db_file, const char* db_name,
     struct pictdb_file temp = {
         .fpdb = NULL, .header = db_file->header, .metadata = NULL
     };
+    memcpy(temp.tiers, db_file->tiers, sizeof(temp.tiers));
+    memcpy(temp.encodings, db_file->encodings, sizeof(temp.encodings));
     int ret = do_create(tmp_name, &temp);
     if (ret != 0) {
         return ret;
@@ -53,10 +55,13 @@ int do_gbcollect(struct pictdb_file* db_file, const char* db_name,
         // Read valid image from old db and insert it to the new one
         if (pics[i].is_valid == NON_EMPTY) {
             ret = do_read(pics[i].pict_id, RES_ORIG, &image, &size, db_file);
-            ret = ret == 0 ? do_insert(image, size, pics[i].pict_id, &temp) : ret;
+            // The hash is already known, no need to compute it again
+            ret = ret == 0 ? do_insert_hashed(image, size, pics[i].SHA,
+                                              pics[i].pict_id, &temp) : ret;
             // Resize the images that are resized in the old db.
-            for (int r = 0; ret == 0 && r < RES_ORIG; ++r) {
-                if (pics[i].size[r] != 0 && pics[i].offset[r] != 0) {
+            for (int r = 0; ret == 0 && r < nb_resolutions(db_file); ++r) {
+                if (r != RES_ORIG && variant_size(db_file, i, r) != 0
+                    && variant_offset(db_file, i, r) != 0) {
                     ret = lazily_resize(r, &temp, temp.header.num_files - 1);
                 }
             }
@@ -6,9 +6,14 @@
  * @author Nicolas Phan Van
  */
 
+#define _POSIX_C_SOURCE 200809L // for fileno and ftruncate
+
 #include "pictDB.h"
 #include "dedup.h"
 #include "image_content.h"
+#include "trace.h"
+#include <unistd.h> // for ftruncate
+#include <openssl/evp.h>
 
 #define RET_ERROR if (ret != 0) return ret
 // fseek + error check
@@ -18,21 +23,249 @@
 #define WRITE(src, size) \
     ret = fwrite(src, size, 1, db_file->fpdb) == 1 ? 0 : ERR_IO
 
+/**
+ * @brief Fills the first empty metadata of a database with the information
+ *        of a new image and deduplicates it.
+ *
+ * On error, the metadata is emptied again.
+ *
+ * @param db_file The database.
+ * @param sha     The hash of the image.
+ * @param size    The size of the image.
+ * @param pict_id The ID of the image.
+ * @param index   Location where the index of the new metadata will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int new_metadata(struct pictdb_file* db_file, const unsigned char* sha,
+                 uint64_t size, const char* pict_id, uint32_t* index);
+
+/**
+ * @brief Writes the header and the metadata of a newly inserted image.
+ *
+ * @param db_file The database.
+ * @param index   The index of the metadata of the image.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int write_new_metadata(struct pictdb_file* db_file, uint32_t index);
+
 
 int do_insert(const char* new_image, size_t size, const char* pict_id,
               struct pictdb_file* db_file)
+{
+    if (new_image == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    TRACE_BEGIN(hash);
+    int ret = compute_sha(new_image, size, sha);
+    TRACE_END(hash, "insert.hash");
+    return ret == 0 ? do_insert_hashed(new_image, size, sha, pict_id, db_file) :
+           ret;
+}
+
+int do_insert_hashed(const char* new_image, size_t size,
+                     const unsigned char* sha, const char* pict_id,
+                     struct pictdb_file* db_file)
 {
     // Argument check
-    if (new_image == NULL || pict_id == NULL || db_file == NULL
+    if (new_image == NULL || sha == NULL || pict_id == NULL || db_file == NULL
         || size == 0) {
         return ERR_INVALID_ARGUMENT;
     }
+
+    uint32_t idx_new = 0;
+    TRACE_BEGIN(dedup);
+    int ret = new_metadata(db_file, sha, size, pict_id, &idx_new);
+    TRACE_END(dedup, "insert.dedup");
+    RET_ERROR;
+
+    // Convenience
+    struct pict_metadata* empty = &db_file->metadata[idx_new];
+
+    // Image does not already exist in the database, write it at the end
+    if (empty->offset[RES_ORIG] == 0) {
+        TRACE_BEGIN(blob);
+        SEEK(0, SEEK_END);
+        if (ret == 0) {
+            empty->offset[RES_ORIG] = ftell(db_file->fpdb);
+            WRITE(new_image, size);
+        }
+        TRACE_END(blob, "insert.blob");
+    }
+
+    // Update metadata with image resolution
+    if (ret == 0) {
+        TRACE_BEGIN(resolution);
+        ret = get_resolution(&empty->res_orig[1], &empty->res_orig[0],
+                             new_image, size);
+        TRACE_END(resolution, "insert.resolution");
+    }
+
+    if (ret == 0) {
+        TRACE_BEGIN(header);
+        ret = write_new_metadata(db_file, idx_new);
+        TRACE_END(header, "insert.header");
+    }
+    if (ret != 0) {
+        memset(empty, 0, sizeof(struct pict_metadata));
+    }
+    return ret;
+}
+
+int do_reserve(struct pictdb_file* db_file, uint64_t size,
+               struct pictdb_upload* upload)
+{
+    if (db_file == NULL || upload == NULL || size == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(upload, 0, sizeof(struct pictdb_upload));
+    int ret = 0;
+    SEEK(0, SEEK_END);
+    RET_ERROR;
+    long end = ftell(db_file->fpdb);
+    if (end == -1) {
+        return ERR_IO;
+    }
+
+    // Grow the file by writing the last byte of the region
+    const char zero = '\0';
+    SEEK(end + size - 1, SEEK_SET);
+    if (ret == 0) {
+        WRITE(&zero, 1);
+    }
+    RET_ERROR;
+
+    upload->start = upload->offset = end;
+    upload->end = end + size;
+    upload->sha_ctx = EVP_MD_CTX_new();
+    return upload->sha_ctx == NULL ? ERR_OUT_OF_MEMORY : 0;
+}
+
+int do_upload_begin(struct pictdb_upload* upload)
+{
+    if (upload == NULL || upload->sha_ctx == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    upload->size = 0;
+    init_jpeg_scanner(&upload->scanner);
+    return EVP_DigestInit_ex(upload->sha_ctx, EVP_sha256(), NULL) == 1 ?
+           0 : ERR_INVALID_ARGUMENT;
+}
+
+int do_upload_write(struct pictdb_file* db_file, struct pictdb_upload* upload,
+                    const char* chunk, size_t len)
+{
+    if (db_file == NULL || upload == NULL || chunk == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (upload->offset + upload->size + len > upload->end) {
+        fprintf(stderr, "Error : image larger than its reserved region\n");
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = 0;
+    TRACE_BEGIN(blob);
+    SEEK(upload->offset + upload->size, SEEK_SET);
+    if (ret == 0 && len > 0) {
+        WRITE(chunk, len);
+    }
+    TRACE_END(blob, "insert.blob");
+    RET_ERROR;
+
+    TRACE_BEGIN(resolution);
+    scan_jpeg_size(&upload->scanner, (const unsigned char*) chunk, len);
+    TRACE_END(resolution, "insert.resolution");
+    upload->size += len;
+    TRACE_BEGIN(hash);
+    ret = EVP_DigestUpdate(upload->sha_ctx, chunk, len) == 1 ? 0 : ERR_IO;
+    TRACE_END(hash, "insert.hash");
+    return ret;
+}
+
+int do_upload_commit(struct pictdb_file* db_file,
+                     struct pictdb_upload* upload, const char* pict_id)
+{
+    if (db_file == NULL || upload == NULL || pict_id == NULL
+        || upload->size == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t height = 0;
+    uint32_t width = 0;
+    int ret = jpeg_scanner_resolution(&upload->scanner, &height, &width);
+    RET_ERROR;
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    TRACE_BEGIN(hash);
+    if (EVP_DigestFinal_ex(upload->sha_ctx, sha, NULL) != 1) {
+        return ERR_IO;
+    }
+    TRACE_END(hash, "insert.hash");
+
+    uint32_t idx_new = 0;
+    TRACE_BEGIN(dedup);
+    ret = new_metadata(db_file, sha, upload->size, pict_id, &idx_new);
+    TRACE_END(dedup, "insert.dedup");
+    RET_ERROR;
+
+    struct pict_metadata* empty = &db_file->metadata[idx_new];
+    empty->res_orig[0] = width;
+    empty->res_orig[1] = height;
+    // The image is already on disk, unless it is a duplicate
+    const int is_new = empty->offset[RES_ORIG] == 0;
+    if (is_new) {
+        empty->offset[RES_ORIG] = upload->offset;
+    }
+
+    TRACE_BEGIN(header);
+    ret = write_new_metadata(db_file, idx_new);
+    TRACE_END(header, "insert.header");
+    if (ret != 0) {
+        memset(empty, 0, sizeof(struct pict_metadata));
+    } else if (is_new) {
+        // Keep the bytes of the image, the next one is written after
+        upload->offset += upload->size;
+    }
+    upload->size = 0;
+    return ret;
+}
+
+void do_release(struct pictdb_file* db_file, struct pictdb_upload* upload)
+{
+    if (db_file == NULL || upload == NULL) {
+        return;
+    }
+
+    // Give back the unused end of the region if it is still at the end
+    // of the file. Otherwise it stays as a hole, cleaned by gc.
+    if (fflush(db_file->fpdb) == 0
+        && fseek(db_file->fpdb, 0, SEEK_END) == 0
+        && ftell(db_file->fpdb) == (long) upload->end
+        && ftruncate(fileno(db_file->fpdb), upload->offset) != 0) {
+        fprintf(stderr, "Error : cannot shrink reserved region\n");
+    }
+
+    EVP_MD_CTX_free(upload->sha_ctx);
+    upload->sha_ctx = NULL;
+}
+
+int new_metadata(struct pictdb_file* db_file, const unsigned char* sha,
+                 uint64_t size, const char* pict_id, uint32_t* index)
+{
     if (strlen(pict_id) == 0 || strlen(pict_id) > MAX_PIC_ID) {
         return ERR_INVALID_PICID;
     }
     if (!(db_file->header.num_files < db_file->header.max_files)) {
         return ERR_FULL_DATABASE;
     }
+    if (size >> 32 > 0) {
+        fprintf(stderr,
+                "Trying to fit a 64 bit integer into a 32 bit variable\n");
+        return ERR_INVALID_ARGUMENT;
+    }
 
     // Find index of first empty metadata
     uint32_t idx_new = 0;
@@ -44,51 +277,47 @@ int do_insert(const char* new_image, size_t size, const char* pict_id,
     struct pict_metadata* empty = &db_file->metadata[idx_new];
 
     // Update metadata with image information
-    (void)SHA256((unsigned char*)new_image, size, empty->SHA);  // Add checksum
+    memcpy(empty->SHA, sha, SHA256_DIGEST_LENGTH);
     strncpy(empty->pict_id, pict_id, MAX_PIC_ID + 1);
-    if (size >> 32 > 0) {
-        fprintf(stderr,
-                "Trying to fit a 64 bit integer into a 32 bit variable\n");
-        return ERR_INVALID_ARGUMENT;
-    }
     empty->size[RES_ORIG] = (uint32_t) size;
     empty->is_valid = NON_EMPTY;
 
     // Deduplication
     int ret = do_name_and_content_dedup(db_file, idx_new);
-    RET_ERROR;
-    // Image does not already exist in the database, write it at the end
-    if (empty->offset[RES_ORIG] == 0) {
-        SEEK(0, SEEK_END);
-        if (ret == 0) {
-            empty->offset[RES_ORIG] = ftell(db_file->fpdb);
-            WRITE(new_image, size);
-        }
-        RET_ERROR;
+    if (ret != 0) {
+        memset(empty, 0, sizeof(struct pict_metadata));
+        return ret;
     }
 
-    // Update metadata with image resolution
-    ret = get_resolution(&empty->res_orig[1], &empty->res_orig[0],
-                         new_image, size);
-    RET_ERROR;
+    *index = idx_new;
+    return 0;
+}
 
+int write_new_metadata(struct pictdb_file* db_file, uint32_t index)
+{
     // Update and write header
     ++db_file->header.db_version;
     ++db_file->header.num_files;
+    int ret = 0;
     SEEK(0, SEEK_SET);
     if (ret == 0) {
         WRITE(&db_file->header, sizeof(struct pictdb_header));
     }
 
-    // Write metadata
+    // Write metadata, then the extra resolutions of the image
     if (ret == 0) {
         uint64_t meta_offset = sizeof(struct pictdb_header) +
-                               idx_new * sizeof(struct pict_metadata);
+                               index * sizeof(struct pict_metadata);
         SEEK(meta_offset, SEEK_SET);
         if (ret == 0) {
-            WRITE(empty, sizeof(struct pict_metadata));
+            WRITE(&db_file->metadata[index], sizeof(struct pict_metadata));
         }
     }
+    ret = ret == 0 ? write_tier_variants(db_file, index) : ret;
 
+    if (ret != 0) {
+        --db_file->header.db_version;
+        --db_file->header.num_files;
+    }
     return ret;
 }
@@ -8,7 +8,39 @@
  */
 
 #include "pictDB.h"
-#include <json-c/json.h>
+
+#define LIST_CHUNK 4096 // Number of bytes of a list written at once
+
+/**
+ * @brief Output of a list being streamed, buffered by chunks.
+ */
+struct list_stream {
+    char buffer[LIST_CHUNK];
+    size_t len;
+    list_writer write;
+    void* arg;
+};
+
+/**
+ * @brief A string growing as pieces are appended to it.
+ */
+struct string_buffer {
+    char* data;
+    size_t len;
+    size_t size;
+    /**
+     * @brief Whether an allocation failed.
+     */
+    int error;
+};
+
+/**
+ * @brief Names of the fields, in the order of enum list_field.
+ */
+static const char* const FIELD_NAMES[] = {
+    "id", "res", "size", "sha", "variants"
+};
+#define NB_FIELDS 5
 
 /**
  * @brief Displays a database on stdout.
@@ -22,7 +54,8 @@ void do_list_cmd_line(const struct pictdb_file* db_file);
  *
  * The resulting string will have the following structure:
  * {
- * "Pictures": [] # an array of the strings of the pict_id fields from the metadata
+ * "Pictures": [], # an array of the strings of the pict_id fields from the metadata
+ * "cursor": null
  * }
  *
  * @param db_file The database to stringify.
@@ -30,6 +63,101 @@ void do_list_cmd_line(const struct pictdb_file* db_file);
  */
 char* do_list_web(const struct pictdb_file* db_file);
 
+/**
+ * @brief Checks whether a picture matches the filters of a list query.
+ *
+ * @param query    The list query.
+ * @param metadata The metadata of the picture.
+ * @return 1 if it matches, 0 otherwise.
+ */
+int list_match(const struct list_query* query,
+               const struct pict_metadata* metadata);
+
+/**
+ * @brief Writes the fields of a picture in JSON.
+ *
+ * @param stream   The output stream.
+ * @param fields   The bitmask of the fields.
+ * @param metadata The metadata of the picture.
+ */
+void list_json(struct list_stream* stream, unsigned int fields,
+               const struct pict_metadata* metadata);
+
+/**
+ * @brief Writes the fields of a picture as a line of CSV.
+ *
+ * @param stream   The output stream.
+ * @param fields   The bitmask of the fields.
+ * @param metadata The metadata of the picture.
+ */
+void list_csv(struct list_stream* stream, unsigned int fields,
+              const struct pict_metadata* metadata);
+
+/**
+ * @brief Writes the fields of a picture in binary.
+ *
+ * @param stream   The output stream.
+ * @param fields   The bitmask of the fields.
+ * @param metadata The metadata of the picture.
+ */
+void list_binary(struct list_stream* stream, unsigned int fields,
+                 const struct pict_metadata* metadata);
+
+/**
+ * @brief Passes the buffered output to the writer of the stream.
+ *
+ * @param stream The output stream.
+ */
+void stream_flush(struct list_stream* stream);
+
+/**
+ * @brief Writes bytes to a stream.
+ *
+ * @param stream The output stream.
+ * @param data   The bytes.
+ * @param len    The number of bytes.
+ */
+void stream_write(struct list_stream* stream, const void* data, size_t len);
+
+/**
+ * @brief Writes a string as is to a stream.
+ *
+ * @param stream The output stream.
+ * @param str    The string.
+ */
+void stream_puts(struct list_stream* stream, const char* str);
+
+/**
+ * @brief Writes a 32 bits integer to a stream, in little-endian.
+ *
+ * @param stream The output stream.
+ * @param value  The integer.
+ */
+void stream_uint32(struct list_stream* stream, uint32_t value);
+
+/**
+ * @brief Writes the content of a JSON string, escaping the quotes,
+ *        backslashes and control characters.
+ *
+ * @param stream The output stream.
+ * @param str    The string to escape.
+ */
+void json_string(struct list_stream* stream, const char* str);
+
+/**
+ * @brief Writes a CSV field, quoted if it contains a comma, a quote or
+ *        a line break.
+ *
+ * @param stream The output stream.
+ * @param str    The field.
+ */
+void csv_string(struct list_stream* stream, const char* str);
+
+/**
+ * @brief A list_writer appending to a string_buffer.
+ */
+void append_to_string(const char* data, size_t len, void* arg);
+
 
 char* do_list(const struct pictdb_file* db_file, enum do_list_mode mode)
 {
@@ -49,6 +177,7 @@ void do_list_cmd_line(const struct pictdb_file* db_file)
 {
     // Print header
     print_header(&db_file->header);
+    print_tiers(db_file);
 
     if (db_file->header.num_files == 0) {
         printf("<< empty database >>\n");
@@ -65,27 +194,399 @@ void do_list_cmd_line(const struct pictdb_file* db_file)
 
 char* do_list_web(const struct pictdb_file* db_file)
 {
-    // JSON array that will contain the pict_id
-    struct json_object* pictid_array = json_object_new_array();
-    // Add each valid image pict_id to the array
-    for (uint32_t i = 0; i < db_file->header.max_files; ++i) {
-        if (db_file->metadata[i].is_valid == NON_EMPTY) {
-            struct json_object* pictid = json_object_new_string(
-                                             db_file->metadata[i].pict_id);
-            json_object_array_add(pictid_array, pictid);
+    struct list_query query;
+    init_list_query(&query);
+    query.limit = db_file->header.max_files;
+
+    struct string_buffer string = {.data = NULL, .len = 0, .size = 0};
+    if (do_list_page(db_file, &query, append_to_string, &string, NULL) != 0
+        || string.error) {
+        free(string.data);
+        return NULL;
+    }
+    // Terminate the string
+    append_to_string("", 1, &string);
+    if (string.error) {
+        free(string.data);
+        return NULL;
+    }
+    return string.data;
+}
+
+void init_list_query(struct list_query* query)
+{
+    memset(query, 0, sizeof(struct list_query));
+    query->limit = UINT32_MAX;
+    query->fields = FIELD_ID;
+    query->format = LIST_JSON;
+}
+
+int parse_list_fields(const char* str, unsigned int* fields)
+{
+    *fields = 0;
+    while (*str != '\0') {
+        const size_t len = strcspn(str, ",");
+        unsigned int field = len == 3 && strncmp(str, "all", 3) == 0 ?
+                             FIELD_ALL : 0;
+        for (size_t i = 0; i < NB_FIELDS && field == 0; ++i) {
+            if (strlen(FIELD_NAMES[i]) == len
+                && strncmp(str, FIELD_NAMES[i], len) == 0) {
+                field = 1u << i;
+            }
+        }
+        if (field == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        *fields |= field;
+        str += str[len] == ',' ? len + 1 : len;
+    }
+    return *fields != 0 ? 0 : ERR_INVALID_ARGUMENT;
+}
+
+int parse_list_variants(const char* str, unsigned int* variants)
+{
+    *variants = 0;
+    char name[16];
+    while (*str != '\0') {
+        const size_t len = strcspn(str, ",");
+        if (len >= sizeof(name)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        memcpy(name, str, len);
+        name[len] = '\0';
+        const int res = resolution_atoi(name, NULL);
+        if (res != RES_THUMB && res != RES_SMALL) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        *variants |= 1u << res;
+        str += str[len] == ',' ? len + 1 : len;
+    }
+    return 0;
+}
+
+int parse_list_format(const char* str, enum list_format* format)
+{
+    if (strcmp(str, "json") == 0) {
+        *format = LIST_JSON;
+    } else if (strcmp(str, "csv") == 0) {
+        *format = LIST_CSV;
+    } else if (strcmp(str, "binary") == 0) {
+        *format = LIST_BINARY;
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return 0;
+}
+
+int do_list_page(const struct pictdb_file* db_file,
+                 const struct list_query* query, list_writer write, void* arg,
+                 uint32_t* next)
+{
+    if (db_file == NULL || query == NULL || write == NULL
+        || query->cursor > db_file->header.max_files || query->fields == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct list_stream stream = {.len = 0, .write = write, .arg = arg};
+    switch (query->format) {
+    case LIST_JSON:
+        stream_puts(&stream, "{\"Pictures\":[");
+        break;
+    case LIST_CSV:
+        for (size_t i = 0, first = 1; i < NB_FIELDS; ++i) {
+            if (query->fields & (1u << i)) {
+                stream_puts(&stream, first ? "" : ",");
+                stream_puts(&stream, FIELD_NAMES[i]);
+                first = 0;
+            }
+        }
+        stream_puts(&stream, "\r\n");
+        break;
+    case LIST_BINARY:
+        stream_puts(&stream, "PDBL");
+        stream_write(&stream, &(uint8_t) {
+            (uint8_t) query->fields
+        }, 1);
+        break;
+    }
+
+    uint32_t count = 0;
+    uint32_t i = query->cursor;
+    for (; i < db_file->header.max_files && count < query->limit; ++i) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        if (!list_match(query, metadata)) {
+            continue;
+        }
+        switch (query->format) {
+        case LIST_JSON:
+            stream_puts(&stream, count > 0 ? "," : "");
+            list_json(&stream, query->fields, metadata);
+            break;
+        case LIST_CSV:
+            list_csv(&stream, query->fields, metadata);
+            break;
+        case LIST_BINARY:
+            list_binary(&stream, query->fields, metadata);
+            break;
+        }
+        ++count;
+    }
+
+    // Skip the pictures not listed to know whether this is the last page
+    while (i < db_file->header.max_files
+           && !list_match(query, &db_file->metadata[i])) {
+        ++i;
+    }
+    if (next != NULL) {
+        *next = i;
+    }
+
+    if (query->format == LIST_JSON) {
+        if (i < db_file->header.max_files) {
+            char cursor[32];
+            snprintf(cursor, sizeof(cursor), "],\"cursor\":%" PRIu32 "}", i);
+            stream_puts(&stream, cursor);
+        } else {
+            stream_puts(&stream, "],\"cursor\":null}");
+        }
+    } else if (query->format == LIST_BINARY) {
+        stream_write(&stream, &(uint8_t) {
+            0
+        }, 1);
+    }
+    stream_flush(&stream);
+    return 0;
+}
+
+int list_match(const struct list_query* query,
+               const struct pict_metadata* metadata)
+{
+    const uint32_t* res = metadata->res_orig;
+    return metadata->is_valid == NON_EMPTY
+           && res[0] >= query->min_res[0] && res[1] >= query->min_res[1]
+           && (query->max_res[0] == 0 || res[0] <= query->max_res[0])
+           && (query->max_res[1] == 0 || res[1] <= query->max_res[1])
+           && ((query->variants & (1u << RES_THUMB)) == 0
+               || metadata->size[RES_THUMB] != 0)
+           && ((query->variants & (1u << RES_SMALL)) == 0
+               || metadata->size[RES_SMALL] != 0)
+           && (query->prefix == NULL
+               || strncmp(metadata->pict_id, query->prefix,
+                          strlen(query->prefix)) == 0);
+}
+
+void list_json(struct list_stream* stream, unsigned int fields,
+               const struct pict_metadata* metadata)
+{
+    char number[64];
+    // The pict_id alone is not wrapped in an object
+    if (fields == FIELD_ID) {
+        stream_puts(stream, "\"");
+        json_string(stream, metadata->pict_id);
+        stream_puts(stream, "\"");
+        return;
+    }
+
+    const char* separator = "{";
+    if (fields & FIELD_ID) {
+        stream_puts(stream, "{\"pict_id\":\"");
+        json_string(stream, metadata->pict_id);
+        stream_puts(stream, "\"");
+        separator = ",";
+    }
+    if (fields & FIELD_RES) {
+        snprintf(number, sizeof(number),
+                 "%s\"width\":%" PRIu32 ",\"height\":%" PRIu32, separator,
+                 metadata->res_orig[0], metadata->res_orig[1]);
+        stream_puts(stream, number);
+        separator = ",";
+    }
+    if (fields & FIELD_SIZE) {
+        snprintf(number, sizeof(number),
+                 "%s\"size\":[%" PRIu32 ",%" PRIu32 ",%" PRIu32 "]", separator,
+                 metadata->size[RES_THUMB], metadata->size[RES_SMALL],
+                 metadata->size[RES_ORIG]);
+        stream_puts(stream, number);
+        separator = ",";
+    }
+    if (fields & FIELD_SHA) {
+        char sha[2 * SHA256_DIGEST_LENGTH + 1];
+        sha_to_string(metadata->SHA, sha);
+        stream_puts(stream, separator);
+        stream_puts(stream, "\"sha\":\"");
+        stream_puts(stream, sha);
+        stream_puts(stream, "\"");
+        separator = ",";
+    }
+    if (fields & FIELD_VARIANTS) {
+        stream_puts(stream, separator);
+        stream_puts(stream, "\"variants\":[");
+        stream_puts(stream, metadata->size[RES_THUMB] != 0 ? "\"thumb\"" : "");
+        stream_puts(stream, metadata->size[RES_THUMB] != 0
+                    && metadata->size[RES_SMALL] != 0 ? "," : "");
+        stream_puts(stream, metadata->size[RES_SMALL] != 0 ? "\"small\"" : "");
+        stream_puts(stream, "]");
+    }
+    stream_puts(stream, "}");
+}
+
+void list_csv(struct list_stream* stream, unsigned int fields,
+              const struct pict_metadata* metadata)
+{
+    char number[64];
+    const char* separator = "";
+    if (fields & FIELD_ID) {
+        csv_string(stream, metadata->pict_id);
+        separator = ",";
+    }
+    if (fields & FIELD_RES) {
+        snprintf(number, sizeof(number), "%s%" PRIu32 "x%" PRIu32, separator,
+                 metadata->res_orig[0], metadata->res_orig[1]);
+        stream_puts(stream, number);
+        separator = ",";
+    }
+    if (fields & FIELD_SIZE) {
+        snprintf(number, sizeof(number),
+                 "%s%" PRIu32 " %" PRIu32 " %" PRIu32, separator,
+                 metadata->size[RES_THUMB], metadata->size[RES_SMALL],
+                 metadata->size[RES_ORIG]);
+        stream_puts(stream, number);
+        separator = ",";
+    }
+    if (fields & FIELD_SHA) {
+        char sha[2 * SHA256_DIGEST_LENGTH + 1];
+        sha_to_string(metadata->SHA, sha);
+        stream_puts(stream, separator);
+        stream_puts(stream, sha);
+        separator = ",";
+    }
+    if (fields & FIELD_VARIANTS) {
+        stream_puts(stream, separator);
+        stream_puts(stream, metadata->size[RES_THUMB] != 0 ? "thumb" : "");
+        stream_puts(stream, metadata->size[RES_THUMB] != 0
+                    && metadata->size[RES_SMALL] != 0 ? " " : "");
+        stream_puts(stream, metadata->size[RES_SMALL] != 0 ? "small" : "");
+    }
+    stream_puts(stream, "\r\n");
+}
+
+void list_binary(struct list_stream* stream, unsigned int fields,
+                 const struct pict_metadata* metadata)
+{
+    stream_write(stream, &(uint8_t) {
+        1
+    }, 1);
+    if (fields & FIELD_ID) {
+        const uint8_t len = (uint8_t) strlen(metadata->pict_id);
+        stream_write(stream, &len, 1);
+        stream_write(stream, metadata->pict_id, len);
+    }
+    if (fields & FIELD_RES) {
+        stream_uint32(stream, metadata->res_orig[0]);
+        stream_uint32(stream, metadata->res_orig[1]);
+    }
+    if (fields & FIELD_SIZE) {
+        for (int res = 0; res < NB_RES; ++res) {
+            stream_uint32(stream, metadata->size[res]);
+        }
+    }
+    if (fields & FIELD_SHA) {
+        stream_write(stream, metadata->SHA, SHA256_DIGEST_LENGTH);
+    }
+    if (fields & FIELD_VARIANTS) {
+        const uint8_t variants =
+            (metadata->size[RES_THUMB] != 0 ? 1u << RES_THUMB : 0)
+            | (metadata->size[RES_SMALL] != 0 ? 1u << RES_SMALL : 0);
+        stream_write(stream, &variants, 1);
+    }
+}
+
+void stream_flush(struct list_stream* stream)
+{
+    if (stream->len > 0) {
+        stream->write(stream->buffer, stream->len, stream->arg);
+        stream->len = 0;
+    }
+}
+
+void stream_write(struct list_stream* stream, const void* data, size_t len)
+{
+    const char* bytes = data;
+    while (len > 0) {
+        if (stream->len == LIST_CHUNK) {
+            stream_flush(stream);
+        }
+        size_t copied = LIST_CHUNK - stream->len < len ?
+                        LIST_CHUNK - stream->len : len;
+        memcpy(stream->buffer + stream->len, bytes, copied);
+        stream->len += copied;
+        bytes += copied;
+        len -= copied;
+    }
+}
+
+void stream_puts(struct list_stream* stream, const char* str)
+{
+    stream_write(stream, str, strlen(str));
+}
+
+void stream_uint32(struct list_stream* stream, uint32_t value)
+{
+    const uint8_t bytes[4] = {
+        (uint8_t) value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+        (uint8_t)(value >> 24)
+    };
+    stream_write(stream, bytes, sizeof(bytes));
+}
+
+void json_string(struct list_stream* stream, const char* str)
+{
+    for (; *str != '\0'; ++str) {
+        const unsigned char c = (unsigned char) *str;
+        char escaped[8] = {(char) c, '\0'};
+        if (c == '"' || c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = (char) c;
+            escaped[2] = '\0';
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        }
+        stream_puts(stream, escaped);
+    }
+}
+
+void csv_string(struct list_stream* stream, const char* str)
+{
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        stream_puts(stream, str);
+        return;
+    }
+    stream_puts(stream, "\"");
+    for (; *str != '\0'; ++str) {
+        stream_write(stream, str, 1);
+        if (*str == '"') {
+            stream_puts(stream, "\"");
+        }
+    }
+    stream_puts(stream, "\"");
+}
+
+void append_to_string(const char* data, size_t len, void* arg)
+{
+    struct string_buffer* string = arg;
+    if (string->error) {
+        return;
+    }
+    if (string->len + len > string->size) {
+        size_t size = 2 * (string->len + len);
+        char* data_new = realloc(string->data, size);
+        if (data_new == NULL) {
+            string->error = 1;
+            return;
         }
+        string->data = data_new;
+        string->size = size;
     }
-    // Create the JSON object that contains the array of pict_id
-    struct json_object* wrapper = json_object_new_object();
-    json_object_object_add(wrapper, "Pictures", pictid_array);
-    // Convert the wrapper to string
-    const char* s = json_object_to_json_string(wrapper);
-    // Copy the string to extend its scope beyond the GC of the JSON object
-    char* ret = calloc(strlen(s) + 1, sizeof(char));
-    if (ret != NULL) {
-        strcpy(ret, s);
-    }
-    // Free the wrapper - does it free the array too??
-    json_object_put(wrapper);
-    return ret;
+    memcpy(string->data + string->len, data, len);
+    string->len += len;
 }
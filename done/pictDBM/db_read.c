@@ -8,6 +8,8 @@
 
 #include "pictDB.h"
 #include "image_content.h"
+#include "trace.h"
+#include "variant_cache.h"
 
 
 int do_read(const char* pict_id, int resolution, char** image_buffer,
@@ -24,44 +26,98 @@ int do_read(const char* pict_id, int resolution, char** image_buffer,
         return ERR_FILE_NOT_FOUND;
     }
 
-    // Look for the image to extract in the metadata array.
     uint32_t idx = 0;
+    int ret = find_image(pict_id, db_file, &idx);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return do_read_index(idx, resolution, image_buffer, image_size, db_file);
+}
+
+int find_image(const char* pict_id, const struct pictdb_file* db_file,
+               uint32_t* index)
+{
+    if (pict_id == NULL || db_file == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // Look for the image in the metadata array.
+    TRACE_BEGIN(lookup);
     int ret = ERR_FILE_NOT_FOUND;
-    for (uint32_t i = 0; i < db_file->header.max_files
-         && ret == ERR_FILE_NOT_FOUND; ++i) {
+    for (uint32_t i = 0; ret != 0 && i < db_file->header.max_files; ++i) {
         if (db_file->metadata[i].is_valid == NON_EMPTY &&
             strncmp(pict_id, db_file->metadata[i].pict_id, MAX_PIC_ID) == 0) {
-            idx = i;
+            *index = i;
             ret = 0;
         }
     }
+    TRACE_END(lookup, "read.lookup");
+    return ret;
+}
+
+int do_read_index(uint32_t index, int resolution, char** image_buffer,
+                  uint32_t* image_size, struct pictdb_file* db_file)
+{
+    FILE* file = NULL;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int ret = do_locate_index(index, resolution, db_file, &file, &offset,
+                              &size);
     if (ret != 0) {
-        return ERR_FILE_NOT_FOUND;
+        return ret;
     }
 
-    struct pict_metadata* to_read = &db_file->metadata[idx]; // Convenience
-
-    // If the resolution is not original, and the asked one is not
-    // in the database, generate it.
-    if (resolution != RES_ORIG && (to_read->offset[resolution] == 0 ||
-                                   to_read->size[resolution] == 0)) {
-        ret = lazily_resize(resolution, db_file, idx);
-        if (ret != 0) {
-            return ret;
-        }
-    }
     // Prepare memory destination of the image.
-    *image_buffer = malloc(to_read->size[resolution]);
+    *image_buffer = malloc(size);
     if (*image_buffer == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
     // Move read head and read image from disk.
-    if (fseek(db_file->fpdb, to_read->offset[resolution], SEEK_SET) ||
-        fread(*image_buffer, to_read->size[resolution], 1,
-              db_file->fpdb) != 1) {
+    TRACE_BEGIN(read);
+    if (fseek(file, offset, SEEK_SET) ||
+        fread(*image_buffer, size, 1, file) != 1) {
         free(*image_buffer); //In case of IO error, free unused memory.
         return ERR_IO;
     }
-    *image_size = to_read->size[resolution]; // Set size.
+    TRACE_END(read, "read.blob");
+    *image_size = size; // Set size.
+    return 0;
+}
+
+int do_locate_index(uint32_t index, int resolution,
+                    struct pictdb_file* db_file, FILE** file,
+                    uint64_t* offset, uint32_t* size)
+{
+    if (db_file == NULL || file == NULL || offset == NULL || size == NULL
+        || index >= db_file->header.max_files
+        || db_file->metadata[index].is_valid != NON_EMPTY
+        || resolution < 0 || resolution >= nb_resolutions(db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // If the resolution is not original, and the asked one is not
+    // in the database, generate it, out of it if it is read-only.
+    const int missing = resolution != RES_ORIG
+                        && (variant_offset(db_file, index, resolution) == 0
+                            || variant_size(db_file, index, resolution) == 0);
+    if (missing && db_file->cache != NULL) {
+        TRACE_BEGIN(resize);
+        int ret = cached_resize(resolution, db_file, index, offset, size);
+        TRACE_END(resize, "read.lazily_resize");
+        *file = db_file->cache->file;
+        return ret;
+    }
+    if (missing) {
+        TRACE_BEGIN(resize);
+        int ret = lazily_resize(resolution, db_file, index);
+        TRACE_END(resize, "read.lazily_resize");
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    *file = db_file->fpdb;
+    *offset = variant_offset(db_file, index, resolution);
+    *size = variant_size(db_file, index, resolution);
     return 0;
 }
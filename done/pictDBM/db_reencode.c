@@ -0,0 +1,361 @@
+/**
+ * @file db_reencode.c
+ * @brief Re-encoding of the resized images of a database, e.g. after the
+ *        encodings of its resolutions changed.
+ *
+ * The originals are read and resized in parallel, a batch at a time, then
+ * the new variants are appended to the file by the calling thread, under
+ * the exclusive flock a server takes to write. A variant shared by
+ * duplicates is encoded once.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _DEFAULT_SOURCE // for fileno, flock and pread
+
+#include "pictDB.h"
+#include "hash_batch.h"
+#include "image_content.h"
+#include "trace.h"
+#include <pthread.h>
+#include <sys/file.h> // for flock
+#include <unistd.h> // for pread
+
+#define REENCODE_BATCH 64 // Maximal number of variants resized at once
+
+/**
+ * @brief A variant to encode again.
+ */
+struct variant_job {
+    uint32_t index;
+    int resolution;
+    /**
+     * @brief Where the original is stored, which is never overwritten.
+     */
+    uint64_t orig_offset;
+    uint32_t orig_size;
+    /**
+     * @brief Where the variant is stored before being encoded again. The
+     *        images sharing it are encoded once.
+     */
+    uint64_t old_offset;
+    uint32_t old_size;
+    /**
+     * @brief The new variant, to be freed with g_free.
+     */
+    void* image;
+    size_t size;
+    /**
+     * @brief 0 if the variant was encoded, an error code otherwise.
+     */
+    int error;
+};
+
+/**
+ * @brief Variants shared by the threads of a batch.
+ */
+struct reencode_batch {
+    const struct pictdb_file* db_file;
+    struct variant_job* jobs;
+    /**
+     * @brief Index of the first variant of the next group to encode, and of
+     *        the end of the batch.
+     */
+    size_t next;
+    size_t end;
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief Orders variants by resolution, then by offset, so that those
+ *        shared by duplicates are next to each other.
+ *
+ * @param a, b The variants to compare.
+ * @return A negative, zero or positive int as required by qsort.
+ */
+int compare_variants(const void* a, const void* b);
+
+/**
+ * @brief Gives the end of the group of variants stored at the same place.
+ *
+ * @param jobs  The variants, sorted by compare_variants.
+ * @param first The first variant of the group.
+ * @param end   The end of the variants.
+ * @return The index of the first variant of the next group.
+ */
+size_t group_end(const struct variant_job* jobs, size_t first, size_t end);
+
+/**
+ * @brief Encodes the first variant of each group of a batch, spreading them
+ *        over a pool of threads.
+ *
+ * @param batch      The batch.
+ * @param nb_threads The number of threads to use; 0 uses one per CPU.
+ * @return 0 if the threads could be run, an error code otherwise. The result
+ *         of each variant is in its error field.
+ */
+int encode_batch(struct reencode_batch* batch, unsigned int nb_threads);
+
+/**
+ * @brief Body of a resizing thread.
+ *
+ * @param arg The batch.
+ * @return NULL.
+ */
+void* reencode_worker(void* arg);
+
+/**
+ * @brief Reads the original of a variant and resizes it.
+ *
+ * @param db_file The database, whose stream was flushed.
+ * @param job     The variant.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int reencode_job(const struct pictdb_file* db_file, struct variant_job* job);
+
+/**
+ * @brief Lists the variants of some resolutions of a database.
+ *
+ * @param db_file     The database, locked.
+ * @param resolutions The bitmask of the resolutions.
+ * @param jobs        Where to list them, NULL to count them only.
+ * @return The number of variants.
+ */
+size_t list_variants(const struct pictdb_file* db_file,
+                     unsigned int resolutions, struct variant_job* jobs);
+
+/**
+ * @brief Appends the variants of a batch, under the exclusive lock of the
+ *        file. The images whose variant changed since it was listed keep
+ *        it.
+ *
+ * @param db_file The database.
+ * @param jobs    The variants, sorted by compare_variants.
+ * @param start   The first variant of the batch.
+ * @param end     The end of the batch.
+ * @param indexes Room for the indexes of a group.
+ * @param report  The summary to update.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int store_batch(struct pictdb_file* db_file, struct variant_job* jobs,
+                size_t start, size_t end, uint32_t* indexes,
+                struct reencode_report* report);
+
+
+int do_reencode(struct pictdb_file* db_file, unsigned int resolutions,
+                unsigned int nb_threads, struct reencode_report* report)
+{
+    if (db_file == NULL || db_file->fpdb == NULL || report == NULL
+        || (resolutions & (1u << RES_ORIG)) != 0
+        || resolutions >> nb_resolutions(db_file) != 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (db_file->cache != NULL) {
+        return ERR_READ_ONLY;
+    }
+    memset(report, 0, sizeof(struct reencode_report));
+
+    // A server may write to the file meanwhile: its metadata is followed
+    // through the shared mapping, while the file is locked
+    const int fd = fileno(db_file->fpdb);
+    int ret = do_share_metadata(db_file);
+    ret = ret == 0 && flock(fd, LOCK_SH) != 0 ? ERR_IO : ret;
+    if (ret != 0) {
+        return ret;
+    }
+    do_refresh_shared(db_file);
+    const size_t nb_jobs = list_variants(db_file, resolutions, NULL);
+    struct variant_job* jobs = calloc(nb_jobs, sizeof(struct variant_job));
+    uint32_t* indexes = calloc(nb_jobs, sizeof(uint32_t));
+    if (nb_jobs > 0 && (jobs == NULL || indexes == NULL)) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else if (nb_jobs > 0) {
+        list_variants(db_file, resolutions, jobs);
+    }
+    flock(fd, LOCK_UN);
+    if (ret != 0 || nb_jobs == 0) {
+        free(jobs);
+        free(indexes);
+        return ret;
+    }
+    qsort(jobs, nb_jobs, sizeof(struct variant_job), compare_variants);
+
+    size_t start = 0;
+    while (ret == 0 && start < nb_jobs) {
+        struct reencode_batch batch = {
+            .db_file = db_file, .jobs = jobs, .next = start, .end = start
+        };
+        for (size_t groups = 0; groups < REENCODE_BATCH
+             && batch.end < nb_jobs; ++groups) {
+            batch.end = group_end(jobs, batch.end, nb_jobs);
+        }
+
+        // The threads read the file with pread, past the stream buffer
+        ret = fflush(db_file->fpdb) == 0 ? 0 : ERR_IO;
+        ret = ret == 0 ? encode_batch(&batch, nb_threads) : ret;
+
+        // The new variants are appended in order by this thread only
+        TRACE_BEGIN(write);
+        ret = ret == 0 ? store_batch(db_file, jobs, start, batch.end, indexes,
+                                     report) : ret;
+        TRACE_END(write, "reencode.write");
+        for (size_t i = start; i < batch.end; ++i) {
+            g_free(jobs[i].image);
+            jobs[i].image = NULL;
+        }
+        start = batch.end;
+    }
+
+    free(jobs);
+    free(indexes);
+    return ret;
+}
+
+size_t list_variants(const struct pictdb_file* db_file,
+                     unsigned int resolutions, struct variant_job* jobs)
+{
+    size_t n = 0;
+    for (uint32_t i = 0; i < db_file->header.max_files; ++i) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for (int r = 0; metadata->is_valid == NON_EMPTY
+             && r < nb_resolutions(db_file); ++r) {
+            if ((resolutions & (1u << r)) != 0
+                && variant_size(db_file, i, r) != 0
+                && variant_offset(db_file, i, r) != 0) {
+                if (jobs != NULL) {
+                    jobs[n].index = i;
+                    jobs[n].resolution = r;
+                    jobs[n].orig_offset = metadata->offset[RES_ORIG];
+                    jobs[n].orig_size = metadata->size[RES_ORIG];
+                    jobs[n].old_offset = variant_offset(db_file, i, r);
+                    jobs[n].old_size = variant_size(db_file, i, r);
+                }
+                ++n;
+            }
+        }
+    }
+    return n;
+}
+
+int store_batch(struct pictdb_file* db_file, struct variant_job* jobs,
+                size_t start, size_t end, uint32_t* indexes,
+                struct reencode_report* report)
+{
+    const int fd = fileno(db_file->fpdb);
+    if (flock(fd, LOCK_EX) != 0) {
+        return ERR_IO;
+    }
+    do_refresh_shared(db_file);
+
+    int ret = 0;
+    for (size_t first = start; ret == 0 && first < end;) {
+        const struct variant_job* job = &jobs[first];
+        const size_t last = group_end(jobs, first, end);
+        // Deleted or resized again by others since listed
+        size_t nb_indexes = 0;
+        for (size_t i = first; i < last; ++i) {
+            const uint32_t index = jobs[i].index;
+            if (db_file->metadata[index].is_valid == NON_EMPTY
+                && variant_offset(db_file, index, job->resolution)
+                == job->old_offset
+                && variant_size(db_file, index, job->resolution)
+                == job->old_size) {
+                indexes[nb_indexes++] = index;
+            }
+        }
+        ret = job->error;
+        ret = ret == 0 && nb_indexes > 0 ?
+              store_variant(db_file, job->resolution, indexes, nb_indexes,
+                            job->image, job->size) : ret;
+        if (ret == 0 && nb_indexes > 0) {
+            ++report->reencoded;
+            report->old_bytes += job->old_size;
+            report->new_bytes += job->size;
+        }
+        first = last;
+    }
+
+    ret = fflush(db_file->fpdb) != 0 && ret == 0 ? ERR_IO : ret;
+    flock(fd, LOCK_UN);
+    return ret;
+}
+
+int compare_variants(const void* a, const void* b)
+{
+    const struct variant_job* first = a;
+    const struct variant_job* second = b;
+    if (first->resolution != second->resolution) {
+        return first->resolution < second->resolution ? -1 : 1;
+    }
+    return first->old_offset < second->old_offset ? -1 :
+           first->old_offset > second->old_offset;
+}
+
+size_t group_end(const struct variant_job* jobs, size_t first, size_t end)
+{
+    size_t last = first + 1;
+    while (last < end && jobs[last].resolution == jobs[first].resolution
+           && jobs[last].old_offset == jobs[first].old_offset) {
+        ++last;
+    }
+    return last;
+}
+
+int encode_batch(struct reencode_batch* batch, unsigned int nb_threads)
+{
+    if (pthread_mutex_init(&batch->lock, NULL) != 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    run_pool(reencode_worker, batch, nb_threads);
+    pthread_mutex_destroy(&batch->lock);
+    return 0;
+}
+
+void* reencode_worker(void* arg)
+{
+    struct reencode_batch* batch = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        const size_t index = batch->next;
+        if (index < batch->end) {
+            batch->next = group_end(batch->jobs, index, batch->end);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        if (index >= batch->end) {
+            // Frees the buffers libvips keeps for this thread
+            vips_thread_shutdown();
+            return NULL;
+        }
+        struct variant_job* job = &batch->jobs[index];
+        job->error = reencode_job(batch->db_file, job);
+    }
+}
+
+int reencode_job(const struct pictdb_file* db_file, struct variant_job* job)
+{
+    const uint32_t size = job->orig_size;
+    char* original = malloc(size);
+    if (original == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    TRACE_BEGIN(load);
+    const int fd = fileno(db_file->fpdb);
+    size_t done = 0;
+    ssize_t n = 1;
+    while (done < size && n > 0) {
+        n = pread(fd, original + done, size - done,
+                  job->orig_offset + done);
+        done += n > 0 ? (size_t) n : 0;
+    }
+    TRACE_END(load, "reencode.load");
+
+    const int ret = done == size ?
+                    resize_variant(db_file, job->resolution, original, size,
+                                   &job->image, &job->size) : ERR_IO;
+    free(original);
+    return ret;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file db_sprite.c
+ * @brief Sprite sheets of the thumbnails of a database.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#include "pictDB.h"
+#include "image_content.h"
+#include <json-c/json.h>
+#include <math.h>
+
+/**
+ * @brief Creates the JSON map of a sprite sheet.
+ *
+ * @param db_file The database.
+ * @param indexes The indexes of the pictures of the sheet.
+ * @param tiles   The thumbnails of the pictures.
+ * @param count   The number of pictures.
+ * @param across  The number of cells of a row.
+ * @param sheet   The sprite sheet, whose image is already joined.
+ * @param joined  The joined image.
+ * @return 0 in case of success, ERR_OUT_OF_MEMORY otherwise.
+ */
+int sprite_map(const struct pictdb_file* db_file, const uint32_t* indexes,
+               VipsImage** tiles, int count, int across,
+               struct sprite_sheet* sheet, const VipsImage* joined);
+
+
+int do_sprite(struct pictdb_file* db_file, uint32_t cursor, uint32_t limit,
+              struct sprite_sheet* sheet)
+{
+    if (db_file == NULL || sheet == NULL || limit == 0
+        || cursor > db_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(sheet, 0, sizeof(struct sprite_sheet));
+
+    uint32_t* indexes = calloc(limit, sizeof(uint32_t));
+    if (indexes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // The tiles are the first limit pictures whose thumbnail can be loaded
+    VipsObject* process = VIPS_OBJECT(vips_image_new());
+    VipsImage** tiles = (VipsImage**) vips_object_local_array(process,
+                        limit + 1);
+    int count = 0;
+    uint32_t i = cursor;
+    for (; i < db_file->header.max_files && (uint32_t) count < limit; ++i) {
+        if (db_file->metadata[i].is_valid != NON_EMPTY) {
+            continue;
+        }
+        char* thumb = NULL;
+        uint32_t thumb_size = 0;
+        if (do_read_index(i, RES_THUMB, &thumb, &thumb_size, db_file) == 0
+            && vips_jpegload_buffer(thumb, thumb_size, &tiles[count],
+                                    NULL) == 0) {
+            // The thumbnail must be decoded before its buffer is freed
+            if (vips_image_wio_input(tiles[count]) == 0) {
+                indexes[count++] = i;
+            }
+        }
+        free(thumb);
+    }
+    while (i < db_file->header.max_files
+           && db_file->metadata[i].is_valid != NON_EMPTY) {
+        ++i;
+    }
+    sheet->next = i;
+
+    int ret = count == 0 ? ERR_FILE_NOT_FOUND : 0;
+    const int across = (int) ceil(sqrt(count));
+    if (ret == 0
+        && (vips_arrayjoin(tiles, &tiles[limit], count,
+                           "across", across,
+                           "hspacing", (int) db_file->header.res_resized[0],
+                           "vspacing", (int) db_file->header.res_resized[1],
+                           NULL) != 0
+            || vips_jpegsave_buffer(tiles[limit], (void**) &sheet->image,
+                                    &sheet->image_size, NULL) != 0)) {
+        ret = ERR_VIPS;
+    }
+    if (ret == 0) {
+        ret = sprite_map(db_file, indexes, tiles, count, across, sheet,
+                         tiles[limit]);
+    }
+
+    g_object_unref(process);
+    free(indexes);
+    if (ret != 0) {
+        free_sprite(sheet);
+    }
+    return ret;
+}
+
+int sprite_map(const struct pictdb_file* db_file, const uint32_t* indexes,
+               VipsImage** tiles, int count, int across,
+               struct sprite_sheet* sheet, const VipsImage* joined)
+{
+    const int cell_width = db_file->header.res_resized[0];
+    const int cell_height = db_file->header.res_resized[1];
+
+    struct json_object* pictures = json_object_new_array();
+    for (int i = 0; i < count; ++i) {
+        struct json_object* tile = json_object_new_object();
+        json_object_object_add(tile, "pict_id", json_object_new_string(
+                                   db_file->metadata[indexes[i]].pict_id));
+        json_object_object_add(tile, "x",
+                               json_object_new_int(i % across * cell_width));
+        json_object_object_add(tile, "y",
+                               json_object_new_int(i / across * cell_height));
+        json_object_object_add(tile, "width",
+                               json_object_new_int(tiles[i]->Xsize));
+        json_object_object_add(tile, "height",
+                               json_object_new_int(tiles[i]->Ysize));
+        json_object_array_add(pictures, tile);
+    }
+
+    struct json_object* map = json_object_new_object();
+    json_object_object_add(map, "width", json_object_new_int(joined->Xsize));
+    json_object_object_add(map, "height", json_object_new_int(joined->Ysize));
+    json_object_object_add(map, "cursor",
+                           sheet->next < db_file->header.max_files ?
+                           json_object_new_int64(sheet->next) : NULL);
+    json_object_object_add(map, "Pictures", pictures);
+
+    // Copy the string to extend its scope beyond the JSON object
+    const char* s = json_object_to_json_string(map);
+    sheet->map = calloc(strlen(s) + 1, sizeof(char));
+    if (sheet->map != NULL) {
+        strcpy(sheet->map, s);
+    }
+    json_object_put(map);
+    return sheet->map == NULL ? ERR_OUT_OF_MEMORY : 0;
+}
+
+void free_sprite(struct sprite_sheet* sheet)
+{
+    if (sheet != NULL) {
+        g_free(sheet->image);
+        free(sheet->map);
+        sheet->image = NULL;
+        sheet->map = NULL;
+    }
+}
@@ -6,7 +6,47 @@
  * @date 2 Nov 2015
  */
 
+#define _POSIX_C_SOURCE 200809L // for fileno
+
 #include "pictDB.h"
+#include "variant_cache.h"
+#include <openssl/evp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * @brief A variant stored in a database file.
+ */
+struct extent {
+    uint64_t offset;
+    uint32_t size;
+};
+
+/**
+ * @brief Compares two extents by offset, for qsort.
+ *
+ * @param a The first extent.
+ * @param b The second extent.
+ * @return A negative, zero or positive integer.
+ */
+int extent_cmp(const void* a, const void* b);
+
+/**
+ * @brief Gives the offset of the end of the metadata of a database.
+ *
+ * @param header The header of the database.
+ * @return The offset.
+ */
+uint64_t metadata_end(const struct pictdb_header* header);
+
+/**
+ * @brief Reads the encodings and the tier extension of a database opened by
+ *        do_open.
+ *
+ * @param db_file The database, whose metadata was just read.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int read_tiers(struct pictdb_file* db_file);
 
 
 int do_open(const char* filename, const char* mode,
@@ -19,6 +59,10 @@ int do_open(const char* filename, const char* mode,
         return ERR_INVALID_FILENAME;
     }
 
+    db_file->shared = NULL;
+    db_file->cache = NULL;
+    db_file->variants = NULL;
+    memset(db_file->encodings, 0, sizeof(db_file->encodings));
     db_file->fpdb = fopen(filename, mode);
     if (db_file->fpdb == NULL) {
         fprintf(stderr, "Error : cannot open file %s\n", filename);
@@ -53,7 +97,7 @@ int do_open(const char* filename, const char* mode,
         return ERR_IO;
     }
 
-    return 0;
+    return db_file->header.tiers_offset == 0 ? 0 : read_tiers(db_file);
 }
 
 void do_close(struct pictdb_file* db_file)
@@ -66,14 +110,152 @@ void do_close(struct pictdb_file* db_file)
         }
 
         // Free memory and overwrite metadata pointer
-        if (db_file->metadata != NULL) {
+        if (db_file->shared != NULL) {
+            munmap(db_file->shared, data_start(&db_file->header));
+            db_file->shared = NULL;
+        } else {
             free(db_file->metadata);
-            db_file->metadata = NULL;
+            free(db_file->variants);
         }
+        db_file->metadata = NULL;
+        db_file->variants = NULL;
+
+        if (db_file->cache != NULL) {
+            variant_cache_close(db_file->cache);
+            free(db_file->cache);
+            db_file->cache = NULL;
+        }
+    }
+}
+
+int do_share_metadata(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->fpdb == NULL
+        || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (db_file->shared != NULL) {
+        return 0;
+    }
+
+    // The tier extension is shared as well
+    const size_t size = data_start(&db_file->header);
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fileno(db_file->fpdb), 0);
+    if (mapping == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    free(db_file->metadata);
+    free(db_file->variants);
+    db_file->shared = mapping;
+    db_file->metadata = (struct pict_metadata*) (db_file->shared + 1);
+    if (db_file->header.nb_tiers > 0) {
+        db_file->variants = (struct tier_variant*)
+                            ((char*) mapping + db_file->header.tiers_offset
+                             + db_file->header.nb_tiers
+                             * sizeof(struct pictdb_tier));
     }
+    return 0;
 }
 
-int resolution_atoi(const char* resolution)
+void do_refresh_shared(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->shared == NULL) {
+        return;
+    }
+    // Drop the bytes read before the others wrote to the file
+    fseek(db_file->fpdb, 0, SEEK_CUR);
+    db_file->header = *db_file->shared;
+    const uint64_t end = metadata_end(&db_file->header);
+    if (db_file->header.tiers_offset == end + sizeof(db_file->encodings)) {
+        memcpy(db_file->encodings, (const char*) db_file->shared + end,
+               sizeof(db_file->encodings));
+    }
+}
+
+int do_open_cache(struct pictdb_file* db_file, const char* filename)
+{
+    if (db_file == NULL || filename == NULL || db_file->cache != NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char sidecar[MAX_DB_NAME + sizeof(VARIANT_CACHE_SUFFIX)];
+    if (snprintf(sidecar, sizeof(sidecar), "%s%s", filename,
+                 VARIANT_CACHE_SUFFIX) >= (int) sizeof(sidecar)) {
+        return ERR_INVALID_FILENAME;
+    }
+    db_file->cache = malloc(sizeof(struct variant_cache));
+    if (db_file->cache == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // On read-only media, each process resizes the images for itself
+    int ret = variant_cache_open(db_file->cache, sidecar);
+    if (ret == ERR_IO) {
+        ret = variant_cache_open(db_file->cache, NULL);
+    }
+    if (ret != 0) {
+        free(db_file->cache);
+        db_file->cache = NULL;
+    }
+    return ret;
+}
+
+int do_space_usage(struct pictdb_file* db_file, struct space_usage* usage)
+{
+    if (db_file == NULL || db_file->fpdb == NULL || usage == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct stat st;
+    if (fflush(db_file->fpdb) != 0 || fstat(fileno(db_file->fpdb), &st) != 0) {
+        return ERR_IO;
+    }
+
+    const int nb_res = nb_resolutions(db_file);
+    struct extent* extents = calloc((size_t) db_file->header.max_files
+                                    * nb_res, sizeof(struct extent));
+    if (extents == NULL && db_file->header.max_files > 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_extents = 0;
+    for (uint32_t i = 0; i < db_file->header.max_files; ++i) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for (int res = 0; metadata->is_valid == NON_EMPTY && res < nb_res;
+             ++res) {
+            const uint64_t offset = variant_offset(db_file, i, res);
+            const uint32_t size = variant_size(db_file, i, res);
+            if (offset != 0 && size != 0) {
+                extents[nb_extents].offset = offset;
+                extents[nb_extents].size = size;
+                ++nb_extents;
+            }
+        }
+    }
+
+    // Duplicates share the offsets of their variants
+    qsort(extents, nb_extents, sizeof(struct extent), extent_cmp);
+    usage->file_size = (uint64_t) st.st_size;
+    usage->live_bytes = data_start(&db_file->header);
+    for (size_t i = 0; i < nb_extents; ++i) {
+        if (i == 0 || extents[i].offset != extents[i - 1].offset) {
+            usage->live_bytes += extents[i].size;
+        }
+    }
+    free(extents);
+    return 0;
+}
+
+int extent_cmp(const void* a, const void* b)
+{
+    const uint64_t first = ((const struct extent*) a)->offset;
+    const uint64_t second = ((const struct extent*) b)->offset;
+    return first < second ? -1 : first > second;
+}
+
+int resolution_atoi(const char* resolution,
+                    const struct pictdb_file* db_file)
 {
     if (resolution != NULL) {
         if (strcmp(resolution, "thumb") == 0
@@ -85,10 +267,196 @@ int resolution_atoi(const char* resolution)
                    || strcmp(resolution, "original") == 0) {
             return RES_ORIG;
         }
+        for (uint32_t i = 0; db_file != NULL && i < db_file->header.nb_tiers;
+             ++i) {
+            if (strncmp(resolution, db_file->tiers[i].name,
+                        MAX_TIER_NAME + 1) == 0) {
+                return NB_RES + (int) i;
+            }
+        }
     }
     return -1;
 }
 
+int nb_resolutions(const struct pictdb_file* db_file)
+{
+    return NB_RES + (int) db_file->header.nb_tiers;
+}
+
+const char* resolution_name(const struct pictdb_file* db_file,
+                            int resolution)
+{
+    static const char* const RES_NAMES[NB_RES] = {"thumb", "small", "orig"};
+    return resolution < NB_RES ? RES_NAMES[resolution] :
+           db_file->tiers[resolution - NB_RES].name;
+}
+
+const uint16_t* resolution_max(const struct pictdb_file* db_file,
+                               int resolution)
+{
+    return resolution < RES_ORIG ?
+           &db_file->header.res_resized[2 * resolution] :
+           resolution == RES_ORIG ? NULL :
+           db_file->tiers[resolution - NB_RES].res;
+}
+
+uint32_t variant_size(const struct pictdb_file* db_file, uint32_t index,
+                      int resolution)
+{
+    return resolution < NB_RES ? db_file->metadata[index].size[resolution] :
+           db_file->variants[index * db_file->header.nb_tiers
+                                   + resolution - NB_RES].size;
+}
+
+uint64_t variant_offset(const struct pictdb_file* db_file, uint32_t index,
+                        int resolution)
+{
+    return resolution < NB_RES ? db_file->metadata[index].offset[resolution] :
+           db_file->variants[index * db_file->header.nb_tiers
+                                   + resolution - NB_RES].offset;
+}
+
+void set_variant(struct pictdb_file* db_file, uint32_t index, int resolution,
+                 uint64_t offset, uint32_t size)
+{
+    if (resolution < NB_RES) {
+        db_file->metadata[index].offset[resolution] = offset;
+        db_file->metadata[index].size[resolution] = size;
+    } else {
+        struct tier_variant* variant =
+            &db_file->variants[index * db_file->header.nb_tiers
+                                     + resolution - NB_RES];
+        variant->offset = offset;
+        variant->size = size;
+    }
+}
+
+int write_tier_variants(struct pictdb_file* db_file, uint32_t index)
+{
+    const uint32_t nb_tiers = db_file->header.nb_tiers;
+    if (nb_tiers == 0) {
+        return 0;
+    }
+    const uint64_t offset = db_file->header.tiers_offset
+                            + nb_tiers * sizeof(struct pictdb_tier)
+                            + (uint64_t) index * nb_tiers
+                            * sizeof(struct tier_variant);
+    return fseek(db_file->fpdb, offset, SEEK_SET) == 0
+           && fwrite(&db_file->variants[index * nb_tiers],
+                     sizeof(struct tier_variant), nb_tiers, db_file->fpdb)
+           == nb_tiers ? 0 : ERR_IO;
+}
+
+int parse_encoding(const char* str, struct pictdb_encoding* encoding)
+{
+    if (str == NULL || encoding == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(encoding, 0, sizeof(struct pictdb_encoding));
+    if (strcmp(str, "default") == 0) {
+        return 0;
+    }
+
+    char option[16];
+    do {
+        const size_t len = strcspn(str, ",");
+        if (len == 0 || len >= sizeof(option)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        memcpy(option, str, len);
+        option[len] = '\0';
+        char* end = NULL;
+        if (strcmp(option, "strip") == 0) {
+            encoding->flags |= ENCODE_STRIP;
+        } else if (strcmp(option, "progressive") == 0) {
+            encoding->flags |= ENCODE_PROGRESSIVE;
+        } else if (strcmp(option, "optimize") == 0) {
+            encoding->flags |= ENCODE_OPTIMIZE;
+        } else if (strncmp(option, "q=", 2) == 0) {
+            const long quality = strtol(option + 2, &end, 10);
+            if (end == option + 2 || *end != '\0' || quality < 1
+                || quality > MAX_QUALITY) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            encoding->quality = (uint8_t) quality;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        str += len;
+    } while (*str++ == ',');
+    return 0;
+}
+
+int write_encodings(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint64_t offset = metadata_end(&db_file->header);
+    if (db_file->header.tiers_offset != offset + sizeof(db_file->encodings)) {
+        return NOT_IMPLEMENTED;
+    }
+    return fseek(db_file->fpdb, offset, SEEK_SET) == 0
+           && fwrite(db_file->encodings, sizeof(db_file->encodings), 1,
+                     db_file->fpdb) == 1 ? 0 : ERR_IO;
+}
+
+uint64_t metadata_end(const struct pictdb_header* header)
+{
+    return sizeof(struct pictdb_header)
+           + (uint64_t) header->max_files * sizeof(struct pict_metadata);
+}
+
+uint64_t data_start(const struct pictdb_header* header)
+{
+    return header->tiers_offset == 0 ? metadata_end(header) :
+           header->tiers_offset + header->nb_tiers * sizeof(struct pictdb_tier)
+           + (uint64_t) header->max_files * header->nb_tiers
+           * sizeof(struct tier_variant);
+}
+
+int read_tiers(struct pictdb_file* db_file)
+{
+    const struct pictdb_header* header = &db_file->header;
+    const uint64_t end = metadata_end(header);
+    const int has_encodings = header->tiers_offset
+                              == end + sizeof(db_file->encodings);
+    if (header->nb_tiers > MAX_NB_RES - NB_RES
+        || (header->tiers_offset != end && !has_encodings)) {
+        return ERR_CORRUPTED;
+    }
+
+    // The metadata was just read: the extensions follow
+    if (has_encodings && fread(db_file->encodings,
+                               sizeof(db_file->encodings), 1,
+                               db_file->fpdb) != 1) {
+        return ERR_IO;
+    }
+    for (int i = 0; i < MAX_NB_RES; ++i) {
+        if (db_file->encodings[i].quality > MAX_QUALITY) {
+            return ERR_CORRUPTED;
+        }
+    }
+    if (header->nb_tiers == 0) {
+        return 0;
+    }
+    const size_t nb_variants = (size_t) header->max_files * header->nb_tiers;
+    db_file->variants = calloc(nb_variants, sizeof(struct tier_variant));
+    if (db_file->variants == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (fread(db_file->tiers, sizeof(struct pictdb_tier), header->nb_tiers,
+              db_file->fpdb) != header->nb_tiers
+        || fread(db_file->variants, sizeof(struct tier_variant), nb_variants,
+                 db_file->fpdb) != nb_variants) {
+        return ERR_IO;
+    }
+    for (uint32_t i = 0; i < header->nb_tiers; ++i) {
+        db_file->tiers[i].name[MAX_TIER_NAME] = '\0';
+    }
+    return 0;
+}
+
 int hashcmp(unsigned char* h1, unsigned char* h2)
 {
     for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
@@ -99,6 +467,20 @@ int hashcmp(unsigned char* h1, unsigned char* h2)
     return 0;
 }
 
+uint64_t sha_key_hash(const unsigned char* sha, uint64_t key)
+{
+    // The SHA is already uniformly distributed
+    uint64_t hash = 0;
+    memcpy(&hash, sha, sizeof(hash));
+    return hash ^ key * 0x9E3779B97F4A7C15ULL;
+}
+
+int compute_sha(const char* data, size_t len, unsigned char* sha)
+{
+    return EVP_Digest(data, len, sha, NULL, EVP_sha256(), NULL) == 1 ?
+           0 : ERR_IO;
+}
+
 char** init_result_array(size_t size)
 {
     char** result = calloc(size, sizeof(char*));
@@ -137,7 +519,7 @@ int split(char* result[], char* tmp, const char* src,
 /********************************************************************//**
  * Human-readable SHA
  */
-static void
+void
 sha_to_string(const unsigned char* SHA,
               char* sha_string)
 {
@@ -171,6 +553,28 @@ void print_header(const struct pictdb_header* header)
            header->res_resized[2], header->res_resized[3]);
 }
 
+void print_tiers(const struct pictdb_file* db_file)
+{
+    for (uint32_t i = 0; i < db_file->header.nb_tiers; ++i) {
+        printf("TIER: %-15s %" PRIu16 " x %" PRIu16 "\n",
+               db_file->tiers[i].name, db_file->tiers[i].res[0],
+               db_file->tiers[i].res[1]);
+    }
+    for (int res = 0; res < nb_resolutions(db_file); ++res) {
+        const struct pictdb_encoding* encoding = &db_file->encodings[res];
+        if (res != RES_ORIG
+            && (encoding->quality != 0 || encoding->flags != 0)) {
+            printf("ENCODING: %-15s q=%d%s%s%s\n",
+                   resolution_name(db_file, res),
+                   encoding->quality == 0 ? DEFAULT_QUALITY :
+                   encoding->quality,
+                   encoding->flags & ENCODE_STRIP ? ",strip" : "",
+                   encoding->flags & ENCODE_PROGRESSIVE ? ",progressive" : "",
+                   encoding->flags & ENCODE_OPTIMIZE ? ",optimize" : "");
+        }
+    }
+}
+
 /********************************************************************//**
  * Metadata display.
  */
@@ -0,0 +1,286 @@
+/**
+ * @file db_verify.c
+ * @brief Verification (scrubbing) of the content of a database.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and nanosleep
+
+#include "pictDB.h"
+#include "hash_batch.h"
+#include "image_content.h"
+#include <time.h>
+
+#define VERIFY_BATCH  256              // Maximal number of blobs read at once
+#define VERIFY_WINDOW (64 * 1048576)   // Maximal number of bytes read at once
+
+/**
+ * @brief A blob of the database: an image in one resolution.
+ */
+struct blob {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t index;
+    int resolution;
+};
+
+/**
+ * @brief State of a verification.
+ */
+struct verification {
+    struct pictdb_file* db_file;
+    unsigned int nb_threads;
+    double rate;
+    corruption_handler on_corruption;
+    void* arg;
+    struct verify_report* report;
+    /**
+     * @brief Time at which the verification started.
+     */
+    struct timespec start;
+};
+
+/**
+ * @brief Orders blobs by offset.
+ *
+ * @param a, b The blobs to compare.
+ * @return A negative, zero or positive int as required by qsort.
+ */
+int compare_offsets(const void* a, const void* b);
+
+/**
+ * @brief Counts a corruption and reports it.
+ *
+ * @param verif      The verification.
+ * @param index      The index of the corrupted image.
+ * @param resolution The corrupted resolution.
+ * @param reason     A description of the corruption.
+ */
+void corruption(struct verification* verif, uint32_t index, int resolution,
+                const char* reason);
+
+/**
+ * @brief Sleeps long enough for the bytes read so far not to exceed the
+ *        maximal read rate.
+ *
+ * @param verif The verification.
+ */
+void throttle(const struct verification* verif);
+
+/**
+ * @brief Reads and checks blobs, sorted by offset.
+ *
+ * @param verif    The verification.
+ * @param blobs    The blobs to check.
+ * @param nb_blobs The number of blobs.
+ * @return 0 if the blobs could be read, an error code otherwise.
+ */
+int verify_blobs(struct verification* verif, const struct blob* blobs,
+                 size_t nb_blobs);
+
+
+int do_verify(struct pictdb_file* db_file, unsigned int nb_threads,
+              double rate, corruption_handler on_corruption, void* arg,
+              struct verify_report* report)
+{
+    if (db_file == NULL || report == NULL || rate < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    __atomic_store_n(&report->checked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&report->corrupted, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&report->bytes_read, 0, __ATOMIC_RELAXED);
+    struct verification verif = {
+        .db_file = db_file, .nb_threads = nb_threads, .rate = rate,
+        .on_corruption = on_corruption, .arg = arg, .report = report
+    };
+    clock_gettime(CLOCK_MONOTONIC, &verif.start);
+
+    if (fseek(db_file->fpdb, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+    const long file_size = ftell(db_file->fpdb);
+    const uint64_t first_blob = data_start(&db_file->header);
+    const int nb_res = nb_resolutions(db_file);
+
+    struct blob* blobs = calloc((size_t) db_file->header.max_files * nb_res,
+                                sizeof(struct blob));
+    if (blobs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Check that the blobs lie inside the file
+    size_t nb_blobs = 0;
+    for (uint32_t i = 0; i < db_file->header.max_files; ++i) {
+        const struct pict_metadata* meta = &db_file->metadata[i];
+        if (meta->is_valid != NON_EMPTY) {
+            continue;
+        }
+        for (int res = 0; res < nb_res; ++res) {
+            const uint64_t offset = variant_offset(db_file, i, res);
+            const uint32_t size = variant_size(db_file, i, res);
+            if (res != RES_ORIG && offset == 0 && size == 0) {
+                continue; // Not generated yet
+            }
+            if (size == 0 || offset < first_blob
+                || offset + size > (uint64_t) file_size) {
+                corruption(&verif, i, res, "outside of the database file");
+                // An original that cannot be read is all there is to check
+                if (res == RES_ORIG) {
+                    __atomic_fetch_add(&report->checked, 1, __ATOMIC_RELAXED);
+                }
+            } else {
+                struct blob new_blob = {
+                    .offset = offset, .size = size,
+                    .index = i, .resolution = res
+                };
+                blobs[nb_blobs++] = new_blob;
+            }
+        }
+    }
+
+    // Read the file sequentially
+    qsort(blobs, nb_blobs, sizeof(struct blob), compare_offsets);
+    int ret = 0;
+    size_t first = 0;
+    while (ret == 0 && first < nb_blobs) {
+        size_t count = 0;
+        uint64_t bytes = 0;
+        while (first + count < nb_blobs && count < VERIFY_BATCH
+               && (count == 0
+                   || bytes + blobs[first + count].size <= VERIFY_WINDOW)) {
+            bytes += blobs[first + count].size;
+            ++count;
+        }
+        ret = verify_blobs(&verif, &blobs[first], count);
+        first += count;
+    }
+
+    free(blobs);
+    return ret;
+}
+
+int verify_blobs(struct verification* verif, const struct blob* blobs,
+                 size_t nb_blobs)
+{
+    struct pictdb_file* db_file = verif->db_file;
+    struct hash_job* jobs = calloc(nb_blobs, sizeof(struct hash_job));
+    char** data = calloc(nb_blobs, sizeof(char*));
+    if (jobs == NULL || data == NULL) {
+        free(jobs);
+        free(data);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Read the blobs; deduplicated images share theirs
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < nb_blobs; ++i) {
+        if (i > 0 && blobs[i].offset == blobs[i - 1].offset
+            && blobs[i].size == blobs[i - 1].size) {
+            continue;
+        }
+        data[i] = malloc(blobs[i].size);
+        if (data[i] == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else if (fseek(db_file->fpdb, blobs[i].offset, SEEK_SET) != 0
+                   || fread(data[i], blobs[i].size, 1, db_file->fpdb) != 1) {
+            ret = ERR_IO;
+        } else {
+            __atomic_fetch_add(&verif->report->bytes_read, blobs[i].size,
+                               __ATOMIC_RELAXED);
+            throttle(verif);
+        }
+    }
+
+    // Hash the originals in parallel
+    size_t nb_jobs = 0;
+    const char* shared = NULL;
+    for (size_t i = 0; ret == 0 && i < nb_blobs; ++i) {
+        shared = data[i] != NULL ? data[i] : shared;
+        if (blobs[i].resolution == RES_ORIG) {
+            jobs[nb_jobs].data = (char*) shared;
+            jobs[nb_jobs].size = blobs[i].size;
+            ++nb_jobs;
+        }
+    }
+    ret = ret == 0 ? hash_batch(jobs, nb_jobs, verif->nb_threads) : ret;
+
+    // Compare the hashes and decode the variants
+    nb_jobs = 0;
+    shared = NULL;
+    for (size_t i = 0; ret == 0 && i < nb_blobs; ++i) {
+        const struct blob* blob = &blobs[i];
+        const struct pict_metadata* meta = &db_file->metadata[blob->index];
+        shared = data[i] != NULL ? data[i] : shared;
+
+        if (blob->resolution == RES_ORIG) {
+            const struct hash_job* job = &jobs[nb_jobs++];
+            if (job->error != 0
+                || hashcmp((unsigned char*) job->sha,
+                           (unsigned char*) meta->SHA) != 0) {
+                corruption(verif, blob->index, RES_ORIG,
+                           "content does not match its hash");
+            }
+            __atomic_fetch_add(&verif->report->checked, 1, __ATOMIC_RELAXED);
+        } else {
+            uint32_t height = 0;
+            uint32_t width = 0;
+            const uint16_t* max = resolution_max(db_file, blob->resolution);
+            if (decode_image(&height, &width, shared, blob->size) != 0) {
+                corruption(verif, blob->index, blob->resolution,
+                           "cannot be decoded");
+            } else if (width > max[0] || height > max[1]) {
+                corruption(verif, blob->index, blob->resolution,
+                           "larger than its resolution");
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nb_blobs; ++i) {
+        free(data[i]);
+    }
+    free(data);
+    free(jobs);
+    return ret;
+}
+
+int compare_offsets(const void* a, const void* b)
+{
+    const struct blob* blob_a = a;
+    const struct blob* blob_b = b;
+    return blob_a->offset < blob_b->offset ? -1 :
+           blob_a->offset > blob_b->offset ? 1 : 0;
+}
+
+void corruption(struct verification* verif, uint32_t index, int resolution,
+                const char* reason)
+{
+    __atomic_fetch_add(&verif->report->corrupted, 1, __ATOMIC_RELAXED);
+    if (verif->on_corruption != NULL) {
+        verif->on_corruption(&verif->db_file->metadata[index], resolution,
+                             reason, verif->arg);
+    }
+}
+
+void throttle(const struct verification* verif)
+{
+    if (verif->rate <= 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double elapsed = (now.tv_sec - verif->start.tv_sec)
+                           + (now.tv_nsec - verif->start.tv_nsec) / 1e9;
+    const double expected = verif->report->bytes_read / (verif->rate * 1e6);
+    if (expected > elapsed) {
+        const double wait = expected - elapsed;
+        struct timespec pause = {
+            .tv_sec = (time_t) wait,
+            .tv_nsec = (long)((wait - (time_t) wait) * 1e9)
+        };
+        nanosleep(&pause, NULL);
+    }
+}
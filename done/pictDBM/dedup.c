@@ -27,9 +27,10 @@ int do_name_and_content_dedup(struct pictdb_file* db_file, uint32_t index)
             } else if (found == 0 &&
                        hashcmp(db_file->metadata[i].SHA, img_index->SHA) == 0) {
                 // Two images with the same hash: deduplication
-                for (size_t res = 0; res < NB_RES; ++res) {
-                    img_index->offset[res] = db_file->metadata[i].offset[res];
-                    img_index->size[res] = db_file->metadata[i].size[res];
+                for (int res = 0; res < nb_resolutions(db_file); ++res) {
+                    set_variant(db_file, index, res,
+                                variant_offset(db_file, i, res),
+                                variant_size(db_file, i, res));
                 }
                 found = 1;
             }
@@ -43,6 +44,10 @@ int do_name_and_content_dedup(struct pictdb_file* db_file, uint32_t index)
             img_index->size[res] = 0;
         }
         img_index->offset[RES_ORIG] = 0;
+        // Those of an image deleted from the same slot
+        for (int res = NB_RES; res < nb_resolutions(db_file); ++res) {
+            set_variant(db_file, index, res, 0, 0);
+        }
     }
 
     return 0;
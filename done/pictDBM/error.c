@@ -22,5 +22,7 @@ const char* const ERROR_MESSAGES[] = {
     "Not implemented",
     "Existing picture ID",
     "Vips error",
+    "Corrupted database",
+    "Read-only database",
     "Debug"
 };
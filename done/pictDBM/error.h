@@ -28,6 +28,8 @@ enum error_codes {
     NOT_IMPLEMENTED,
     ERR_DUPLICATE_ID,
     ERR_VIPS,
+    ERR_CORRUPTED,
+    ERR_READ_ONLY,
     ERR_DEBUG
 };
 
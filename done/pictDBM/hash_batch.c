@@ -0,0 +1,149 @@
+/**
+ * @file hash_batch.c
+ * @brief Parallel hashing of many images, for bulk workloads.
+ *
+ * Each thread takes the next job of the batch until there is none left, so
+ * that large and small images are balanced between the threads.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _POSIX_C_SOURCE 200809L // for sysconf
+
+#include "hash_batch.h"
+#include "trace.h"
+#include <pthread.h>
+#include <unistd.h> // for sysconf
+
+#define MAX_THREADS 256 // Maximal number of threads of a pool
+
+/**
+ * @brief Jobs shared by the threads of a batch.
+ */
+struct batch {
+    struct hash_job* jobs;
+    size_t nb_jobs;
+    /**
+     * @brief Index of the next job to run.
+     */
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief Body of a hashing thread.
+ *
+ * @param arg The batch.
+ * @return NULL.
+ */
+void* hash_worker(void* arg);
+
+/**
+ * @brief Loads an image from disk into a newly allocated buffer.
+ *
+ * @param job The job whose filename is to be loaded.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int load_job(struct hash_job* job);
+
+
+int hash_batch(struct hash_job* jobs, size_t nb_jobs,
+               unsigned int nb_threads)
+{
+    if (jobs == NULL && nb_jobs > 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    nb_threads = nb_threads == 0 ? default_threads() : nb_threads;
+    nb_threads = nb_threads > nb_jobs ? (unsigned int) nb_jobs : nb_threads;
+
+    struct batch batch = { .jobs = jobs, .nb_jobs = nb_jobs, .next = 0 };
+    if (pthread_mutex_init(&batch.lock, NULL) != 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    run_pool(hash_worker, &batch, nb_threads);
+    pthread_mutex_destroy(&batch.lock);
+    return 0;
+}
+
+void run_pool(void* (*fn)(void*), void* arg, unsigned int nb_threads)
+{
+    nb_threads = nb_threads == 0 ? default_threads() : nb_threads;
+    nb_threads = nb_threads > MAX_THREADS ? MAX_THREADS : nb_threads;
+
+    // The calling thread works too
+    pthread_t threads[MAX_THREADS];
+    unsigned int started = 0;
+    while (started + 1 < nb_threads
+           && pthread_create(&threads[started], NULL, fn, arg) == 0) {
+        ++started;
+    }
+    (void) fn(arg);
+    for (unsigned int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+unsigned int default_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : (unsigned int) cpus;
+}
+
+void* hash_worker(void* arg)
+{
+    struct batch* batch = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        size_t index = batch->next;
+        if (index < batch->nb_jobs) {
+            ++batch->next;
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        if (index >= batch->nb_jobs) {
+            return NULL;
+        }
+
+        struct hash_job* job = &batch->jobs[index];
+        job->error = job->data == NULL ? load_job(job) : 0;
+        if (job->error == 0) {
+            TRACE_BEGIN(hash);
+            job->error = compute_sha(job->data, job->size, job->sha);
+            TRACE_END(hash, "insert.hash");
+        }
+    }
+}
+
+int load_job(struct hash_job* job)
+{
+    if (job->filename == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    FILE* image = fopen(job->filename, "rb");
+    if (image == NULL) {
+        return ERR_IO;
+    }
+
+    int ret = ERR_IO;
+    long size = -1;
+    if (fseek(image, 0, SEEK_END) == 0 && (size = ftell(image)) > 0
+        && fseek(image, 0, SEEK_SET) == 0) {
+        job->data = malloc(size);
+        if (job->data == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else if (fread(job->data, size, 1, image) == 1) {
+            job->size = size;
+            ret = 0;
+        } else {
+            free(job->data);
+            job->data = NULL;
+        }
+    }
+    fclose(image);
+
+    return ret;
+}
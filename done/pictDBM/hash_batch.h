@@ -0,0 +1,74 @@
+/**
+ * @file hash_batch.h
+ * @brief Header file for the parallel hashing of many images, and for the
+ *        pool of threads running it.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_HASH_BATCH_H
+#define PICTDBPRJ_HASH_BATCH_H
+
+#include "pictDB.h"
+
+/**
+ * @brief An image to hash as part of a batch.
+ */
+struct hash_job {
+    /**
+     * @brief File to load the image from, or NULL if data is already set.
+     */
+    const char* filename;
+    /**
+     * @brief The bytes of the image. When loaded from filename, they are
+     *        allocated with malloc and must be freed by the caller.
+     */
+    char* data;
+    /**
+     * @brief The size of the image, in bytes.
+     */
+    size_t size;
+    /**
+     * @brief The SHA-256 hash of the image, once computed.
+     */
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    /**
+     * @brief 0 if the image was hashed, an error code otherwise.
+     */
+    int error;
+};
+
+/**
+ * @brief Loads (if need be) and hashes many images at once, spreading
+ *        the jobs over a pool of threads.
+ *
+ * @param jobs       The images to hash.
+ * @param nb_jobs    The number of images.
+ * @param nb_threads The number of threads to use; 0 uses one per CPU.
+ * @return 0 if the threads could be run, an error code otherwise. The result
+ *         of each job is in its error field.
+ */
+int hash_batch(struct hash_job* jobs, size_t nb_jobs,
+               unsigned int nb_threads);
+
+/**
+ * @brief Runs a function in a pool of threads, the calling one included,
+ *        until they all returned. Each thread takes the work shared in the
+ *        argument until there is none left; those which could not be
+ *        started leave theirs to the others.
+ *
+ * @param fn         The body of the threads.
+ * @param arg        The argument of fn, shared by the threads.
+ * @param nb_threads The number of threads to use; 0 uses one per CPU.
+ */
+void run_pool(void* (*fn)(void*), void* arg, unsigned int nb_threads);
+
+/**
+ * @brief Gives the number of threads used by default, one per online CPU.
+ *
+ * @return The number of threads, at least 1.
+ */
+unsigned int default_threads(void);
+
+#endif
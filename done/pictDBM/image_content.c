@@ -7,14 +7,28 @@
  */
 
 #include "image_content.h"
+#include "trace.h"
+#include "variant_cache.h"
+
+#define JPEG_MAX_SHRINK 8 // Maximal shrink factor of the JPEG decoder
+#define PROBE_SIZE 16     // Width and height of the images probing encoders
+
+const char* const FORMAT_TYPES[NB_FORMATS] = {
+    "image/jpeg", "image/webp", "image/avif"
+};
+
+const char* const FORMAT_EXTENSIONS[NB_FORMATS] = {
+    "jpg", "webp", "avif"
+};
 
 /**
  * @brief Checks whether the given resolution is within the valid range.
  *
+ * @param db_file    The database, which may have extra resolutions.
  * @param resolution The resolution to check.
  * @return 0 if the resolution is valid, 1 otherwise.
  */
-int valid_resolution(int resolution);
+int valid_resolution(const struct pictdb_file* db_file, int resolution);
 
 /**
  * @brief Writes the data pointed to by the given pointer to disk.
@@ -33,7 +47,8 @@ long write_to_disk(struct pictdb_file* db_file, void* to_write,
 
 /**
  * @brief Updates the metadata at the given index with the new size and offset,
- *        and writes it to disk.
+ *        or its entry of the tier extension for an extra resolution, and
+ *        writes it to disk.
  *
  * @param db_file    The database containing the metadata.
  * @param index      The index of the metadata.
@@ -54,10 +69,33 @@ long update_metadata(struct pictdb_file* db_file, size_t index, int resolution,
  * @param input_size    The size (in bytes) of the image to resize.
  * @param max_x         The maximum width of the new image.
  * @param max_y         The maximum height of the new image.
+ * @param fit           How the image is fitted to max_x and max_y.
+ * @param format        The encoding of the new image.
+ * @param encoding      The options of the JPEG encoder, NULL for its
+ *                      defaults.
  * @return 0 in case of success, 1 otherwise.
  */
 int resize(void** output_buffer, size_t* output_size, const void* input_buffer,
-           uint32_t input_size, uint16_t max_x, uint16_t max_y);
+           uint32_t input_size, uint16_t max_x, uint16_t max_y,
+           enum resize_fit fit, enum image_format format,
+           const struct pictdb_encoding* encoding);
+
+/**
+ * @brief Encodes an image.
+ *
+ * @param image         The image.
+ * @param format        The format.
+ * @param encoding      The options of the encoder, NULL for the defaults.
+ *                      WebP and AVIF only use the quality and the
+ *                      stripping of the metadata.
+ * @param output_buffer Location of the encoded image, to be freed with
+ *                      g_free.
+ * @param output_size   Location where its size will be stored.
+ * @return 0 in case of success, non-zero otherwise.
+ */
+int encode_image(VipsImage* image, enum image_format format,
+                 const struct pictdb_encoding* encoding,
+                 void** output_buffer, size_t* output_size);
 
 /**
  * @brief Computes the ratio to use for resizing.
@@ -65,16 +103,67 @@ int resize(void** output_buffer, size_t* output_size, const void* input_buffer,
  * @param image      The image to resize.
  * @param max_width  The maximum width of the new image.
  * @param max_height The maximum height of the new image.
+ * @param fit        FIT_INSIDE for the image to fit in the box, FIT_COVER
+ *                   for it to cover the box.
  * @return The resize ratio.
  */
-double shrink_value(VipsImage* image, uint16_t max_width, uint16_t max_height);
+double shrink_value(VipsImage* image, uint16_t max_width, uint16_t max_height,
+                    enum resize_fit fit);
+
+/**
+ * @brief Loads a JPEG image, letting the decoder shrink it by a power of
+ *        two if it is to be resized by at least that much.
+ *
+ * @param workspace    Two images: the first one is loaded without shrinking,
+ *                     the second one with, if need be.
+ * @param input_buffer The image.
+ * @param input_size   The size (in bytes) of the image.
+ * @param max_x        The maximum width of the new image.
+ * @param max_y        The maximum height of the new image.
+ * @param fit          How the image is fitted to max_x and max_y.
+ * @return The image loaded, NULL in case of error.
+ */
+VipsImage* shrink_on_load(VipsImage** workspace, const void* input_buffer,
+                          uint32_t input_size, uint16_t max_x, uint16_t max_y,
+                          enum resize_fit fit);
+
+/**
+ * @brief Checks whether a JPEG marker starts a frame header (SOFn).
+ *
+ * @param marker The marker.
+ * @return 1 if it is a frame header, 0 otherwise.
+ */
+int is_frame_marker(uint8_t marker);
+
+/**
+ * @brief Reads the original of an image and resizes it, without writing it.
+ *
+ * @param resolution    The resolution of the image to create.
+ * @param db_file       The database containing the image.
+ * @param index         The index of the image in the database.
+ * @param output_buffer Location of the resized image, to be freed with
+ *                      g_free.
+ * @param output_size   Location where its size will be stored.
+ * @return 0 in case of success, ERR_IO or ERR_VIPS otherwise.
+ */
+int resize_original(int resolution, struct pictdb_file* db_file,
+                    size_t index, void** output_buffer, size_t* output_size);
+
+/**
+ * @enum jpeg_scanner_states
+ * @brief States of the JPEG dimensions scanner.
+ */
+enum jpeg_scanner_states {
+    JS_SOI, JS_MARKER, JS_MARKER_CODE, JS_LENGTH, JS_SEGMENT, JS_FRAME,
+    JS_DONE, JS_ERROR
+};
 
 
 int lazily_resize(int resolution, struct pictdb_file* db_file,
                   size_t index)
 {
     // Error checks on arguments
-    if (valid_resolution(resolution) != 0 || db_file == NULL
+    if (db_file == NULL || valid_resolution(db_file, resolution) != 0
         || index >= db_file->header.max_files) {
         return ERR_INVALID_ARGUMENT;
     }
@@ -90,32 +179,24 @@ int lazily_resize(int resolution, struct pictdb_file* db_file,
     // If the image already exists in the asked resolution or the asked
     // resolution is the original resolution, do nothing.
     if (resolution == RES_ORIG
-        || meta_index->size[resolution] != 0) {
+        || variant_size(db_file, index, resolution) != 0) {
         return 0;
     }
 
-    uint32_t size_orig = meta_index->size[RES_ORIG]; // Used often
-
-    // Store the original image in an array
-    char image_in_bytes[size_orig];
-    if (fseek(db_file->fpdb, meta_index->offset[RES_ORIG], SEEK_SET)
-        || fread(image_in_bytes, size_orig, 1, db_file->fpdb) != 1) {
-        return ERR_IO;
-    }
-
     // Resize the image using VIPS
     size_t output_size = 0;
     void* output_buffer = NULL;
-    if (resize(&output_buffer, &output_size,
-               image_in_bytes, size_orig,
-               db_file->header.res_resized[resolution * 2],
-               db_file->header.res_resized[resolution * 2 + 1]) != 0) {
-        return ERR_VIPS;
+    const int ret = resize_original(resolution, db_file, index,
+                                    &output_buffer, &output_size);
+    if (ret != 0) {
+        return ret;
     }
 
     // Write the image at the end of the file and get the offset
+    TRACE_BEGIN(write);
     long file_position = write_to_disk(db_file, output_buffer, output_size,
                                        1, 0, SEEK_END);
+    TRACE_END(write, "lazily_resize.write");
     // Once written, we can free the memory from the image
     g_free(output_buffer);
     if (file_position != -1) {
@@ -125,22 +206,181 @@ int lazily_resize(int resolution, struct pictdb_file* db_file,
             return ERR_INVALID_ARGUMENT;
         }
         // Update the metadata and write it to disk
+        TRACE_BEGIN(propagate);
         file_position = update_metadata(db_file, index, resolution,
                                         output_size, file_position);
         // Update the metadata of the duplicate images, if there is any
+        const uint64_t offset = variant_offset(db_file, index, resolution);
         for (size_t i = 0; i < db_file->header.max_files && file_position != -1; ++i) {
             if (i != index && db_file->metadata[i].is_valid == NON_EMPTY) {
                 if (hashcmp(db_file->metadata[i].SHA, meta_index->SHA) == 0) {
                     file_position = update_metadata(db_file, i, resolution,
-                                                    output_size,
-                                                    meta_index->offset[resolution]);
+                                                    output_size, offset);
                 }
             }
         }
+        TRACE_END(propagate, "lazily_resize.propagate");
+    }
+    return file_position == -1 ? ERR_IO : 0;
+}
+
+int cached_resize(int resolution, struct pictdb_file* db_file, size_t index,
+                  uint64_t* offset, uint32_t* size)
+{
+    if (db_file == NULL || valid_resolution(db_file, resolution) != 0
+        || resolution == RES_ORIG || db_file->cache == NULL || offset == NULL
+        || size == NULL || index >= db_file->header.max_files
+        || db_file->metadata[index].is_valid == EMPTY) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const unsigned char* sha = db_file->metadata[index].SHA;
+    const uint16_t max_x = resolution_max(db_file, resolution)[0];
+    const uint16_t max_y = resolution_max(db_file, resolution)[1];
+    const struct pictdb_encoding* encoding = &db_file->encodings[resolution];
+    int ret = variant_cache_find(db_file->cache, sha, max_x, max_y, encoding,
+                                 offset, size);
+    if (ret != ERR_FILE_NOT_FOUND) {
+        return ret;
+    }
+
+    size_t output_size = 0;
+    void* output_buffer = NULL;
+    ret = resize_original(resolution, db_file, index,
+                          &output_buffer, &output_size);
+    if (ret == 0 && output_size >> 32 > 0) {
+        ret = ERR_INVALID_ARGUMENT;
+    }
+    if (ret == 0) {
+        TRACE_BEGIN(write);
+        ret = variant_cache_add(db_file->cache, sha, max_x, max_y, encoding,
+                                output_buffer, output_size, offset);
+        TRACE_END(write, "lazily_resize.write");
+        *size = output_size;
+    }
+    g_free(output_buffer);
+    return ret;
+}
+
+int resize_original(int resolution, struct pictdb_file* db_file,
+                    size_t index, void** output_buffer, size_t* output_size)
+{
+    const struct pict_metadata* meta_index = &db_file->metadata[index];
+    uint32_t size_orig = meta_index->size[RES_ORIG]; // Used often
+
+    // Store the original image in an array, too large for the stack
+    char* image_in_bytes = malloc(size_orig);
+    if (image_in_bytes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = 0;
+    TRACE_BEGIN(load);
+    if (fseek(db_file->fpdb, meta_index->offset[RES_ORIG], SEEK_SET)
+        || fread(image_in_bytes, size_orig, 1, db_file->fpdb) != 1) {
+        ret = ERR_IO;
+    }
+    TRACE_END(load, "lazily_resize.load");
+
+    ret = ret == 0 ? resize_variant(db_file, resolution, image_in_bytes,
+                                    size_orig, output_buffer,
+                                    output_size) : ret;
+    free(image_in_bytes);
+    return ret;
+}
+
+int resize_variant(const struct pictdb_file* db_file, int resolution,
+                   const void* original, uint32_t original_size,
+                   void** output_buffer, size_t* output_size)
+{
+    if (db_file == NULL || valid_resolution(db_file, resolution) != 0
+        || resolution == RES_ORIG || original == NULL
+        || output_buffer == NULL || output_size == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint16_t* max = resolution_max(db_file, resolution);
+    return resize(output_buffer, output_size, original, original_size,
+                  max[0], max[1], FIT_INSIDE, FORMAT_JPEG,
+                  &db_file->encodings[resolution]) != 0 ? ERR_VIPS : 0;
+}
+
+int store_variant(struct pictdb_file* db_file, int resolution,
+                  const uint32_t* indexes, size_t nb_indexes,
+                  const void* image, size_t size)
+{
+    if (db_file == NULL || valid_resolution(db_file, resolution) != 0
+        || resolution == RES_ORIG || indexes == NULL || image == NULL
+        || size >> 32 > 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    long file_position = write_to_disk(db_file, (void*) image, size, 1, 0,
+                                       SEEK_END);
+    const long offset = file_position;
+    for (size_t i = 0; i < nb_indexes && file_position != -1; ++i) {
+        file_position = indexes[i] < db_file->header.max_files ?
+                        update_metadata(db_file, indexes[i], resolution, size,
+                                        offset) : -1;
     }
     return file_position == -1 ? ERR_IO : 0;
 }
 
+int resize_box(struct pictdb_file* db_file, size_t index, uint16_t width,
+               uint16_t height, enum resize_fit fit,
+               enum image_format format,
+               const struct pictdb_encoding* encoding, void** output_buffer,
+               size_t* output_size)
+{
+    if (db_file == NULL || output_buffer == NULL || output_size == NULL
+        || format >= NB_FORMATS
+        || index >= db_file->header.max_files
+        || db_file->metadata[index].is_valid == EMPTY
+        || (fit == FIT_COVER && (width == 0 || height == 0))
+        || (width == 0 && height == 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct pict_metadata* meta_index = &db_file->metadata[index];
+    char* image_in_bytes = malloc(meta_index->size[RES_ORIG]);
+    if (image_in_bytes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = 0;
+    TRACE_BEGIN(load);
+    if (fseek(db_file->fpdb, meta_index->offset[RES_ORIG], SEEK_SET)
+        || fread(image_in_bytes, meta_index->size[RES_ORIG], 1,
+                 db_file->fpdb) != 1) {
+        ret = ERR_IO;
+    }
+    TRACE_END(load, "resize_box.load");
+
+    // An unbounded dimension never limits the ratio
+    ret = ret == 0 && resize(output_buffer, output_size, image_in_bytes,
+                             meta_index->size[RES_ORIG],
+                             width == 0 ? UINT16_MAX : width,
+                             height == 0 ? UINT16_MAX : height, fit,
+                             format, encoding) != 0 ? ERR_VIPS : ret;
+    free(image_in_bytes);
+    return ret;
+}
+
+int format_supported(enum image_format format)
+{
+    VipsObject* process = VIPS_OBJECT(vips_image_new());
+    VipsImage** workspace = (VipsImage**) vips_object_local_array(process, 1);
+    void* buffer = NULL;
+    size_t size = 0;
+    // A saver may be there without an encoder, e.g. HEIF without AV1
+    const int supported = format < NB_FORMATS
+                          && vips_black(&workspace[0], PROBE_SIZE, PROBE_SIZE,
+                                        "bands", 3, NULL) == 0
+                          && encode_image(workspace[0], format, NULL,
+                                          &buffer, &size) == 0;
+    g_free(buffer);
+    g_object_unref(process);
+    vips_error_clear();
+    return supported;
+}
+
 int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
                    size_t image_size)
 {
@@ -157,10 +397,28 @@ int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
     return 0;
 }
 
-int valid_resolution(int resolution)
+int decode_image(uint32_t* height, uint32_t* width, const char* image_buffer,
+                 size_t image_size)
+{
+    VipsObject* process = VIPS_OBJECT(vips_image_new());
+    VipsImage** workspace = (VipsImage**) vips_object_local_array(process, 1);
+    double average = 0;
+    // Loading is lazy: only computing on the pixels decodes them
+    if (vips_jpegload_buffer((void*) image_buffer, image_size,
+                             &workspace[0], "fail", 1, NULL)
+        || vips_avg(workspace[0], &average, NULL)) {
+        g_object_unref(process);
+        return ERR_VIPS;
+    }
+    *height = workspace[0]->Ysize;
+    *width = workspace[0]->Xsize;
+    g_object_unref(process);
+    return 0;
+}
+
+int valid_resolution(const struct pictdb_file* db_file, int resolution)
 {
-    return (resolution == RES_THUMB || resolution == RES_SMALL
-            || resolution == RES_ORIG) ? 0 : 1;
+    return (resolution >= 0 && resolution < nb_resolutions(db_file)) ? 0 : 1;
 }
 
 long write_to_disk(struct pictdb_file* db_file, void* to_write,
@@ -177,36 +435,225 @@ long write_to_disk(struct pictdb_file* db_file, void* to_write,
 long update_metadata(struct pictdb_file* db_file, size_t index, int resolution,
                      size_t size, size_t offset)
 {
-    db_file->metadata[index].size[resolution] = size;
-    db_file->metadata[index].offset[resolution] = offset;
+    set_variant(db_file, index, resolution, offset, size);
+    if (resolution >= NB_RES) {
+        return write_tier_variants(db_file, index) == 0 ? (long) offset : -1;
+    }
     return write_to_disk(db_file, &db_file->metadata[index],
                          sizeof(struct pict_metadata), 1, sizeof(struct pictdb_header)
                          + sizeof(struct pict_metadata) * index, SEEK_SET);
 }
 
 int resize(void** output_buffer, size_t* output_size, const void* input_buffer,
-           uint32_t input_size, uint16_t max_x, uint16_t max_y)
+           uint32_t input_size, uint16_t max_x, uint16_t max_y,
+           enum resize_fit fit, enum image_format format,
+           const struct pictdb_encoding* encoding)
 {
     VipsObject* process = VIPS_OBJECT(vips_image_new());
-    VipsImage** workspace = (VipsImage**) vips_object_local_array(process, 2);
-    if (vips_jpegload_buffer((void*) input_buffer, input_size,
-                             &workspace[0], NULL) != 0) {
+    VipsImage** workspace = (VipsImage**) vips_object_local_array(process, 4);
+    TRACE_BEGIN(resize);
+    VipsImage* loaded = shrink_on_load(workspace, input_buffer, input_size,
+                                       max_x, max_y, fit);
+    if (loaded == NULL) {
         g_object_unref(process);
         return 1;
     }
     int ret = 0;
-    double ratio = shrink_value(workspace[0], max_x, max_y);
-    if (vips_resize(workspace[0], &workspace[1], ratio, NULL) ||
-        vips_jpegsave_buffer(workspace[1], output_buffer, output_size, NULL)) {
+    double ratio = shrink_value(loaded, max_x, max_y, fit);
+    // A covering image is cropped, never enlarged
+    ratio = fit == FIT_COVER && ratio > 1 ? 1 : ratio;
+    if (vips_resize(loaded, &workspace[2], ratio, NULL)) {
         ret = 1;
     }
+    VipsImage* resized = workspace[2];
+    if (ret == 0 && fit == FIT_COVER) {
+        // Keep the center of the image
+        const int width = resized->Xsize < max_x ? resized->Xsize : max_x;
+        const int height = resized->Ysize < max_y ? resized->Ysize : max_y;
+        ret = vips_extract_area(resized, &workspace[3],
+                                (resized->Xsize - width) / 2,
+                                (resized->Ysize - height) / 2,
+                                width, height, NULL) != 0;
+        resized = workspace[3];
+    }
+    TRACE_END(resize, "lazily_resize.resize");
+
+    // VIPS is lazy: the decoding and the resizing mostly run while encoding
+    TRACE_BEGIN(encode);
+    if (ret == 0 && encode_image(resized, format, encoding, output_buffer,
+                                 output_size)) {
+        ret = 1;
+    }
+    TRACE_END(encode, "lazily_resize.encode");
     g_object_unref(process);
     return ret;
 }
 
-double shrink_value(VipsImage* image, uint16_t max_width, uint16_t max_height)
+int encode_image(VipsImage* image, enum image_format format,
+                 const struct pictdb_encoding* encoding,
+                 void** output_buffer, size_t* output_size)
+{
+    static const struct pictdb_encoding defaults = {.quality = 0, .flags = 0};
+    encoding = encoding == NULL ? &defaults : encoding;
+    const int quality = encoding->quality == 0 ? DEFAULT_QUALITY :
+                        encoding->quality;
+    const int strip = (encoding->flags & ENCODE_STRIP) != 0;
+    switch (format) {
+    case FORMAT_WEBP:
+        return vips_webpsave_buffer(image, output_buffer, output_size,
+                                    "Q", quality, "strip", strip, NULL);
+    case FORMAT_AVIF:
+        return vips_heifsave_buffer(image, output_buffer, output_size,
+                                    "Q", quality, "strip", strip,
+                                    "compression",
+                                    VIPS_FOREIGN_HEIF_COMPRESSION_AV1, NULL);
+    default:
+        return vips_jpegsave_buffer(image, output_buffer, output_size,
+                                    "Q", quality, "strip", strip,
+                                    "interlace",
+                                    (encoding->flags & ENCODE_PROGRESSIVE) != 0,
+                                    "optimize_coding",
+                                    (encoding->flags & ENCODE_OPTIMIZE) != 0,
+                                    NULL);
+    }
+}
+
+double shrink_value(VipsImage* image, uint16_t max_width, uint16_t max_height,
+                    enum resize_fit fit)
 {
     const double h_shrink = (double)max_width / (double)image->Xsize;
     const double v_shrink = (double)max_height / (double)image->Ysize;
+    if (fit == FIT_COVER) {
+        return h_shrink > v_shrink ? h_shrink : v_shrink;
+    }
     return h_shrink > v_shrink ? v_shrink : h_shrink;
 }
+
+VipsImage* shrink_on_load(VipsImage** workspace, const void* input_buffer,
+                          uint32_t input_size, uint16_t max_x, uint16_t max_y,
+                          enum resize_fit fit)
+{
+    // Loading is lazy: only the header is decoded until the image is used
+    if (vips_jpegload_buffer((void*) input_buffer, input_size,
+                             &workspace[0], NULL) != 0) {
+        return NULL;
+    }
+    const double ratio = shrink_value(workspace[0], max_x, max_y, fit);
+    int shrink = 1;
+    while (shrink < JPEG_MAX_SHRINK && ratio * shrink * 2 <= 1) {
+        shrink *= 2;
+    }
+    if (shrink == 1) {
+        return workspace[0];
+    }
+    // The decoder skips the DCT coefficients it does not need
+    return vips_jpegload_buffer((void*) input_buffer, input_size,
+                                &workspace[1], "shrink", shrink, NULL) == 0 ?
+           workspace[1] : NULL;
+}
+
+void init_jpeg_scanner(struct jpeg_size_scanner* scanner)
+{
+    memset(scanner, 0, sizeof(struct jpeg_size_scanner));
+    scanner->state = JS_SOI;
+}
+
+void scan_jpeg_size(struct jpeg_size_scanner* scanner,
+                    const unsigned char* data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && scanner->state != JS_DONE
+           && scanner->state != JS_ERROR) {
+        const uint8_t byte = data[i];
+        switch (scanner->state) {
+        case JS_SOI:
+            // The image must start with FF D8
+            scanner->field[scanner->pos++] = byte;
+            if (scanner->pos == 2) {
+                scanner->state = (scanner->field[0] == 0xFF
+                                  && scanner->field[1] == 0xD8) ?
+                                 JS_MARKER : JS_ERROR;
+            }
+            ++i;
+            break;
+        case JS_MARKER:
+            scanner->state = byte == 0xFF ? JS_MARKER_CODE : JS_ERROR;
+            ++i;
+            break;
+        case JS_MARKER_CODE:
+            ++i;
+            if (byte == 0xFF) {
+                // Fill byte
+            } else if (byte == 0x01 || (byte >= 0xD0 && byte <= 0xD8)) {
+                // Markers without a segment
+                scanner->state = JS_MARKER;
+            } else if (byte == 0xD9 || byte == 0xDA) {
+                // End of image or start of scan before any frame header
+                scanner->state = JS_ERROR;
+            } else {
+                scanner->marker = byte;
+                scanner->pos = 0;
+                scanner->state = JS_LENGTH;
+            }
+            break;
+        case JS_LENGTH:
+            scanner->field[scanner->pos++] = byte;
+            ++i;
+            if (scanner->pos == 2) {
+                scanner->skip = (scanner->field[0] << 8 | scanner->field[1]);
+                scanner->pos = 0;
+                if (scanner->skip < 2) {
+                    scanner->state = JS_ERROR;
+                } else if (is_frame_marker(scanner->marker)) {
+                    scanner->state = scanner->skip < 7 ? JS_ERROR : JS_FRAME;
+                } else {
+                    scanner->skip -= 2;
+                    scanner->state = scanner->skip == 0 ? JS_MARKER :
+                                     JS_SEGMENT;
+                }
+            }
+            break;
+        case JS_SEGMENT: {
+            // Skip the whole segment at once
+            size_t n = len - i < scanner->skip ? len - i : scanner->skip;
+            i += n;
+            scanner->skip -= n;
+            if (scanner->skip == 0) {
+                scanner->state = JS_MARKER;
+            }
+            break;
+        }
+        case JS_FRAME:
+            // Precision, height and width
+            scanner->field[scanner->pos++] = byte;
+            ++i;
+            if (scanner->pos == 5) {
+                scanner->height = scanner->field[1] << 8 | scanner->field[2];
+                scanner->width = scanner->field[3] << 8 | scanner->field[4];
+                scanner->state = scanner->height != 0 && scanner->width != 0 ?
+                                 JS_DONE : JS_ERROR;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+int jpeg_scanner_resolution(const struct jpeg_size_scanner* scanner,
+                            uint32_t* height, uint32_t* width)
+{
+    if (scanner->state != JS_DONE) {
+        return ERR_VIPS;
+    }
+    *height = scanner->height;
+    *width = scanner->width;
+    return 0;
+}
+
+int is_frame_marker(uint8_t marker)
+{
+    // SOF0 to SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+           && marker != 0xC8 && marker != 0xCC;
+}
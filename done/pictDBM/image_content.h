@@ -10,10 +10,56 @@
 #include <vips/vips.h>
 
 /**
- * @brief Resizes an image to a new resolution.
+ * @brief How an image is fitted to the width and height it is resized to.
+ */
+enum resize_fit {
+    /**
+     * @brief The whole image fits in the box, keeping its aspect ratio.
+     */
+    FIT_INSIDE,
+    /**
+     * @brief The image covers the box, keeping its aspect ratio, and is
+     *        cropped to it around its center. It is never enlarged.
+     */
+    FIT_COVER
+};
+
+/**
+ * @brief Encodings of the resized images. The resolutions stored in a
+ *        database are always JPEG.
+ */
+enum image_format {
+    FORMAT_JPEG,
+    FORMAT_WEBP,
+    /**
+     * @brief AV1 in a HEIF container, if libvips was built with an encoder.
+     */
+    FORMAT_AVIF,
+    NB_FORMATS
+};
+
+/**
+ * @brief MIME types and file extensions of the formats.
+ */
+extern const char* const FORMAT_TYPES[NB_FORMATS];
+extern const char* const FORMAT_EXTENSIONS[NB_FORMATS];
+
+/**
+ * @brief Tells whether libvips can encode images in a format, by encoding
+ *        a small one.
+ *
+ * @param format The format.
+ * @return 1 if it can, 0 otherwise.
+ */
+int format_supported(enum image_format format);
+
+/**
+ * @brief Resizes an image to a new resolution, encoded with the settings of
+ *        the resolution, and writes it to the database.
  *
  * @param resolution The resolution of the image to create. Possible values are
- *                   RES_THUMB, RES_SMALL, RES_ORIG.
+ *                   RES_THUMB, RES_SMALL, RES_ORIG and the extra resolutions
+ *                   of the database.
  * @param db_file    The database file containing the image to resize
  *                   and the resized image.
  * @param index      The index of the image to resize in the database.
@@ -22,6 +68,82 @@
 int lazily_resize(int resolution, struct pictdb_file* db_file,
                   size_t index);
 
+/**
+ * @brief Gives an image resized to a new resolution from the cache of a
+ *        database opened read-only, resizing it and adding it to the cache
+ *        if need be. The database itself is left untouched.
+ *
+ * @param resolution The resolution of the image, other than RES_ORIG.
+ * @param db_file    The database, with a cache.
+ * @param index      The index of the image in the database.
+ * @param offset     Location where the offset of the image in the cache file
+ *                   will be stored.
+ * @param size       Location where the size of the image will be stored.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int cached_resize(int resolution, struct pictdb_file* db_file, size_t index,
+                  uint64_t* offset, uint32_t* size);
+
+/**
+ * @brief Resizes an original image to a resolution of a database, as a JPEG
+ *        encoded with the settings of the resolution. Neither the file nor
+ *        the database is touched, so that several threads may resize images
+ *        of the same database at once.
+ *
+ * @param db_file       The database.
+ * @param resolution    The resolution, other than RES_ORIG.
+ * @param original      The bytes of the original image.
+ * @param original_size The size of the original image.
+ * @param output_buffer Location of the resized image, to be freed with
+ *                      g_free.
+ * @param output_size   Location where its size will be stored.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int resize_variant(const struct pictdb_file* db_file, int resolution,
+                   const void* original, uint32_t original_size,
+                   void** output_buffer, size_t* output_size);
+
+/**
+ * @brief Appends an image resized to a resolution to a database and makes
+ *        it the variant of some images in that resolution, e.g. duplicates.
+ *        Their previous variant, if any, is left to the garbage collection.
+ *
+ * @param db_file    The database.
+ * @param resolution The resolution, other than RES_ORIG.
+ * @param indexes    The indexes of the images.
+ * @param nb_indexes The number of images.
+ * @param image      The resized image.
+ * @param size       The size of the resized image.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int store_variant(struct pictdb_file* db_file, int resolution,
+                  const uint32_t* indexes, size_t nb_indexes,
+                  const void* image, size_t size);
+
+/**
+ * @brief Resizes the original of an image to any width and height, in any
+ *        format, without writing it to the database.
+ *
+ * @param db_file       The database containing the image.
+ * @param index         The index of the image in the database.
+ * @param width         The width of the box, 0 if unbounded (FIT_INSIDE
+ *                      only).
+ * @param height        The height of the box, 0 if unbounded (FIT_INSIDE
+ *                      only).
+ * @param fit           How the image is fitted to the box.
+ * @param format        The encoding of the resized image.
+ * @param encoding      The options of its encoder, NULL for the defaults.
+ * @param output_buffer Location of the resized image, to be freed with
+ *                      g_free.
+ * @param output_size   Location where its size will be stored.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int resize_box(struct pictdb_file* db_file, size_t index, uint16_t width,
+               uint16_t height, enum resize_fit fit,
+               enum image_format format,
+               const struct pictdb_encoding* encoding, void** output_buffer,
+               size_t* output_size);
+
 /**
  * @brief Retrieves the resolution (width and height) of an image.
  *
@@ -33,3 +155,46 @@ int lazily_resize(int resolution, struct pictdb_file* db_file,
  */
 int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
                    size_t image_size);
+
+/**
+ * @brief Decodes all the pixels of an image, failing on any damaged data
+ *        instead of only reading its header as get_resolution does.
+ *
+ * @param height       Location where the height of the image will be stored.
+ * @param width        Location where the width of the image will be stored.
+ * @param image_buffer Pointer to the memory location of the image.
+ * @param image_size   The size of the image (in bytes).
+ * @return 0 if the image could be decoded, ERR_VIPS otherwise.
+ */
+int decode_image(uint32_t* height, uint32_t* width, const char* image_buffer,
+                 size_t image_size);
+
+/**
+ * @brief Initializes a scanner looking for the dimensions of a JPEG image.
+ *
+ * @param scanner The scanner to initialize.
+ */
+void init_jpeg_scanner(struct jpeg_size_scanner* scanner);
+
+/**
+ * @brief Feeds the next bytes of a JPEG image to a scanner. Once the frame
+ *        header is found, the remaining bytes are ignored.
+ *
+ * @param scanner The scanner.
+ * @param data    The next bytes of the image.
+ * @param len     The number of bytes.
+ */
+void scan_jpeg_size(struct jpeg_size_scanner* scanner,
+                    const unsigned char* data, size_t len);
+
+/**
+ * @brief Retrieves the resolution found by a scanner.
+ *
+ * @param scanner The scanner.
+ * @param height  Location where the height of the image will be stored.
+ * @param width   Location where the width of the image will be stored.
+ * @return 0 if the dimensions were found, ERR_VIPS if the bytes scanned are
+ *         not the beginning of a valid JPEG image.
+ */
+int jpeg_scanner_resolution(const struct jpeg_size_scanner* scanner,
+                            uint32_t* height, uint32_t* width);
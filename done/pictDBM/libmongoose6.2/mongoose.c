@@ -2014,7 +2014,8 @@ int to_wchar(const char *path, wchar_t *wbuf, size_t wbuf_len) {
 #define _MG_CALLBACK_MODIFIABLE_FLAGS_MASK                               \
   (MG_F_USER_1 | MG_F_USER_2 | MG_F_USER_3 | MG_F_USER_4 | MG_F_USER_5 | \
    MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_SEND_AND_CLOSE |        \
-   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK)
+   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK |     \
+   MG_F_RESPONSE_PENDING)
 
 #ifndef intptr_t
 #define intptr_t long
@@ -2027,6 +2028,7 @@ extern void mg_ev_mgr_init(struct mg_mgr *mgr);
 extern void mg_ev_mgr_free(struct mg_mgr *mgr);
 extern void mg_ev_mgr_add_conn(struct mg_connection *nc);
 extern void mg_ev_mgr_remove_conn(struct mg_connection *nc);
+extern void mg_ev_mgr_ready(struct mg_connection *nc);
 
 MG_INTERNAL void mg_add_conn(struct mg_mgr *mgr, struct mg_connection *c) {
   DBG(("%p %p", mgr, c));
@@ -3047,11 +3049,13 @@ int mg_if_listen_udp(struct mg_connection *nc, union socket_address *sa) {
 
 void mg_if_tcp_send(struct mg_connection *nc, const void *buf, size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
+  mg_ev_mgr_ready(nc);
 }
 
 void mg_if_udp_send(struct mg_connection *nc, const void *buf, size_t len) {
   DBG(("%p %d %d", nc, (int) len, (int) nc->send_mbuf.len));
   mbuf_append(&nc->send_mbuf, buf, len);
+  mg_ev_mgr_ready(nc);
 }
 
 void mg_if_recved(struct mg_connection *nc, size_t len) {
@@ -3082,7 +3086,8 @@ void mg_if_destroy_conn(struct mg_connection *nc) {
   nc->sock = INVALID_SOCKET;
 }
 
-static void mg_accept_conn(struct mg_connection *lc) {
+/* Returns 0 if no connection was pending */
+static int mg_accept_conn(struct mg_connection *lc) {
   struct mg_connection *nc;
   union socket_address sa;
   socklen_t sa_len = sizeof(sa);
@@ -3090,14 +3095,18 @@ static void mg_accept_conn(struct mg_connection *lc) {
   sock_t sock = accept(lc->sock, &sa.sa, &sa_len);
   if (sock < 0) {
     DBG(("%p: failed to accept: %d", lc, errno));
-    return;
+    return 0;
   }
   nc = mg_if_accept_tcp_cb(lc, &sa, sa_len);
   if (nc == NULL) {
     closesocket(sock);
-    return;
+    return 1;
   }
   mg_sock_set(nc, sock);
+#if MG_MGR_EV_MGR == 1
+  /* The connection was added before it had a socket to watch */
+  mg_ev_mgr_add_conn(nc);
+#endif
 #ifdef MG_ENABLE_SSL
   if (lc->ssl_ctx != NULL) {
     nc->ssl = SSL_new(lc->ssl_ctx);
@@ -3107,6 +3116,7 @@ static void mg_accept_conn(struct mg_connection *lc) {
     }
   }
 #endif
+  return 1;
 }
 
 /* 'sa' must be an initialized address to bind to */
@@ -3156,13 +3166,14 @@ static sock_t mg_open_listening_socket(union socket_address *sa, int proto) {
   return sock;
 }
 
-static void mg_write_to_socket(struct mg_connection *nc) {
+/* Returns the number of bytes sent, before the handlers queue more */
+static int mg_write_to_socket(struct mg_connection *nc) {
   struct mbuf *io = &nc->send_mbuf;
   int n = 0;
 
 #ifdef MG_LWIP
   /* With LWIP we don't know if the socket is ready */
-  if (io->len == 0) return;
+  if (io->len == 0) return 0;
 #endif
 
   assert(io->len > 0);
@@ -3176,7 +3187,7 @@ static void mg_write_to_socket(struct mg_connection *nc) {
       mbuf_remove(io, n);
     }
     mg_if_sent_cb(nc, n);
-    return;
+    return n;
   }
 
 #ifdef MG_ENABLE_SSL
@@ -3186,7 +3197,7 @@ static void mg_write_to_socket(struct mg_connection *nc) {
       if (n <= 0) {
         int ssl_err = mg_ssl_err(nc, n);
         if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
-          return; /* Call us again */
+          return 0; /* Call us again */
         }
       } else {
         /* Successful SSL operation, clear off SSL wait flags */
@@ -3194,7 +3205,7 @@ static void mg_write_to_socket(struct mg_connection *nc) {
       }
     } else {
       mg_ssl_begin(nc);
-      return;
+      return 0;
     }
   } else
 #endif
@@ -3208,15 +3219,17 @@ static void mg_write_to_socket(struct mg_connection *nc) {
     mbuf_remove(io, n);
   }
   mg_if_sent_cb(nc, n);
+  return n;
 }
 
-static void mg_read_from_socket(struct mg_connection *conn) {
+/* Returns the result of the last read */
+static int mg_read_from_socket(struct mg_connection *conn) {
   int n = 0;
   char *buf = (char *) MG_MALLOC(MG_TCP_RECV_BUFFER_SIZE);
 
   if (buf == NULL) {
     DBG(("OOM"));
-    return;
+    return 0;
   }
 
 #ifdef MG_ENABLE_SSL
@@ -3239,7 +3252,7 @@ static void mg_read_from_socket(struct mg_connection *conn) {
     } else {
       MG_FREE(buf);
       mg_ssl_begin(conn);
-      return;
+      return 0;
     }
   } else
 #endif
@@ -3256,6 +3269,7 @@ static void mg_read_from_socket(struct mg_connection *conn) {
       conn->flags |= MG_F_CLOSE_IMMEDIATELY;
     }
   }
+  return n;
 }
 
 static int mg_recvfrom(struct mg_connection *nc, union socket_address *sa,
@@ -3447,12 +3461,44 @@ static void mg_sock_set(struct mg_connection *nc, sock_t sock) {
 #if MG_MGR_EV_MGR == 1 /* epoll() */
 
 #ifndef MG_EPOLL_MAX_EVENTS
-#define MG_EPOLL_MAX_EVENTS 100
+#define MG_EPOLL_MAX_EVENTS 1024
+#endif
+
+/*
+ * TCP sockets are edge-triggered: each connection remembers whether its
+ * socket may still be read or written, and is read until it would block,
+ * but at most MG_EPOLL_MAX_READS times per poll so that a busy client does
+ * not starve the others. This spares an epoll_ctl() per connection and per
+ * poll. UDP sockets remain level-triggered.
+ *
+ * A poll only handles the connections of a ready list: those given events
+ * by epoll_wait(), those with I/O left to do and those with data queued by
+ * mg_send(). MG_EV_POLL, and the timers of the other connections, are
+ * delivered to all connections every MG_EPOLL_POLL_INTERVAL seconds.
+ */
+#ifndef MG_EPOLL_MAX_READS
+#define MG_EPOLL_MAX_READS 16
+#endif
+
+#ifndef MG_EPOLL_POLL_INTERVAL
+#define MG_EPOLL_POLL_INTERVAL 1.0
 #endif
 
+/* Event manager's data */
+struct mg_epoll_mgr {
+  int epoll_fd;
+  struct mg_connection *ready; /* Connections to handle at the next poll */
+  double poll_time;            /* Time MG_EV_POLL was last delivered at */
+};
+
 #define _MG_EPF_EV_EPOLLIN (1 << 0)
 #define _MG_EPF_EV_EPOLLOUT (1 << 1)
 #define _MG_EPF_NO_POLL (1 << 2)
+#define _MG_EPF_CAN_READ (1 << 3)
+#define _MG_EPF_CAN_WRITE (1 << 4)
+#define _MG_EPF_READY (1 << 5)
+
+#define MG_EPOLL_IS_EDGE(nc) (!((nc)->flags & MG_F_UDP))
 
 uint32_t mg_epf_to_evflags(unsigned int epf) {
   uint32_t result = 0;
@@ -3465,6 +3511,10 @@ void mg_ev_mgr_epoll_set_flags(const struct mg_connection *nc,
                                struct epoll_event *ev) {
   /* NOTE: EPOLLERR and EPOLLHUP are always enabled. */
   ev->events = 0;
+  if (MG_EPOLL_IS_EDGE(nc)) {
+    ev->events = EPOLLIN | EPOLLOUT | EPOLLET;
+    return;
+  }
   if ((nc->flags & MG_F_LISTENING) || nc->recv_mbuf.len < nc->recv_mbuf_limit) {
     ev->events |= EPOLLIN;
   }
@@ -3474,18 +3524,24 @@ void mg_ev_mgr_epoll_set_flags(const struct mg_connection *nc,
 }
 
 void mg_ev_mgr_epoll_ctl(struct mg_connection *nc, int op) {
-  int epoll_fd = (intptr_t) nc->mgr->mgr_data;
+  int epoll_fd = ((struct mg_epoll_mgr *) nc->mgr->mgr_data)->epoll_fd;
   struct epoll_event ev;
-  assert(op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD || EPOLL_CTL_DEL);
+  intptr_t epf = (intptr_t) nc->mgr_data;
+  assert(op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD || op == EPOLL_CTL_DEL);
   DBG(("%p %d %d", nc, nc->sock, op));
   if (nc->sock == INVALID_SOCKET) return;
   if (op != EPOLL_CTL_DEL) {
     mg_ev_mgr_epoll_set_flags(nc, &ev);
     if (op == EPOLL_CTL_MOD) {
-      uint32_t old_ev_flags = mg_epf_to_evflags((intptr_t) nc->mgr_data);
+      uint32_t old_ev_flags = mg_epf_to_evflags(epf);
       if (ev.events == old_ev_flags) return;
     }
     ev.data.ptr = nc;
+    /* Remember the registered events to skip needless modifications */
+    epf &= ~(_MG_EPF_EV_EPOLLIN | _MG_EPF_EV_EPOLLOUT);
+    if (ev.events & EPOLLIN) epf |= _MG_EPF_EV_EPOLLIN;
+    if (ev.events & EPOLLOUT) epf |= _MG_EPF_EV_EPOLLOUT;
+    nc->mgr_data = (void *) epf;
   }
   if (epoll_ctl(epoll_fd, op, nc->sock, &ev) != 0) {
     perror("epoll_ctl");
@@ -3495,6 +3551,7 @@ void mg_ev_mgr_epoll_ctl(struct mg_connection *nc, int op) {
 
 void mg_ev_mgr_init(struct mg_mgr *mgr) {
   int epoll_fd;
+  struct mg_epoll_mgr *em;
   DBG(("%p using epoll()", mgr));
 #ifndef MG_DISABLE_SOCKETPAIR
   do {
@@ -3506,7 +3563,13 @@ void mg_ev_mgr_init(struct mg_mgr *mgr) {
     perror("epoll_ctl");
     abort();
   }
-  mgr->mgr_data = (void *) ((intptr_t) epoll_fd);
+  em = (struct mg_epoll_mgr *) MG_CALLOC(1, sizeof(*em));
+  if (em == NULL) {
+    perror("calloc");
+    abort();
+  }
+  em->epoll_fd = epoll_fd;
+  mgr->mgr_data = em;
   if (mgr->ctl[1] != INVALID_SOCKET) {
     struct epoll_event ev;
     ev.events = EPOLLIN;
@@ -3519,8 +3582,36 @@ void mg_ev_mgr_init(struct mg_mgr *mgr) {
 }
 
 void mg_ev_mgr_free(struct mg_mgr *mgr) {
-  int epoll_fd = (intptr_t) mgr->mgr_data;
-  close(epoll_fd);
+  struct mg_epoll_mgr *em = (struct mg_epoll_mgr *) mgr->mgr_data;
+  close(em->epoll_fd);
+  MG_FREE(em);
+  mgr->mgr_data = NULL;
+}
+
+/* Adds a connection to a ready list, unless it is already in one */
+static void mg_epoll_link(struct mg_connection **list,
+                          struct mg_connection *nc) {
+  intptr_t epf = (intptr_t) nc->mgr_data;
+  if (epf & _MG_EPF_READY) return;
+  nc->mgr_data = (void *) (epf | _MG_EPF_READY);
+  nc->ready_next = *list;
+  nc->ready_link = list;
+  if (*list != NULL) (*list)->ready_link = &nc->ready_next;
+  *list = nc;
+}
+
+/* Removes a connection from the ready list it is in, if any */
+static void mg_epoll_unlink(struct mg_connection *nc) {
+  intptr_t epf = (intptr_t) nc->mgr_data;
+  if (!(epf & _MG_EPF_READY)) return;
+  *nc->ready_link = nc->ready_next;
+  if (nc->ready_next != NULL) nc->ready_next->ready_link = nc->ready_link;
+  nc->mgr_data = (void *) (epf & ~_MG_EPF_READY);
+}
+
+void mg_ev_mgr_ready(struct mg_connection *nc) {
+  if (nc->mgr == NULL) return;
+  mg_epoll_link(&((struct mg_epoll_mgr *) nc->mgr->mgr_data)->ready, nc);
 }
 
 void mg_ev_mgr_add_conn(struct mg_connection *nc) {
@@ -3530,19 +3621,86 @@ void mg_ev_mgr_add_conn(struct mg_connection *nc) {
 }
 
 void mg_ev_mgr_remove_conn(struct mg_connection *nc) {
+  mg_epoll_unlink(nc);
   if (!(nc->flags & MG_F_UDP) || nc->listener == NULL) {
     mg_ev_mgr_epoll_ctl(nc, EPOLL_CTL_DEL);
   }
 }
 
+/* Whether an edge-triggered connection has I/O left to do without waiting */
+static int mg_epoll_has_pending_io(const struct mg_connection *nc) {
+  intptr_t epf = (intptr_t) nc->mgr_data;
+  if (!MG_EPOLL_IS_EDGE(nc) || (nc->flags & MG_F_CONNECTING)) return 0;
+  return ((epf & _MG_EPF_CAN_READ) &&
+          ((nc->flags & MG_F_LISTENING) ||
+           nc->recv_mbuf.len < nc->recv_mbuf_limit)) ||
+         ((epf & _MG_EPF_CAN_WRITE) && nc->send_mbuf.len > 0);
+}
+
+static void mg_epoll_handle_conn(struct mg_connection *nc, double now) {
+  intptr_t epf = (intptr_t) nc->mgr_data;
+  int i;
+
+  if (nc->flags & MG_F_CONNECTING) {
+    mg_mgr_handle_conn(
+        nc, (epf & (_MG_EPF_CAN_READ | _MG_EPF_CAN_WRITE)) ? _MG_F_FD_CAN_WRITE
+                                                            : 0,
+        now);
+    return;
+  }
+
+  for (i = 0; i < MG_EPOLL_MAX_READS && (epf & _MG_EPF_CAN_READ) &&
+                  !(nc->flags & MG_F_CLOSE_IMMEDIATELY);
+       i++) {
+    if (nc->flags & MG_F_LISTENING) {
+      if (!mg_accept_conn(nc)) epf &= ~_MG_EPF_CAN_READ;
+    } else {
+      size_t len = recv_avail_size(nc, MG_TCP_RECV_BUFFER_SIZE);
+      /* A full receive buffer is read again once the handler drained it */
+      if (len == 0) break;
+      /* A short read leaves the socket empty */
+      if (mg_read_from_socket(nc) < (int) len) epf &= ~_MG_EPF_CAN_READ;
+    }
+  }
+
+  if ((epf & _MG_EPF_CAN_WRITE) && nc->send_mbuf.len > 0 &&
+      !(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    /*
+     * A short write means the socket buffer is full; data queued by the
+     * MG_EV_SEND handlers (e.g. pipelined responses) is sent next time.
+     */
+    size_t len = nc->send_mbuf.len;
+    if (mg_write_to_socket(nc) < (int) len) epf &= ~_MG_EPF_CAN_WRITE;
+  }
+
+  /* The handlers may have readied the connection meanwhile */
+  epf &= _MG_EPF_CAN_READ | _MG_EPF_CAN_WRITE;
+  epf |= (intptr_t) nc->mgr_data & ~(_MG_EPF_CAN_READ | _MG_EPF_CAN_WRITE);
+  nc->mgr_data = (void *) epf;
+  mg_if_timer(nc, now);
+}
+
 time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
-  int epoll_fd = (intptr_t) mgr->mgr_data;
+  struct mg_epoll_mgr *em = (struct mg_epoll_mgr *) mgr->mgr_data;
   struct epoll_event events[MG_EPOLL_MAX_EVENTS];
-  struct mg_connection *nc, *next;
+  struct mg_connection *nc, *ready;
   int num_ev, fd_flags;
   double now;
 
-  num_ev = epoll_wait(epoll_fd, events, MG_EPOLL_MAX_EVENTS, timeout_ms);
+  /*
+   * Do not wait while a socket still has data to read or room to write,
+   * nor past the next delivery of MG_EV_POLL
+   */
+  if (em->ready != NULL) {
+    timeout_ms = 0;
+  } else {
+    double left = em->poll_time + MG_EPOLL_POLL_INTERVAL - mg_time();
+    if (timeout_ms < 0 || left * 1000 < timeout_ms) {
+      timeout_ms = left > 0 ? (int) (left * 1000) + 1 : 0;
+    }
+  }
+
+  num_ev = epoll_wait(em->epoll_fd, events, MG_EPOLL_MAX_EVENTS, timeout_ms);
   now = mg_time();
   DBG(("epoll_wait @ %ld num_ev=%d", (long) now, num_ev));
 
@@ -3554,29 +3712,62 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
       mg_mgr_handle_ctl_sock(mgr);
       continue;
     }
+    epf = (intptr_t) nc->mgr_data;
+    if (MG_EPOLL_IS_EDGE(nc)) {
+      /* Handled below, with the connections having pending I/O */
+      if (ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) epf |= _MG_EPF_CAN_READ;
+      if (ev->events & (EPOLLOUT | EPOLLERR)) epf |= _MG_EPF_CAN_WRITE;
+      nc->mgr_data = (void *) epf;
+      mg_ev_mgr_ready(nc);
+      continue;
+    }
     fd_flags = ((ev->events & (EPOLLIN | EPOLLHUP)) ? _MG_F_FD_CAN_READ : 0) |
                ((ev->events & (EPOLLOUT)) ? _MG_F_FD_CAN_WRITE : 0) |
                ((ev->events & (EPOLLERR)) ? _MG_F_FD_ERROR : 0);
     mg_mgr_handle_conn(nc, fd_flags, now);
     epf = (intptr_t) nc->mgr_data;
-    epf ^= _MG_EPF_NO_POLL;
+    epf |= _MG_EPF_NO_POLL;
     nc->mgr_data = (void *) epf;
+    mg_ev_mgr_ready(nc);
+  }
+
+  /* Idle connections are only polled, e.g. to be closed, from time to time */
+  if (now >= em->poll_time + MG_EPOLL_POLL_INTERVAL) {
+    em->poll_time = now;
+    for (nc = mgr->active_connections; nc != NULL; nc = nc->next) {
+      if (MG_EPOLL_IS_EDGE(nc)) {
+        mg_if_poll(nc, now);
+      } else if (!(((intptr_t) nc->mgr_data) & _MG_EPF_NO_POLL)) {
+        mg_mgr_handle_conn(nc, 0, now);
+        nc->mgr_data = (void *) (((intptr_t) nc->mgr_data) | _MG_EPF_NO_POLL);
+      }
+      mg_ev_mgr_ready(nc);
+    }
   }
 
-  for (nc = mgr->active_connections; nc != NULL; nc = next) {
-    next = nc->next;
-    if (!(((intptr_t) nc->mgr_data) & _MG_EPF_NO_POLL)) {
-      mg_mgr_handle_conn(nc, 0, now);
+  /*
+   * The connections readied while handling these ones, e.g. by mg_send(),
+   * are handled at the next poll, or in this one if not handled yet
+   */
+  ready = em->ready;
+  if (ready != NULL) ready->ready_link = &ready;
+  em->ready = NULL;
+  while ((nc = ready) != NULL) {
+    mg_epoll_unlink(nc);
+    if (MG_EPOLL_IS_EDGE(nc)) {
+      mg_epoll_handle_conn(nc, now);
+    } else if (!(((intptr_t) nc->mgr_data) & _MG_EPF_NO_POLL)) {
+      mg_if_timer(nc, now);
     } else {
       intptr_t epf = (intptr_t) nc->mgr_data;
-      epf ^= _MG_EPF_NO_POLL;
+      epf &= ~_MG_EPF_NO_POLL;
       nc->mgr_data = (void *) epf;
     }
     if ((nc->flags & MG_F_CLOSE_IMMEDIATELY) ||
         (nc->send_mbuf.len == 0 && (nc->flags & MG_F_SEND_AND_CLOSE))) {
       mg_close_conn(nc);
-    } else {
-      if (!(nc->flags & MG_F_UDP) || nc->listener == NULL) {
+    } else if (!MG_EPOLL_IS_EDGE(nc)) {
+      if (nc->listener == NULL) {
         mg_ev_mgr_epoll_ctl(nc, EPOLL_CTL_MOD);
       } else {
         /* This is a kludge, but... */
@@ -3584,6 +3775,8 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
           mg_mgr_handle_conn(nc, _MG_F_FD_CAN_WRITE, now);
         }
       }
+    } else if (mg_epoll_has_pending_io(nc)) {
+      mg_ev_mgr_ready(nc);
     }
   }
 
@@ -3614,6 +3807,10 @@ void mg_ev_mgr_remove_conn(struct mg_connection *nc) {
   (void) nc;
 }
 
+void mg_ev_mgr_ready(struct mg_connection *nc) {
+  (void) nc;
+}
+
 void mg_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
   if (sock != INVALID_SOCKET) {
     FD_SET(sock, set);
@@ -4080,6 +4277,27 @@ int mg_normalize_uri_path(const struct mg_str *in, struct mg_str *out) {
 
 enum http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT, DATA_CGI };
 
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+enum mg_http_multipart_stream_state {
+  MPS_BEGIN,
+  MPS_WAITING_FOR_BOUNDARY,
+  MPS_WAITING_FOR_CHUNK,
+  MPS_FINALIZE,
+  MPS_FINISHED
+};
+
+struct mg_http_multipart_stream {
+  char *boundary; /* "--" followed by the boundary of the Content-Type */
+  size_t boundary_len;
+  char *var_name;
+  char *file_name;
+  void *user_data;
+  int64_t body_left; /* Body bytes not consumed yet, -1 if unknown */
+  int processing_part;
+  enum mg_http_multipart_stream_state state;
+};
+#endif
+
 struct proto_data_http {
 #ifndef MG_DISABLE_FILESYSTEM
   FILE *fp; /* Opened file. */
@@ -4089,6 +4307,9 @@ struct proto_data_http {
   int64_t body_len; /* How many bytes of chunked body was reassembled. */
   struct mg_connection *cgi_nc;
   enum http_proto_data_type type;
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+  struct mg_http_multipart_stream mp_stream;
+#endif
 };
 
 /*
@@ -4625,12 +4846,27 @@ static void free_http_proto_data(struct mg_connection *nc) {
 #endif
 #ifndef MG_DISABLE_CGI
     if (dp->cgi_nc != NULL) dp->cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+#endif
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+    MG_FREE(dp->mp_stream.boundary);
+    MG_FREE(dp->mp_stream.var_name);
+    MG_FREE(dp->mp_stream.file_name);
 #endif
     MG_FREE(dp);
     nc->proto_data = NULL;
   }
 }
 
+/*
+ * Returns whether no file, PUT or CGI data is being transferred, and no
+ * response is being prepared by the application.
+ */
+static int mg_http_is_idle(struct mg_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  return !(nc->flags & MG_F_RESPONSE_PENDING) &&
+         (dp == NULL || dp->type == DATA_NONE);
+}
+
 #ifndef MG_DISABLE_FILESYSTEM
 static void transfer_file_data(struct mg_connection *nc) {
   struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
@@ -4785,6 +5021,249 @@ MG_INTERNAL size_t mg_handle_chunked(struct mg_connection *nc,
   return body_len;
 }
 
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+#define MG_CONTENT_DISPOSITION "Content-Disposition: "
+
+/* Binary-safe lookup of `needle` in the first `hay_len` bytes of `hay` */
+static const char *mg_mp_find(const char *hay, size_t hay_len,
+                              const char *needle, size_t needle_len) {
+  const char *p = hay, *end = hay + hay_len;
+  while (needle_len > 0 && (size_t)(end - p) >= needle_len &&
+         (p = (const char *) memchr(p, needle[0],
+                                    end - p - needle_len + 1)) != NULL) {
+    if (memcmp(p, needle, needle_len) == 0) return p;
+    p++;
+  }
+  return NULL;
+}
+
+static char *mg_mp_strdup(const char *s) {
+  size_t len = strlen(s) + 1;
+  char *copy = (char *) MG_MALLOC(len);
+  if (copy != NULL) memcpy(copy, s, len);
+  return copy;
+}
+
+static int mg_mp_in_progress(struct mg_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  return dp != NULL && dp->mp_stream.boundary != NULL;
+}
+
+static void mg_mp_reset(struct mg_http_multipart_stream *mp) {
+  MG_FREE(mp->boundary);
+  MG_FREE(mp->var_name);
+  MG_FREE(mp->file_name);
+  memset(mp, 0, sizeof(*mp));
+}
+
+/* Drop `n` body bytes from the receive buffer */
+static void mg_mp_consume(struct mg_connection *nc,
+                          struct mg_http_multipart_stream *mp, size_t n) {
+  mbuf_remove(&nc->recv_mbuf, n);
+  if (mp->body_left > 0) {
+    mp->body_left -= (int64_t) n < mp->body_left ? (int64_t) n : mp->body_left;
+  }
+}
+
+static void mg_mp_call(struct mg_connection *nc, int ev, const char *data,
+                       size_t data_len, int status) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  struct mg_http_multipart_part part;
+
+  memset(&part, 0, sizeof(part));
+  part.file_name = dp->mp_stream.file_name != NULL ? dp->mp_stream.file_name : "";
+  part.var_name = dp->mp_stream.var_name != NULL ? dp->mp_stream.var_name : "";
+  part.data.p = data;
+  part.data.len = data_len;
+  part.status = status;
+  part.user_data = dp->mp_stream.user_data;
+  mg_call(nc, nc->handler, ev, &part);
+  dp->mp_stream.user_data = part.user_data;
+}
+
+/*
+ * Switch the connection to streaming mode if the request carries a
+ * multipart/form-data body. Return 1 if it did, 0 otherwise.
+ */
+static int mg_mp_begin(struct mg_connection *nc, struct http_message *hm,
+                       int req_len) {
+  struct mg_str *ct = mg_get_http_header(hm, "Content-Type");
+  struct proto_data_http *dp;
+  char boundary[100];
+  int boundary_len;
+
+  if (ct == NULL || ct->len < 19 ||
+      mg_ncasecmp(ct->p, "multipart/form-data", 19) != 0) {
+    return 0;
+  }
+
+  boundary_len =
+      mg_http_parse_header(ct, "boundary", boundary, sizeof(boundary));
+  if (nc->proto_data == NULL) {
+    nc->proto_data = MG_CALLOC(1, sizeof(*dp));
+  }
+  dp = (struct proto_data_http *) nc->proto_data;
+  if (boundary_len == 0 || dp == NULL || dp->mp_stream.boundary != NULL ||
+      (dp->mp_stream.boundary = (char *) MG_MALLOC(boundary_len + 5)) ==
+          NULL) {
+    /* Malformed request, out of memory or protocol error */
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return 1;
+  }
+
+  /* Parts are separated by CRLF "--" boundary */
+  memcpy(dp->mp_stream.boundary, "\r\n--", 4);
+  memcpy(dp->mp_stream.boundary + 4, boundary, boundary_len + 1);
+  dp->mp_stream.boundary_len = boundary_len + 4;
+  dp->mp_stream.body_left =
+      hm->body.len == (size_t) ~0 ? -1 : (int64_t) hm->body.len;
+  dp->mp_stream.state = MPS_BEGIN;
+
+  mg_call(nc, nc->handler, MG_EV_HTTP_MULTIPART_REQUEST, hm);
+  mbuf_remove(&nc->recv_mbuf, req_len);
+  return 1;
+}
+
+/*
+ * Parse the headers of the part starting at the head of the receive buffer
+ * (right on its boundary line). Return 0 if they are not fully buffered yet.
+ */
+static int mg_mp_process_headers(struct mg_connection *nc,
+                                 struct mg_http_multipart_stream *mp) {
+  struct mbuf *io = &nc->recv_mbuf;
+  const char *end = mg_mp_find(io->buf, io->len, "\r\n\r\n", 4);
+  const char *line, *eol;
+  const size_t cd_len = sizeof(MG_CONTENT_DISPOSITION) - 1;
+  char var_name[256], file_name[256];
+
+  if (end == NULL) {
+    if (io->len >= MG_MAX_HTTP_REQUEST_SIZE) {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    }
+    return 0;
+  }
+
+  var_name[0] = file_name[0] = '\0';
+  for (line = io->buf; line < end; line = eol + 2) {
+    eol = mg_mp_find(line, end + 2 - line, "\r\n", 2);
+    if ((size_t)(eol - line) > cd_len &&
+        mg_ncasecmp(line, MG_CONTENT_DISPOSITION, cd_len) == 0) {
+      struct mg_str hdr;
+      hdr.p = line + cd_len;
+      hdr.len = eol - hdr.p;
+      mg_http_parse_header(&hdr, "name", var_name, sizeof(var_name));
+      mg_http_parse_header(&hdr, "filename", file_name, sizeof(file_name));
+    }
+  }
+
+  MG_FREE(mp->var_name);
+  MG_FREE(mp->file_name);
+  mp->var_name = mg_mp_strdup(var_name);
+  mp->file_name = mg_mp_strdup(file_name);
+  mg_mp_consume(nc, mp, end + 4 - io->buf);
+
+  mp->processing_part = 1;
+  mp->state = MPS_WAITING_FOR_CHUNK;
+  mg_mp_call(nc, MG_EV_HTTP_PART_BEGIN, NULL, 0, 0);
+  return 1;
+}
+
+/*
+ * Hand the buffered part data to the handler. Bytes that could be the start
+ * of the next boundary are kept until more data arrives.
+ * Return 0 if more data is needed.
+ */
+static int mg_mp_process_data(struct mg_connection *nc,
+                              struct mg_http_multipart_stream *mp) {
+  struct mbuf *io = &nc->recv_mbuf;
+  const char *p = mg_mp_find(io->buf, io->len, mp->boundary, mp->boundary_len);
+  size_t n;
+
+  if (p == NULL) {
+    if (io->len >= mp->boundary_len) {
+      n = io->len - mp->boundary_len + 1;
+      mg_mp_call(nc, MG_EV_HTTP_PART_DATA, io->buf, n, 0);
+      mg_mp_consume(nc, mp, n);
+    }
+    return 0;
+  }
+
+  if (p > io->buf) {
+    mg_mp_call(nc, MG_EV_HTTP_PART_DATA, io->buf, p - io->buf, 0);
+  }
+  mp->processing_part = 0;
+  mg_mp_call(nc, MG_EV_HTTP_PART_END, NULL, 0, 0);
+  /* Keep "--" boundary at the head of the buffer */
+  mg_mp_consume(nc, mp, p - io->buf + 2);
+  mp->state = MPS_WAITING_FOR_BOUNDARY;
+  return 1;
+}
+
+static void mg_mp_continue(struct mg_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  struct mg_http_multipart_stream *mp = &dp->mp_stream;
+  struct mbuf *io = &nc->recv_mbuf;
+  /* Boundary line without the leading CRLF */
+  const char *delim = mp->boundary + 2;
+  const size_t delim_len = mp->boundary_len - 2;
+  const char *p;
+  size_t n;
+
+  while (!(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    switch (mp->state) {
+      case MPS_BEGIN:
+        mp->state = MPS_WAITING_FOR_BOUNDARY;
+        break;
+      case MPS_WAITING_FOR_BOUNDARY:
+        /* Skip the preamble, if any */
+        if ((p = mg_mp_find(io->buf, io->len, delim, delim_len)) == NULL) {
+          if (io->len >= delim_len) {
+            mg_mp_consume(nc, mp, io->len - delim_len + 1);
+          }
+          return;
+        }
+        mg_mp_consume(nc, mp, p - io->buf);
+        if (io->len < delim_len + 2) return;
+        if (memcmp(io->buf + delim_len, "--", 2) == 0) {
+          /* Closing boundary */
+          mg_mp_consume(nc, mp, delim_len + 2);
+          mp->state = MPS_FINALIZE;
+        } else if (!mg_mp_process_headers(nc, mp)) {
+          return;
+        }
+        break;
+      case MPS_WAITING_FOR_CHUNK:
+        if (!mg_mp_process_data(nc, mp)) return;
+        break;
+      case MPS_FINALIZE:
+        mp->state = MPS_FINISHED;
+        mg_mp_call(nc, MG_EV_HTTP_MULTIPART_REQUEST_END, NULL, 0, 0);
+        break;
+      case MPS_FINISHED:
+        /* Discard the epilogue, up to the end of the body */
+        n = mp->body_left < 0 || (int64_t) io->len < mp->body_left
+                ? io->len
+                : (size_t) mp->body_left;
+        mg_mp_consume(nc, mp, n);
+        if (mp->body_left == 0) mg_mp_reset(mp);
+        return;
+    }
+  }
+}
+
+/* Let the handler clean up after a request interrupted by a disconnection */
+static void mg_mp_abort(struct mg_connection *nc) {
+  struct proto_data_http *dp = (struct proto_data_http *) nc->proto_data;
+  if (dp->mp_stream.state != MPS_FINISHED) {
+    if (dp->mp_stream.processing_part) {
+      mg_mp_call(nc, MG_EV_HTTP_PART_END, NULL, 0, -1);
+    }
+    mg_mp_call(nc, MG_EV_HTTP_MULTIPART_REQUEST_END, NULL, 0, -1);
+  }
+  mg_mp_reset(&dp->mp_stream);
+}
+#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+
 /*
  * lx106 compiler has a bug (TODO(mkm) report and insert tracking bug here)
  * If a big structure is declared in a big function, lx106 gcc will make it
@@ -4813,11 +5292,19 @@ void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
   struct mg_str *vec;
 #endif
   if (ev == MG_EV_CLOSE) {
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+    if (mg_mp_in_progress(nc)) {
+      mg_mp_abort(nc);
+      mbuf_remove(io, io->len);
+    }
+#endif
     /*
      * For HTTP messages without Content-Length, always send HTTP message
-     * before MG_EV_CLOSE message.
+     * before MG_EV_CLOSE message. Requests queued behind a pending response
+     * are dropped with the connection.
      */
-    if (io->len > 0 && mg_parse_http(io->buf, io->len, hm, is_req) > 0) {
+    if (io->len > 0 && !(nc->flags & MG_F_RESPONSE_PENDING) &&
+        mg_parse_http(io->buf, io->len, hm, is_req) > 0) {
       int ev2 = is_req ? MG_EV_HTTP_REQUEST : MG_EV_HTTP_REPLY;
       hm->message.len = io->len;
       hm->body.len = io->buf + io->len - hm->body.p;
@@ -4834,10 +5321,34 @@ void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
 
   mg_call(nc, nc->handler, ev, ev_data);
 
-  if (ev == MG_EV_RECV) {
+  /*
+   * Requests pipelined behind a served file or a pending response are
+   * handled once it is sent, since no new data may arrive to trigger them.
+   */
+  if ((ev == MG_EV_RECV && !(nc->flags & MG_F_RESPONSE_PENDING)) ||
+      (ev == MG_EV_SEND && is_req && io->len > 0 &&
+       !(nc->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE)) &&
+       mg_http_is_idle(nc))) {
     struct mg_str *s;
+  again:
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+    if (mg_mp_in_progress(nc)) {
+      /* Multipart request body is being streamed */
+      mg_mp_continue(nc);
+      return;
+    }
+#endif
     req_len = mg_parse_http(io->buf, io->len, hm, is_req);
 
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+    if (req_len > 0 && is_req &&
+        mg_get_http_header(hm, "Transfer-Encoding") == NULL &&
+        mg_mp_begin(nc, hm, req_len)) {
+      if (mg_mp_in_progress(nc)) mg_mp_continue(nc);
+      return;
+    }
+#endif
+
     if (req_len > 0 &&
         (s = mg_get_http_header(hm, "Transfer-Encoding")) != NULL &&
         mg_vcasecmp(s, "chunked") == 0) {
@@ -4932,6 +5443,16 @@ void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
       mg_call(nc, nc->handler, trigger_ev, hm);
 #endif
       mbuf_remove(io, hm->message.len);
+
+      /*
+       * Serve the next pipelined request, unless the connection is closing
+       * or a file or a pending response is still being sent.
+       */
+      if (is_req && io->len > 0 &&
+          !(nc->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE)) &&
+          mg_http_is_idle(nc)) {
+        goto again;
+      }
     }
   }
 }
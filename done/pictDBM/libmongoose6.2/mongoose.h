@@ -1062,6 +1062,8 @@ struct mg_connection {
   void *priv_1;                     /* Used by mg_enable_multithreading() */
   void *priv_2;                     /* Used by mg_enable_multithreading() */
   void *mgr_data; /* Implementation-specific event manager's data. */
+  struct mg_connection *ready_next;  /* Connections having I/O to do, */
+  struct mg_connection **ready_link; /* for the epoll() manager */
 
   unsigned long flags;
 /* Flags set by Mongoose */
@@ -1079,6 +1081,7 @@ struct mg_connection {
 #define MG_F_CLOSE_IMMEDIATELY (1 << 11)   /* Disconnect */
 #define MG_F_WEBSOCKET_NO_DEFRAG (1 << 12) /* Websocket specific */
 #define MG_F_DELETE_CHUNK (1 << 13)        /* HTTP specific */
+#define MG_F_RESPONSE_PENDING (1 << 14)    /* HTTP specific */
 
 #define MG_F_USER_1 (1 << 20) /* Flags left for application */
 #define MG_F_USER_2 (1 << 21)
@@ -1865,6 +1868,24 @@ struct websocket_message {
 #define MG_EV_WEBSOCKET_FRAME 113             /* struct websocket_message * */
 #define MG_EV_WEBSOCKET_CONTROL_FRAME 114     /* struct websocket_message * */
 
+#ifdef MG_ENABLE_HTTP_STREAMING_MULTIPART
+/* A part of a multipart/form-data body, delivered piece by piece */
+struct mg_http_multipart_part {
+  const char *file_name; /* "filename" of the Content-Disposition header */
+  const char *var_name;  /* "name" of the Content-Disposition header */
+  struct mg_str data;    /* Body bytes received since the last event */
+  int status;            /* < 0 if the connection was closed mid-request */
+  void *user_data;       /* Kept across all events of one request */
+};
+
+#define MG_EV_HTTP_MULTIPART_REQUEST 121 /* struct http_message * */
+#define MG_EV_HTTP_PART_BEGIN 122        /* struct mg_http_multipart_part * */
+#define MG_EV_HTTP_PART_DATA 123         /* struct mg_http_multipart_part * */
+#define MG_EV_HTTP_PART_END 124          /* struct mg_http_multipart_part * */
+/* struct mg_http_multipart_part * */
+#define MG_EV_HTTP_MULTIPART_REQUEST_END 125
+#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+
 /*
  * Attach built-in HTTP event handler to the given connection.
  * User-defined event handler will receive following extra events:
@@ -1892,6 +1913,15 @@ struct websocket_message {
  *   `ev_data` is `NULL`.
  * - MG_EV_WEBSOCKET_FRAME: new websocket frame has arrived. `ev_data` is
  *   `struct websocket_message *`
+ *
+ * When compiled with `-DMG_ENABLE_HTTP_STREAMING_MULTIPART`, requests with a
+ * `multipart/form-data` body are not buffered. Instead the handler receives
+ * MG_EV_HTTP_MULTIPART_REQUEST with the parsed headers (`body.len` holds the
+ * announced Content-Length, but the body itself is not available), then
+ * MG_EV_HTTP_PART_BEGIN, any number of MG_EV_HTTP_PART_DATA and
+ * MG_EV_HTTP_PART_END for each part, and finally
+ * MG_EV_HTTP_MULTIPART_REQUEST_END, after which the reply should be sent.
+ * `mg_http_multipart_part::user_data` is preserved between those events.
  */
 void mg_set_protocol_http_websocket(struct mg_connection *nc);
 
@@ -0,0 +1,451 @@
+/**
+ * @file libpictdb.c
+ * @brief The interface of libpictdb, over the functions of pictDB.h.
+ *
+ * A handle is an open database with a lock. The images are read with pread,
+ * which does not move the stream of the database, so that the copies run
+ * outside the lock. The zero-copy lookups point into read-only mappings of
+ * the whole file: when the file grew past the last mapping, a larger one is
+ * made and the older ones are kept until close, so that the blobs already
+ * given stay valid. A read-only database keeps the images it resizes in its
+ * cache file, mapped the same way.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, pread and mmap
+
+#include "libpictdb.h"
+#include "pictDB.h"
+#include "hash_batch.h"
+#include "variant_cache.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+// The public codes are those of pictDB.h: a mismatch fails to compile
+#define CHECK_CODE(public, internal) \
+    typedef char check_##internal[(int)(public) == (int)(internal) ? 1 : -1]
+
+CHECK_CODE(PICTDB_ERR_IO, ERR_IO);
+CHECK_CODE(PICTDB_ERR_OUT_OF_MEMORY, ERR_OUT_OF_MEMORY);
+CHECK_CODE(PICTDB_ERR_INVALID_FILENAME, ERR_INVALID_FILENAME);
+CHECK_CODE(PICTDB_ERR_INVALID_ARGUMENT, ERR_INVALID_ARGUMENT);
+CHECK_CODE(PICTDB_ERR_MAX_FILES, ERR_MAX_FILES);
+CHECK_CODE(PICTDB_ERR_RESOLUTIONS, ERR_RESOLUTIONS);
+CHECK_CODE(PICTDB_ERR_INVALID_PICID, ERR_INVALID_PICID);
+CHECK_CODE(PICTDB_ERR_FULL_DATABASE, ERR_FULL_DATABASE);
+CHECK_CODE(PICTDB_ERR_FILE_NOT_FOUND, ERR_FILE_NOT_FOUND);
+CHECK_CODE(PICTDB_ERR_DUPLICATE_ID, ERR_DUPLICATE_ID);
+CHECK_CODE(PICTDB_ERR_VIPS, ERR_VIPS);
+CHECK_CODE(PICTDB_ERR_CORRUPTED, ERR_CORRUPTED);
+CHECK_CODE(PICTDB_ERR_READ_ONLY, ERR_READ_ONLY);
+CHECK_CODE(PICTDB_RES_THUMB, RES_THUMB);
+CHECK_CODE(PICTDB_RES_SMALL, RES_SMALL);
+CHECK_CODE(PICTDB_RES_ORIG, RES_ORIG);
+CHECK_CODE(PICTDB_MAX_PIC_ID, MAX_PIC_ID);
+CHECK_CODE(PICTDB_SHA_LENGTH, SHA256_DIGEST_LENGTH);
+
+#define THUMB_DEFAULT 64  // Default thumbnail resolution, as pictDBM create
+#define THUMB_MAX     128 // Maximal thumbnail resolution
+#define SMALL_DEFAULT 256 // Default small resolution
+#define SMALL_MAX     512 // Maximal small resolution
+
+/**
+ * @brief A read-only mapping of a database file.
+ */
+struct pictdb_mapping {
+    void* data;
+    size_t size;
+    /**
+     * @brief The previous, smaller, mapping.
+     */
+    struct pictdb_mapping* next;
+};
+
+struct pictdb {
+    struct pictdb_file db_file;
+    int read_only;
+    /**
+     * @brief Serializes the calls on the database.
+     */
+    pthread_mutex_t lock;
+    /**
+     * @brief The mappings of the file, the largest first.
+     */
+    struct pictdb_mapping* mappings;
+    /**
+     * @brief The mappings of the cache file, if read-only.
+     */
+    struct pictdb_mapping* cache_mappings;
+};
+
+pthread_once_t s_vips_once = PTHREAD_ONCE_INIT;
+int s_vips_error = 0;
+
+/**
+ * @brief Starts VIPS, once for the whole program.
+ */
+void init_vips(void);
+
+/**
+ * @brief Locates an image, creating the resized image first if need be.
+ *
+ * @param db         The database.
+ * @param pict_id    The ID of the image.
+ * @param resolution The resolution.
+ * @param file       Location where the file holding the image will be
+ *                   stored.
+ * @param offset     Location where the offset of the image will be stored.
+ * @param size       Location where the size of the image will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int locate(pictdb* db, const char* pict_id, int resolution,
+           FILE** file, uint64_t* offset, uint32_t* size);
+
+/**
+ * @brief Makes sure that the largest mapping of a file covers a region of
+ *        it, mapping it again if need be. Called with the lock.
+ *
+ * @param file     The database file or its cache file.
+ * @param mappings The mappings of the file.
+ * @param end      The offset following the last byte of the region.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int map_locked(FILE* file, struct pictdb_mapping** mappings, uint64_t end);
+
+/**
+ * @brief Unmaps the mappings of a file.
+ *
+ * @param mappings The mappings.
+ */
+void unmap_all(struct pictdb_mapping* mappings);
+
+
+unsigned int pictdb_version(void)
+{
+    return PICTDB_VERSION;
+}
+
+const char* pictdb_strerror(int status)
+{
+    if (status == PICTDB_ERR_BUFFER_TOO_SMALL) {
+        return "Buffer too small";
+    }
+    return status >= 0 && status <= ERR_DEBUG ? ERROR_MESSAGES[status] :
+           "Unknown error";
+}
+
+int pictdb_open(const char* filename, int flags, pictdb** db)
+{
+    if (filename == NULL || db == NULL
+        || (flags != PICTDB_READ_ONLY && flags != PICTDB_READ_WRITE)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    pthread_once(&s_vips_once, init_vips);
+    if (s_vips_error != 0) {
+        return s_vips_error;
+    }
+
+    pictdb* handle = calloc(1, sizeof(pictdb));
+    if (handle == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    handle->read_only = flags == PICTDB_READ_ONLY;
+    int ret = do_open(filename, handle->read_only ? "rb" : "rb+",
+                      &handle->db_file);
+    // The resized images of a read-only database go to its cache file
+    if (ret == 0 && handle->read_only) {
+        ret = do_open_cache(&handle->db_file, filename);
+    }
+    if (ret == 0 && pthread_mutex_init(&handle->lock, NULL) != 0) {
+        ret = ERR_OUT_OF_MEMORY;
+    }
+    if (ret != 0) {
+        do_close(&handle->db_file);
+        free(handle);
+        return ret;
+    }
+
+    *db = handle;
+    return 0;
+}
+
+int pictdb_create(const char* filename, uint32_t max_files,
+                  const uint16_t res_resized[4], pictdb** db)
+{
+    if (filename == NULL || db == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (max_files == 0 || max_files > MAX_MAX_FILES) {
+        return ERR_MAX_FILES;
+    }
+    const uint16_t defaults[4] = {
+        THUMB_DEFAULT, THUMB_DEFAULT, SMALL_DEFAULT, SMALL_DEFAULT
+    };
+    res_resized = res_resized != NULL ? res_resized : defaults;
+    for (size_t i = 0; i < 4; ++i) {
+        if (res_resized[i] == 0
+            || res_resized[i] > (i < 2 ? THUMB_MAX : SMALL_MAX)) {
+            return ERR_RESOLUTIONS;
+        }
+    }
+
+    struct pictdb_file db_file = {
+        .fpdb = NULL, .header = { .max_files = max_files }, .metadata = NULL
+    };
+    memcpy(db_file.header.res_resized, res_resized, 4 * sizeof(uint16_t));
+    int ret = do_create(filename, &db_file);
+    do_close(&db_file);
+    return ret == 0 ? pictdb_open(filename, PICTDB_READ_WRITE, db) : ret;
+}
+
+void pictdb_close(pictdb* db)
+{
+    if (db == NULL) {
+        return;
+    }
+
+    unmap_all(db->mappings);
+    unmap_all(db->cache_mappings);
+    pthread_mutex_destroy(&db->lock);
+    do_close(&db->db_file);
+    free(db);
+}
+
+int pictdb_read(pictdb* db, const char* pict_id, int resolution,
+                void* buffer, size_t capacity, size_t* size)
+{
+    if (size == NULL || (buffer == NULL && capacity > 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    FILE* file = NULL;
+    uint64_t offset = 0;
+    uint32_t blob_size = 0;
+    int ret = locate(db, pict_id, resolution, &file, &offset, &blob_size);
+    if (ret != 0) {
+        return ret;
+    }
+    *size = blob_size;
+    if (blob_size > capacity) {
+        return PICTDB_ERR_BUFFER_TOO_SMALL;
+    }
+
+    const int fd = fileno(file);
+    size_t done = 0;
+    while (done < blob_size) {
+        const ssize_t n = pread(fd, (char*) buffer + done, blob_size - done,
+                                (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+int pictdb_lookup(pictdb* db, const char* pict_id, int resolution,
+                  struct pictdb_blob* blob)
+{
+    if (blob == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    FILE* file = NULL;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int ret = locate(db, pict_id, resolution, &file, &offset, &size);
+    if (ret != 0) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&db->lock);
+    struct pictdb_mapping** mappings = file == db->db_file.fpdb ?
+                                       &db->mappings : &db->cache_mappings;
+    ret = map_locked(file, mappings, offset + size);
+    if (ret == 0) {
+        blob->data = (const char*) (*mappings)->data + offset;
+        blob->size = size;
+        blob->fd = fileno(file);
+        blob->offset = offset;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+int pictdb_insert_batch(pictdb* db, const struct pictdb_image* images,
+                        size_t count, int* results, unsigned int nb_threads)
+{
+    if (images == NULL && count > 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    int err = db == NULL ? ERR_INVALID_ARGUMENT :
+              db->read_only ? ERR_READ_ONLY : 0;
+    struct hash_job* jobs = err != 0 ? NULL :
+                            calloc(count, sizeof(struct hash_job));
+    err = err == 0 && jobs == NULL ? ERR_OUT_OF_MEMORY : err;
+    if (err != 0) {
+        for (size_t i = 0; results != NULL && i < count; ++i) {
+            results[i] = err;
+        }
+        return err;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        // Only read by the hashing, never freed
+        jobs[i].data = (char*) images[i].data;
+        jobs[i].size = images[i].size;
+    }
+
+    // Hash without the lock, then insert one after the other
+    err = hash_batch(jobs, count, nb_threads);
+    int ret = 0;
+    pthread_mutex_lock(&db->lock);
+    for (size_t i = 0; i < count; ++i) {
+        int result = images[i].data == NULL ? ERR_INVALID_ARGUMENT : err;
+        result = result != 0 ? result : jobs[i].error;
+        result = result != 0 ? result :
+                 do_insert_hashed(images[i].data, images[i].size, jobs[i].sha,
+                                  images[i].pict_id, &db->db_file);
+        if (results != NULL) {
+            results[i] = result;
+        }
+        ret = ret == 0 ? result : ret;
+    }
+    // Make the images visible to pread and the mappings
+    if (fflush(db->db_file.fpdb) != 0) {
+        ret = ret == 0 ? ERR_IO : ret;
+    }
+    pthread_mutex_unlock(&db->lock);
+
+    free(jobs);
+    return ret;
+}
+
+int pictdb_delete(pictdb* db, const char* pict_id)
+{
+    if (db == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (db->read_only) {
+        return ERR_READ_ONLY;
+    }
+
+    pthread_mutex_lock(&db->lock);
+    int ret = do_delete(&db->db_file, pict_id);
+    if (ret == 0 && fflush(db->db_file.fpdb) != 0) {
+        ret = ERR_IO;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+int pictdb_next(pictdb* db, uint32_t* cursor, struct pictdb_info* info)
+{
+    if (db == NULL || cursor == NULL || info == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = ERR_FILE_NOT_FOUND;
+    pthread_mutex_lock(&db->lock);
+    const uint32_t max_files = db->db_file.header.max_files;
+    for (; *cursor < max_files && ret != 0; ++*cursor) {
+        const struct pict_metadata* metadata =
+            &db->db_file.metadata[*cursor];
+        if (metadata->is_valid == NON_EMPTY) {
+            strncpy(info->pict_id, metadata->pict_id, MAX_PIC_ID);
+            info->pict_id[MAX_PIC_ID] = '\0';
+            memcpy(info->sha, metadata->SHA, SHA256_DIGEST_LENGTH);
+            info->width = metadata->res_orig[0];
+            info->height = metadata->res_orig[1];
+            memcpy(info->size, metadata->size, sizeof(info->size));
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+int pictdb_resolution(pictdb* db, const char* name)
+{
+    // The tiers are set at creation: no need to lock
+    const int resolution = db == NULL ? -1 :
+                           resolution_atoi(name, &db->db_file);
+    return resolution != -1 ? resolution : -ERR_INVALID_ARGUMENT;
+}
+
+void init_vips(void)
+{
+    s_vips_error = VIPS_INIT("libpictdb") ? ERR_VIPS : 0;
+}
+
+int locate(pictdb* db, const char* pict_id, int resolution,
+           FILE** file, uint64_t* offset, uint32_t* size)
+{
+    if (db == NULL || pict_id == NULL || resolution < 0
+        || resolution >= nb_resolutions(&db->db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (strlen(pict_id) == 0 || strlen(pict_id) > MAX_PIC_ID) {
+        return ERR_INVALID_PICID;
+    }
+
+    uint32_t index = 0;
+    pthread_mutex_lock(&db->lock);
+    int ret = find_image(pict_id, &db->db_file, &index);
+    ret = ret == 0 ? do_locate_index(index, resolution, &db->db_file,
+                                     file, offset, size) : ret;
+    // A resized image is written through the stream: make it visible
+    if (ret == 0 && !db->read_only && fflush(db->db_file.fpdb) != 0) {
+        ret = ERR_IO;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+int map_locked(FILE* file, struct pictdb_mapping** mappings, uint64_t end)
+{
+    if (*mappings != NULL && (*mappings)->size >= end) {
+        return 0;
+    }
+
+    struct stat st;
+    const int fd = fileno(file);
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < end) {
+        return ERR_IO;
+    }
+    struct pictdb_mapping* mapping = calloc(1, sizeof(struct pictdb_mapping));
+    if (mapping == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    mapping->size = (size_t) st.st_size;
+    mapping->data = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping->data == MAP_FAILED) {
+        free(mapping);
+        return ERR_IO;
+    }
+    mapping->next = *mappings;
+    *mappings = mapping;
+    return 0;
+}
+
+void unmap_all(struct pictdb_mapping* mappings)
+{
+    while (mappings != NULL) {
+        struct pictdb_mapping* next = mappings->next;
+        munmap(mappings->data, mappings->size);
+        free(mappings);
+        mappings = next;
+    }
+}
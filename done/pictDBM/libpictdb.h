@@ -0,0 +1,278 @@
+/**
+ * @file libpictdb.h
+ * @brief Public header of libpictdb, to read and insert images of a pictDB
+ *        database from another program, without running pictDBM.
+ *
+ * Link with -lpictdb (libpictdb.so or libpictdb.a, built by make lib).
+ * Only the functions and types of this header are part of the library's
+ * interface: they keep their meaning for all the versions of a given major
+ * number, while everything else may change.
+ *
+ * A handle may be shared by the threads of the program: its calls are
+ * serialized, except the copy of the bytes read by pictdb_read.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef LIBPICTDB_H
+#define LIBPICTDB_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#define PICTDB_VERSION_MAJOR 1
+#define PICTDB_VERSION_MINOR 3
+#define PICTDB_VERSION_PATCH 0
+
+/**
+ * @brief The version of this header, to be compared with pictdb_version().
+ */
+#define PICTDB_VERSION (PICTDB_VERSION_MAJOR * 10000 \
+                        + PICTDB_VERSION_MINOR * 100 + PICTDB_VERSION_PATCH)
+
+#define PICTDB_MAX_PIC_ID  127 // Maximal length of the ID of an image
+#define PICTDB_SHA_LENGTH  32  // Length of the SHA-256 hash of an image
+
+/* Resolutions of the images */
+#define PICTDB_RES_THUMB 0
+#define PICTDB_RES_SMALL 1
+#define PICTDB_RES_ORIG  2
+
+/* Flags of pictdb_open */
+#define PICTDB_READ_ONLY  0
+#define PICTDB_READ_WRITE 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Results of the functions of the library. Their values never change.
+ */
+enum pictdb_status {
+    PICTDB_OK = 0,
+    PICTDB_ERR_IO = 1,
+    PICTDB_ERR_OUT_OF_MEMORY = 2,
+    PICTDB_ERR_INVALID_FILENAME = 4,
+    PICTDB_ERR_INVALID_ARGUMENT = 6,
+    PICTDB_ERR_MAX_FILES = 7,
+    PICTDB_ERR_RESOLUTIONS = 8,
+    PICTDB_ERR_INVALID_PICID = 9,
+    PICTDB_ERR_FULL_DATABASE = 10,
+    PICTDB_ERR_FILE_NOT_FOUND = 11,
+    PICTDB_ERR_DUPLICATE_ID = 13,
+    PICTDB_ERR_VIPS = 14,
+    PICTDB_ERR_CORRUPTED = 15,
+    /**
+     * @brief The database was opened with PICTDB_READ_ONLY. (Since 1.2)
+     */
+    PICTDB_ERR_READ_ONLY = 16,
+    /**
+     * @brief The buffer given to pictdb_read is too small for the image.
+     */
+    PICTDB_ERR_BUFFER_TOO_SMALL = 100
+};
+
+/**
+ * @brief An open database, opaque to the program.
+ */
+typedef struct pictdb pictdb;
+
+/**
+ * @brief Where an image is stored, to be used without copying it.
+ */
+struct pictdb_blob {
+    /**
+     * @brief The bytes of the image in a read-only mapping of the database
+     *        or of its cache file, valid until the database is closed.
+     */
+    const void* data;
+    /**
+     * @brief The size of the image, in bytes.
+     */
+    uint32_t size;
+    /**
+     * @brief File descriptor of the database, or of its cache file, and
+     *        offset of the image in it, e.g. for sendfile. The descriptor
+     *        is valid until the database is closed.
+     */
+    int fd;
+    uint64_t offset;
+};
+
+/**
+ * @brief An image to insert with pictdb_insert_batch.
+ */
+struct pictdb_image {
+    /**
+     * @brief The ID of the image, of at most 127 characters.
+     */
+    const char* pict_id;
+    /**
+     * @brief The bytes of the image, a JPEG.
+     */
+    const void* data;
+    size_t size;
+};
+
+/**
+ * @brief The metadata of an image, given by pictdb_next.
+ */
+struct pictdb_info {
+    char pict_id[PICTDB_MAX_PIC_ID + 1];
+    unsigned char sha[PICTDB_SHA_LENGTH];
+    /**
+     * @brief Resolution of the original image.
+     */
+    uint32_t width;
+    uint32_t height;
+    /**
+     * @brief Sizes of the image in each resolution, in bytes, 0 for the
+     *        resized images not created yet in the database itself.
+     */
+    uint32_t size[3];
+};
+
+/**
+ * @brief Gives the version of the library, to check at run time that it
+ *        has the major version of the header (PICTDB_VERSION / 10000).
+ *
+ * @return The version, as PICTDB_VERSION.
+ */
+unsigned int pictdb_version(void);
+
+/**
+ * @brief Describes a result of the library.
+ *
+ * @param status The result.
+ * @return Its description, a static string.
+ */
+const char* pictdb_strerror(int status);
+
+/**
+ * @brief Opens a database.
+ *
+ * A database opened with PICTDB_READ_ONLY is never written, so that it may
+ * be on read-only media or shared by many processes: the resized images it
+ * lacks are kept in <filename>.variants, shared by the processes reading
+ * it, or in a temporary file if that one cannot be written. (Since 1.2;
+ * reading them gave PICTDB_ERR_FILE_NOT_FOUND before.)
+ *
+ * @param filename The file of the database, of at most 31 characters.
+ * @param flags    PICTDB_READ_ONLY or PICTDB_READ_WRITE.
+ * @param db       Location where the handle will be stored.
+ * @return PICTDB_OK in case of success, an error code otherwise.
+ */
+int pictdb_open(const char* filename, int flags, pictdb** db);
+
+/**
+ * @brief Creates an empty database, replacing any file of the same name,
+ *        and opens it with PICTDB_READ_WRITE. (Since 1.1)
+ *
+ * @param filename    The file of the database, of at most 31 characters.
+ * @param max_files   The maximal number of images, at most 100000.
+ * @param res_resized The maximal width and height of the thumbnails (at
+ *                    most 128) then of the small images (at most 512), or
+ *                    NULL for 64x64 and 256x256.
+ * @param db          Location where the handle will be stored.
+ * @return PICTDB_OK in case of success, an error code otherwise.
+ */
+int pictdb_create(const char* filename, uint32_t max_files,
+                  const uint16_t res_resized[4], pictdb** db);
+
+/**
+ * @brief Closes a database and frees its handle.
+ *
+ * @param db The database, may be NULL.
+ */
+void pictdb_close(pictdb* db);
+
+/**
+ * @brief Reads an image into a buffer of the program, creating the resized
+ *        image first if need be.
+ *
+ * @param db         The database.
+ * @param pict_id    The ID of the image.
+ * @param resolution The resolution, a PICTDB_RES_ value or one given by
+ *                   pictdb_resolution.
+ * @param buffer     The buffer, may be NULL if capacity is 0.
+ * @param capacity   The size of the buffer, in bytes.
+ * @param size       Location where the size of the image will be stored,
+ *                   even if the buffer is too small.
+ * @return PICTDB_OK in case of success, PICTDB_ERR_BUFFER_TOO_SMALL if the
+ *         image does not fit in the buffer, another error code otherwise.
+ */
+int pictdb_read(pictdb* db, const char* pict_id, int resolution,
+                void* buffer, size_t capacity, size_t* size);
+
+/**
+ * @brief Locates an image, creating the resized image first if need be,
+ *        without copying it.
+ *
+ * @param db         The database.
+ * @param pict_id    The ID of the image.
+ * @param resolution The resolution, a PICTDB_RES_ value or one given by
+ *                   pictdb_resolution.
+ * @param blob       Location where the image will be described.
+ * @return PICTDB_OK in case of success, an error code otherwise.
+ */
+int pictdb_lookup(pictdb* db, const char* pict_id, int resolution,
+                  struct pictdb_blob* blob);
+
+/**
+ * @brief Inserts many images, hashing them in parallel. The images are
+ *        inserted in order, each one independently of the others.
+ *
+ * @param db         A database opened with PICTDB_READ_WRITE.
+ * @param images     The images.
+ * @param count      The number of images.
+ * @param results    Location where the result of each insertion will be
+ *                   stored, may be NULL.
+ * @param nb_threads The number of threads hashing; 0 uses one per CPU.
+ * @return PICTDB_OK if all the images were inserted, the error code of the
+ *         first one which could not be otherwise, PICTDB_ERR_READ_ONLY for
+ *         a database opened with PICTDB_READ_ONLY.
+ */
+int pictdb_insert_batch(pictdb* db, const struct pictdb_image* images,
+                        size_t count, int* results, unsigned int nb_threads);
+
+/**
+ * @brief Deletes an image. Its bytes stay in the file until it is garbage
+ *        collected with pictDBM gc. (Since 1.1)
+ *
+ * @param db      A database opened with PICTDB_READ_WRITE.
+ * @param pict_id The ID of the image.
+ * @return PICTDB_OK in case of success, PICTDB_ERR_READ_ONLY for a database
+ *         opened with PICTDB_READ_ONLY, another error code otherwise.
+ */
+int pictdb_delete(pictdb* db, const char* pict_id);
+
+/**
+ * @brief Gives the metadata of the images one after the other. (Since 1.1)
+ *
+ * @param db     The database.
+ * @param cursor Where to start from, 0 for the first image. It is moved
+ *               past the image given.
+ * @param info   Location where the metadata will be stored.
+ * @return PICTDB_OK if an image was given, PICTDB_ERR_FILE_NOT_FOUND if
+ *         there is no image left, another error code otherwise.
+ */
+int pictdb_next(pictdb* db, uint32_t* cursor, struct pictdb_info* info);
+
+/**
+ * @brief Gives the resolution of the given name: thumb, small, orig or one
+ *        of the tiers the database was created with, such as medium.
+ *        (Since 1.3)
+ *
+ * @param db   The database.
+ * @param name The name of the resolution.
+ * @return The resolution, to be given to pictdb_read or pictdb_lookup, or
+ *         -PICTDB_ERR_INVALID_ARGUMENT if the database has no such one.
+ */
+int pictdb_resolution(pictdb* db, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms of the server.
+ *
+ * Each thread records into its own shard with relaxed atomic additions: no
+ * lock is taken and no cache line is shared on the hot path. The shards
+ * live in an anonymous shared mapping, so that the workers forked by the
+ * server record into the same region and any of them can sum them all.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS and clock_gettime
+
+#include "metrics.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+const char* const METRIC_OP_NAMES[NB_METRIC_OPS] = {
+    "list", "read", "thumbs", "sprite", "insert", "delete", "resize"
+};
+
+/**
+ * @brief The shards of all the threads of all the processes.
+ */
+struct metrics_region {
+    /**
+     * @brief Number of shards claimed.
+     */
+    uint64_t claimed;
+    struct metrics_shard shards[METRIC_SHARDS];
+};
+
+struct metrics_region* s_metrics = NULL;
+pthread_key_t s_shard_key;
+
+/**
+ * @brief Adds the histogram of a shard to a sum.
+ *
+ * @param total     The sum.
+ * @param histogram The histogram.
+ */
+void add_histogram(struct histogram* total, const struct histogram* histogram);
+
+/**
+ * @brief Reads a counter written by another thread.
+ *
+ * @param counter The counter.
+ * @return Its value.
+ */
+uint64_t load_counter(const uint64_t* counter);
+
+
+int metrics_init(void)
+{
+    if (s_metrics != NULL) {
+        return 0;
+    }
+
+    void* region = mmap(NULL, sizeof(struct metrics_region),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (region == MAP_FAILED) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (pthread_key_create(&s_shard_key, NULL) != 0) {
+        munmap(region, sizeof(struct metrics_region));
+        return ERR_OUT_OF_MEMORY;
+    }
+    s_metrics = region; // Zeroed by mmap
+    return 0;
+}
+
+void metrics_free(void)
+{
+    if (s_metrics != NULL) {
+        pthread_key_delete(s_shard_key);
+        munmap(s_metrics, sizeof(struct metrics_region));
+        s_metrics = NULL;
+    }
+}
+
+struct metrics_shard* metrics_shard(void)
+{
+    if (s_metrics == NULL) {
+        return NULL;
+    }
+
+    struct metrics_shard* shard = pthread_getspecific(s_shard_key);
+    if (shard == NULL) {
+        uint64_t index = __atomic_fetch_add(&s_metrics->claimed, 1,
+                                            __ATOMIC_RELAXED);
+        index = index < METRIC_SHARDS ? index : METRIC_SHARDS - 1;
+        shard = &s_metrics->shards[index];
+        pthread_setspecific(s_shard_key, shard);
+    }
+    return shard;
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+void metrics_add(uint64_t* counter, uint64_t value)
+{
+    // Atomic only for the threads sharing the last shard, uncontended else
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(struct histogram* histogram, uint64_t us)
+{
+    // The bucket is the number of bits of the duration
+    size_t bucket = us == 0 ? 0 : 64 - (size_t) __builtin_clzll(us);
+    bucket = bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS;
+    metrics_add(&histogram->buckets[bucket], 1);
+    metrics_add(&histogram->sum_us, us);
+}
+
+void metrics_sum(struct metrics_shard* total)
+{
+    memset(total, 0, sizeof(struct metrics_shard));
+    if (s_metrics == NULL) {
+        return;
+    }
+
+    uint64_t claimed = load_counter(&s_metrics->claimed);
+    claimed = claimed < METRIC_SHARDS ? claimed : METRIC_SHARDS;
+    for (uint64_t i = 0; i < claimed; ++i) {
+        const struct metrics_shard* shard = &s_metrics->shards[i];
+        for (size_t op = 0; op < NB_METRIC_OPS; ++op) {
+            for (size_t res = 0; res < MAX_NB_RES; ++res) {
+                add_histogram(&total->requests[op][res][0],
+                              &shard->requests[op][res][0]);
+                add_histogram(&total->requests[op][res][1],
+                              &shard->requests[op][res][1]);
+            }
+            total->errors[op] += load_counter(&shard->errors[op]);
+        }
+        for (size_t res = 0; res < MAX_NB_RES; ++res) {
+            add_histogram(&total->resizes[res], &shard->resizes[res]);
+        }
+        total->sprite_hits += load_counter(&shard->sprite_hits);
+        total->sprite_misses += load_counter(&shard->sprite_misses);
+        total->resize_hits += load_counter(&shard->resize_hits);
+        total->resize_misses += load_counter(&shard->resize_misses);
+        total->bytes_sent += load_counter(&shard->bytes_sent);
+    }
+}
+
+uint64_t histogram_count(const struct histogram* histogram)
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i <= METRIC_BUCKETS; ++i) {
+        count += histogram->buckets[i];
+    }
+    return count;
+}
+
+void add_histogram(struct histogram* total, const struct histogram* histogram)
+{
+    for (size_t i = 0; i <= METRIC_BUCKETS; ++i) {
+        total->buckets[i] += load_counter(&histogram->buckets[i]);
+    }
+    total->sum_us += load_counter(&histogram->sum_us);
+}
+
+uint64_t load_counter(const uint64_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,139 @@
+/**
+ * @file metrics.h
+ * @brief Header file for the counters and latency histograms of the server.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_METRICS_H
+#define PICTDBPRJ_METRICS_H
+
+#include "pictDB.h"
+
+#define METRIC_BUCKETS 24  // Histogram buckets, of 1 us to 2^23 us (~8 s)
+#define METRIC_SHARDS  128 // Maximal number of threads with their own shard
+
+/**
+ * @brief The operations whose requests are measured.
+ */
+enum metric_op {
+    METRIC_LIST,
+    METRIC_READ,
+    METRIC_THUMBS,
+    METRIC_SPRITE,
+    METRIC_INSERT,
+    METRIC_DELETE,
+    METRIC_RESIZE,
+    NB_METRIC_OPS,
+    METRIC_NONE = NB_METRIC_OPS
+};
+
+/**
+ * @brief Names of the operations, as the op label of the metrics.
+ */
+extern const char* const METRIC_OP_NAMES[NB_METRIC_OPS];
+
+/**
+ * @brief A histogram of durations, in buckets of powers of two
+ *        microseconds: bucket i counts the durations below 2^i us, the last
+ *        one the longer ones.
+ */
+struct histogram {
+    uint64_t buckets[METRIC_BUCKETS + 1];
+    uint64_t sum_us;
+};
+
+/**
+ * @brief The metrics recorded by a thread. Only it writes to its shard,
+ *        so that recording never contends; readers sum all the shards.
+ */
+struct metrics_shard {
+    /**
+     * @brief Durations of the requests, by operation, resolution (read and
+     *        thumbs only, tiers included) and whether a variant had to be
+     *        resized.
+     */
+    struct histogram requests[NB_METRIC_OPS][MAX_NB_RES][2];
+    /**
+     * @brief Number of requests answered with an error, by operation.
+     */
+    uint64_t errors[NB_METRIC_OPS];
+    /**
+     * @brief Durations of the lazy resizes, by resolution.
+     */
+    struct histogram resizes[MAX_NB_RES];
+    uint64_t sprite_hits;
+    uint64_t sprite_misses;
+    /**
+     * @brief Lookups of the cache of images resized on demand.
+     */
+    uint64_t resize_hits;
+    uint64_t resize_misses;
+    /**
+     * @brief Number of bytes sent to the clients.
+     */
+    uint64_t bytes_sent;
+} __attribute__((aligned(64)));
+
+/**
+ * @brief Allocates the shards, in memory shared with the processes forked
+ *        afterwards so that any of them reports the metrics of all.
+ *
+ * @return 0 in case of success, an error code otherwise (nothing is then
+ *         recorded).
+ */
+int metrics_init(void);
+
+/**
+ * @brief Frees the shards.
+ */
+void metrics_free(void);
+
+/**
+ * @brief Gives the shard of the calling thread, claiming one the first
+ *        time. Threads beyond METRIC_SHARDS share the last one.
+ *
+ * @return The shard, NULL if metrics_init failed.
+ */
+struct metrics_shard* metrics_shard(void);
+
+/**
+ * @brief Reads a monotonic clock.
+ *
+ * @return The time, in microseconds.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Adds to a counter of a shard.
+ *
+ * @param counter The counter.
+ * @param value   The value to add.
+ */
+void metrics_add(uint64_t* counter, uint64_t value);
+
+/**
+ * @brief Records a duration in a histogram of a shard.
+ *
+ * @param histogram The histogram.
+ * @param us        The duration, in microseconds.
+ */
+void metrics_observe(struct histogram* histogram, uint64_t us);
+
+/**
+ * @brief Sums the shards of all the threads.
+ *
+ * @param total Location where the sum will be stored.
+ */
+void metrics_sum(struct metrics_shard* total);
+
+/**
+ * @brief Gives the number of durations recorded in a histogram.
+ *
+ * @param histogram The histogram.
+ * @return The number of durations.
+ */
+uint64_t histogram_count(const struct histogram* histogram);
+
+#endif
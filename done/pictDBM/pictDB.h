@@ -44,6 +44,17 @@
 #define RES_SMALL 1
 #define RES_ORIG  2
 #define NB_RES    3
+// The extra resolutions of a database, if any, come after those
+#define MAX_NB_RES    8    // max. number of resolutions, NB_RES included
+#define MAX_TIER_NAME 15   // max. size of the name of an extra resolution
+#define MAX_TIER_RES  8192 // max. width and height of an extra resolution
+
+// Options of the encoder of a resolution, see struct pictdb_encoding
+#define ENCODE_STRIP       1   // without the EXIF, ICC and XMP metadata
+#define ENCODE_PROGRESSIVE 2   // progressive instead of baseline JPEG
+#define ENCODE_OPTIMIZE    4   // optimized Huffman tables
+#define DEFAULT_QUALITY    75  // quality of the encoder by default
+#define MAX_QUALITY        100
 
 #ifdef __cplusplus
 extern "C" {
@@ -84,13 +95,73 @@ struct pictdb_header {
      */
     uint16_t res_resized[2 * (NB_RES - 1)];
     /**
-     * @brief Unused 32 bit integer.
+     * @brief Number of extra resolutions, described in the tier extension
+     *        of the file. 0 if it has none, as in the first databases.
+     */
+    uint32_t nb_tiers;
+    /**
+     * @brief Offset of the tier extension, or 0 if the file has no
+     *        extension, as in the first databases: the nb_tiers tiers, then
+     *        for each image, where it is stored in each of them. It follows
+     *        the MAX_NB_RES encodings of the resolutions, which follow the
+     *        metadata, or directly the metadata in the files created before
+     *        the encodings.
+     */
+    uint64_t tiers_offset;
+};
+
+/**
+ * @brief An extra resolution of a database.
+ */
+struct pictdb_tier {
+    /**
+     * @brief Name of the resolution, as given to read.
+     */
+    char name[MAX_TIER_NAME + 1];
+    /**
+     * @brief Maximal width and height of the images.
+     */
+    uint16_t res[2];
+    /**
+     * @brief Unused 32 bit integer, keeping the variants that follow the
+     *        tiers aligned.
      */
     uint32_t unused_32;
+};
+
+/**
+ * @brief How the images of a resolution are encoded.
+ */
+struct pictdb_encoding {
+    /**
+     * @brief Quality of the encoder, from 1 to MAX_QUALITY, or 0 for
+     *        DEFAULT_QUALITY.
+     */
+    uint8_t quality;
     /**
-     * @brief Unused 64 bit integer.
+     * @brief Options of the encoder, ENCODE_STRIP, ENCODE_PROGRESSIVE and
+     *        ENCODE_OPTIMIZE.
      */
-    uint64_t unused_64;
+    uint8_t flags;
+    /**
+     * @brief Unused 16 bit integer.
+     */
+    uint16_t unused_16;
+};
+
+/**
+ * @brief Where an image is stored in an extra resolution.
+ */
+struct tier_variant {
+    uint64_t offset;
+    /**
+     * @brief Size of the image, 0 if it was not resized yet.
+     */
+    uint32_t size;
+    /**
+     * @brief Unused 32 bit integer.
+     */
+    uint32_t unused_32;
 };
 
 /**
@@ -128,6 +199,8 @@ struct pict_metadata {
     uint16_t unused_16;
 };
 
+struct variant_cache; // See variant_cache.h
+
 /**
  * @brief An image database.
  */
@@ -144,8 +217,144 @@ struct pictdb_file {
      * @brief Metadata of the images.
      */
     struct pict_metadata* metadata;
+    /**
+     * @brief Header and metadata as mapped from the file and shared with
+     *        the other processes mapping it, NULL if metadata is private.
+     */
+    struct pictdb_header* shared;
+    /**
+     * @brief Where the resized images are kept when the file is opened
+     *        read-only, NULL if they are written to the file.
+     */
+    struct variant_cache* cache;
+    /**
+     * @brief The extra resolutions, header.nb_tiers of them.
+     */
+    struct pictdb_tier tiers[MAX_NB_RES - NB_RES];
+    /**
+     * @brief How the images are encoded, by resolution. All zero, for the
+     *        defaults of the encoder, in the files without the encodings.
+     */
+    struct pictdb_encoding encodings[MAX_NB_RES];
+    /**
+     * @brief Where the images are stored in the extra resolutions: those
+     *        of image i start at i * header.nb_tiers. NULL if there is none.
+     */
+    struct tier_variant* variants;
+};
+
+/**
+ * @brief Space taken by a database file.
+ */
+struct space_usage {
+    uint64_t file_size;
+    /**
+     * @brief Bytes still referenced: the header, the metadata and the
+     *        variants of the valid images, counted once when shared by
+     *        duplicates. The rest is reclaimed by the garbage collection.
+     */
+    uint64_t live_bytes;
+};
+
+/**
+ * @brief State of the incremental search of the dimensions of a JPEG image
+ *        whose bytes are received piece by piece.
+ */
+struct jpeg_size_scanner {
+    /**
+     * @brief Current state of the parser.
+     */
+    int state;
+    /**
+     * @brief Marker of the segment being parsed.
+     */
+    uint8_t marker;
+    /**
+     * @brief Number of bytes of the current field already read.
+     */
+    uint8_t pos;
+    /**
+     * @brief Bytes of the current field (segment length or frame header).
+     */
+    uint8_t field[5];
+    /**
+     * @brief Bytes left to skip in the current segment.
+     */
+    uint32_t skip;
+    /**
+     * @brief Dimensions of the image, valid once the frame header is parsed.
+     */
+    uint32_t width;
+    uint32_t height;
 };
 
+/**
+ * @brief A region reserved at the end of a database file, in which images
+ *        are written as they are received, before their metadata is
+ *        committed.
+ *
+ * Several images may be streamed one after the other in the same region.
+ */
+struct pictdb_upload {
+    /**
+     * @brief Offset of the first byte of the region.
+     */
+    uint64_t start;
+    /**
+     * @brief Offset following the last reserved byte of the region.
+     */
+    uint64_t end;
+    /**
+     * @brief Offset of the image being received.
+     */
+    uint64_t offset;
+    /**
+     * @brief Number of bytes of the image received so far.
+     */
+    uint64_t size;
+    /**
+     * @brief Hash of the bytes received so far (an EVP_MD_CTX, named by its
+     *        struct so that openssl/evp.h is not needed here).
+     */
+    struct evp_md_ctx_st* sha_ctx;
+    /**
+     * @brief Dimensions of the image, found in its first bytes.
+     */
+    struct jpeg_size_scanner scanner;
+};
+
+/**
+ * @brief Summary of the verification of a database. Its counters grow as
+ *        the verification goes, with atomic stores: another thread may
+ *        follow them with __atomic_load_n.
+ */
+struct verify_report {
+    /**
+     * @brief Number of images whose original was checked.
+     */
+    uint32_t checked;
+    /**
+     * @brief Number of corrupted images and variants.
+     */
+    uint32_t corrupted;
+    /**
+     * @brief Number of bytes read from the database.
+     */
+    uint64_t bytes_read;
+};
+
+/**
+ * @brief A function called for each corruption found by do_verify.
+ *
+ * @param metadata   The metadata of the corrupted image.
+ * @param resolution The resolution of the corrupted variant.
+ * @param reason     A description of the corruption.
+ * @param arg        The argument given to do_verify.
+ */
+typedef void (*corruption_handler)(const struct pict_metadata* metadata,
+                                   int resolution, const char* reason,
+                                   void* arg);
+
 /**
  * @brief Prints a database header informations.
  *
@@ -153,6 +362,14 @@ struct pictdb_file {
  */
 void print_header(const struct pictdb_header* header);
 
+/**
+ * @brief Prints the extra resolutions of a database and the encodings of its
+ *        resolutions which are not the defaults, if any.
+ *
+ * @param db_file The database.
+ */
+void print_tiers(const struct pictdb_file* db_file);
+
 /**
  * @brief Prints picture metadata informations.
  *
@@ -172,12 +389,149 @@ void print_metadata(const struct pict_metadata* metadata);
  */
 char* do_list(const struct pictdb_file* db_file, enum do_list_mode mode);
 
+/**
+ * @brief A function receiving the successive pieces of a streamed output.
+ *
+ * @param data The next piece of the output.
+ * @param len  The length of the piece.
+ * @param arg  The argument given with the function.
+ */
+typedef void (*list_writer)(const char* data, size_t len, void* arg);
+
+/**
+ * @enum list_format
+ * @brief Specifies the output format of a list query.
+ */
+enum list_format {
+    LIST_JSON, LIST_CSV, LIST_BINARY
+};
+
+/**
+ * @enum list_field
+ * @brief The fields of the pictures that a list query can output,
+ *        combined as a bitmask.
+ */
+enum list_field {
+    FIELD_ID = 1,       // pict_id
+    FIELD_RES = 2,      // res_orig
+    FIELD_SIZE = 4,     // size of each resolution
+    FIELD_SHA = 8,      // SHA
+    FIELD_VARIANTS = 16 // resized resolutions which exist
+};
+
+#define FIELD_ALL 31
+
+/**
+ * @brief A query listing the pictures of a database: which pictures, which
+ *        of their fields and in which format.
+ */
+struct list_query {
+    /**
+     * @brief The first metadata slot to list.
+     */
+    uint32_t cursor;
+    /**
+     * @brief The maximal number of pictures to list.
+     */
+    uint32_t limit;
+    /**
+     * @brief Bitmask of list_field.
+     */
+    unsigned int fields;
+    enum list_format format;
+    /**
+     * @brief Bounds of the original resolution as (width, height);
+     *        a maximum of 0 is no bound.
+     */
+    uint32_t min_res[2];
+    uint32_t max_res[2];
+    /**
+     * @brief Bitmask of the resized resolutions (1 << RES_THUMB, 1 << RES_SMALL)
+     *        that the pictures must have.
+     */
+    unsigned int variants;
+    /**
+     * @brief Prefix of the listed pict_id, NULL for any.
+     */
+    const char* prefix;
+};
+
+/**
+ * @brief Initializes a list query to the whole list of the pict_id,
+ *        as JSON.
+ *
+ * @param query The query to initialize.
+ */
+void init_list_query(struct list_query* query);
+
+/**
+ * @brief Parses a comma-separated list of fields (id, res, size, sha,
+ *        variants, or all).
+ *
+ * @param str    The list of fields.
+ * @param fields Location where the bitmask of list_field will be stored.
+ * @return 0 in case of success, ERR_INVALID_ARGUMENT otherwise.
+ */
+int parse_list_fields(const char* str, unsigned int* fields);
+
+/**
+ * @brief Parses a comma-separated list of resized resolutions (see
+ *        resolution_atoi) that listed pictures must have.
+ *
+ * @param str      The list of resolutions.
+ * @param variants Location where the bitmask of resolutions will be stored.
+ * @return 0 in case of success, ERR_INVALID_ARGUMENT otherwise.
+ */
+int parse_list_variants(const char* str, unsigned int* variants);
+
+/**
+ * @brief Parses the name of a list format (json, csv or binary).
+ *
+ * @param str    The name of the format.
+ * @param format Location where the format will be stored.
+ * @return 0 in case of success, ERR_INVALID_ARGUMENT otherwise.
+ */
+int parse_list_format(const char* str, enum list_format* format);
+
+/**
+ * @brief Streams a page of the list of the pictures of a database, reading
+ *        the metadata once.
+ *
+ * The cursor is the index of a metadata slot, so that pages stay stable
+ * while pictures are inserted or deleted (but not across a gc).
+ *
+ * In JSON, the page is {"Pictures": [...], "cursor": next}, next being null on
+ * the last page. The pictures are their pict_id if it is the only field,
+ * objects otherwise.
+ * In CSV, a line naming the fields is followed by one line per picture.
+ * In binary, the 4 bytes "PDBL" and a byte with the fields are followed by
+ * the pictures, each prefixed by a byte 1, then by a byte 0. The fields of
+ * a picture are, in this order and little-endian: the length of pict_id on
+ * a byte and its chars, the width and the height on 4 bytes, the 3 sizes on
+ * 4 bytes, the 32 bytes of the SHA and a byte with the variants bitmask.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param query   The pictures, fields and format to list.
+ * @param write   The function receiving the output.
+ * @param arg     The argument given to write.
+ * @param next    Location where the cursor of the next page will be stored,
+ *                max_files on the last page. Can be NULL.
+ * @return 0 in case of success, ERR_INVALID_ARGUMENT if the cursor is not
+ *         a slot of the database.
+ */
+int do_list_page(const struct pictdb_file* db_file,
+                 const struct list_query* query, list_writer write, void* arg,
+                 uint32_t* next);
+
 /**
  * @brief Creates the database called db_filename. Writes the header and the
- *        preallocated empty metadata array to database file.
+ *        preallocated empty metadata array to database file, then the
+ *        encodings and the tier extension, with the header.nb_tiers extra
+ *        resolutions given in tiers.
  *
  * @param filename Path to the file we want to write to.
- * @param db_file In memory structure with header and metadata.
+ * @param db_file In memory structure with header, tiers, encodings and
+ *                metadata.
  */
 int do_create(const char* filename, struct pictdb_file* db_file);
 
@@ -201,6 +555,49 @@ int do_open(const char* filename, const char* mode,
  */
 void do_close(struct pictdb_file* db_file);
 
+/**
+ * @brief Replaces the metadata read by do_open by a shared mapping of the
+ *        file: the changes made by any process become visible to all those
+ *        mapping it. The header stays a private copy, to be refreshed from
+ *        db_file->shared while the file is not being written.
+ *
+ * @param db_file A database opened in "rb+" mode.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int do_share_metadata(struct pictdb_file* db_file);
+
+/**
+ * @brief Refreshes the header and the encodings of a database from its
+ *        shared mapping, and drops what its stream buffered, once its file
+ *        was locked: other processes may have written to it.
+ *
+ * @param db_file A database whose metadata is shared.
+ */
+void do_refresh_shared(struct pictdb_file* db_file);
+
+/**
+ * @brief Keeps the images resized from a database opened in "rb" mode out
+ *        of it, in the file named after it with the VARIANT_CACHE_SUFFIX
+ *        suffix, shared with the other processes reading the database. If
+ *        that file cannot be written, they are kept in a temporary file
+ *        private to the process instead.
+ *
+ * @param db_file  An open database.
+ * @param filename The file of the database.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int do_open_cache(struct pictdb_file* db_file, const char* filename);
+
+/**
+ * @brief Measures the space taken by a database and how much of it is
+ *        still in use.
+ *
+ * @param db_file The database; what it buffered is written first.
+ * @param usage   Location where the usage will be stored.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int do_space_usage(struct pictdb_file* db_file, struct space_usage* usage);
+
 /**
  * @brief Deletes an image from a database
  *
@@ -213,12 +610,118 @@ int do_delete(struct pictdb_file* db_file, const char* pict_id);
 /**
  * @brief Converts a string to a resolution code.
  *
- * Valid codes are: RES_THUMB, RES_SMALL, RES_ORIG.
+ * Valid codes are: RES_THUMB, RES_SMALL, RES_ORIG, then NB_RES and above for
+ * the extra resolutions of the database, named after them.
  *
  * @param resolution The string to convert.
+ * @param db_file    The database, or NULL for the first NB_RES codes only.
  * @return A valid resolution code if the conversion was successful, -1 otherwise.
  */
-int resolution_atoi(const char* resolution);
+int resolution_atoi(const char* resolution,
+                    const struct pictdb_file* db_file);
+
+/**
+ * @brief Gives the number of resolutions of a database.
+ *
+ * @param db_file The database.
+ * @return NB_RES plus its number of extra resolutions.
+ */
+int nb_resolutions(const struct pictdb_file* db_file);
+
+/**
+ * @brief Gives the name of a resolution of a database.
+ *
+ * @param db_file    The database.
+ * @param resolution A valid resolution code.
+ * @return "thumb", "small", "orig" or the name of the extra resolution.
+ */
+const char* resolution_name(const struct pictdb_file* db_file,
+                            int resolution);
+
+/**
+ * @brief Gives the maximal width and height of a resized resolution.
+ *
+ * @param db_file    The database.
+ * @param resolution A valid resolution code.
+ * @return The width and the height, NULL for RES_ORIG.
+ */
+const uint16_t* resolution_max(const struct pictdb_file* db_file,
+                               int resolution);
+
+/**
+ * @brief Gives the size of an image in a resolution, from its metadata or
+ *        from the tier extension.
+ *
+ * @param db_file    The database.
+ * @param index      The index of the image.
+ * @param resolution A valid resolution code.
+ * @return The size, 0 if the image was not resized yet.
+ */
+uint32_t variant_size(const struct pictdb_file* db_file, uint32_t index,
+                      int resolution);
+
+/**
+ * @brief Gives the offset of an image in a resolution.
+ *
+ * @param db_file    The database.
+ * @param index      The index of the image.
+ * @param resolution A valid resolution code.
+ * @return The offset, 0 if the image was not resized yet.
+ */
+uint64_t variant_offset(const struct pictdb_file* db_file, uint32_t index,
+                        int resolution);
+
+/**
+ * @brief Sets where an image is stored in a resolution, in memory only: the
+ *        metadata or the tier extension is then written by the caller.
+ *
+ * @param db_file    The database.
+ * @param index      The index of the image.
+ * @param resolution A valid resolution code.
+ * @param offset     The offset of the image.
+ * @param size       The size of the image.
+ */
+void set_variant(struct pictdb_file* db_file, uint32_t index, int resolution,
+                 uint64_t offset, uint32_t size);
+
+/**
+ * @brief Writes where an image is stored in the extra resolutions to the
+ *        tier extension. Nothing is done for a database without it.
+ *
+ * @param db_file The database.
+ * @param index   The index of the image.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int write_tier_variants(struct pictdb_file* db_file, uint32_t index);
+
+/**
+ * @brief Parses the encoding of a resolution: "default", or comma-separated
+ *        "q=<QUALITY>", "strip", "progressive" and "optimize".
+ *
+ * @param str      The string to parse.
+ * @param encoding Location where the encoding will be stored.
+ * @return 0 if no errors occur, ERR_INVALID_ARGUMENT otherwise
+ */
+int parse_encoding(const char* str, struct pictdb_encoding* encoding);
+
+/**
+ * @brief Writes the encodings of the resolutions of a database to its file.
+ *
+ * @param db_file The database.
+ * @return 0 if no errors occur, NOT_IMPLEMENTED if the file was created
+ *         before the encodings (the garbage collection upgrades it), another
+ *         int coded in error.h in case of errors
+ */
+int write_encodings(struct pictdb_file* db_file);
+
+/**
+ * @brief Gives the offset of the first image of a database, past its
+ *        header, its metadata, its encodings and its tier extension.
+ *
+ * @param header The header of the database.
+ * @return The offset.
+ */
+uint64_t data_start(const struct pictdb_header* header);
 
 /**
  * @brief Compares two hashes digests.
@@ -228,6 +731,37 @@ int resolution_atoi(const char* resolution);
  */
 int hashcmp(unsigned char* h1, unsigned char* h2);
 
+/**
+ * @brief Hashes a SHA digest with a key, for the indexes of the caches.
+ *
+ * @param sha The digest.
+ * @param key What else identifies the entry, e.g. its size and encoding.
+ * @return The hash, whose low bits are uniformly distributed.
+ */
+uint64_t sha_key_hash(const unsigned char* sha, uint64_t key);
+
+/**
+ * @brief Writes a hash digest in hexadecimal.
+ *
+ * @param SHA        The hash digest.
+ * @param sha_string Location where the 2 * SHA256_DIGEST_LENGTH + 1 chars
+ *                   will be stored.
+ */
+void sha_to_string(const unsigned char* SHA, char* sha_string);
+
+/**
+ * @brief Computes the SHA-256 hash of a buffer, through the EVP interface
+ *        so that the fastest implementation for the CPU (SHA-NI, AVX2...)
+ *        is used.
+ *
+ * @param data The bytes to hash.
+ * @param len  The number of bytes.
+ * @param sha  Location where the SHA256_DIGEST_LENGTH bytes of the hash
+ *             will be stored.
+ * @return 0 in case of success, ERR_IO otherwise.
+ */
+int compute_sha(const char* data, size_t len, unsigned char* sha);
+
 /**
  * @brief Initializes an empty array of strings to be used in the split method.
  *
@@ -273,6 +807,49 @@ int split(char* result[], char* tmp, const char* src,
 int do_read(const char* pict_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct pictdb_file* db_file);
 
+/**
+ * @brief Reads the image of a metadata slot, like do_read.
+ *
+ * @param index         The index of the metadata of the image.
+ * @param resolution    The resolution of the image.
+ * @param image_buffer  The destination of the image.
+ * @param image_size    The size of the image, in bytes.
+ * @param db_file       The database.
+ * @return 0 if the read was successful, an error code otherwise.
+ */
+int do_read_index(uint32_t index, int resolution, char** image_buffer,
+                  uint32_t* image_size, struct pictdb_file* db_file);
+
+/**
+ * @brief Finds the metadata slot of an image.
+ *
+ * @param pict_id       The ID of the image.
+ * @param db_file       The database.
+ * @param index         Location where the index of the slot will be stored.
+ * @return 0 if the image was found, an error code otherwise.
+ */
+int find_image(const char* pict_id, const struct pictdb_file* db_file,
+               uint32_t* index);
+
+/**
+ * @brief Locates the image of a metadata slot in the file, resizing it in
+ *        the asked resolution if need be, without reading it: the caller
+ *        may then read it however it likes.
+ *
+ * @param index         The index of the metadata of the image.
+ * @param resolution    The resolution of the image.
+ * @param db_file       The database.
+ * @param file          Location where the file holding the image will be
+ *                      stored: the database, or its cache if it was opened
+ *                      read-only.
+ * @param offset        Location where the offset of the image will be stored.
+ * @param size          Location where the size of the image will be stored.
+ * @return 0 if the image was located, an error code otherwise.
+ */
+int do_locate_index(uint32_t index, int resolution,
+                    struct pictdb_file* db_file, FILE** file,
+                    uint64_t* offset, uint32_t* size);
+
 /**
  * @brief Adds an image to a database.
  *
@@ -285,6 +862,185 @@ int do_read(const char* pict_id, int resolution, char** image_buffer,
 int do_insert(const char* new_image, size_t size, const char* pict_id,
               struct pictdb_file* db_file);
 
+/**
+ * @brief Adds an image whose hash is already known to a database, which
+ *        avoids a second pass over its bytes.
+ *
+ * @param new_image The image to insert.
+ * @param size      The size of the image.
+ * @param sha       The SHA-256 hash of the image.
+ * @param pict_id   The ID of the image.
+ * @param db_file   The database.
+ * @return 0 if the insertion was successful, an error code otherwise.
+ */
+int do_insert_hashed(const char* new_image, size_t size,
+                     const unsigned char* sha, const char* pict_id,
+                     struct pictdb_file* db_file);
+
+/**
+ * @brief Reserves a region at the end of a database file, in which images
+ *        can then be streamed with do_upload_begin, do_upload_write and
+ *        do_upload_commit.
+ *
+ * Other writes to the database are appended after the region, so several
+ * uploads may be in progress at the same time.
+ *
+ * @param db_file The database.
+ * @param size    The size of the region, in bytes (e.g. the Content-Length
+ *                of the request carrying the images).
+ * @param upload  The upload to initialize.
+ * @return 0 if the region was reserved, an error code otherwise.
+ */
+int do_reserve(struct pictdb_file* db_file, uint64_t size,
+               struct pictdb_upload* upload);
+
+/**
+ * @brief Starts receiving a new image in a reserved region.
+ *
+ * The bytes of a previous image that was not committed are overwritten.
+ *
+ * @param upload The upload initialized by do_reserve.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int do_upload_begin(struct pictdb_upload* upload);
+
+/**
+ * @brief Appends a chunk of the image being received to the reserved region
+ *        and feeds it to the hash.
+ *
+ * @param db_file The database.
+ * @param upload  The upload.
+ * @param chunk   The bytes received.
+ * @param len     The number of bytes received.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int do_upload_write(struct pictdb_file* db_file, struct pictdb_upload* upload,
+                    const char* chunk, size_t len);
+
+/**
+ * @brief Adds the image received since the last do_upload_begin to the
+ *        database by writing its metadata.
+ *
+ * @param db_file The database.
+ * @param upload  The upload.
+ * @param pict_id The ID of the image.
+ * @return 0 if the insertion was successful, an error code otherwise.
+ */
+int do_upload_commit(struct pictdb_file* db_file,
+                     struct pictdb_upload* upload, const char* pict_id);
+
+/**
+ * @brief Ends an upload: frees its resources and gives back the unused part
+ *        of the region if nothing was written after it.
+ *
+ * @param db_file The database.
+ * @param upload  The upload.
+ */
+void do_release(struct pictdb_file* db_file, struct pictdb_upload* upload);
+
+/**
+ * @brief Checks the integrity of a database: the images and their variants
+ *        must lie inside the file, the originals must still match their
+ *        hash and the variants must be decodable within their resolution.
+ *
+ * The images are read in the order of their offsets, so that the file is
+ * read sequentially, and the originals are hashed in parallel.
+ *
+ * @param db_file       The database.
+ * @param nb_threads    The number of hashing threads; 0 uses one per CPU.
+ * @param rate          The maximal read rate, in MB/s; 0 for no limit.
+ * @param on_corruption Function called for each corruption, may be NULL.
+ * @param arg           Argument passed to on_corruption.
+ * @param report        Location where the summary will be stored.
+ * @return 0 if the database could be read, an error code otherwise
+ *         (corruptions are counted in the report, they are not errors).
+ */
+int do_verify(struct pictdb_file* db_file, unsigned int nb_threads,
+              double rate, corruption_handler on_corruption, void* arg,
+              struct verify_report* report);
+
+/**
+ * @brief Summary of the re-encoding of a database.
+ */
+struct reencode_report {
+    /**
+     * @brief Number of variants encoded again, counted once when shared by
+     *        duplicates.
+     */
+    uint32_t reencoded;
+    /**
+     * @brief Total size of these variants before and after, in bytes.
+     */
+    uint64_t old_bytes;
+    uint64_t new_bytes;
+};
+
+/**
+ * @brief Encodes again the variants of some resolutions of a database with
+ *        the current encodings of the resolutions, e.g. after they changed.
+ *        The new variants are appended to the file: the old ones are left to
+ *        the garbage collection.
+ *
+ * The originals are read and resized in parallel, a batch at a time. Each
+ * batch is appended under an exclusive flock of the file, the one a server
+ * takes to write, so that the database may be served meanwhile: the
+ * variants changed by others since they were listed are left alone.
+ *
+ * @param db_file     The database, opened for writing.
+ * @param resolutions The bitmask of the resolutions, 1 << resolution for
+ *                    each, RES_ORIG excluded.
+ * @param nb_threads  The number of resizing threads; 0 uses one per CPU.
+ * @param report      Location where the summary will be stored.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int do_reencode(struct pictdb_file* db_file, unsigned int resolutions,
+                unsigned int nb_threads, struct reencode_report* report);
+
+/**
+ * @brief A sprite sheet: thumbnails joined in one JPEG image, and the
+ *        JSON map of their positions.
+ */
+struct sprite_sheet {
+    /**
+     * @brief The JPEG image.
+     */
+    char* image;
+    size_t image_size;
+    /**
+     * @brief The map, as a null-terminated JSON string:
+     *        {"width": w, "height": h, "cursor": next, "Pictures":
+     *        [{"pict_id": id, "x": x, "y": y, "width": w, "height": h}...]}
+     */
+    char* map;
+    /**
+     * @brief The cursor of the next page, max_files on the last page.
+     */
+    uint32_t next;
+};
+
+/**
+ * @brief Joins the thumbnails of a page of pictures into a sprite sheet.
+ *        The thumbnails are placed on a grid of cells of the thumbnail
+ *        resolution, as square as possible. Missing thumbnails are created.
+ *
+ * @param db_file The database.
+ * @param cursor  The first metadata slot of the page.
+ * @param limit   The maximal number of pictures of the page.
+ * @param sheet   Location where the sprite sheet will be stored, to be freed
+ *                with free_sprite.
+ * @return 0 in case of success, ERR_FILE_NOT_FOUND if the page is empty,
+ *         another error code otherwise.
+ */
+int do_sprite(struct pictdb_file* db_file, uint32_t cursor, uint32_t limit,
+              struct sprite_sheet* sheet);
+
+/**
+ * @brief Frees the content of a sprite sheet.
+ *
+ * @param sheet The sprite sheet.
+ */
+void free_sprite(struct sprite_sheet* sheet);
+
 /**
  * @brief Cleans the database file by eliminating the holes created when
  *        deleting pictures. This is done by creating a new db and
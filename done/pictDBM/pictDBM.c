@@ -8,12 +8,18 @@
  * @date 2 Nov 2015
  */
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and fileno
+
 #include "pictDB.h"
 #include "pictDBM_tools.h"
 #include "image_content.h"
+#include "hash_batch.h"
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h> // for access
 
 // Constants
-#define NB_CMD        9      // Number of command line functions the database possesses
+#define NB_CMD        15     // Number of command line functions the database possesses
 #define FILE_DEFAULT  10     // Default max file number
 #define THUMB_DEFAULT 64     // Default thumb resolution
 #define THUMB_MAX     128    // Maximal thumb resolution
@@ -21,6 +27,8 @@
 #define SMALL_MAX     512    // Maximal small resolution
 #define MAX_PARAMS    20     // Maximal number of command line arguments for the interpretor
 #define MAX_INPUT_LENGTH 300 // Maximal number of chars parsed by the interpretor
+#define INSERT_CHUNK  65536  // Number of bytes of an image read at once by insert
+#define IMPORT_BATCH  256    // Number of images loaded and hashed at once by import
 
 // Macro that checks the number of arguments of a command
 #define ARG_CHECK(args, min) \
@@ -62,7 +70,7 @@ typedef struct {
  * @brief Specifies the create options.
  */
 enum options {
-    INVALID_OPTION, MAX_FILES, THUMB_RES, SMALL_RES
+    INVALID_OPTION, MAX_FILES, THUMB_RES, SMALL_RES, TIER, ENCODE
 };
 
 /**
@@ -74,6 +82,11 @@ enum interpretor_states {
 };
 
 int interpretor_state; // The state of the interpretor
+int timing;            // Whether the interpretor prints the duration of commands
+
+// Database kept open by the interpretor between commands
+struct pictdb_file session = {.fpdb = NULL, .metadata = NULL};
+char* session_name = NULL;
 
 /**
  * @brief Parses the command line options of do_create_cmd.
@@ -106,24 +119,118 @@ int check_values(const uint16_t x_res, const uint16_t y_res,
                  const uint16_t max_value);
 
 /**
- * @brief Reads an image from disk and stores it to a buffer.
+ * @brief Parses the options of do_list_cmd.
  *
- * @param filename     The name of the image file.
- * @param image_buffer The destination of the image.
- * @param image_size   The size of the image.
+ * @param args  The number of options.
+ * @param argv  The options.
+ * @param query The list query to fill.
+ * @return 0 in case of success, a non zero error code otherwise.
+ */
+int parse_list_options(int args, char* argv[], struct list_query* query);
+
+/**
+ * @brief A list_writer writing to stdout.
+ */
+void write_to_stdout(const char* data, size_t len, void* arg);
+
+/**
+ * @brief Opens a database for a command. The database of the interpretor
+ *        session is reused if it is the requested one.
+ *
+ * @param filename The name of the database file.
+ * @param mode     The mode in which to open the file, if it is not already.
+ * @param db_file  The database to initialize.
+ * @return 0 in case of success, a non zero error code otherwise.
+ */
+int open_database(const char* filename, const char* mode,
+                  struct pictdb_file* db_file);
+
+/**
+ * @brief Closes a database opened by open_database. The database of the
+ *        interpretor session stays open, with the changes made to its header.
+ *
+ * @param db_file The database to close.
+ */
+void close_database(struct pictdb_file* db_file);
+
+/**
+ * @brief Checks whether a database is the one of the interpretor session.
+ *
+ * @param db_file The database.
+ * @return 1 if it is, 0 otherwise.
+ */
+int is_session(const struct pictdb_file* db_file);
+
+/**
+ * @brief Checks whether a file is the database of the interpretor session,
+ *        whatever the path naming it.
+ *
+ * @param filename The name of the file.
+ * @return 1 if it is, 0 otherwise.
+ */
+int is_session_file(const char* filename);
+
+/**
+ * @brief Closes the database of the interpretor session, if any.
+ */
+void close_session(void);
+
+/**
+ * @brief Inserts an image file into a database, chunk by chunk: the image is
+ *        hashed while it is copied, and never entirely held in memory.
+ *
+ * @param filename The name of the image file.
+ * @param pict_id  The ID of the image.
+ * @param db_file  The database.
  * @return 0 in case of success, a non zero error code otherwise.
  */
-int read_image_from_disk(const char* filename, char** image_buffer,
-                         size_t* image_size);
+int insert_image_from_disk(const char* filename, const char* pict_id,
+                           struct pictdb_file* db_file);
+
+/**
+ * @brief Inserts many image files into a database. The files are loaded and
+ *        hashed in parallel by batches, then inserted one after the other.
+ *
+ * @param nb_files   The number of files.
+ * @param filenames  The names of the files.
+ * @param nb_threads The number of threads loading and hashing the files.
+ * @param db_file    The database.
+ * @return 0 if all the images were inserted, the error code of the first
+ *         failed insertion otherwise.
+ */
+int import_images(int nb_files, char* filenames[], unsigned int nb_threads,
+                  struct pictdb_file* db_file);
+
+/**
+ * @brief Prints a corrupted image found by verify.
+ *
+ * @param metadata   The metadata of the image.
+ * @param resolution The corrupted resolution.
+ * @param reason     A description of the corruption.
+ * @param arg        The database verified.
+ */
+void print_corruption(const struct pict_metadata* metadata, int resolution,
+                      const char* reason, void* arg);
+
+/**
+ * @brief Derives the ID of an image from its filename, by removing the
+ *        directories and the extension.
+ *
+ * @param filename The name of the image file.
+ * @param pict_id  Location where the MAX_PIC_ID + 1 chars of the ID will be
+ *                 stored.
+ * @return 0 in case of success, ERR_INVALID_PICID otherwise.
+ */
+int id_from_filename(const char* filename, char* pict_id);
 
 /**
  * @brief Creates the filename corresponding to the given resolution.
  *
  * @param pict_id    The ID of the image.
- * @param resolution The resolution of the image.
+ * @param resolution The name of the resolution of the image.
  * @return The new name, or NULL if an error occurred.
  */
-char* create_name(const char* pict_id, int resolution);
+char* create_name(const char* pict_id, const char* resolution);
 
 /**
  * @brief Appends a suffix to the given ID.
@@ -184,11 +291,24 @@ int do_list_cmd(int args, char* argv[])
 
     NEW_DATABASE;
 
-    int ret = do_open(argv[1], "rb", &db_file);
-    if (ret == 0) {
+    const char* db_name = argv[1];
+    const int formatted = args > 2;
+    struct list_query query;
+    init_list_query(&query);
+    // Any option selects the formatted output, CSV by default
+    query.format = LIST_CSV;
+    int ret = parse_list_options(args - 2, argv + 2, &query);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = open_database(db_name, "rb", &db_file);
+    if (ret == 0 && formatted) {
+        ret = do_list_page(&db_file, &query, write_to_stdout, NULL, NULL);
+    } else if (ret == 0) {
         do_list(&db_file, STDOUT);
     }
-    do_close(&db_file);
+    close_database(&db_file);
 
     return ret;
 }
@@ -204,12 +324,18 @@ int do_create_cmd(int args, char* argv[])
     args -= 2;
     argv += 2;
 
+    // The database of the session cannot be overwritten
+    if (is_session_file(filename)) {
+        return ERR_INVALID_FILENAME;
+    }
+
     // Default values
     uint32_t max_files = FILE_DEFAULT;
     uint16_t x_thumb_res = THUMB_DEFAULT;
     uint16_t y_thumb_res = THUMB_DEFAULT;
     uint16_t x_small_res = SMALL_DEFAULT;
     uint16_t y_small_res = SMALL_DEFAULT;
+    NEW_DATABASE;
 
     // For each command line argument, checks if there are enough arguments
     // remaining, converts the arguments to integers and assigns them to the
@@ -241,6 +367,34 @@ int do_create_cmd(int args, char* argv[])
             args -= 3;
             argv += 3;
             break;
+        case TIER:
+            OPTION_ARG_CHECK(args, 4);
+            if (db_file.header.nb_tiers == MAX_NB_RES - NB_RES
+                || strlen(argv[1]) == 0 || strlen(argv[1]) > MAX_TIER_NAME
+                || resolution_atoi(argv[1], &db_file) != -1) {
+                return ERR_RESOLUTIONS;
+            }
+            struct pictdb_tier* tier = &db_file.tiers[db_file.header.nb_tiers];
+            strncpy(tier->name, argv[1], MAX_TIER_NAME + 1);
+            tier->res[0] = atouint16(argv[2]);
+            tier->res[1] = atouint16(argv[3]);
+            RES_CHECK(tier->res[0], tier->res[1], MAX_TIER_RES);
+            ++db_file.header.nb_tiers;
+            args -= 4;
+            argv += 4;
+            break;
+        case ENCODE:
+            OPTION_ARG_CHECK(args, 3);
+            const int res = resolution_atoi(argv[1], &db_file);
+            if (res == -1 || res == RES_ORIG) {
+                return ERR_RESOLUTIONS;
+            }
+            if (parse_encoding(argv[2], &db_file.encodings[res]) != 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            args -= 3;
+            argv += 3;
+            break;
         case INVALID_OPTION:
             return ERR_INVALID_ARGUMENT;
         }
@@ -249,17 +403,16 @@ int do_create_cmd(int args, char* argv[])
     puts("Create");
 
     // Initialize header and database
-    struct pictdb_header db_header = {
-        .max_files = max_files,
-        .res_resized = { x_thumb_res, y_thumb_res, x_small_res, y_small_res }
-    };
-    struct pictdb_file db_file = {
-        .fpdb = NULL, .header = db_header, .metadata = NULL
-    };
+    db_file.header.max_files = max_files;
+    db_file.header.res_resized[0] = x_thumb_res;
+    db_file.header.res_resized[1] = y_thumb_res;
+    db_file.header.res_resized[2] = x_small_res;
+    db_file.header.res_resized[3] = y_small_res;
 
     int ret = do_create(filename, &db_file);
     if (ret == 0) {
         print_header(&db_file.header);
+        print_tiers(&db_file);
     }
     do_close(&db_file);
 
@@ -273,7 +426,16 @@ int help(int args, char* argv[])
 {
     printf("pictDBM [COMMAND] [ARGUMENTS]\n"
            "  help: displays this help.\n"
-           "  list   <dbfilename>: list pictDB content.\n"
+           "  list   <dbfilename> [options]: list pictDB content.\n"
+           "      with options, only the selected fields of the matching pictures\n"
+           "      are listed, in one pass. options are:\n"
+           "          -format <json|csv|binary>: output format, default is csv.\n"
+           "          -fields <id,res,size,sha,variants|all>: default is id.\n"
+           "          -min_res <X_RES> <Y_RES>, -max_res <X_RES> <Y_RES>:\n"
+           "                                  bounds of the original resolution.\n"
+           "          -has <thumb,small>: resolutions the pictures must have.\n"
+           "          -prefix <PREFIX>: prefix of the pictIDs.\n"
+           "          -cursor <SLOT> -limit <N>: page of the list.\n"
            "  create <dbfilename> [options]: create a new pictDB.\n"
            "      options are:\n"
            "          -max_files <MAX_FILES>: maximum number of files.\n"
@@ -285,17 +447,42 @@ int help(int args, char* argv[])
            "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
            "                                  default value is %dx%d\n"
            "                                  maximum value is %dx%d\n"
-           "  read   <dbfilename> <pictID> [original|orig|thumbnail|thumb|small]:\n"
+           "          -tier <NAME> <X_RES> <Y_RES>: extra resolution, such as\n"
+           "                                  medium 1024 1024; up to %d of them.\n"
+           "                                  maximum value is %dx%d\n"
+           "          -encode <RES> <SETTINGS>: how the images of RES (thumb,\n"
+           "                                  small or a tier given before) are\n"
+           "                                  encoded: default, or comma-separated\n"
+           "                                  q=<1-%d>, strip, progressive and\n"
+           "                                  optimize.\n"
+           "  read   <dbfilename> <pictID> [original|orig|thumbnail|thumb|small|<tier>]:\n"
            "      read an image from the pictDB and save it to a file.\n"
            "      default resolution is \"original\".\n"
+           "      if the pictDB is read-only, resized images go to <dbfilename>.variants.\n"
            "  insert <dbfilename> <pictID> <filename>: insert a new image in the pictDB.\n"
            "  delete <dbfilename> <pictID>: delete picture pictID from pictDB.\n"
            "  gc <dbfilename> <temporarypath>: performs garbage collecting on pictDB.\n"
            "      requires a temporary filename for copying the pictDB.\n"
+           "  import <dbfilename> [-j <THREADS>] <filename>...: insert many images,\n"
+           "      named after their filename without extension.\n"
+           "      files are loaded and hashed by THREADS threads (default: one per CPU).\n"
+           "  verify <dbfilename> [-j <THREADS>] [-rate <MB/s>]: check that the images\n"
+           "      of the pictDB are not corrupted, reading at most MB/s megabytes per\n"
+           "      second (default: no limit).\n"
+           "  reencode <dbfilename> [-j <THREADS>] [-encode <RES> <SETTINGS>]...:\n"
+           "      set the encoding of RES as in create, then encode its resized images\n"
+           "      again in THREADS threads (default: one per CPU). without -encode,\n"
+           "      all the resized images are. the old images are reclaimed by gc.\n"
+           "      a running pictDB_server keeps serving the pictDB meanwhile.\n"
            "  interpretor: launch command line interpretor.\n"
+           "  open <dbfilename>: keep a pictDB open in the interpretor; the next\n"
+           "      commands on <dbfilename> use it instead of reopening it.\n"
+           "  close: close the pictDB kept open by open.\n"
+           "  timing <on|off>: print the duration of each interpretor command.\n"
            "  quit: exit interpretor.\n",
            FILE_DEFAULT, MAX_MAX_FILES, THUMB_DEFAULT, THUMB_DEFAULT, THUMB_MAX,
-           THUMB_MAX, SMALL_DEFAULT, SMALL_DEFAULT, SMALL_MAX, SMALL_MAX);
+           THUMB_MAX, SMALL_DEFAULT, SMALL_DEFAULT, SMALL_MAX, SMALL_MAX,
+           MAX_NB_RES - NB_RES, MAX_TIER_RES, MAX_TIER_RES, MAX_QUALITY);
 
     return 0;
 }
@@ -309,12 +496,12 @@ int do_delete_cmd(int args, char* argv[])
 
     NEW_DATABASE;
 
-    int ret = do_open(argv[1], "rb+", &db_file);
+    int ret = open_database(argv[1], "rb+", &db_file);
     if (ret == 0) {
         puts("Delete");
         ret = do_delete(&db_file, argv[2]);
     }
-    do_close(&db_file);
+    close_database(&db_file);
 
     return ret;
 }
@@ -328,24 +515,17 @@ int do_insert_cmd(int args, char* argv[])
 
     NEW_DATABASE;
 
-    int ret = do_open(argv[1], "rb+", &db_file);
+    int ret = open_database(argv[1], "rb+", &db_file);
     if (ret == 0) {
         ret = db_file.header.num_files < db_file.header.max_files ? 0 :
               ERR_FULL_DATABASE;
     }
     if (ret == 0) {
-        // Store the image read from disk into a buffer
-        char* image_buffer = NULL;
-        size_t image_size = 0;
-        ret = read_image_from_disk(argv[3], &image_buffer, &image_size);
-        if (ret == 0) {
-            // Inserts the image into the database
-            puts("Insert");
-            ret = do_insert(image_buffer, image_size, argv[2], &db_file);
-        }
-        free(image_buffer);
+        // Inserts the image into the database
+        puts("Insert");
+        ret = insert_image_from_disk(argv[3], argv[2], &db_file);
     }
-    do_close(&db_file);
+    close_database(&db_file);
 
     return ret;
 }
@@ -358,12 +538,25 @@ int do_read_cmd(int args, char* argv[])
     ARG_CHECK(args, 3);
 
     NEW_DATABASE;
-    // Default resolution is RES_ORIG if no optional argument is provided
-    int resolution = args > 3 ? resolution_atoi(argv[3]) : RES_ORIG;
+    // Builtin resolutions are checked before opening the database, its tiers
+    // once it is open. Default resolution is RES_ORIG if none is provided.
+    int resolution = args > 3 ? resolution_atoi(argv[3], NULL) : RES_ORIG;
+    const int tier = args > 3 && resolution == -1;
+    if (tier && strlen(argv[3]) > MAX_TIER_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-    // Open the database only if the resolution is valid
-    int ret = resolution != -1 ? do_open(argv[1], "rb+", &db_file) :
-              ERR_INVALID_ARGUMENT;
+    // A database which cannot be written keeps the images it resizes in its
+    // cache file
+    const int read_only = access(argv[1], W_OK) != 0;
+    int ret = open_database(argv[1], read_only ? "rb" : "rb+", &db_file);
+    if (ret == 0 && tier) {
+        resolution = resolution_atoi(argv[3], &db_file);
+        ret = resolution != -1 ? 0 : ERR_INVALID_ARGUMENT;
+    }
+    if (ret == 0 && read_only && !is_session(&db_file)) {
+        ret = do_open_cache(&db_file, argv[1]);
+    }
     if (ret == 0) {
         // Store the image read from the database into a buffer
         char* image_buffer = NULL;
@@ -375,13 +568,14 @@ int do_read_cmd(int args, char* argv[])
             // Create filename by appending the suffix corresponding to
             // the resolution to the pic ID and write the image to disk
             ret = (filename = create_name(argv[2],
-                                          resolution)) == NULL ? ERR_OUT_OF_MEMORY : 0;
+                                          resolution_name(&db_file, resolution)))
+                  == NULL ? ERR_OUT_OF_MEMORY : 0;
             ret = ret == 0 ? write_image_to_disk(filename, image_buffer, image_size) : ret;
             free(filename);
         }
         free(image_buffer);
     }
-    do_close(&db_file);
+    close_database(&db_file);
 
     return ret;
 }
@@ -392,16 +586,341 @@ int do_gc_cmd(int args, char* argv[])
 
     NEW_DATABASE;
 
-    int ret = do_open(argv[1], "rb+", &db_file);
+    int ret = open_database(argv[1], "rb+", &db_file);
+    const int in_session = ret == 0 && is_session(&db_file);
     if (ret == 0) {
         puts("Garbage collecting");
         ret = do_gbcollect(&db_file, argv[1], argv[2]);
     }
-    do_close(&db_file);
+    // gc closes the database unless it fails first: the session then keeps
+    // it, else only its stale handles are left
+    const int reopen = in_session && db_file.fpdb == NULL;
+    close_database(&db_file);
+
+    // The database of the session was closed and replaced by gc
+    if (reopen) {
+        session.fpdb = NULL;
+        session.metadata = NULL;
+        const int err = do_open(session_name, "rb+", &session);
+        if (err != 0) {
+            close_session();
+        }
+        ret = ret == 0 ? err : ret;
+    }
+
+    return ret;
+}
+
+/********************************************************************/ /**
+ * Inserts many images into a database.
+ ********************************************************************** */
+int do_import_cmd(int args, char* argv[])
+{
+    ARG_CHECK(args, 3);
+
+    const char* db_name = argv[1];
+    args -= 2;
+    argv += 2;
+
+    unsigned int nb_threads = 0;
+    if (strcmp(argv[0], "-j") == 0) {
+        OPTION_ARG_CHECK(args, 3);
+        nb_threads = atouint16(argv[1]);
+        if (nb_threads == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        args -= 2;
+        argv += 2;
+    }
+
+    NEW_DATABASE;
+
+    int ret = open_database(db_name, "rb+", &db_file);
+    if (ret == 0) {
+        puts("Import");
+        ret = import_images(args, argv, nb_threads, &db_file);
+    }
+    close_database(&db_file);
+
+    return ret;
+}
+
+/********************************************************************/ /**
+ * Checks the content of a database.
+ ********************************************************************** */
+int do_verify_cmd(int args, char* argv[])
+{
+    ARG_CHECK(args, 2);
+
+    const char* db_name = argv[1];
+    args -= 2;
+    argv += 2;
+
+    unsigned int nb_threads = 0;
+    double rate = 0;
+    while (args > 0) {
+        OPTION_ARG_CHECK(args, 2);
+        if (strcmp(argv[0], "-j") == 0) {
+            nb_threads = atouint16(argv[1]);
+            if (nb_threads == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (strcmp(argv[0], "-rate") == 0) {
+            char* end = NULL;
+            rate = strtod(argv[1], &end);
+            if (end == argv[1] || *end != '\0' || !(rate > 0)) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        args -= 2;
+        argv += 2;
+    }
+
+    NEW_DATABASE;
+    struct verify_report report;
+
+    int ret = open_database(db_name, "rb", &db_file);
+    if (ret == 0) {
+        puts("Verify");
+        ret = do_verify(&db_file, nb_threads, rate, print_corruption,
+                        &db_file, &report);
+    }
+    close_database(&db_file);
+
+    if (ret == 0) {
+        printf("%" PRIu32 " images checked, %" PRIu32 " corrupted, "
+               "%" PRIu64 " bytes read\n",
+               report.checked, report.corrupted, report.bytes_read);
+        ret = report.corrupted > 0 ? ERR_CORRUPTED : 0;
+    }
+
+    return ret;
+}
+
+void print_corruption(const struct pict_metadata* metadata, int resolution,
+                      const char* reason, void* arg)
+{
+    printf("CORRUPTED: %s %s: %s\n", metadata->pict_id,
+           resolution_name(arg, resolution), reason);
+}
+
+/********************************************************************/ /**
+ * Encodes again the resized images of a database.
+ ********************************************************************** */
+int do_reencode_cmd(int args, char* argv[])
+{
+    ARG_CHECK(args, 2);
+
+    const char* db_name = argv[1];
+    args -= 2;
+    argv += 2;
+
+    NEW_DATABASE;
+    struct reencode_report report;
+
+    // The database is needed to know the names of its tiers
+    int ret = open_database(db_name, "rb+", &db_file);
+    struct pictdb_encoding encodings[MAX_NB_RES];
+    memcpy(encodings, db_file.encodings, sizeof(encodings));
+    unsigned int nb_threads = 0;
+    unsigned int resolutions = 0;
+    while (ret == 0 && args > 0) {
+        if (args >= 2 && strcmp(argv[0], "-j") == 0) {
+            nb_threads = atouint16(argv[1]);
+            ret = nb_threads == 0 ? ERR_INVALID_ARGUMENT : 0;
+            args -= 2;
+            argv += 2;
+        } else if (args >= 3 && strcmp(argv[0], "-encode") == 0) {
+            const int res = resolution_atoi(argv[1], &db_file);
+            ret = res == -1 || res == RES_ORIG ? ERR_RESOLUTIONS :
+                  parse_encoding(argv[2], &encodings[res]);
+            resolutions |= ret == 0 ? 1u << res : 0;
+            args -= 3;
+            argv += 3;
+        } else {
+            ret = strcmp(argv[0], "-j") == 0
+                  || strcmp(argv[0], "-encode") == 0 ?
+                  ERR_NOT_ENOUGH_ARGUMENTS : ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (ret == 0 && resolutions != 0) {
+        // Kept in memory only once written
+        struct pictdb_encoding old[MAX_NB_RES];
+        memcpy(old, db_file.encodings, sizeof(old));
+        memcpy(db_file.encodings, encodings, sizeof(encodings));
+        ret = write_encodings(&db_file);
+        if (ret != 0) {
+            memcpy(db_file.encodings, old, sizeof(old));
+        }
+        if (ret == NOT_IMPLEMENTED) {
+            fprintf(stderr, "Error : %s has no room for encodings, "
+                    "run gc on it first\n", db_name);
+        }
+    } else if (ret == 0) {
+        resolutions = ((1u << nb_resolutions(&db_file)) - 1)
+                      & ~(1u << RES_ORIG);
+    }
+    if (ret == 0) {
+        puts("Reencode");
+        print_tiers(&db_file);
+        ret = do_reencode(&db_file, resolutions, nb_threads, &report);
+    }
+    close_database(&db_file);
+
+    if (ret == 0) {
+        printf("%" PRIu32 " resized images encoded again, "
+               "%" PRIu64 " bytes before, %" PRIu64 " bytes after\n",
+               report.reencoded, report.old_bytes, report.new_bytes);
+    }
+
+    return ret;
+}
+
+/********************************************************************/ /**
+ * Keeps a database open for the next commands of the interpretor.
+ ********************************************************************** */
+int do_open_cmd(int args, char* argv[])
+{
+    ARG_CHECK(args, 2);
+
+    close_session();
+    session_name = malloc(strlen(argv[1]) + 1);
+    if (session_name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    strcpy(session_name, argv[1]);
+
+    int ret = do_open(session_name, "rb+", &session);
+    if (ret != 0) {
+        close_session();
+    }
+
+    return ret;
+}
+
+/********************************************************************/ /**
+ * Closes the database kept open by the interpretor.
+ ********************************************************************** */
+int do_close_cmd(int args, char* argv[])
+{
+    ARG_CHECK(args, 1);
+    (void) argv;
+
+    if (session_name == NULL) {
+        puts("No database open");
+    }
+    close_session();
+
+    return 0;
+}
+
+/********************************************************************/ /**
+ * Enables or disables the timing of the commands of the interpretor.
+ ********************************************************************** */
+int do_timing_cmd(int args, char* argv[])
+{
+    ARG_CHECK(args, 2);
+
+    if (strcmp(argv[1], "on") == 0) {
+        timing = 1;
+    } else if (strcmp(argv[1], "off") == 0) {
+        timing = 0;
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return 0;
+}
 
+int parse_list_options(int args, char* argv[], struct list_query* query)
+{
+    int ret = 0;
+    while (ret == 0 && args > 0) {
+        OPTION_ARG_CHECK(args, 2);
+        int used = 2;
+        if (strcmp(argv[0], "-format") == 0) {
+            ret = parse_list_format(argv[1], &query->format);
+        } else if (strcmp(argv[0], "-fields") == 0) {
+            ret = parse_list_fields(argv[1], &query->fields);
+        } else if (strcmp(argv[0], "-has") == 0) {
+            ret = parse_list_variants(argv[1], &query->variants);
+        } else if (strcmp(argv[0], "-prefix") == 0) {
+            query->prefix = argv[1];
+        } else if (strcmp(argv[0], "-cursor") == 0) {
+            query->cursor = atouint32(argv[1]);
+            ret = query->cursor == 0 && strcmp(argv[1], "0") != 0 ?
+                  ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[0], "-limit") == 0) {
+            query->limit = atouint32(argv[1]);
+            ret = query->limit == 0 ? ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[0], "-min_res") == 0
+                   || strcmp(argv[0], "-max_res") == 0) {
+            OPTION_ARG_CHECK(args, 3);
+            uint32_t* res = strcmp(argv[0], "-min_res") == 0 ?
+                            query->min_res : query->max_res;
+            res[0] = atouint32(argv[1]);
+            res[1] = atouint32(argv[2]);
+            used = 3;
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+        args -= used;
+        argv += used;
+    }
     return ret;
 }
 
+void write_to_stdout(const char* data, size_t len, void* arg)
+{
+    (void) arg;
+    fwrite(data, len, 1, stdout);
+}
+
+int open_database(const char* filename, const char* mode,
+                  struct pictdb_file* db_file)
+{
+    if (is_session_file(filename)) {
+        *db_file = session;
+        return 0;
+    }
+    return do_open(filename, mode, db_file);
+}
+
+void close_database(struct pictdb_file* db_file)
+{
+    if (is_session(db_file)) {
+        session = *db_file;
+    } else {
+        do_close(db_file);
+    }
+}
+
+int is_session(const struct pictdb_file* db_file)
+{
+    return session_name != NULL && db_file->fpdb != NULL
+           && db_file->fpdb == session.fpdb;
+}
+
+int is_session_file(const char* filename)
+{
+    struct stat file;
+    struct stat opened;
+    return session_name != NULL && session.fpdb != NULL
+           && stat(filename, &file) == 0
+           && fstat(fileno(session.fpdb), &opened) == 0
+           && file.st_dev == opened.st_dev && file.st_ino == opened.st_ino;
+}
+
+void close_session(void)
+{
+    do_close(&session);
+    free(session_name);
+    session_name = NULL;
+}
+
 int launch_interpretor(int args, char* argv[])
 {
     ARG_CHECK(args, 1);
@@ -450,7 +969,13 @@ int main(int argc, char* argv[])
         { "read", do_read_cmd },
         { "insert", do_insert_cmd },
         { "gc", do_gc_cmd },
+        { "import", do_import_cmd },
+        { "verify", do_verify_cmd },
+        { "reencode", do_reencode_cmd },
         { "interpretor", launch_interpretor },
+        { "open", do_open_cmd },
+        { "close", do_close_cmd },
+        { "timing", do_timing_cmd },
         { "quit", close_interpretor }
     };
 
@@ -460,6 +985,7 @@ int main(int argc, char* argv[])
         --argc;
         ++argv; // skips command call name
         interpretor_state = OFF;
+        timing = 0;
         ret = parse_cmd_line(argc, argv, commands);
     }
 
@@ -467,6 +993,8 @@ int main(int argc, char* argv[])
         ret = interpretor_loop(commands);
     }
 
+    close_session();
+
     if (ret) {
         fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
         (void)help(0, NULL);
@@ -486,7 +1014,15 @@ int interpretor_loop(command_mapping commands[])
 
     if (tmp != NULL && interp_argv != NULL) {
         int interp_args = split(interp_argv, tmp, line, " ", len, MAX_PARAMS);
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
         ret = parse_cmd_line(interp_args, interp_argv, commands);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (timing) {
+            printf("Time: %.3f ms\n", (end.tv_sec - start.tv_sec) * 1e3
+                   + (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
     } else {
         ret = ERR_OUT_OF_MEMORY;
     }
@@ -538,6 +1074,8 @@ int parse_create_options(const char* option)
     return (strcmp(option, "-max_files") == 0) ? MAX_FILES :
            (strcmp(option, "-thumb_res") == 0) ? THUMB_RES :
            (strcmp(option, "-small_res") == 0) ? SMALL_RES :
+           (strcmp(option, "-tier") == 0) ? TIER :
+           (strcmp(option, "-encode") == 0) ? ENCODE :
            INVALID_OPTION;
 }
 
@@ -553,42 +1091,113 @@ int check_values(const uint16_t x_res, const uint16_t y_res,
             || y_res > max_value) ? 1 : 0;
 }
 
-int read_image_from_disk(const char* filename, char** image_buffer,
-                         size_t* image_size)
+int insert_image_from_disk(const char* filename, const char* pict_id,
+                           struct pictdb_file* db_file)
 {
     FILE* image = fopen(filename, "rb");
     if (image == NULL) {
         return ERR_IO;
     }
+
+    long image_size = -1;
     if (fseek(image, 0, SEEK_END) == 0) {
-        *image_size = ftell(image);
-        if (fseek(image, 0, SEEK_SET) == 0) {
-            *image_buffer = malloc(*image_size);
-            if (*image_buffer != NULL) {
-                if (fread(*image_buffer, *image_size, 1, image) == 1) {
-                    fclose(image);
-                    return 0;
-                }
-            }
+        image_size = ftell(image);
+    }
+    int ret = image_size > 0 && fseek(image, 0, SEEK_SET) == 0 ? 0 : ERR_IO;
+
+    // Copy the image to the end of the database, chunk by chunk
+    struct pictdb_upload upload;
+    ret = ret == 0 ? do_reserve(db_file, image_size, &upload) : ret;
+    if (ret == 0) {
+        char chunk[INSERT_CHUNK];
+        size_t bytes_read = 0;
+        ret = do_upload_begin(&upload);
+        while (ret == 0
+               && (bytes_read = fread(chunk, 1, INSERT_CHUNK, image)) > 0) {
+            ret = do_upload_write(db_file, &upload, chunk, bytes_read);
         }
+        ret = ret == 0 && ferror(image) ? ERR_IO : ret;
+        ret = ret == 0 ? do_upload_commit(db_file, &upload, pict_id) : ret;
+        do_release(db_file, &upload);
     }
     fclose(image);
 
-    return ERR_IO;
+    return ret;
+}
+
+int import_images(int nb_files, char* filenames[], unsigned int nb_threads,
+                  struct pictdb_file* db_file)
+{
+    struct hash_job* jobs = calloc(IMPORT_BATCH, sizeof(struct hash_job));
+    if (jobs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = 0;
+    size_t imported = 0;
+    for (int first = 0; first < nb_files; first += IMPORT_BATCH) {
+        size_t nb_jobs = nb_files - first < IMPORT_BATCH ?
+                         (size_t)(nb_files - first) : IMPORT_BATCH;
+        memset(jobs, 0, nb_jobs * sizeof(struct hash_job));
+        for (size_t i = 0; i < nb_jobs; ++i) {
+            jobs[i].filename = filenames[first + i];
+        }
+
+        // Load and hash the whole batch in parallel
+        int err = hash_batch(jobs, nb_jobs, nb_threads);
+        if (err != 0) {
+            fprintf(stderr, "Error : cannot import %s to %s: %s\n",
+                    filenames[first], filenames[first + nb_jobs - 1],
+                    ERROR_MESSAGES[err]);
+            ret = ret == 0 ? err : ret;
+            continue;
+        }
+        for (size_t i = 0; i < nb_jobs; ++i) {
+            char pict_id[MAX_PIC_ID + 1];
+            err = jobs[i].error;
+            err = err != 0 ? err : id_from_filename(jobs[i].filename, pict_id);
+            err = err != 0 ? err : do_insert_hashed(jobs[i].data, jobs[i].size,
+                                                    jobs[i].sha, pict_id,
+                                                    db_file);
+            if (err == 0) {
+                ++imported;
+            } else {
+                fprintf(stderr, "Error : cannot import %s: %s\n",
+                        jobs[i].filename, ERROR_MESSAGES[err]);
+                ret = ret == 0 ? err : ret;
+            }
+            free(jobs[i].data);
+        }
+    }
+    free(jobs);
+
+    printf("%zu image(s) imported\n", imported);
+    return ret;
 }
 
-char* create_name(const char* pict_id, int resolution)
+int id_from_filename(const char* filename, char* pict_id)
 {
-    switch (resolution) {
-    case RES_THUMB:
-        return append_suffix(pict_id, "_thumb.jpg", 11);
-    case RES_SMALL:
-        return append_suffix(pict_id, "_small.jpg", 11);
-    case RES_ORIG:
-        return append_suffix(pict_id, "_orig.jpg", 10);
-    default:
-        return NULL;
+    const char* start = strrchr(filename, '/');
+    start = start == NULL ? filename : start + 1;
+    const char* end = strrchr(start, '.');
+    size_t len = end == NULL || end == start ? strlen(start) :
+                 (size_t)(end - start);
+
+    if (len == 0 || len > MAX_PIC_ID) {
+        return ERR_INVALID_PICID;
     }
+    memcpy(pict_id, start, len);
+    pict_id[len] = '\0';
+    return 0;
+}
+
+char* create_name(const char* pict_id, const char* resolution)
+{
+    // "_" + resolution + ".jpg"
+    char suffix[MAX_TIER_NAME + 6];
+    const int len = snprintf(suffix, sizeof(suffix), "_%s.jpg", resolution);
+    return len < 0 || (size_t) len >= sizeof(suffix) ? NULL :
+           append_suffix(pict_id, suffix, (size_t) len + 1);
 }
 
 char* append_suffix(const char* pict_id, const char* suffix, size_t len)
@@ -6,19 +6,161 @@
  * @author Nicolas Phan Van
  */
 
+#define _DEFAULT_SOURCE // for flock, SO_REUSEPORT, kill and sigaction
+
 #include "pictDB.h"
 #include "mongoose.h"
 #include <vips/vips.h>
 #include "html_msg.h"
+#include "pictDBM_tools.h"
+#include "read_engine.h"
+#include "metrics.h"
+#include "image_content.h"
+#include "resize_cache.h"
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/file.h> // for flock
+#include <sys/wait.h>
+#include <unistd.h>
+#include <json-c/json.h>
 
 #define MAX_QUERY_PARAM 5
+#define LIST_LIMIT      1000 // Default number of pictures of a list page
+#define LIST_MAX        10000 // Maximal number of pictures of a list page
+#define THUMBS_LIMIT    100 // Default number of thumbnails of a page
+#define THUMBS_MAX      1000 // Maximal number of thumbnails of a page
+#define SPRITE_LIMIT    100  // Default number of thumbnails of a sprite sheet
+#define SPRITE_MAX      400  // Maximal number of thumbnails of a sprite sheet
+#define SPRITE_CACHE    8    // Number of sprite sheets kept in memory
+#define VERIFY_RATE     50 // Default read rate of verifications, in MB/s
+#define VERIFY_IDS      16 // Number of corrupted images listed by verify
+#define IDLE_TIMEOUT    30  // Default idle time before closing, in seconds
+#define MAX_REQUESTS    100 // Default number of requests of a connection
+#define MAX_WORKERS     64  // Maximal number of worker processes
+#define RESIZE_BUDGET   64  // Default size of the images resized on demand, in MB
+#define RESIZE_GRID     32  // Default step of their widths and heights, in pixels
+#define MAX_UPLOAD      64  // Default maximal size of an insertion, in MB
 
 // Image database - defined as a global variable to facilitate its use
 // in the different call handlers
 struct pictdb_file* db_file;
+const char* db_filename;          // Name of the database file
 const char* s_http_port = "8000"; // Listening port
 struct mg_serve_http_opts s_http_server_opts;
 int s_sig_received = 0;           // Signal
+uint32_t s_idle_timeout = IDLE_TIMEOUT; // Seconds before closing idle connections
+uint32_t s_max_requests = MAX_REQUESTS; // Requests served per connection
+uint32_t s_workers = 1;           // Processes serving the database
+uint32_t s_read_threads = 0;      // Reading threads, 0 for the default
+int s_read_only = 0;              // Resized images go to the cache file
+uint32_t s_resize_budget = RESIZE_BUDGET; // MB of images resized on demand
+uint32_t s_resize_grid = RESIZE_GRID;     // Step of their dimensions
+uint32_t s_max_upload = MAX_UPLOAD;       // MB of an insertion request
+char* s_resize_dir = NULL;        // Directory of the images resized on demand
+unsigned int s_formats = 0;       // Formats offered besides JPEG, by bit
+struct resize_cache s_resized;    // Images resized on demand by this process
+struct read_engine* s_reads = NULL; // Reads the blobs sent to the clients
+
+struct pending_response;
+
+/**
+ * @brief State of a persistent connection with a client.
+ */
+struct connection {
+    /**
+     * @brief Number of requests received on the connection.
+     */
+    uint32_t requests;
+    /**
+     * @brief Whether the connection is closed after the current response.
+     */
+    int close;
+    /**
+     * @brief Insert request being received, NULL if none.
+     */
+    struct insert_request* insert;
+    /**
+     * @brief The connection, NULL once it is closed.
+     */
+    struct mg_connection* nc;
+    /**
+     * @brief Response waiting for its blobs to be read, NULL if none. The
+     *        state outlives the connection until the reads complete.
+     */
+    struct pending_response* response;
+    /**
+     * @brief Operation of the current request, METRIC_NONE if it is not
+     *        measured or was already recorded.
+     */
+    int op;
+    /**
+     * @brief Resolution read by the current request.
+     */
+    int resolution;
+    /**
+     * @brief Whether the current request had to resize a variant.
+     */
+    int resized;
+    /**
+     * @brief Whether the response to the current request depends on its
+     *        Accept header.
+     */
+    int vary;
+    /**
+     * @brief Start of the current request, in microseconds.
+     */
+    uint64_t started;
+};
+
+/**
+ * @brief A blob sent in a response, read asynchronously.
+ */
+struct response_part {
+    struct blob_read read;
+    struct pending_response* response;
+    char pict_id[MAX_PIC_ID + 1];
+    /**
+     * @brief 0 if the blob was read, an error code otherwise.
+     */
+    int error;
+    /**
+     * @brief Whether the blob was resized when located.
+     */
+    int resized;
+    /**
+     * @brief File descriptor opened for this part only, closed once the
+     *        blob is read, -1 if none.
+     */
+    int fd;
+    /**
+     * @brief Encoding of the blob, an image_format.
+     */
+    int format;
+};
+
+/**
+ * @brief A response to a read or thumbs request, sent once all its blobs
+ *        are read. The connection serves no other request meanwhile, so
+ *        that the responses are sent in the order of the requests.
+ */
+struct pending_response {
+    struct connection* conn;
+    /**
+     * @brief Whether the parts are sent as thumbnail frames, or else as a
+     *        single image.
+     */
+    int frames;
+    /**
+     * @brief The cursor of the next page of thumbnails, max_files if none.
+     */
+    uint32_t next;
+    /**
+     * @brief Number of parts not read yet.
+     */
+    uint32_t remaining;
+    uint32_t nb_parts;
+    struct response_part parts[];
+};
 
 /**
  * @brief Initializes an empty pictdb_file.
@@ -31,11 +173,64 @@ int s_sig_received = 0;           // Signal
 int init_dbfile(int argc, const char* filename);
 
 /**
- * @brief Serves a list request.
+ * @brief Parses the options following the database filename:
+ *        -idle <seconds>, -max_requests <N>, -workers <N>,
+ *        -read_threads <N>, -read_only 1, -resize_cache <MB>,
+ *        -resize_grid <pixels>, -max_upload <MB>, -webp 1 and -avif 1.
+ *        Insertions larger than max_upload are refused. A read-only server
+ *        never writes the database, which may then be on read-only media or
+ *        served by other servers at once: it refuses insertions and
+ *        deletions, and keeps the images it resizes in the cache file of the
+ *        database.
+ *
+ * @param argc The number of options.
+ * @param argv The options.
+ * @return 0 if the options are valid, an error code otherwise.
+ */
+int parse_server_options(int argc, char* argv[]);
+
+/**
+ * @brief Serves a list request. The list is paginated by the 'cursor' and
+ *        'limit' parameters, LIST_LIMIT pictures by default and LIST_MAX at
+ *        most, the next cursor being sent in X-Next-Cursor. It is filtered
+ *        by 'min_width', 'min_height', 'max_width', 'max_height', 'has' and
+ *        'prefix', projected on 'fields' and output as 'format' (see struct
+ *        list_query). It is streamed to the connection.
  *
  * @param nc The Network Connection used to communicate.
+ * @param hm The HTTP message containing the page to list.
+ */
+void handle_list_call(struct mg_connection* nc, struct http_message* hm);
+
+/**
+ * @brief Reads an unsigned integer parameter of a query string.
+ *
+ * @param params The query string.
+ * @param name   The name of the parameter.
+ * @param value  Location where the value will be stored, unchanged if the
+ *               parameter is absent.
+ * @return 0 if the parameter is absent or valid, ERR_INVALID_ARGUMENT
+ *         otherwise.
+ */
+int query_uint32(const struct mg_str* params, const char* name,
+                 uint32_t* value);
+
+/**
+ * @brief Inserts the headers of a response whose body was directly
+ *        appended to the send buffer of a connection.
+ *
+ * @param nc           The Network Connection used to communicate.
+ * @param start        The position of the body in the send buffer.
+ * @param content_type The type of the body.
+ * @param next         The cursor of the next page, max_files if none.
+ */
+void insert_headers(struct mg_connection* nc, size_t start,
+                    const char* content_type, uint32_t next);
+
+/**
+ * @brief A list_writer appending to the send buffer of a connection.
  */
-void handle_list_call(struct mg_connection* nc);
+void send_json(const char* data, size_t len, void* arg);
 
 /**
  * @brief Serves a read request.
@@ -46,14 +241,279 @@ void handle_list_call(struct mg_connection* nc);
 void handle_read_call(struct mg_connection* nc, struct http_message* hm);
 
 /**
- * @brief Serves an insert request.
+ * @brief Tells whether a request reads an image resized on demand, i.e. a
+ *        read request with a 'w' or an 'h' parameter.
+ *
+ * @param hm The HTTP message.
+ * @return 1 if it does, 0 otherwise.
+ */
+int is_resize_request(struct http_message* hm);
+
+/**
+ * @brief Serves an image resized on demand: 'w' and 'h' give the box, one
+ *        of them possibly absent with 'fit=inside' (the default), and 'fit'
+ *        how the image fits in it: inside, or cover to crop it to the box.
  *
  * @param nc The Network Connection used to communicate.
  * @param hm The HTTP message containing information about the image to read.
  */
+void handle_resize_call(struct mg_connection* nc, struct http_message* hm);
+
+/**
+ * @brief Chooses the format of a resized image from the Accept header of a
+ *        request, among the formats offered by the server: the one with
+ *        the highest q-value, the smallest one (AVIF before WebP before
+ *        JPEG) on a tie, JPEG if none is acceptable. Wildcards only stand
+ *        for JPEG.
+ *
+ * @param hm The HTTP message.
+ * @return The format.
+ */
+enum image_format accepted_format(struct http_message* hm);
+
+/**
+ * @brief Locates the smallest image of a part of a response at least as
+ *        large as the box asked for. The box may first be enlarged to the
+ *        next step of the grid, so that close requests share their images:
+ *        the original, a JPEG resolution of the database in between, or
+ *        else an image resized on demand, from the cache if it is there.
+ *
+ * @param part     The part.
+ * @param pict_id  The ID of the picture.
+ * @param width    The width of the box, 0 if unbounded.
+ * @param height   The height of the box, 0 if unbounded.
+ * @param fit      How the image fits in the box.
+ * @param format   The encoding of an image resized on demand.
+ * @param encoding The options of its encoder, NULL for the defaults.
+ * @param grid     Whether the box is enlarged to the grid.
+ * @return 0 if the image was located, an error code otherwise (also stored
+ *         in the part).
+ */
+int locate_resized(struct response_part* part, const char* pict_id,
+                   uint16_t width, uint16_t height, enum resize_fit fit,
+                   enum image_format format,
+                   const struct pictdb_encoding* encoding, int grid);
+
+/**
+ * @brief Gives the resolution of the database to send for a box, if there
+ *        is one of the right size which is already resized.
+ *
+ * @param index   The index of the image.
+ * @param width   The width of the box asked for, 0 if unbounded.
+ * @param height  The height of the box asked for, 0 if unbounded.
+ * @param snapped The width and the height of the box on the grid.
+ * @param fit     How the image fits in the box.
+ * @param format  The format asked for.
+ * @return RES_ORIG if the original fits in the box on the grid, else the
+ *         smallest resolution between the two boxes if JPEG is asked for,
+ *         -1 if there is none.
+ */
+int stored_resolution(uint32_t index, uint16_t width, uint16_t height,
+                      const uint16_t snapped[2], enum resize_fit fit,
+                      enum image_format format);
+
+/**
+ * @brief Computes the ratio of an image fitting inside a box.
+ *
+ * @param metadata The image.
+ * @param width    The width of the box, 0 if unbounded.
+ * @param height   The height of the box, 0 if unbounded.
+ * @return The ratio.
+ */
+double box_ratio(const struct pict_metadata* metadata, uint16_t width,
+                 uint16_t height);
+
+/**
+ * @brief Enlarges a dimension to the next step of the grid.
+ *
+ * @param value The dimension, 0 if unbounded.
+ * @return The dimension on the grid, at most MAX_TIER_RES.
+ */
+uint16_t snap_to_grid(uint16_t value);
+
+/**
+ * @brief Prepares the directory of the images resized on demand, named
+ *        after the database, or a temporary one if it cannot be written.
+ *
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int init_resize_dir(void);
+
+/**
+ * @brief Serves a batch of thumbnails, either of the pict_id listed by the
+ *        'ids' parameter (comma-separated), or of a page of the database
+ *        given by 'cursor' and 'limit' like a list request.
+ *
+ * The body is a sequence of frames, one per picture: the length of the
+ * pict_id on a byte, the pict_id, the size of the thumbnail on 4 bytes
+ * (little-endian, 0 if it could not be read) and the thumbnail.
+ *
+ * @param nc The Network Connection used to communicate.
+ * @param hm The HTTP message containing the thumbnails to send.
+ */
+void handle_thumbs_call(struct mg_connection* nc, struct http_message* hm);
+
+/**
+ * @brief Appends the frame of a thumbnail to the send buffer of a
+ *        connection.
+ *
+ * @param nc   The Network Connection used to communicate.
+ * @param part The thumbnail, empty if it could not be read.
+ */
+void send_thumb_frame(struct mg_connection* nc,
+                      const struct response_part* part);
+
+/**
+ * @brief Allocates a response to a request of a connection.
+ *
+ * @param nc       The Network Connection used to communicate.
+ * @param nb_parts The maximal number of blobs it sends.
+ * @param frames   Whether the blobs are sent as thumbnail frames.
+ * @return The response, NULL if it could not be allocated.
+ */
+struct pending_response* new_response(struct mg_connection* nc,
+                                      uint32_t nb_parts, int frames);
+
+/**
+ * @brief Locates the blob of a part of a response and prepares its read.
+ *
+ * @param part       The part.
+ * @param pict_id    The ID of the picture.
+ * @param index      The index of its metadata, or max_files if it is unknown.
+ * @param resolution The resolution of the blob.
+ * @return 0 if the blob was located, an error code otherwise (also stored
+ *         in the part).
+ */
+int locate_part(struct response_part* part, const char* pict_id,
+                uint32_t index, int resolution);
+
+/**
+ * @brief Submits the reads of the located parts of a response, whose
+ *        connection then waits for them. The response is sent at once if
+ *        there is nothing to read.
+ *
+ * @param nc       The Network Connection used to communicate.
+ * @param response The response, owned by the connection from then on.
+ */
+void submit_response(struct mg_connection* nc,
+                     struct pending_response* response);
+
+/**
+ * @brief Handles the notifications of the read engine: the completed reads
+ *        are matched to their responses.
+ *
+ * @param nc      The connection receiving the notifications.
+ * @param ev      The event code.
+ * @param ev_data Unused.
+ */
+void complete_reads(struct mg_connection* nc, int ev, void* ev_data);
+
+/**
+ * @brief Records that a part of a response was read, and finishes the
+ *        response if it was the last one.
+ *
+ * @param read The completed read of the part.
+ */
+void finish_part(struct blob_read* read);
+
+/**
+ * @brief Sends a response whose blobs are all read, or drops it if its
+ *        connection was closed meanwhile, then frees it.
+ *
+ * @param response The response.
+ */
+void finish_response(struct pending_response* response);
+
+/**
+ * @brief Writes a response whose blobs are all read to its connection.
+ *
+ * @param nc       The Network Connection used to communicate.
+ * @param response The response.
+ */
+void send_response(struct mg_connection* nc,
+                   const struct pending_response* response);
+
+/**
+ * @brief A sprite sheet kept in memory, valid as long as the version of the
+ *        database does not change.
+ */
+struct cached_sprite {
+    uint32_t cursor;
+    uint32_t limit;
+    uint32_t db_version;
+    /**
+     * @brief Time of the last use, for the eviction of the least recently
+     *        used sheet. 0 if the entry is empty.
+     */
+    unsigned long last_use;
+    struct sprite_sheet sheet;
+};
+
+struct cached_sprite s_sprites[SPRITE_CACHE];
+unsigned long s_sprite_clock = 0;
+
+/**
+ * @brief Serves a sprite sheet of the thumbnails of the page given by
+ *        'cursor' and 'limit', or its map.
+ *
+ * @param nc  The Network Connection used to communicate.
+ * @param hm  The HTTP message containing the page.
+ * @param map Whether to send the JSON map instead of the image.
+ */
+void handle_sprite_call(struct mg_connection* nc, struct http_message* hm,
+                        int map);
+
+/**
+ * @brief Gets a sprite sheet from the cache, creating it if it is not there.
+ *
+ * @param cursor The first metadata slot of the page.
+ * @param limit  The maximal number of pictures of the page.
+ * @param sheet  Location where the sheet will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int get_sprite(uint32_t cursor, uint32_t limit,
+               const struct sprite_sheet** sheet);
+
+/**
+ * @brief State of an insert request whose images are streamed
+ *        into the database.
+ */
+struct insert_request {
+    /**
+     * @brief Region of the database receiving the images.
+     */
+    struct pictdb_upload upload;
+    /**
+     * @brief Whether an image is being received.
+     */
+    int receiving;
+    /**
+     * @brief First error that occurred, 0 if none.
+     */
+    int error;
+};
+
+/**
+ * @brief Starts serving an insert request, whose multipart body will be
+ *        streamed into the database.
+ *
+ * @param nc The Network Connection used to communicate.
+ * @param hm The HTTP message, without its body.
+ */
 void handle_insert_call(struct mg_connection* nc,
                         struct http_message* hm);
 
+/**
+ * @brief Handles a part of the body of an insert request: each file of the
+ *        form is written to the database as it is received, then committed.
+ *
+ * @param nc   The Network Connection used to communicate.
+ * @param ev   The multipart event code.
+ * @param part The part being received.
+ */
+void handle_insert_part(struct mg_connection* nc, int ev,
+                        struct mg_http_multipart_part* part);
+
 /**
  * @brief Serves a delete request.
  *
@@ -63,6 +523,67 @@ void handle_insert_call(struct mg_connection* nc,
 void handle_delete_call(struct mg_connection* nc,
                         struct http_message* hm);
 
+/**
+ * @brief State of the background verification of the database.
+ */
+struct verify_status {
+    pthread_mutex_t lock;
+    /**
+     * @brief Whether a verification is running.
+     */
+    int running;
+    /**
+     * @brief Error of the last verification, 0 if none.
+     */
+    int error;
+    /**
+     * @brief Report of the running or last verification, whose counters
+     *        are updated as it goes.
+     */
+    struct verify_report report;
+    /**
+     * @brief The first corrupted images found, each listed once.
+     */
+    char ids[VERIFY_IDS][MAX_PIC_ID + 1];
+    uint32_t nb_ids;
+    /**
+     * @brief Read rate of the running verification, in MB/s.
+     */
+    double rate;
+};
+
+struct verify_status s_verify = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Serves a verify request: a POST starts verifying the database in
+ *        the background, at the read rate given by the 'rate' parameter
+ *        (in MB/s). Any request answers the state of the verification.
+ *
+ * @param nc The Network Connection used to communicate.
+ * @param hm The HTTP message.
+ */
+void handle_verify_call(struct mg_connection* nc, struct http_message* hm);
+
+/**
+ * @brief Verifies the database, through its own handle, so that requests
+ *        are still served meanwhile.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+void* verify_thread(void* arg);
+
+/**
+ * @brief Records a corrupted image found by the background verification.
+ *
+ * @param metadata   The metadata of the image.
+ * @param resolution The corrupted resolution.
+ * @param reason     A description of the corruption.
+ * @param arg        Unused.
+ */
+void record_corruption(const struct pict_metadata* metadata, int resolution,
+                       const char* reason, void* arg);
+
 /**
  * @brief Parses the array containing the uri split results.
  *
@@ -72,6 +593,176 @@ void handle_delete_call(struct mg_connection* nc,
  */
 void parse_uri(char* result[], int* resolution, char** pict_id);
 
+/**
+ * @brief Starts a request on a connection, deciding whether the connection
+ *        is kept alive after the response: it is closed if the client asks
+ *        for it, does not speak HTTP/1.1 without asking for keep-alive, or
+ *        has reached the maximal number of requests.
+ *
+ * @param nc The Network Connection used to communicate.
+ * @param hm The HTTP message of the request.
+ */
+void begin_request(struct mg_connection* nc, struct http_message* hm);
+
+/**
+ * @brief Gives the operation of a request, as measured by the metrics.
+ *
+ * @param hm The HTTP message of the request.
+ * @return The operation, METRIC_NONE for static content and the others.
+ */
+int request_op(struct http_message* hm);
+
+/**
+ * @brief Serves the metrics of the server, in the text format of
+ *        Prometheus: the durations of the requests by operation, the
+ *        durations of the lazy resizes, the cache of sprite sheets, the
+ *        bytes sent, the depths of the queues of this worker and the space
+ *        taken by the database.
+ *
+ * @param nc The Network Connection used to communicate.
+ */
+void handle_metrics_call(struct mg_connection* nc);
+
+/**
+ * @brief Appends a histogram of durations to the send buffer of a
+ *        connection.
+ *
+ * @param nc        The Network Connection used to communicate.
+ * @param name      The name of the metric.
+ * @param labels    Its labels, followed by a comma if not empty.
+ * @param histogram The histogram.
+ */
+void send_histogram(struct mg_connection* nc, const char* name,
+                    const char* labels, const struct histogram* histogram);
+
+/**
+ * @brief Gives the Connection header of the responses of a connection.
+ *
+ * @param nc The Network Connection used to communicate.
+ * @return "Connection: close" if the connection is closed after the
+ *         response, an empty string otherwise.
+ */
+const char* connection_header(struct mg_connection* nc);
+
+/**
+ * @brief Ends a response, closing the connection once it is sent if it is
+ *        not kept alive.
+ *
+ * @param nc The Network Connection used to communicate.
+ */
+void end_response(struct mg_connection* nc);
+
+/**
+ * @brief Closes the connections idle for longer than the idle timeout.
+ *
+ * @param nc The Network Connection being polled.
+ */
+void close_if_idle(struct mg_connection* nc);
+
+/**
+ * @brief Starts the read engine, notifying the event loop through a socket
+ *        pair whose end is handled by complete_reads.
+ *
+ * @param mgr    The event manager.
+ * @param notify Location where the notifying end will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int start_reads(struct mg_mgr* mgr, sock_t* notify);
+
+/**
+ * @brief Stops the read engine once its reads completed, and drops the
+ *        responses left, whose connections are closed.
+ *
+ * @param notify The notifying end of the socket pair.
+ */
+void stop_reads(sock_t notify);
+
+/**
+ * @brief Serves the database in the current process until a signal is
+ *        received.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return 0 if the server ran, an error code otherwise.
+ */
+int serve(int argc, char* argv[]);
+
+/**
+ * @brief Forks s_workers processes serving the database on the same port,
+ *        and waits for them. A signal, or a worker exiting on its own,
+ *        stops them all.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @return 0 if the workers ran, an error code otherwise.
+ */
+int prefork(int argc, char* argv[]);
+
+/**
+ * @brief Creates the listening connection. Workers each have their own
+ *        socket bound to the port with SO_REUSEPORT, the kernel spreading
+ *        the clients among them.
+ *
+ * @param mgr The event manager.
+ * @return The listening connection, NULL on error.
+ */
+struct mg_connection* bind_port(struct mg_mgr* mgr);
+
+/**
+ * @brief Gives the lock a request needs on the database shared with the
+ *        other workers and pictDBM reencode: exclusive if it may write to
+ *        it, shared if it reads it, none otherwise or for a read-only server.
+ *
+ * @param hm The HTTP message of the request.
+ * @return LOCK_EX, LOCK_SH or 0.
+ */
+int request_lock(struct http_message* hm);
+
+/**
+ * @brief Locks the database for a request with the lock it needs. The
+ *        lock is chosen before others stop writing: a request found to
+ *        write once the database is shared locked is locked exclusively.
+ *
+ * @param hm The HTTP message of the request.
+ * @return The operation given to lock_database, for unlock_database.
+ */
+int lock_request(struct http_message* hm);
+
+/**
+ * @brief Tells whether a resolution of the images requested has not been
+ *        created yet, so that reading them would write to the database:
+ *        the image named by pict_id, those named by ids, or else the page
+ *        of the database given by cursor and limit.
+ *
+ * @param hm         The HTTP message of the request.
+ * @param resolution The resolution.
+ * @return 1 if one of the images lacks the resolution, 0 otherwise.
+ */
+int missing_variants(struct http_message* hm, int resolution);
+
+/**
+ * @brief Locks the database shared with other processes, and refreshes the
+ *        header, the encodings and the buffer of the file, which they may
+ *        have changed. Does nothing for a read-only server.
+ *
+ * @param operation LOCK_EX, LOCK_SH or 0 for no lock.
+ */
+void lock_database(int operation);
+
+/**
+ * @brief Writes what was buffered and unlocks the database shared with
+ *        other processes.
+ *
+ * @param operation The operation given to lock_database.
+ */
+void unlock_database(int operation);
+
+/**
+ * @brief Raises the limit on open files to its maximum, each client using
+ *        a socket.
+ */
+void raise_file_limit(void);
+
 /**
  * @brief Sends error messages to clients.
  *
@@ -103,38 +794,733 @@ int init_dbfile(int argc, const char* filename)
     if (db_file != NULL) {
         db_file->fpdb = NULL;
         db_file->metadata = NULL;
-        return argc < 2 ? ERR_NOT_ENOUGH_ARGUMENTS : do_open(filename, "rb+", db_file);
+        db_file->shared = NULL;
+        db_file->cache = NULL;
+        int ret = argc < 2 ? ERR_NOT_ENOUGH_ARGUMENTS :
+                  do_open(filename, s_read_only ? "rb" : "rb+", db_file);
+        return ret == 0 && s_read_only ? do_open_cache(db_file, filename) : ret;
     }
     return ERR_OUT_OF_MEMORY;
 }
 
+int parse_server_options(int argc, char* argv[])
+{
+    while (argc > 0) {
+        if (argc < 2) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        const uint32_t value = atouint32(argv[1]);
+        if (value == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (strcmp(argv[0], "-idle") == 0) {
+            s_idle_timeout = value;
+        } else if (strcmp(argv[0], "-max_requests") == 0) {
+            s_max_requests = value;
+        } else if (strcmp(argv[0], "-workers") == 0 && value <= MAX_WORKERS) {
+            s_workers = value;
+        } else if (strcmp(argv[0], "-read_threads") == 0
+                   && value <= MAX_READ_THREADS) {
+            s_read_threads = value;
+        } else if (strcmp(argv[0], "-read_only") == 0 && value == 1) {
+            s_read_only = 1;
+        } else if (strcmp(argv[0], "-resize_cache") == 0) {
+            s_resize_budget = value;
+        } else if (strcmp(argv[0], "-resize_grid") == 0
+                   && value <= MAX_TIER_RES) {
+            s_resize_grid = value;
+        } else if (strcmp(argv[0], "-max_upload") == 0
+                   && value <= UINT32_MAX / (1024 * 1024)) {
+            s_max_upload = value;
+        } else if (strcmp(argv[0], "-webp") == 0 && value == 1) {
+            s_formats |= 1u << FORMAT_WEBP;
+        } else if (strcmp(argv[0], "-avif") == 0 && value == 1) {
+            s_formats |= 1u << FORMAT_AVIF;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    return 0;
+}
+
+struct mg_connection* bind_port(struct mg_mgr* mgr)
+{
+    if (s_workers <= 1) {
+        return mg_bind(mgr, s_http_port, db_event_handler);
+    }
+
+    const int on = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(atouint16(s_http_port));
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return NULL;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+        || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+        || bind(sock, (struct sockaddr*) &address, sizeof(address)) != 0
+        || listen(sock, SOMAXCONN) != 0) {
+        close(sock);
+        return NULL;
+    }
+
+    struct mg_connection* nc = mg_add_sock(mgr, sock, db_event_handler);
+    if (nc == NULL) {
+        close(sock);
+    } else {
+        nc->flags |= MG_F_LISTENING;
+    }
+    return nc;
+}
+
+int request_lock(struct http_message* hm)
+{
+    if (db_file->shared == NULL) {
+        return 0;
+    }
+    if (mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
+        return LOCK_EX;
+    }
+    if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
+        return LOCK_SH;
+    }
+
+    // Reads create the resolutions they lack
+    int resolution = -1;
+    if (mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
+        char res[16];
+        mg_get_http_var(&hm->query_string, "res", res, sizeof(res));
+        resolution = resolution_atoi(res, db_file);
+    } else if (mg_vcmp(&hm->uri, "/pictDB/thumbs") == 0
+               || mg_vcmp(&hm->uri, "/pictDB/sprite") == 0
+               || mg_vcmp(&hm->uri, "/pictDB/sprite/map") == 0) {
+        resolution = RES_THUMB;
+    } else {
+        return 0; // Static content, or verification with its own handle
+    }
+    return missing_variants(hm, resolution) ? LOCK_EX : LOCK_SH;
+}
+
+int missing_variants(struct http_message* hm, int resolution)
+{
+    if (resolution < 0 || resolution == RES_ORIG
+        || resolution >= nb_resolutions(db_file)) {
+        return 0;
+    }
+
+    const struct mg_str* params = &hm->query_string;
+    char* ids = malloc(params->len + 1);
+    if (ids == NULL) {
+        return 1; // An exclusive lock is always safe
+    }
+    // Without a lock, the answer may change: lock_request asks again
+    int missing = 0;
+    uint32_t index = 0;
+    if (mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
+        missing = mg_get_http_var(params, "pict_id", ids, params->len + 1) > 0
+                  && find_image(ids, db_file, &index) == 0
+                  && variant_size(db_file, index, resolution) == 0;
+    } else if (mg_get_http_var(params, "ids", ids, params->len + 1) > 0) {
+        for (char* id = strtok(ids, ","); id != NULL && !missing;
+             id = strtok(NULL, ",")) {
+            missing = find_image(id, db_file, &index) == 0
+                      && variant_size(db_file, index, resolution) == 0;
+        }
+    } else {
+        uint32_t cursor = 0;
+        uint32_t limit = mg_vcmp(&hm->uri, "/pictDB/thumbs") == 0 ?
+                         THUMBS_LIMIT : SPRITE_LIMIT;
+        // Invalid values are rejected by the handler
+        query_uint32(params, "cursor", &cursor);
+        query_uint32(params, "limit", &limit);
+        for (uint32_t i = cursor; i < db_file->header.max_files && limit > 0
+             && !missing; ++i) {
+            if (db_file->metadata[i].is_valid == NON_EMPTY) {
+                missing = variant_size(db_file, i, resolution) == 0;
+                --limit;
+            }
+        }
+    }
+    free(ids);
+    return missing;
+}
+
+int lock_request(struct http_message* hm)
+{
+    int lock = request_lock(hm);
+    lock_database(lock);
+    // Another process may have removed a variant, or inserted the image,
+    // since it was looked for
+    if (lock == LOCK_SH && request_lock(hm) == LOCK_EX) {
+        unlock_database(lock);
+        lock = LOCK_EX;
+        lock_database(lock);
+    }
+    return lock;
+}
+
+void lock_database(int operation)
+{
+    if (db_file->shared == NULL || operation == 0) {
+        return;
+    }
+    if (flock(fileno(db_file->fpdb), operation) != 0) {
+        perror("flock");
+    }
+    do_refresh_shared(db_file);
+}
+
+void unlock_database(int operation)
+{
+    if (db_file->shared == NULL || operation == 0) {
+        return;
+    }
+    fflush(db_file->fpdb);
+    if (flock(fileno(db_file->fpdb), LOCK_UN) != 0) {
+        perror("flock");
+    }
+}
+
+void raise_file_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+        && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
 void mg_error(struct mg_connection* nc, int error)
 {
+    const struct connection* conn = nc->user_data;
+    struct metrics_shard* shard = metrics_shard();
+    if (conn != NULL && conn->op != METRIC_NONE && shard != NULL) {
+        metrics_add(&shard->errors[conn->op], 1);
+    }
     size_t total = strlen(error_start) + strlen(error_end) + strlen(
-                       ERROR_MESSAGES[error]) + 3;
+                       ERROR_MESSAGES[error]);
     mg_printf(nc,
               "HTTP/1.1 500\r\n"
               "Content-Type: text/html\r\n"
-              "Content-Length: %zu\r\n\r\n%s%s%s",
-              total, error_start, ERROR_MESSAGES[error], error_end);
-    nc->flags |= MG_F_SEND_AND_CLOSE;
+              "Content-Length: %zu\r\n%s\r\n%s%s%s",
+              total, connection_header(nc), error_start,
+              ERROR_MESSAGES[error], error_end);
+    end_response(nc);
+}
+
+void begin_request(struct mg_connection* nc, struct http_message* hm)
+{
+    struct connection* conn = nc->user_data;
+    if (conn == NULL) {
+        return;
+    }
+
+    ++conn->requests;
+    conn->op = request_op(hm);
+    conn->resolution = RES_ORIG;
+    conn->resized = 0;
+    conn->vary = 0;
+    conn->started = metrics_now();
+    const struct mg_str* header = mg_get_http_header(hm, "Connection");
+    const int keep_alive = header != NULL
+                           && mg_vcasecmp(header, "keep-alive") == 0;
+    conn->close = conn->requests >= s_max_requests
+                  || (header != NULL && mg_vcasecmp(header, "close") == 0)
+                  || (mg_vcmp(&hm->proto, "HTTP/1.1") != 0 && !keep_alive);
+}
+
+const char* connection_header(struct mg_connection* nc)
+{
+    const struct connection* conn = nc->user_data;
+    return conn == NULL || conn->close ? "Connection: close\r\n" : "";
+}
+
+void end_response(struct mg_connection* nc)
+{
+    struct connection* conn = nc->user_data;
+    struct metrics_shard* shard = metrics_shard();
+    if (conn != NULL && conn->op != METRIC_NONE && shard != NULL) {
+        // Only the read requests are told apart by resolution
+        const int resolution = conn->op == METRIC_READ
+                               || conn->op == METRIC_THUMBS ?
+                               conn->resolution : RES_THUMB;
+        metrics_observe(&shard->requests[conn->op][resolution][conn->resized],
+                        metrics_now() - conn->started);
+        conn->op = METRIC_NONE;
+    }
+    if (conn == NULL || conn->close) {
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+}
+
+int request_op(struct http_message* hm)
+{
+    if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
+        return METRIC_LIST;
+    } else if (is_resize_request(hm)) {
+        return METRIC_RESIZE;
+    } else if (mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
+        return METRIC_READ;
+    } else if (mg_vcmp(&hm->uri, "/pictDB/thumbs") == 0) {
+        return METRIC_THUMBS;
+    } else if (mg_vcmp(&hm->uri, "/pictDB/sprite") == 0
+               || mg_vcmp(&hm->uri, "/pictDB/sprite/map") == 0) {
+        return METRIC_SPRITE;
+    } else if (mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
+        return METRIC_INSERT;
+    } else if (mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
+        return METRIC_DELETE;
+    }
+    return METRIC_NONE;
+}
+
+void close_if_idle(struct mg_connection* nc)
+{
+    // Connections still sending (e.g. static files), or waiting for the
+    // blobs of a response, are not idle
+    if (!(nc->flags & (MG_F_LISTENING | MG_F_RESPONSE_PENDING))
+        && nc->send_mbuf.len == 0
+        && time(NULL) - nc->last_io_time > (time_t) s_idle_timeout) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    }
+}
+
+void handle_list_call(struct mg_connection* nc, struct http_message* hm)
+{
+    // Large databases are listed a page at a time
+    struct list_query query;
+    init_list_query(&query);
+    query.limit = LIST_LIMIT;
+
+    const struct mg_str* params = &hm->query_string;
+    char prefix[MAX_PIC_ID + 1] = "";
+    char fields[64] = "";
+    char format[16] = "";
+    char variants[16] = "";
+    // A value too long for its buffer is invalid (-2)
+    int err_check =
+        mg_get_http_var(params, "fields", fields, sizeof(fields)) == -2
+        || mg_get_http_var(params, "format", format, sizeof(format)) == -2
+        || mg_get_http_var(params, "has", variants, sizeof(variants)) == -2
+        || mg_get_http_var(params, "prefix", prefix, sizeof(prefix)) == -2 ?
+        ERR_INVALID_ARGUMENT : 0;
+    if (err_check == 0 && fields[0] != '\0') {
+        err_check = parse_list_fields(fields, &query.fields);
+    }
+    if (err_check == 0 && format[0] != '\0') {
+        err_check = parse_list_format(format, &query.format);
+    }
+    if (err_check == 0 && variants[0] != '\0') {
+        err_check = parse_list_variants(variants, &query.variants);
+    }
+    query.prefix = prefix[0] != '\0' ? prefix : NULL;
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "cursor", &query.cursor);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "limit", &query.limit);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "min_width", &query.min_res[0]);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "min_height", &query.min_res[1]);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "max_width", &query.max_res[0]);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "max_height", &query.max_res[1]);
+    if (err_check == 0 && (query.limit == 0 || query.limit > LIST_MAX)) {
+        err_check = ERR_INVALID_ARGUMENT;
+    }
+
+    // The list is written after the data already queued, and its headers
+    // are inserted before it once its length is known
+    const size_t start = nc->send_mbuf.len;
+    uint32_t next = 0;
+    if (err_check == 0) {
+        err_check = do_list_page(db_file, &query, send_json, nc, &next);
+    }
+    if (err_check != 0) {
+        mg_error(nc, err_check);
+        return;
+    }
+
+    static const char* const CONTENT_TYPES[] = {
+        "application/json", "text/csv", "application/octet-stream"
+    };
+    insert_headers(nc, start, CONTENT_TYPES[query.format], next);
+    end_response(nc);
+}
+
+int query_uint32(const struct mg_str* params, const char* name,
+                 uint32_t* value)
+{
+    char str[16];
+    int len = mg_get_http_var(params, name, str, sizeof(str));
+    if (len <= 0) {
+        return len == 0 || len == -1 ? 0 : ERR_INVALID_ARGUMENT;
+    }
+    uint32_t parsed = atouint32(str);
+    if (parsed == 0 && strcmp(str, "0") != 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *value = parsed;
+    return 0;
+}
+
+void insert_headers(struct mg_connection* nc, size_t start,
+                    const char* content_type, uint32_t next)
+{
+    // Caches must not send an image negotiated for another client
+    const struct connection* conn = nc->user_data;
+    char headers[256];
+    int len = snprintf(headers, sizeof(headers),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %zu\r\n%s%s",
+                       content_type, nc->send_mbuf.len - start,
+                       connection_header(nc),
+                       conn != NULL && conn->vary ? "Vary: Accept\r\n" : "");
+    // The next cursor is only given if there is a next page
+    if (next < db_file->header.max_files) {
+        len += snprintf(headers + len, sizeof(headers) - len,
+                        "X-Next-Cursor: %" PRIu32 "\r\n", next);
+    }
+    len += snprintf(headers + len, sizeof(headers) - len, "\r\n");
+    mbuf_insert(&nc->send_mbuf, start, headers, len);
+}
+
+void send_json(const char* data, size_t len, void* arg)
+{
+    mbuf_append(&((struct mg_connection*) arg)->send_mbuf, data, len);
+}
+
+void handle_thumbs_call(struct mg_connection* nc, struct http_message* hm)
+{
+    const struct mg_str* params = &hm->query_string;
+    char* ids = malloc(params->len + 1);
+    if (ids == NULL) {
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+
+    uint32_t cursor = 0;
+    uint32_t limit = THUMBS_LIMIT;
+    int err_check = query_uint32(params, "cursor", &cursor);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "limit", &limit);
+    if (err_check == 0 && (cursor > db_file->header.max_files || limit == 0
+                           || limit > THUMBS_MAX)) {
+        err_check = ERR_INVALID_ARGUMENT;
+    }
+
+    // Each listed pict_id takes at least a comma
+    const int by_ids = err_check == 0
+                       && mg_get_http_var(params, "ids", ids,
+                                          params->len + 1) > 0;
+    uint32_t nb_parts = limit;
+    if (by_ids) {
+        nb_parts = 1;
+        for (const char* c = ids; *c != '\0' && nb_parts < THUMBS_MAX; ++c) {
+            nb_parts += *c == ',';
+        }
+    }
+    struct pending_response* response = err_check != 0 ? NULL :
+                                        new_response(nc, nb_parts, 1);
+    if (err_check == 0 && response == NULL) {
+        err_check = ERR_OUT_OF_MEMORY;
+    }
+    if (err_check != 0) {
+        free(ids);
+        mg_error(nc, err_check);
+        return;
+    }
+
+    // The thumbnails are located now, while the database is locked, and
+    // read in the background
+    response->conn->resolution = RES_THUMB;
+    response->next = db_file->header.max_files;
+    if (by_ids) {
+        for (char* id = strtok(ids, ","); id != NULL
+             && response->nb_parts < nb_parts; id = strtok(NULL, ",")) {
+            locate_part(&response->parts[response->nb_parts++], id,
+                        db_file->header.max_files, RES_THUMB);
+        }
+    } else {
+        uint32_t i = cursor;
+        for (; i < db_file->header.max_files && response->nb_parts < limit;
+             ++i) {
+            if (db_file->metadata[i].is_valid == NON_EMPTY) {
+                locate_part(&response->parts[response->nb_parts++],
+                            db_file->metadata[i].pict_id, i, RES_THUMB);
+            }
+        }
+        while (i < db_file->header.max_files
+               && db_file->metadata[i].is_valid != NON_EMPTY) {
+            ++i;
+        }
+        response->next = i;
+    }
+    free(ids);
+
+    submit_response(nc, response);
+}
+
+void send_thumb_frame(struct mg_connection* nc,
+                      const struct response_part* part)
+{
+    const uint32_t image_size = part->error != 0 ? 0 : part->read.size;
+    const size_t id_len = strnlen(part->pict_id, MAX_PIC_ID);
+    uint8_t frame[1 + MAX_PIC_ID + 4];
+    frame[0] = (uint8_t) id_len;
+    memcpy(&frame[1], part->pict_id, id_len);
+    for (size_t i = 0; i < 4; ++i) {
+        frame[1 + id_len + i] = (uint8_t)(image_size >> (8 * i));
+    }
+    // Sent by mg_send, which readies the connection for the event loop
+    mg_send(nc, frame, (int)(1 + id_len + 4));
+    if (image_size > 0) {
+        mg_send(nc, part->read.data, (int) image_size);
+    }
+}
+
+struct pending_response* new_response(struct mg_connection* nc,
+                                      uint32_t nb_parts, int frames)
+{
+    struct connection* conn = nc->user_data;
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    struct pending_response* response =
+        calloc(1, sizeof(struct pending_response)
+               + nb_parts * sizeof(struct response_part));
+    if (response != NULL) {
+        response->conn = conn;
+        response->frames = frames;
+        for (uint32_t i = 0; i < nb_parts; ++i) {
+            response->parts[i].fd = -1;
+        }
+    }
+    return response;
+}
+
+int locate_part(struct response_part* part, const char* pict_id,
+                uint32_t index, int resolution)
+{
+    strncpy(part->pict_id, pict_id, MAX_PIC_ID);
+    part->response = NULL;
+
+    int err_check = 0;
+    if (index >= db_file->header.max_files) {
+        const size_t id_len = strlen(pict_id);
+        err_check = id_len == 0 || id_len > MAX_PIC_ID ? ERR_INVALID_PICID :
+                    find_image(pict_id, db_file, &index);
+    }
+    // Lazy resizes are timed apart from the requests doing them
+    const struct pict_metadata* metadata = &db_file->metadata[index];
+    part->resized = err_check == 0 && resolution >= 0
+                    && resolution != RES_ORIG
+                    && resolution < nb_resolutions(db_file)
+                    && metadata->is_valid == NON_EMPTY
+                    && (variant_offset(db_file, index, resolution) == 0
+                        || variant_size(db_file, index, resolution) == 0);
+    const uint64_t started = part->resized ? metrics_now() : 0;
+    FILE* file = db_file->fpdb;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    err_check = err_check != 0 ? err_check :
+                do_locate_index(index, resolution, db_file, &file, &offset,
+                                &size);
+    struct metrics_shard* shard = metrics_shard();
+    if (part->resized && err_check == 0 && shard != NULL) {
+        metrics_observe(&shard->resizes[resolution], metrics_now() - started);
+    }
+
+    part->read.fd = fileno(file);
+    part->read.offset = offset;
+    part->read.size = size;
+    part->read.data = NULL;
+    part->read.arg = part;
+    part->error = err_check;
+    return err_check;
+}
+
+void submit_response(struct mg_connection* nc,
+                     struct pending_response* response)
+{
+    // Only the located parts not in memory yet are read
+    struct blob_read* reads = NULL;
+    for (uint32_t i = response->nb_parts; i > 0; --i) {
+        struct response_part* part = &response->parts[i - 1];
+        part->response = response;
+        response->conn->resized |= part->resized;
+        if (part->error == 0 && part->read.data == NULL) {
+            part->read.next = reads;
+            reads = &part->read;
+            ++response->remaining;
+        }
+    }
+
+    // The engine reads the file directly, bypassing its buffer
+    int err_check = 0;
+    if (reads != NULL) {
+        fflush(db_file->fpdb);
+        err_check = read_engine_submit(s_reads, reads);
+    }
+    response->conn->response = response;
+    if (reads == NULL || err_check != 0) {
+        for (uint32_t i = 0; i < response->nb_parts; ++i) {
+            if (response->parts[i].error == 0) {
+                response->parts[i].error = err_check;
+            }
+        }
+        response->remaining = 0;
+        finish_response(response);
+        return;
+    }
+    nc->flags |= MG_F_RESPONSE_PENDING;
+}
+
+void complete_reads(struct mg_connection* nc, int ev, void* ev_data)
+{
+    (void) ev_data;
+    if (ev != MG_EV_RECV) {
+        return;
+    }
+
+    // The bytes received only wake the event loop up
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+    struct blob_read* read = read_engine_completed(s_reads);
+    while (read != NULL) {
+        struct blob_read* next = read->next;
+        finish_part(read);
+        read = next;
+    }
+}
+
+void finish_part(struct blob_read* read)
+{
+    struct response_part* part = read->arg;
+    part->error = read->error;
+    if (--part->response->remaining == 0) {
+        finish_response(part->response);
+    }
+}
+
+void finish_response(struct pending_response* response)
+{
+    struct connection* conn = response->conn;
+    conn->response = NULL;
+    if (conn->nc == NULL) {
+        free(conn);
+    } else {
+        conn->nc->flags &= ~MG_F_RESPONSE_PENDING;
+        send_response(conn->nc, response);
+    }
+
+    for (uint32_t i = 0; i < response->nb_parts; ++i) {
+        free(response->parts[i].read.data);
+        if (response->parts[i].fd >= 0) {
+            close(response->parts[i].fd);
+        }
+    }
+    free(response);
+}
+
+void send_response(struct mg_connection* nc,
+                   const struct pending_response* response)
+{
+    const size_t start = nc->send_mbuf.len;
+    if (response->frames) {
+        for (uint32_t i = 0; i < response->nb_parts; ++i) {
+            send_thumb_frame(nc, &response->parts[i]);
+        }
+        insert_headers(nc, start, "application/octet-stream", response->next);
+        end_response(nc);
+    } else if (response->parts[0].error != 0) {
+        mg_error(nc, response->parts[0].error);
+    } else {
+        mg_send(nc, response->parts[0].read.data, response->parts[0].read.size);
+        insert_headers(nc, start, FORMAT_TYPES[response->parts[0].format],
+                       db_file->header.max_files);
+        end_response(nc);
+    }
+}
+
+void handle_sprite_call(struct mg_connection* nc, struct http_message* hm,
+                        int map)
+{
+    uint32_t cursor = 0;
+    uint32_t limit = SPRITE_LIMIT;
+    int err_check = query_uint32(&hm->query_string, "cursor", &cursor);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(&hm->query_string, "limit", &limit);
+    if (err_check == 0 && (limit == 0 || limit > SPRITE_MAX)) {
+        err_check = ERR_INVALID_ARGUMENT;
+    }
+
+    const struct sprite_sheet* sheet = NULL;
+    err_check = err_check != 0 ? err_check : get_sprite(cursor, limit, &sheet);
+    if (err_check != 0) {
+        mg_error(nc, err_check);
+        return;
+    }
+
+    const size_t start = nc->send_mbuf.len;
+    if (map) {
+        mg_send(nc, sheet->map, strlen(sheet->map));
+    } else {
+        mg_send(nc, sheet->image, sheet->image_size);
+    }
+    insert_headers(nc, start, map ? "application/json" : "image/jpeg",
+                   sheet->next);
+    end_response(nc);
 }
 
-void handle_list_call(struct mg_connection* nc)
+int get_sprite(uint32_t cursor, uint32_t limit,
+               const struct sprite_sheet** sheet)
 {
-    char* json_list = do_list(db_file, JSON);
-    if (json_list == NULL) {
-        mg_error(nc, ERR_IO);
-        return;
+    // Look for the sheet, or else for the least recently used entry
+    struct metrics_shard* shard = metrics_shard();
+    struct cached_sprite* entry = &s_sprites[0];
+    for (size_t i = 0; i < SPRITE_CACHE; ++i) {
+        struct cached_sprite* cached = &s_sprites[i];
+        if (cached->last_use != 0 && cached->cursor == cursor
+            && cached->limit == limit
+            && cached->db_version == db_file->header.db_version) {
+            cached->last_use = ++s_sprite_clock;
+            *sheet = &cached->sheet;
+            if (shard != NULL) {
+                metrics_add(&shard->sprite_hits, 1);
+            }
+            return 0;
+        }
+        if (cached->last_use < entry->last_use) {
+            entry = cached;
+        }
     }
-    size_t msg_length = strlen(json_list);
-    mg_printf(nc,
-              "HTTP/1.1 200 OK\r\n"
-              "Content-Type: application/json\r\n"
-              "Content-Length: %zu\r\n\r\n%s",
-              msg_length, json_list);
-    nc->flags |= MG_F_SEND_AND_CLOSE;
-    free(json_list);
+
+    if (shard != NULL) {
+        metrics_add(&shard->sprite_misses, 1);
+    }
+    free_sprite(&entry->sheet);
+    entry->last_use = 0;
+    int err_check = do_sprite(db_file, cursor, limit, &entry->sheet);
+    if (err_check == 0) {
+        entry->cursor = cursor;
+        entry->limit = limit;
+        entry->db_version = db_file->header.db_version;
+        entry->last_use = ++s_sprite_clock;
+        *sheet = &entry->sheet;
+    }
+    return err_check;
 }
 
 void parse_uri(char* result[], int* resolution, char** pict_id)
@@ -142,7 +1528,7 @@ void parse_uri(char* result[], int* resolution, char** pict_id)
     size_t i = 0;
     while (i < MAX_QUERY_PARAM && result[i] != NULL) {
         if (strcmp(result[i], "res") == 0) {
-            *resolution = resolution_atoi(result[i + 1]);
+            *resolution = resolution_atoi(result[i + 1], db_file);
             i += 2;
         } else if (strcmp(result[i], "pict_id") == 0) {
             char* id = calloc(strlen(result[i + 1]) + 1, sizeof(char));
@@ -163,6 +1549,11 @@ void parse_uri(char* result[], int* resolution, char** pict_id)
 
 void handle_read_call(struct mg_connection* nc, struct http_message* hm)
 {
+    if (is_resize_request(hm)) {
+        handle_resize_call(nc, hm);
+        return;
+    }
+
     char** result = init_result_array(MAX_QUERY_PARAM);
     char* tmp = init_tmp((MAX_PIC_ID + 1) * MAX_QUERY_PARAM);
     if (result == NULL || tmp == NULL) {
@@ -180,23 +1571,33 @@ void handle_read_call(struct mg_connection* nc, struct http_message* hm)
     parse_uri(result, &resolution, &pict_id);
 
     if (resolution != -1 && pict_id != NULL) {
-        char* image_buffer = NULL;
-        uint32_t image_size = 0;
-        int err_check = do_read(pict_id, resolution, &image_buffer,
-                                &image_size, db_file);
-        free(pict_id);
-        if (err_check != 0) {
-            mg_error(nc, err_check);
+        // The originals are always sent as they were inserted
+        const enum image_format format = resolution == RES_ORIG ?
+                                         FORMAT_JPEG : accepted_format(hm);
+        struct connection* conn = nc->user_data;
+        if (conn != NULL) {
+            conn->resolution = resolution;
+            conn->vary = resolution != RES_ORIG && s_formats != 0;
+        }
+        struct pending_response* response = new_response(nc, 1, 0);
+        if (response == NULL) {
+            mg_error(nc, ERR_OUT_OF_MEMORY);
+        } else if (format == FORMAT_JPEG) {
+            response->nb_parts = 1;
+            locate_part(&response->parts[0], pict_id,
+                        db_file->header.max_files, resolution);
+            submit_response(nc, response);
         } else {
-            mg_printf(nc,
-                      "HTTP/1.1 200 OK\r\n"
-                      "Content-Type: image/jpeg\r\n"
-                      "Content-Length: %" PRIu32 "\r\n\r\n",
-                      image_size);
-            mg_send(nc, image_buffer, image_size);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
-        }
-        free(image_buffer);
+            // Encoded from the original, not from the stored JPEG, with
+            // the options of the resolution
+            const uint16_t* max = resolution_max(db_file, resolution);
+            response->nb_parts = 1;
+            locate_resized(&response->parts[0], pict_id, max[0], max[1],
+                           FIT_INSIDE, format, &db_file->encodings[resolution],
+                           0);
+            submit_response(nc, response);
+        }
+        free(pict_id);
     } else {
         mg_error(nc, ERR_INVALID_ARGUMENT);
     }
@@ -208,41 +1609,91 @@ void handle_read_call(struct mg_connection* nc, struct http_message* hm)
 void handle_insert_call(struct mg_connection* nc,
                         struct http_message* hm)
 {
-    int err_check = db_file->header.num_files < db_file->header.max_files ? 0 :
+    int err_check = s_read_only ? ERR_READ_ONLY :
+                    db_file->header.num_files < db_file->header.max_files ? 0 :
                     ERR_FULL_DATABASE;
+    // The size of the body bounds the size of the region to reserve: it is
+    // checked before any space is taken for it
+    if (err_check == 0 && (hm->body.len == (size_t) ~0
+                           || hm->body.len > (size_t) s_max_upload
+                           * 1024 * 1024)) {
+        err_check = ERR_INVALID_ARGUMENT;
+    }
 
+    struct insert_request* request = NULL;
     if (err_check == 0) {
-        char var_name[100];
-        char file_name[MAX_PIC_ID + 1];
-        const char* chunk;
-        size_t chunk_len = 0;
-        size_t n1 = 0;
-        size_t n2 = 0;
-
-        while ((n2 = mg_parse_multipart(hm->body.p + n1,
-                                        hm->body.len - n1,
-                                        var_name, sizeof(var_name),
-                                        file_name, sizeof(file_name),
-                                        &chunk, &chunk_len)) > 0) {
-            printf("var: %s, file_name: %s, size: %zu, chunk: [%.*s]\n",
-                   var_name, file_name, chunk_len, (int) chunk_len, chunk);
-            n1 += n2;
-        }
-
-        err_check = do_insert(chunk, chunk_len, file_name, db_file);
-
-        // Success
-        if (err_check == 0) {
-            mg_printf(nc,
-                      "HTTP/1.1 302 Found\r\n"
-                      "Location: http://localhost:%s/index.html\r\n",
-                      s_http_port);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
-        }
+        request = calloc(1, sizeof(struct insert_request));
+        err_check = request == NULL ? ERR_OUT_OF_MEMORY :
+                    do_reserve(db_file, hm->body.len, &request->upload);
+    }
+
+    struct connection* conn = nc->user_data;
+    if (err_check == 0 && conn == NULL) {
+        do_release(db_file, &request->upload);
+        err_check = ERR_OUT_OF_MEMORY;
     }
 
     if (err_check != 0) {
+        free(request);
+        // The rest of the body is not read: the connection cannot be reused
+        if (conn != NULL) {
+            conn->close = 1;
+        }
         mg_error(nc, err_check);
+    } else {
+        conn->insert = request;
+    }
+}
+
+void handle_insert_part(struct mg_connection* nc, int ev,
+                        struct mg_http_multipart_part* part)
+{
+    struct connection* conn = nc->user_data;
+    struct insert_request* request = conn != NULL ? conn->insert : NULL;
+    if (request == NULL) {
+        return; // Request already answered
+    }
+
+    switch (ev) {
+    case MG_EV_HTTP_PART_BEGIN:
+        // Only the files of the form are images
+        request->receiving = request->error == 0 && part->file_name[0] != '\0';
+        if (request->receiving) {
+            request->error = do_upload_begin(&request->upload);
+        }
+        break;
+    case MG_EV_HTTP_PART_DATA:
+        if (request->receiving && request->error == 0) {
+            request->error = do_upload_write(db_file, &request->upload,
+                                             part->data.p, part->data.len);
+        }
+        break;
+    case MG_EV_HTTP_PART_END:
+        if (request->receiving && request->error == 0 && part->status == 0) {
+            request->error = do_upload_commit(db_file, &request->upload,
+                                              part->file_name);
+        }
+        request->receiving = 0;
+        break;
+    case MG_EV_HTTP_MULTIPART_REQUEST_END:
+        do_release(db_file, &request->upload);
+        if (part->status == 0) {
+            if (request->error == 0) {
+                mg_printf(nc,
+                          "HTTP/1.1 302 Found\r\n"
+                          "Location: http://localhost:%s/index.html\r\n"
+                          "Content-Length: 0\r\n%s\r\n",
+                          s_http_port, connection_header(nc));
+                end_response(nc);
+            } else {
+                mg_error(nc, request->error);
+            }
+        }
+        free(request);
+        conn->insert = NULL;
+        break;
+    default:
+        break;
     }
 }
 
@@ -266,13 +1717,14 @@ void handle_delete_call(struct mg_connection* nc,
     parse_uri(result, &err_check, &pict_id);
 
     if (pict_id != NULL) {
-        err_check = do_delete(db_file, pict_id);
+        err_check = s_read_only ? ERR_READ_ONLY : do_delete(db_file, pict_id);
         if (err_check == 0) {
             mg_printf(nc,
                       "HTTP/1.1 302 Found\r\n"
-                      "Location: http://localhost:%s/index.html\r\n",
-                      s_http_port);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
+                      "Location: http://localhost:%s/index.html\r\n"
+                      "Content-Length: 0\r\n%s\r\n",
+                      s_http_port, connection_header(nc));
+            end_response(nc);
         }
     }
 
@@ -284,6 +1736,530 @@ void handle_delete_call(struct mg_connection* nc,
     free(tmp);
 }
 
+void handle_verify_call(struct mg_connection* nc, struct http_message* hm)
+{
+    int err_check = 0;
+    pthread_mutex_lock(&s_verify.lock);
+    if (mg_vcmp(&hm->method, "POST") == 0 && !s_verify.running) {
+        char rate[32] = "";
+        mg_get_http_var(&hm->query_string, "rate", rate, sizeof(rate));
+        s_verify.rate = rate[0] == '\0' ? VERIFY_RATE : strtod(rate, NULL);
+        pthread_t thread;
+        if (!(s_verify.rate > 0)) {
+            err_check = ERR_INVALID_ARGUMENT;
+        } else {
+            // Not to show the counters of the last verification meanwhile
+            memset(&s_verify.report, 0, sizeof(s_verify.report));
+            err_check = pthread_create(&thread, NULL, verify_thread,
+                                       NULL) != 0 ? ERR_OUT_OF_MEMORY : 0;
+        }
+        if (err_check == 0) {
+            pthread_detach(thread);
+            s_verify.running = 1;
+            s_verify.error = 0;
+            s_verify.nb_ids = 0;
+        }
+    }
+
+    // Stringify the state of the verification
+    struct json_object* ids = json_object_new_array();
+    for (uint32_t i = 0; i < s_verify.nb_ids; ++i) {
+        json_object_array_add(ids, json_object_new_string(s_verify.ids[i]));
+    }
+    // The counters of a running verification grow meanwhile
+    const struct verify_report* report = &s_verify.report;
+    struct json_object* status = json_object_new_object();
+    json_object_object_add(status, "running",
+                           json_object_new_boolean(s_verify.running));
+    json_object_object_add(status, "checked", json_object_new_int64(
+                               __atomic_load_n(&report->checked,
+                                               __ATOMIC_RELAXED)));
+    json_object_object_add(status, "corrupted", json_object_new_int64(
+                               __atomic_load_n(&report->corrupted,
+                                               __ATOMIC_RELAXED)));
+    json_object_object_add(status, "bytes_read", json_object_new_int64(
+                               (int64_t) __atomic_load_n(&report->bytes_read,
+                                       __ATOMIC_RELAXED)));
+    json_object_object_add(status, "error", json_object_new_string(
+                               ERROR_MESSAGES[s_verify.error]));
+    json_object_object_add(status, "Corrupted", ids);
+    pthread_mutex_unlock(&s_verify.lock);
+
+    if (err_check != 0) {
+        mg_error(nc, err_check);
+    } else {
+        const char* json = json_object_to_json_string(status);
+        mg_printf(nc,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: application/json\r\n"
+                  "Content-Length: %zu\r\n%s\r\n%s",
+                  strlen(json), connection_header(nc), json);
+        end_response(nc);
+    }
+    json_object_put(status);
+}
+
+void* verify_thread(void* arg)
+{
+    (void) arg;
+    struct pictdb_file verified = {.fpdb = NULL, .metadata = NULL};
+
+    // The metadata read now is the snapshot being verified. Only this
+    // thread writes the report, which requests read as it grows
+    int ret = do_open(db_filename, "rb", &verified);
+    if (ret == 0) {
+        ret = do_verify(&verified, 0, s_verify.rate, record_corruption, NULL,
+                        &s_verify.report);
+    }
+    do_close(&verified);
+
+    pthread_mutex_lock(&s_verify.lock);
+    s_verify.error = ret;
+    s_verify.running = 0;
+    pthread_mutex_unlock(&s_verify.lock);
+
+    vips_thread_shutdown();
+    return NULL;
+}
+
+void record_corruption(const struct pict_metadata* metadata, int resolution,
+                       const char* reason, void* arg)
+{
+    (void) resolution;
+    (void) reason;
+    (void) arg;
+    // An image may be corrupted in several resolutions
+    pthread_mutex_lock(&s_verify.lock);
+    uint32_t i = 0;
+    while (i < s_verify.nb_ids
+           && strncmp(s_verify.ids[i], metadata->pict_id, MAX_PIC_ID) != 0) {
+        ++i;
+    }
+    if (i == s_verify.nb_ids && i < VERIFY_IDS) {
+        strncpy(s_verify.ids[i], metadata->pict_id, MAX_PIC_ID);
+        s_verify.ids[i][MAX_PIC_ID] = '\0';
+        ++s_verify.nb_ids;
+    }
+    pthread_mutex_unlock(&s_verify.lock);
+}
+
+void handle_metrics_call(struct mg_connection* nc)
+{
+    struct space_usage usage;
+    int err_check = do_space_usage(db_file, &usage);
+    if (err_check != 0) {
+        mg_error(nc, err_check);
+        return;
+    }
+    struct metrics_shard total;
+    metrics_sum(&total);
+
+    // The queues are those of the worker answering
+    size_t connections = 0;
+    size_t pending = 0;
+    size_t queued = 0;
+    for (struct mg_connection* c = mg_next(nc->mgr, NULL); c != NULL;
+         c = mg_next(nc->mgr, c)) {
+        connections += c->user_data != NULL;
+        pending += (c->flags & MG_F_RESPONSE_PENDING) != 0;
+        queued += c->send_mbuf.len;
+    }
+
+    const size_t start = nc->send_mbuf.len;
+    mg_printf(nc, "# HELP pictdb_request_duration_seconds Duration of the "
+              "requests, by operation, resolution and whether a variant "
+              "was resized.\n"
+              "# TYPE pictdb_request_duration_seconds histogram\n");
+    for (size_t op = 0; op < NB_METRIC_OPS; ++op) {
+        for (int res = 0; res < nb_resolutions(db_file); ++res) {
+            for (size_t resized = 0; resized < 2; ++resized) {
+                const struct histogram* histogram =
+                        &total.requests[op][res][resized];
+                if (histogram_count(histogram) == 0) {
+                    continue;
+                }
+                char labels[80];
+                if (op == METRIC_READ || op == METRIC_THUMBS) {
+                    snprintf(labels, sizeof(labels),
+                             "op=\"%s\",res=\"%s\",variant=\"%s\"",
+                             METRIC_OP_NAMES[op],
+                             resolution_name(db_file, res),
+                             resized ? "resized" : "stored");
+                } else if (op == METRIC_RESIZE) {
+                    snprintf(labels, sizeof(labels),
+                             "op=\"%s\",variant=\"%s\"", METRIC_OP_NAMES[op],
+                             resized ? "resized" : "stored");
+                } else {
+                    snprintf(labels, sizeof(labels), "op=\"%s\"",
+                             METRIC_OP_NAMES[op]);
+                }
+                send_histogram(nc, "pictdb_request_duration_seconds", labels,
+                               histogram);
+            }
+        }
+    }
+
+    mg_printf(nc, "# HELP pictdb_request_errors_total Requests answered "
+              "with an error.\n"
+              "# TYPE pictdb_request_errors_total counter\n");
+    for (size_t op = 0; op < NB_METRIC_OPS; ++op) {
+        mg_printf(nc, "pictdb_request_errors_total{op=\"%s\"} %" PRIu64 "\n",
+                  METRIC_OP_NAMES[op], total.errors[op]);
+    }
+
+    mg_printf(nc, "# HELP pictdb_resize_duration_seconds Duration of the "
+              "lazy resizes.\n"
+              "# TYPE pictdb_resize_duration_seconds histogram\n");
+    for (int res = 0; res < nb_resolutions(db_file); ++res) {
+        if (res == RES_ORIG) {
+            continue;
+        }
+        char labels[32];
+        snprintf(labels, sizeof(labels), "res=\"%s\"",
+                 resolution_name(db_file, res));
+        send_histogram(nc, "pictdb_resize_duration_seconds", labels,
+                       &total.resizes[res]);
+    }
+
+    mg_printf(nc,
+              "# HELP pictdb_sprite_cache_requests_total Lookups of the "
+              "cache of sprite sheets.\n"
+              "# TYPE pictdb_sprite_cache_requests_total counter\n"
+              "pictdb_sprite_cache_requests_total{result=\"hit\"} %" PRIu64 "\n"
+              "pictdb_sprite_cache_requests_total{result=\"miss\"} %" PRIu64 "\n"
+              "# HELP pictdb_resize_cache_requests_total Lookups of the "
+              "cache of images resized on demand.\n"
+              "# TYPE pictdb_resize_cache_requests_total counter\n"
+              "pictdb_resize_cache_requests_total{result=\"hit\"} %" PRIu64 "\n"
+              "pictdb_resize_cache_requests_total{result=\"miss\"} %" PRIu64 "\n"
+              "# HELP pictdb_sent_bytes_total Bytes sent to the clients.\n"
+              "# TYPE pictdb_sent_bytes_total counter\n"
+              "pictdb_sent_bytes_total %" PRIu64 "\n"
+              "# HELP pictdb_connections Open client connections.\n"
+              "# TYPE pictdb_connections gauge\n"
+              "pictdb_connections %zu\n"
+              "# HELP pictdb_pending_responses Responses waiting for blobs.\n"
+              "# TYPE pictdb_pending_responses gauge\n"
+              "pictdb_pending_responses %zu\n"
+              "# HELP pictdb_read_queue_depth Blob reads not completed.\n"
+              "# TYPE pictdb_read_queue_depth gauge\n"
+              "pictdb_read_queue_depth %zu\n"
+              "# HELP pictdb_send_queue_bytes Bytes waiting to be sent.\n"
+              "# TYPE pictdb_send_queue_bytes gauge\n"
+              "pictdb_send_queue_bytes %zu\n"
+              "# HELP pictdb_images Images in the database.\n"
+              "# TYPE pictdb_images gauge\n"
+              "pictdb_images %" PRIu32 "\n"
+              "# HELP pictdb_max_images Capacity of the database.\n"
+              "# TYPE pictdb_max_images gauge\n"
+              "pictdb_max_images %" PRIu32 "\n"
+              "# HELP pictdb_file_bytes Size of the database file.\n"
+              "# TYPE pictdb_file_bytes gauge\n"
+              "pictdb_file_bytes %" PRIu64 "\n"
+              "# HELP pictdb_live_bytes Bytes of the file still in use.\n"
+              "# TYPE pictdb_live_bytes gauge\n"
+              "pictdb_live_bytes %" PRIu64 "\n",
+              total.sprite_hits, total.sprite_misses, total.resize_hits,
+              total.resize_misses, total.bytes_sent,
+              connections, pending, read_engine_pending(s_reads), queued,
+              db_file->header.num_files, db_file->header.max_files,
+              usage.file_size, usage.live_bytes);
+
+    insert_headers(nc, start, "text/plain; version=0.0.4",
+                   db_file->header.max_files);
+    end_response(nc);
+}
+
+void send_histogram(struct mg_connection* nc, const char* name,
+                    const char* labels, const struct histogram* histogram)
+{
+    const char* separator = labels[0] != '\0' ? "," : "";
+    uint64_t count = 0;
+    for (size_t i = 0; i < METRIC_BUCKETS; ++i) {
+        count += histogram->buckets[i];
+        mg_printf(nc, "%s_bucket{%s%sle=\"%.6f\"} %" PRIu64 "\n", name, labels,
+                  separator, (double)(1ULL << i) / 1e6, count);
+    }
+    count += histogram->buckets[METRIC_BUCKETS];
+    mg_printf(nc, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n"
+              "%s_sum{%s} %.6f\n"
+              "%s_count{%s} %" PRIu64 "\n",
+              name, labels, separator, count,
+              name, labels, (double) histogram->sum_us / 1e6,
+              name, labels, count);
+}
+
+int is_resize_request(struct http_message* hm)
+{
+    // -1 if the parameter is absent, -2 if it is too long for the buffer
+    char value[2];
+    return mg_vcmp(&hm->uri, "/pictDB/read") == 0
+           && (mg_get_http_var(&hm->query_string, "w", value,
+                               sizeof(value)) != -1
+               || mg_get_http_var(&hm->query_string, "h", value,
+                                  sizeof(value)) != -1);
+}
+
+void handle_resize_call(struct mg_connection* nc, struct http_message* hm)
+{
+    const struct mg_str* params = &hm->query_string;
+    char pict_id[MAX_PIC_ID + 1];
+    char fit_name[8];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    int err_check = query_uint32(params, "w", &width);
+    err_check = err_check != 0 ? err_check :
+                query_uint32(params, "h", &height);
+    const int fit_len = mg_get_http_var(params, "fit", fit_name,
+                                        sizeof(fit_name));
+    const enum resize_fit fit = fit_len == -1
+                                || strcmp(fit_name, "inside") == 0 ?
+                                FIT_INSIDE : FIT_COVER;
+    if (err_check == 0
+        && (width > MAX_TIER_RES || height > MAX_TIER_RES
+            || (width == 0 && height == 0)
+            || (fit_len != -1 && strcmp(fit_name, "inside") != 0
+                && strcmp(fit_name, "cover") != 0)
+            || (fit == FIT_COVER && (width == 0 || height == 0)))) {
+        err_check = ERR_INVALID_ARGUMENT;
+    }
+    if (err_check == 0 && mg_get_http_var(params, "pict_id", pict_id,
+                                          sizeof(pict_id)) <= 0) {
+        err_check = ERR_INVALID_PICID;
+    }
+
+    struct pending_response* response = err_check != 0 ? NULL :
+                                        new_response(nc, 1, 0);
+    if (err_check == 0 && response == NULL) {
+        err_check = ERR_OUT_OF_MEMORY;
+    }
+    if (err_check != 0) {
+        mg_error(nc, err_check);
+        return;
+    }
+    if (response->conn != NULL) {
+        response->conn->vary = s_formats != 0;
+    }
+    response->nb_parts = 1;
+    locate_resized(&response->parts[0], pict_id, (uint16_t) width,
+                   (uint16_t) height, fit, accepted_format(hm), NULL, 1);
+    submit_response(nc, response);
+}
+
+enum image_format accepted_format(struct http_message* hm)
+{
+    const struct mg_str* accept = mg_get_http_header(hm, "Accept");
+    if (accept == NULL || s_formats == 0) {
+        return FORMAT_JPEG;
+    }
+
+    // The q-values of the formats and of image/* and */*, -1 if not listed
+    double quality[NB_FORMATS];
+    for (int format = 0; format < NB_FORMATS; ++format) {
+        quality[format] = -1;
+    }
+    double wildcards[2] = { -1, -1 };
+
+    // One media range at a time, e.g. "image/webp;q=0.9"
+    const char* end = accept->p + accept->len;
+    for (const char* p = accept->p; p < end;) {
+        const char* next = memchr(p, ',', (size_t) (end - p));
+        next = next == NULL ? end : next;
+        while (p < next && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        char range[64];
+        const size_t range_len = (size_t) (next - p);
+        if (range_len < sizeof(range)) {
+            memcpy(range, p, range_len);
+            range[range_len] = '\0';
+            const size_t type_len = strcspn(range, "; \t");
+            const char* q = strstr(range + type_len, "q=");
+            const double value = q == NULL ? 1 : strtod(q + 2, NULL);
+            if (type_len == 7 && mg_ncasecmp(range, "image/*", 7) == 0) {
+                wildcards[0] = value;
+            } else if (type_len == 3 && strncmp(range, "*/*", 3) == 0) {
+                wildcards[1] = value;
+            }
+            for (int format = 0; format < NB_FORMATS; ++format) {
+                if (strlen(FORMAT_TYPES[format]) == type_len
+                    && mg_ncasecmp(range, FORMAT_TYPES[format], type_len) == 0) {
+                    quality[format] = value;
+                }
+            }
+        }
+        p = next + 1;
+    }
+    // The most specific range listing JPEG gives its q-value
+    if (quality[FORMAT_JPEG] < 0) {
+        quality[FORMAT_JPEG] = wildcards[0] >= 0 ? wildcards[0] : wildcards[1];
+    }
+
+    enum image_format best = FORMAT_JPEG;
+    double best_quality = 0;
+    for (int format = NB_FORMATS - 1; format >= 0; --format) {
+        if ((format == FORMAT_JPEG || (s_formats & 1u << format) != 0)
+            && quality[format] > best_quality) {
+            best = (enum image_format) format;
+            best_quality = quality[format];
+        }
+    }
+    return best;
+}
+
+int locate_resized(struct response_part* part, const char* pict_id,
+                   uint16_t width, uint16_t height, enum resize_fit fit,
+                   enum image_format format,
+                   const struct pictdb_encoding* encoding, int grid)
+{
+    static const struct pictdb_encoding defaults = {.quality = 0, .flags = 0};
+    encoding = encoding == NULL ? &defaults : encoding;
+    strncpy(part->pict_id, pict_id, MAX_PIC_ID);
+    part->response = NULL;
+    part->read.fd = -1;
+    part->read.offset = 0;
+    part->read.size = 0;
+    part->read.data = NULL;
+    part->read.arg = part;
+
+    uint32_t index = 0;
+    int err_check = find_image(pict_id, db_file, &index);
+    const uint16_t snapped[2] = {
+        grid ? snap_to_grid(width) : width,
+        grid ? snap_to_grid(height) : height
+    };
+    const int resolution = err_check != 0 ? -1 :
+                           stored_resolution(index, width, height, snapped,
+                                             fit, format);
+    if (err_check != 0 || resolution != -1) {
+        FILE* file = db_file->fpdb;
+        uint64_t offset = 0;
+        uint32_t size = 0;
+        err_check = err_check != 0 ? err_check :
+                    do_locate_index(index, resolution, db_file, &file, &offset,
+                                    &size);
+        part->read.fd = fileno(file);
+        part->read.offset = offset;
+        part->read.size = size;
+        part->error = err_check;
+        return err_check;
+    }
+
+    // Resized on demand, once per box and format
+    struct metrics_shard* shard = metrics_shard();
+    const unsigned char* sha = db_file->metadata[index].SHA;
+    part->format = format;
+    err_check = resize_cache_find(&s_resized, sha, snapped[0], snapped[1], fit,
+                                  format, encoding, &part->fd,
+                                  &part->read.size);
+    if (err_check == 0) {
+        part->read.fd = part->fd;
+        if (shard != NULL) {
+            metrics_add(&shard->resize_hits, 1);
+        }
+    } else if (err_check == ERR_FILE_NOT_FOUND) {
+        if (shard != NULL) {
+            metrics_add(&shard->resize_misses, 1);
+        }
+        void* image = NULL;
+        size_t size = 0;
+        part->resized = 1;
+        err_check = resize_box(db_file, index, snapped[0], snapped[1], fit,
+                               format, encoding, &image, &size);
+        if (err_check == 0 && size >> 32 > 0) {
+            err_check = ERR_INVALID_ARGUMENT;
+        }
+        // Sent from memory: the cache only serves the next requests
+        part->read.data = err_check == 0 ? malloc(size) : NULL;
+        if (err_check == 0 && part->read.data == NULL) {
+            err_check = ERR_OUT_OF_MEMORY;
+        }
+        if (err_check == 0) {
+            memcpy(part->read.data, image, size);
+            part->read.size = (uint32_t) size;
+            resize_cache_add(&s_resized, sha, snapped[0], snapped[1], fit,
+                             format, encoding, image, (uint32_t) size);
+        }
+        g_free(image);
+    }
+    part->error = err_check;
+    return err_check;
+}
+
+int stored_resolution(uint32_t index, uint16_t width, uint16_t height,
+                      const uint16_t snapped[2], enum resize_fit fit,
+                      enum image_format format)
+{
+    const struct pict_metadata* metadata = &db_file->metadata[index];
+    if (fit == FIT_COVER) {
+        // The resolutions of the database are not cropped
+        return snapped[0] >= metadata->res_orig[0]
+               && snapped[1] >= metadata->res_orig[1] ? RES_ORIG : -1;
+    }
+
+    const double max_ratio = box_ratio(metadata, snapped[0], snapped[1]);
+    if (max_ratio >= 1) {
+        return RES_ORIG;
+    }
+    // The resolutions of the database are only stored in JPEG
+    if (format != FORMAT_JPEG) {
+        return -1;
+    }
+    const double min_ratio = box_ratio(metadata, width, height);
+    int best = -1;
+    double best_ratio = max_ratio;
+    for (int res = 0; res < nb_resolutions(db_file); ++res) {
+        if (res == RES_ORIG || variant_size(db_file, index, res) == 0) {
+            continue;
+        }
+        const uint16_t* max = resolution_max(db_file, res);
+        const double ratio = box_ratio(metadata, max[0], max[1]);
+        if (ratio >= min_ratio && ratio <= best_ratio) {
+            best = res;
+            best_ratio = ratio;
+        }
+    }
+    return best;
+}
+
+double box_ratio(const struct pict_metadata* metadata, uint16_t width,
+                 uint16_t height)
+{
+    const double h_shrink = (double) width / metadata->res_orig[0];
+    const double v_shrink = (double) height / metadata->res_orig[1];
+    return width == 0 ? v_shrink : height == 0 ? h_shrink :
+           h_shrink > v_shrink ? v_shrink : h_shrink;
+}
+
+uint16_t snap_to_grid(uint16_t value)
+{
+    const uint32_t snapped = (value + s_resize_grid - 1) / s_resize_grid
+                             * s_resize_grid;
+    return (uint16_t) (snapped < MAX_TIER_RES ? snapped : MAX_TIER_RES);
+}
+
+int init_resize_dir(void)
+{
+    const size_t len = strlen(db_filename) + strlen(RESIZE_CACHE_SUFFIX);
+    s_resize_dir = malloc(len + 1);
+    if (s_resize_dir == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(s_resize_dir, len + 1, "%s%s", db_filename, RESIZE_CACHE_SUFFIX);
+    if (resize_cache_clear(s_resize_dir) == 0
+        && access(s_resize_dir, W_OK) == 0) {
+        return 0;
+    }
+
+    // e.g. next to a database on read-only media
+    free(s_resize_dir);
+    s_resize_dir = strdup("/tmp/pictdb-resized-XXXXXX");
+    if (s_resize_dir == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    return mkdtemp(s_resize_dir) != NULL ? 0 : ERR_IO;
+}
+
 void signal_handler(int sig_num)
 {
     signal(sig_num, signal_handler);
@@ -293,50 +2269,146 @@ void signal_handler(int sig_num)
 void db_event_handler(struct mg_connection* nc, int ev, void* ev_data)
 {
     struct http_message* hm = (struct http_message*) ev_data;
+    struct metrics_shard* shard = metrics_shard();
+    int lock = 0;
 
     switch (ev) {
+    case MG_EV_ACCEPT:
+        nc->user_data = calloc(1, sizeof(struct connection));
+        if (nc->user_data == NULL) {
+            nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        } else {
+            ((struct connection*) nc->user_data)->nc = nc;
+        }
+        break;
+    case MG_EV_CLOSE:
+        if (nc->user_data != NULL) {
+            struct connection* conn = nc->user_data;
+            if (conn->insert != NULL) {
+                lock_database(LOCK_EX);
+                do_release(db_file, &conn->insert->upload);
+                unlock_database(LOCK_EX);
+                free(conn->insert);
+            }
+            // A response being read frees the state once completed
+            conn->nc = NULL;
+            if (conn->response == NULL) {
+                free(conn);
+            }
+            nc->user_data = NULL;
+        }
+        break;
+    case MG_EV_POLL:
+        close_if_idle(nc);
+        break;
+    case MG_EV_SEND:
+        // The data of the event is the number of bytes sent
+        if (shard != NULL && *(int*) ev_data > 0) {
+            metrics_add(&shard->bytes_sent, *(int*) ev_data);
+        }
+        break;
     case MG_EV_HTTP_REQUEST:
+        begin_request(nc, hm);
+        lock = lock_request(hm);
         if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
-            handle_list_call(nc);
+            handle_list_call(nc, hm);
         } else if (mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
             handle_read_call(nc, hm);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/thumbs") == 0) {
+            handle_thumbs_call(nc, hm);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/sprite") == 0) {
+            handle_sprite_call(nc, hm, 0);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/sprite/map") == 0) {
+            handle_sprite_call(nc, hm, 1);
         } else if (mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
-            handle_insert_call(nc, hm);
+            // Images are only accepted as multipart/form-data
+            mg_error(nc, ERR_INVALID_ARGUMENT);
         } else if (mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
             handle_delete_call(nc, hm);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/verify") == 0) {
+            handle_verify_call(nc, hm);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/metrics") == 0) {
+            handle_metrics_call(nc);
         } else {
             mg_serve_http(nc, hm, s_http_server_opts); // Serve static content
         }
+        unlock_database(lock);
+        break;
+    case MG_EV_HTTP_MULTIPART_REQUEST:
+        begin_request(nc, hm);
+        if (mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
+            lock_database(LOCK_EX);
+            handle_insert_call(nc, hm);
+            unlock_database(LOCK_EX);
+        } else {
+            if (nc->user_data != NULL) {
+                ((struct connection*) nc->user_data)->close = 1;
+            }
+            mg_error(nc, ERR_INVALID_COMMAND);
+        }
+        break;
+    case MG_EV_HTTP_PART_BEGIN:
+    case MG_EV_HTTP_PART_DATA:
+    case MG_EV_HTTP_PART_END:
+    case MG_EV_HTTP_MULTIPART_REQUEST_END:
+        // The images are written in regions reserved for the request, only
+        // committing them changes the database
+        lock = ev == MG_EV_HTTP_PART_END
+               || ev == MG_EV_HTTP_MULTIPART_REQUEST_END ? LOCK_EX : 0;
+        lock_database(lock);
+        handle_insert_part(nc, ev, (struct mg_http_multipart_part*) ev_data);
+        unlock_database(lock);
         break;
     default:
         break;
     }
 }
 
-int main(int argc, char* argv[])
+int serve(int argc, char* argv[])
 {
     if (VIPS_INIT(argv[0])) {
         vips_error_exit("Unable to start VIPS");
     }
-
-    int ret = 0;
+    // The clients are only offered the formats libvips can encode
+    for (int format = FORMAT_JPEG + 1; format < NB_FORMATS; ++format) {
+        if ((s_formats & 1u << format) != 0
+            && !format_supported((enum image_format) format)) {
+            fprintf(stderr, "Not offering %s: libvips cannot encode it\n",
+                    FORMAT_TYPES[format]);
+            s_formats &= ~(1u << format);
+        }
+    }
 
     // Initialize and open database
-    ret = init_dbfile(argc, argv[1]);
+    // The workers of a read-only server only share its cache file. A
+    // single process shares the file too, with pictDBM reencode
+    int ret = init_dbfile(argc, argv[1]);
+    if (ret == 0 && !s_read_only) {
+        ret = do_share_metadata(db_file);
+    }
+    // The workers share the directory, prepared before forking them
+    if (ret == 0 && s_workers <= 1) {
+        ret = init_resize_dir();
+    }
+    ret = ret == 0 ? resize_cache_open(&s_resized, s_resize_dir,
+                                       (unsigned long) getpid(),
+                                       (uint64_t) s_resize_budget * 1024 * 1024
+                                       / s_workers) : ret;
 
     if (ret == 0) {
-        print_header(&db_file->header);
-
-        // Initialize signal handler and kill previous one
-        signal(SIGTERM, signal_handler);
-        signal(SIGINT, signal_handler);
+        if (s_workers <= 1) {
+            print_header(&db_file->header);
+            print_tiers(db_file);
+        }
 
         struct mg_mgr mgr;
         struct mg_connection* nc;
+        sock_t notify = INVALID_SOCKET;
 
         // Create listening connection
         mg_mgr_init(&mgr, NULL);
-        nc = mg_bind(&mgr, s_http_port, db_event_handler);
+        ret = start_reads(&mgr, &notify);
+        nc = ret == 0 ? bind_port(&mgr) : NULL;
 
         if (nc != NULL) {
             // Set up HTTP server parameters
@@ -345,29 +2417,172 @@ int main(int argc, char* argv[])
             s_http_server_opts.enable_directory_listing = "yes";
 
             // Listening loop
-            printf("Starting web server on port %s,\nserving %s\n", s_http_port,
-                   s_http_server_opts.document_root);
+            if (s_workers <= 1) {
+                printf("Starting web server on port %s,\nserving %s\n",
+                       s_http_port, s_http_server_opts.document_root);
+                printf("Reading blobs with %s\n", read_engine_backend(s_reads));
+            }
             while (!s_sig_received) {
                 mg_mgr_poll(&mgr, 1000);
             }
             printf("Exiting on signal %d\n", s_sig_received);
-        } else {
+        } else if (ret == 0) {
             fprintf(stderr, "Unable to create web server on port %s\n", s_http_port);
+            ret = ERR_IO;
         }
 
         mg_mgr_free(&mgr);
+        stop_reads(notify);
+    }
+
+    for (size_t i = 0; i < SPRITE_CACHE; ++i) {
+        free_sprite(&s_sprites[i].sheet);
     }
+    resize_cache_close(&s_resized);
 
     // Close database and free the pointer
     do_close(db_file);
     free(db_file);
 
+    vips_shutdown();
+
+    return ret;
+}
+
+int start_reads(struct mg_mgr* mgr, sock_t* notify)
+{
+    sock_t pair[2];
+    if (!mg_socketpair(pair, SOCK_STREAM)) {
+        return ERR_IO;
+    }
+    if (mg_add_sock(mgr, pair[1], complete_reads) == NULL) {
+        closesocket(pair[0]);
+        closesocket(pair[1]);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    *notify = pair[0];
+    int ret = read_engine_start(s_read_threads, pair[0], &s_reads);
+    if (ret != 0) {
+        closesocket(pair[0]);
+        *notify = INVALID_SOCKET;
+    }
+    return ret;
+}
+
+void stop_reads(sock_t notify)
+{
+    // The connections are all closed: the responses are freed unsent
+    struct blob_read* read = read_engine_stop(s_reads);
+    while (read != NULL) {
+        struct blob_read* next = read->next;
+        finish_part(read);
+        read = next;
+    }
+    s_reads = NULL;
+    if (notify != INVALID_SOCKET) {
+        closesocket(notify);
+    }
+}
+
+int prefork(int argc, char* argv[])
+{
+    // Check the database once, before starting the workers
+    int ret = init_dbfile(argc, argv[1]);
+    if (ret == 0) {
+        print_header(&db_file->header);
+        print_tiers(db_file);
+        ret = init_resize_dir();
+    }
+    do_close(db_file);
+    free(db_file);
+    db_file = NULL;
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Signals must interrupt waitpid
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    printf("Starting %" PRIu32 " workers on port %s\n", s_workers, s_http_port);
+    fflush(stdout);
+
+    pid_t workers[MAX_WORKERS];
+    uint32_t running = 0;
+    while (running < s_workers && ret == 0) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            exit(serve(argc, argv));
+        } else if (pid < 0) {
+            perror("fork");
+            ret = ERR_IO;
+        } else {
+            workers[running++] = pid;
+        }
+    }
+
+    int stopping = 0;
+    while (running > 0) {
+        if (!stopping && (ret != 0 || s_sig_received)) {
+            for (uint32_t i = 0; i < s_workers; ++i) {
+                if (workers[i] > 0) {
+                    kill(workers[i], SIGTERM);
+                }
+            }
+            stopping = 1;
+        }
+
+        int status = 0;
+        const pid_t pid = waitpid(-1, &status, 0);
+        for (uint32_t i = 0; pid > 0 && i < s_workers; ++i) {
+            if (workers[i] == pid) {
+                workers[i] = 0;
+                --running;
+            }
+        }
+        if (pid > 0 && !stopping) {
+            fprintf(stderr, "Worker %d exited\n", (int) pid);
+            ret = WIFEXITED(status) && WEXITSTATUS(status) != 0 ?
+                  WEXITSTATUS(status) : ERR_IO;
+        }
+    }
+
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = argc < 2 ? ERR_NOT_ENOUGH_ARGUMENTS :
+              parse_server_options(argc - 2, argv + 2);
+    db_filename = argv[1];
+
+    if (ret == 0) {
+        // Initialize signal handler and kill previous one
+        signal(SIGTERM, signal_handler);
+        signal(SIGINT, signal_handler);
+        raise_file_limit();
+
+        // The workers share the metrics, allocated before forking them
+        ret = metrics_init();
+        if (ret == 0) {
+            ret = s_workers > 1 ? prefork(argc, argv) : serve(argc, argv);
+        }
+        metrics_free();
+    }
+    // Empty once the caches of the workers are closed
+    if (s_resize_dir != NULL) {
+        rmdir(s_resize_dir);
+        free(s_resize_dir);
+    }
+
     // Print error message if there was an error
     if (ret) {
         fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
     }
 
-    vips_shutdown();
-
     return ret;
 }
@@ -0,0 +1,681 @@
+/**
+ * @file pictdbmodule.c
+ * @brief Python module pictdb, over libpictdb, so that scripts use a
+ *        database in-process instead of running pictDBM for each image.
+ *
+ * Built by make python into python/pictdb.so:
+ *
+ *     import pictdb
+ *     with pictdb.open("db", writable=True) as db:
+ *         db.insert("cat", open("cat.jpg", "rb").read())
+ *         thumb = db.read("cat", "thumb")      # bytes
+ *         view = db.view("cat", "orig")        # memoryview, no copy
+ *         for meta in db:
+ *             print(meta.pict_id, meta.width, meta.height)
+ *
+ * The GIL is released while libpictdb runs, so that the reads, resizes and
+ * hashes of several Python threads overlap. A database cannot be closed
+ * while a call on it is running or a view of it is alive.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "libpictdb.h"
+
+/**
+ * @brief A database, as Python object.
+ */
+typedef struct {
+    PyObject_HEAD
+    pictdb* db;
+    /**
+     * @brief Number of calls running without the GIL and of views alive.
+     */
+    Py_ssize_t in_use;
+} DatabaseObject;
+
+/**
+ * @brief An image in the mapping of a database, exported to memoryview.
+ */
+typedef struct {
+    PyObject_HEAD
+    DatabaseObject* owner;
+    struct pictdb_blob blob;
+} BlobObject;
+
+/**
+ * @brief Iterator over the metadata of a database.
+ */
+typedef struct {
+    PyObject_HEAD
+    DatabaseObject* owner;
+    uint32_t cursor;
+} IteratorObject;
+
+static PyObject* s_error = NULL;
+
+// Defined below
+static PyTypeObject s_database_type;
+static PyTypeObject s_blob_type;
+static PyTypeObject s_iterator_type;
+static PyTypeObject s_metadata_type;
+
+static PyStructSequence_Field s_metadata_fields[] = {
+    { "pict_id", "ID of the image" },
+    { "sha", "SHA-256 hash of the image, in hexadecimal" },
+    { "width", "width of the original image" },
+    { "height", "height of the original image" },
+    { "thumb_size", "size of the thumbnail in bytes, 0 if not created yet" },
+    { "small_size", "size of the small image in bytes, 0 if not created yet" },
+    { "orig_size", "size of the original image in bytes" },
+    { NULL, NULL }
+};
+
+static PyStructSequence_Desc s_metadata_desc = {
+    "pictdb.Metadata", "The metadata of an image.", s_metadata_fields, 7
+};
+
+/**
+ * @brief Raises pictdb.Error for a result of libpictdb.
+ *
+ * @param status The result.
+ * @return NULL.
+ */
+static PyObject* raise_status(int status)
+{
+    PyObject* error = PyObject_CallFunction(s_error, "is", status,
+                                            pictdb_strerror(status));
+    if (error != NULL) {
+        PyObject* code = PyLong_FromLong(status);
+        if (code != NULL) {
+            PyObject_SetAttrString(error, "code", code);
+            Py_DECREF(code);
+        }
+        PyErr_SetObject(s_error, error);
+        Py_DECREF(error);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Gives the handle of a database, raising ValueError if closed.
+ *
+ * @param self The database.
+ * @return The handle, NULL if closed.
+ */
+static pictdb* get_db(DatabaseObject* self)
+{
+    if (self->db == NULL) {
+        PyErr_SetString(PyExc_ValueError, "database is closed");
+    }
+    return self->db;
+}
+
+/**
+ * @brief Converts a resolution, "thumb", "small", "orig", the name of a
+ *        tier of the database or a RES_ value.
+ *
+ * @param db         The database.
+ * @param arg        The resolution, NULL for the original one.
+ * @param resolution Location where the resolution will be stored.
+ * @return 0 in case of success, -1 with an exception otherwise.
+ */
+static int parse_resolution(pictdb* db, PyObject* arg, int* resolution)
+{
+    if (arg == NULL) {
+        *resolution = PICTDB_RES_ORIG;
+        return 0;
+    }
+    if (PyLong_Check(arg)) {
+        *resolution = (int) PyLong_AsLong(arg);
+    } else if (PyUnicode_Check(arg)) {
+        const char* name = PyUnicode_AsUTF8(arg);
+        if (name == NULL) {
+            return -1;
+        }
+        *resolution = pictdb_resolution(db, name);
+    } else {
+        *resolution = -1;
+    }
+    // The library checks the values against the tiers of the database
+    if (*resolution < PICTDB_RES_THUMB) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "resolution must be thumb, "
+                            "small, orig or a tier of the database");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wraps a handle into a new Database object.
+ */
+static PyObject* new_database(pictdb* db);
+
+
+/********************************************************************/ /**
+ * Database
+ ********************************************************************** */
+
+static void database_dealloc(DatabaseObject* self)
+{
+    // Views and running calls hold a reference: nothing uses the handle
+    pictdb_close(self->db);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyObject* database_close(DatabaseObject* self, PyObject* unused)
+{
+    (void) unused;
+    if (self->in_use > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                        "database is in use by a call or a view");
+        return NULL;
+    }
+    pictdb_close(self->db);
+    self->db = NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject* database_enter(DatabaseObject* self, PyObject* unused)
+{
+    (void) unused;
+    Py_INCREF(self);
+    return (PyObject*) self;
+}
+
+static PyObject* database_exit(DatabaseObject* self, PyObject* args)
+{
+    (void) args;
+    return database_close(self, NULL);
+}
+
+static PyObject* database_read(DatabaseObject* self, PyObject* args)
+{
+    const char* pict_id = NULL;
+    PyObject* res = NULL;
+    int resolution = 0;
+    pictdb* db = get_db(self);
+    if (db == NULL || !PyArg_ParseTuple(args, "s|O:read", &pict_id, &res)
+        || parse_resolution(db, res, &resolution) != 0) {
+        return NULL;
+    }
+
+    // Get the size (creating the resized image), then read into the bytes
+    PyObject* bytes = NULL;
+    size_t size = 0;
+    int ret = PICTDB_ERR_BUFFER_TOO_SMALL;
+    ++self->in_use;
+    while (ret == PICTDB_ERR_BUFFER_TOO_SMALL) {
+        Py_CLEAR(bytes);
+        if (size > 0) {
+            bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) size);
+            if (bytes == NULL) {
+                --self->in_use;
+                return NULL;
+            }
+        }
+        char* buffer = bytes != NULL ? PyBytes_AS_STRING(bytes) : NULL;
+        const size_t capacity = size;
+        Py_BEGIN_ALLOW_THREADS
+        ret = pictdb_read(db, pict_id, resolution, buffer, capacity, &size);
+        Py_END_ALLOW_THREADS
+    }
+    --self->in_use;
+
+    if (ret != PICTDB_OK) {
+        Py_XDECREF(bytes);
+        return raise_status(ret);
+    }
+    return bytes;
+}
+
+static PyObject* database_view(DatabaseObject* self, PyObject* args)
+{
+    const char* pict_id = NULL;
+    PyObject* res = NULL;
+    int resolution = 0;
+    pictdb* db = get_db(self);
+    if (db == NULL || !PyArg_ParseTuple(args, "s|O:view", &pict_id, &res)
+        || parse_resolution(db, res, &resolution) != 0) {
+        return NULL;
+    }
+
+    struct pictdb_blob blob;
+    int ret = 0;
+    ++self->in_use;
+    Py_BEGIN_ALLOW_THREADS
+    ret = pictdb_lookup(db, pict_id, resolution, &blob);
+    Py_END_ALLOW_THREADS
+    --self->in_use;
+    if (ret != PICTDB_OK) {
+        return raise_status(ret);
+    }
+
+    BlobObject* exported = PyObject_New(BlobObject, &s_blob_type);
+    if (exported == NULL) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    exported->owner = self;
+    exported->blob = blob;
+    ++self->in_use;
+
+    // The memoryview keeps the blob, and so the database, alive
+    PyObject* view = PyMemoryView_FromObject((PyObject*) exported);
+    Py_DECREF(exported);
+    return view;
+}
+
+static PyObject* database_insert(DatabaseObject* self, PyObject* args)
+{
+    const char* pict_id = NULL;
+    Py_buffer data;
+    pictdb* db = get_db(self);
+    if (db == NULL || !PyArg_ParseTuple(args, "sy*:insert", &pict_id, &data)) {
+        return NULL;
+    }
+
+    const struct pictdb_image image = {
+        .pict_id = pict_id, .data = data.buf, .size = (size_t) data.len
+    };
+    int ret = 0;
+    ++self->in_use;
+    Py_BEGIN_ALLOW_THREADS
+    ret = pictdb_insert_batch(db, &image, 1, NULL, 1);
+    Py_END_ALLOW_THREADS
+    --self->in_use;
+    PyBuffer_Release(&data);
+
+    if (ret != PICTDB_OK) {
+        return raise_status(ret);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* database_insert_many(DatabaseObject* self, PyObject* args,
+                                      PyObject* kwargs)
+{
+    static char* keywords[] = { "images", "threads", NULL };
+    PyObject* items = NULL;
+    unsigned int nb_threads = 0;
+    pictdb* db = get_db(self);
+    if (db == NULL || !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                                   "O|I:insert_many",
+                                                   keywords, &items,
+                                                   &nb_threads)) {
+        return NULL;
+    }
+
+    // Keep the items, whose IDs and buffers are used without the GIL
+    PyObject* sequence = PySequence_Fast(items, "images must be iterable");
+    if (sequence == NULL) {
+        return NULL;
+    }
+    const Py_ssize_t count = PySequence_Fast_GET_SIZE(sequence);
+    struct pictdb_image* images = PyMem_Calloc(count + 1,
+                                  sizeof(struct pictdb_image));
+    Py_buffer* buffers = PyMem_Calloc(count + 1, sizeof(Py_buffer));
+    int* results = PyMem_Calloc(count + 1, sizeof(int));
+    Py_ssize_t parsed = 0;
+    int ok = images != NULL && buffers != NULL && results != NULL;
+    if (!ok) {
+        PyErr_NoMemory();
+    }
+    for (; ok && parsed < count; ++parsed) {
+        // The ID stays owned by the item, kept by the sequence
+        PyObject* pair = PySequence_Tuple(PySequence_Fast_GET_ITEM(sequence,
+                                          parsed));
+        ok = pair != NULL && PyArg_ParseTuple(pair, "sy*:insert_many",
+                                              &images[parsed].pict_id,
+                                              &buffers[parsed]);
+        Py_XDECREF(pair);
+        images[parsed].data = buffers[parsed].buf;
+        images[parsed].size = (size_t) buffers[parsed].len;
+    }
+    parsed -= ok ? 0 : 1; // The failed item holds no buffer
+
+    PyObject* list = NULL;
+    if (ok) {
+        int ret = 0;
+        ++self->in_use;
+        Py_BEGIN_ALLOW_THREADS
+        ret = pictdb_insert_batch(db, images, (size_t) count, results,
+                                  nb_threads);
+        Py_END_ALLOW_THREADS
+        --self->in_use;
+        list = PyList_New(count);
+        for (Py_ssize_t i = 0; list != NULL && i < count; ++i) {
+            PyList_SET_ITEM(list, i, PyLong_FromLong(ret == PICTDB_OK ? 0 :
+                                                     results[i]));
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < parsed; ++i) {
+        PyBuffer_Release(&buffers[i]);
+    }
+    PyMem_Free(results);
+    PyMem_Free(buffers);
+    PyMem_Free(images);
+    Py_DECREF(sequence);
+    return list;
+}
+
+static PyObject* database_delete(DatabaseObject* self, PyObject* args)
+{
+    const char* pict_id = NULL;
+    pictdb* db = get_db(self);
+    if (db == NULL || !PyArg_ParseTuple(args, "s:delete", &pict_id)) {
+        return NULL;
+    }
+
+    int ret = 0;
+    ++self->in_use;
+    Py_BEGIN_ALLOW_THREADS
+    ret = pictdb_delete(db, pict_id);
+    Py_END_ALLOW_THREADS
+    --self->in_use;
+    if (ret != PICTDB_OK) {
+        return raise_status(ret);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* database_iter(DatabaseObject* self)
+{
+    if (get_db(self) == NULL) {
+        return NULL;
+    }
+    IteratorObject* iterator = PyObject_New(IteratorObject, &s_iterator_type);
+    if (iterator == NULL) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    iterator->owner = self;
+    iterator->cursor = 0;
+    return (PyObject*) iterator;
+}
+
+static PyMethodDef s_database_methods[] = {
+    {
+        "read", (PyCFunction) database_read, METH_VARARGS,
+        "read(pict_id, res='orig') -> bytes\n\n"
+        "Reads an image, creating the resized image first if need be.\n"
+        "res is thumb, small, orig or a tier of the database, e.g. medium."
+    },
+    {
+        "view", (PyCFunction) database_view, METH_VARARGS,
+        "view(pict_id, res='orig') -> memoryview\n\n"
+        "Gives a read-only view of an image in the database file, without\n"
+        "copying it. The database cannot be closed while the view lives."
+    },
+    {
+        "insert", (PyCFunction) database_insert, METH_VARARGS,
+        "insert(pict_id, data)\n\nInserts a JPEG image."
+    },
+    {
+        "insert_many", (PyCFunction)(void(*)(void)) database_insert_many,
+        METH_VARARGS | METH_KEYWORDS,
+        "insert_many(images, threads=0) -> list\n\n"
+        "Inserts (pict_id, data) pairs, hashing them on several threads\n"
+        "(0 for one per CPU). Gives the result of each insertion: 0, or the\n"
+        "code of the error."
+    },
+    {
+        "delete", (PyCFunction) database_delete, METH_VARARGS,
+        "delete(pict_id)\n\nDeletes an image."
+    },
+    {
+        "close", (PyCFunction) database_close, METH_NOARGS,
+        "close()\n\nCloses the database."
+    },
+    { "__enter__", (PyCFunction) database_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction) database_exit, METH_VARARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject s_database_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pictdb.Database",
+    .tp_doc = "An open pictDB database, iterable over its metadata.",
+    .tp_basicsize = sizeof(DatabaseObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) database_dealloc,
+    .tp_iter = (getiterfunc) database_iter,
+    .tp_methods = s_database_methods,
+};
+
+static PyObject* new_database(pictdb* db)
+{
+    DatabaseObject* self = PyObject_New(DatabaseObject, &s_database_type);
+    if (self == NULL) {
+        pictdb_close(db);
+        return NULL;
+    }
+    self->db = db;
+    self->in_use = 0;
+    return (PyObject*) self;
+}
+
+
+/********************************************************************/ /**
+ * Blob
+ ********************************************************************** */
+
+static void blob_dealloc(BlobObject* self)
+{
+    --self->owner->in_use;
+    Py_DECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int blob_getbuffer(BlobObject* self, Py_buffer* view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject*) self, (void*) self->blob.data,
+                             (Py_ssize_t) self->blob.size, 1, flags);
+}
+
+static PyBufferProcs s_blob_buffer = {
+    .bf_getbuffer = (getbufferproc) blob_getbuffer,
+};
+
+static PyTypeObject s_blob_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pictdb.Blob",
+    .tp_basicsize = sizeof(BlobObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) blob_dealloc,
+    .tp_as_buffer = &s_blob_buffer,
+};
+
+
+/********************************************************************/ /**
+ * Iterator
+ ********************************************************************** */
+
+static void iterator_dealloc(IteratorObject* self)
+{
+    Py_DECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyObject* iterator_next(IteratorObject* self)
+{
+    pictdb* db = get_db(self->owner);
+    if (db == NULL) {
+        return NULL;
+    }
+
+    // Only reads the metadata in memory: the GIL is kept
+    struct pictdb_info info;
+    const int ret = pictdb_next(db, &self->cursor, &info);
+    if (ret == PICTDB_ERR_FILE_NOT_FOUND) {
+        return NULL; // StopIteration
+    }
+    if (ret != PICTDB_OK) {
+        return raise_status(ret);
+    }
+
+    char sha[2 * PICTDB_SHA_LENGTH + 1];
+    for (size_t i = 0; i < PICTDB_SHA_LENGTH; ++i) {
+        snprintf(&sha[2 * i], 3, "%02x", info.sha[i]);
+    }
+    PyObject* metadata = PyStructSequence_New(&s_metadata_type);
+    if (metadata == NULL) {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(metadata, 0, PyUnicode_FromString(info.pict_id));
+    PyStructSequence_SET_ITEM(metadata, 1, PyUnicode_FromString(sha));
+    PyStructSequence_SET_ITEM(metadata, 2, PyLong_FromUnsignedLong(info.width));
+    PyStructSequence_SET_ITEM(metadata, 3,
+                              PyLong_FromUnsignedLong(info.height));
+    for (int res = 0; res < 3; ++res) {
+        PyStructSequence_SET_ITEM(metadata, 4 + res,
+                                  PyLong_FromUnsignedLong(info.size[res]));
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(metadata);
+        return NULL;
+    }
+    return metadata;
+}
+
+static PyTypeObject s_iterator_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pictdb.Iterator",
+    .tp_basicsize = sizeof(IteratorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) iterator_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) iterator_next,
+};
+
+
+/********************************************************************/ /**
+ * Module
+ ********************************************************************** */
+
+static PyObject* module_open(PyObject* module, PyObject* args,
+                             PyObject* kwargs)
+{
+    (void) module;
+    static char* keywords[] = { "filename", "writable", NULL };
+    const char* filename = NULL;
+    int writable = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|p:open", keywords,
+                                     &filename, &writable)) {
+        return NULL;
+    }
+
+    pictdb* db = NULL;
+    int ret = 0;
+    Py_BEGIN_ALLOW_THREADS
+    ret = pictdb_open(filename, writable ? PICTDB_READ_WRITE :
+                      PICTDB_READ_ONLY, &db);
+    Py_END_ALLOW_THREADS
+    return ret == PICTDB_OK ? new_database(db) : raise_status(ret);
+}
+
+static PyObject* module_create(PyObject* module, PyObject* args,
+                               PyObject* kwargs)
+{
+    (void) module;
+    static char* keywords[] = { "filename", "max_files", "thumb", "small",
+                                NULL
+                              };
+    const char* filename = NULL;
+    unsigned int max_files = 10;
+    uint16_t res[4] = { 64, 64, 256, 256 };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|I(HH)(HH):create",
+                                     keywords, &filename, &max_files,
+                                     &res[0], &res[1], &res[2], &res[3])) {
+        return NULL;
+    }
+
+    pictdb* db = NULL;
+    int ret = 0;
+    Py_BEGIN_ALLOW_THREADS
+    ret = pictdb_create(filename, max_files, res, &db);
+    Py_END_ALLOW_THREADS
+    return ret == PICTDB_OK ? new_database(db) : raise_status(ret);
+}
+
+static PyMethodDef s_module_methods[] = {
+    {
+        "open", (PyCFunction)(void(*)(void)) module_open,
+        METH_VARARGS | METH_KEYWORDS,
+        "open(filename, writable=False) -> Database\n\n"
+        "Opens a database. A read-only one is never written: the images it\n"
+        "resizes go to the filename.variants cache file instead."
+    },
+    {
+        "create", (PyCFunction)(void(*)(void)) module_create,
+        METH_VARARGS | METH_KEYWORDS,
+        "create(filename, max_files=10, thumb=(64, 64), small=(256, 256))"
+        " -> Database\n\n"
+        "Creates an empty database, replacing any file of the same name,\n"
+        "and opens it for writing."
+    },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef s_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "pictdb",
+    .m_doc = "In-process access to pictDB databases, through libpictdb.",
+    .m_size = -1,
+    .m_methods = s_module_methods,
+};
+
+PyMODINIT_FUNC PyInit_pictdb(void)
+{
+    if (PyType_Ready(&s_database_type) < 0 || PyType_Ready(&s_blob_type) < 0
+        || PyType_Ready(&s_iterator_type) < 0
+        || (s_metadata_type.tp_name == NULL
+            && PyStructSequence_InitType2(&s_metadata_type,
+                                          &s_metadata_desc) < 0)) {
+        return NULL;
+    }
+
+    PyObject* module = PyModule_Create(&s_module);
+    if (module == NULL) {
+        return NULL;
+    }
+    s_error = PyErr_NewExceptionWithDoc("pictdb.Error",
+                                        "An error of libpictdb, its result "
+                                        "in code.", NULL, NULL);
+    char version[16];
+    const unsigned int number = pictdb_version();
+    snprintf(version, sizeof(version), "%u.%u.%u", number / 10000,
+             number / 100 % 100, number % 100);
+
+    Py_XINCREF(s_error);
+    Py_INCREF(&s_database_type);
+    Py_INCREF(&s_metadata_type);
+    if (s_error == NULL
+        || PyModule_AddObject(module, "Error", s_error) < 0
+        || PyModule_AddObject(module, "Database",
+                              (PyObject*) &s_database_type) < 0
+        || PyModule_AddObject(module, "Metadata",
+                              (PyObject*) &s_metadata_type) < 0
+        || PyModule_AddStringConstant(module, "__version__", version) < 0
+        || PyModule_AddIntConstant(module, "RES_THUMB", PICTDB_RES_THUMB) < 0
+        || PyModule_AddIntConstant(module, "RES_SMALL", PICTDB_RES_SMALL) < 0
+        || PyModule_AddIntConstant(module, "RES_ORIG", PICTDB_RES_ORIG) < 0
+        || PyModule_AddIntConstant(module, "ERR_FILE_NOT_FOUND",
+                                   PICTDB_ERR_FILE_NOT_FOUND) < 0
+        || PyModule_AddIntConstant(module, "ERR_DUPLICATE_ID",
+                                   PICTDB_ERR_DUPLICATE_ID) < 0
+        || PyModule_AddIntConstant(module, "ERR_FULL_DATABASE",
+                                   PICTDB_ERR_FULL_DATABASE) < 0
+        || PyModule_AddIntConstant(module, "ERR_INVALID_PICID",
+                                   PICTDB_ERR_INVALID_PICID) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,640 @@
+/**
+ * @file read_engine.c
+ * @brief Asynchronous reads of blobs, so that a slow disk does not block
+ *        the caller.
+ *
+ * Reads are queued, then run by a pool of threads with pread or, when built
+ * with PICTDB_IO_URING, handed to the kernel through an io_uring: the reads
+ * of many requests are then in flight at once and the disk may reorder them.
+ * Completed reads are queued in turn, and a byte on the notification socket
+ * tells the caller to take them.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _DEFAULT_SOURCE // for pread and syscall
+
+#include "read_engine.h"
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef PICTDB_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define RING_ENTRIES 256 // Number of reads in flight in the io_uring
+#define PROBE_OPS    256 // Number of operations asked to the io_uring probe
+
+#ifdef PICTDB_IO_URING
+/**
+ * @brief The rings shared with the kernel, mapped as described by
+ *        io_uring_setup(2).
+ */
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /**
+     * @brief Number of reads submitted to the kernel and not completed.
+     */
+    unsigned int in_flight;
+};
+#endif
+
+struct read_engine {
+    pthread_mutex_t lock;
+    /**
+     * @brief Signaled when reads are queued or the engine stops.
+     */
+    pthread_cond_t wake;
+    /**
+     * @brief Signaled when no read is pending any more.
+     */
+    pthread_cond_t idle;
+    /**
+     * @brief Reads waiting to be run, in order of submission.
+     */
+    struct blob_read* queued;
+    struct blob_read* queued_last;
+    struct blob_read* completed;
+    /**
+     * @brief Number of reads submitted and not completed.
+     */
+    size_t pending;
+    int stopping;
+    int notify;
+    unsigned int nb_threads;
+    pthread_t threads[MAX_READ_THREADS];
+#ifdef PICTDB_IO_URING
+    /**
+     * @brief The io_uring, NULL if the threads read the blobs.
+     */
+    struct uring* ring;
+#endif
+};
+
+/**
+ * @brief Body of a reading thread.
+ *
+ * @param arg The engine.
+ * @return NULL.
+ */
+void* read_worker(void* arg);
+
+/**
+ * @brief Reads a blob with pread.
+ *
+ * @param read The read to run.
+ */
+void run_read(struct blob_read* read);
+
+/**
+ * @brief Queues a completed read. Must be called with the lock held.
+ *
+ * @param engine The engine.
+ * @param read   The completed read.
+ * @return Whether the caller must be notified, once the lock is released.
+ */
+int complete_locked(struct read_engine* engine, struct blob_read* read);
+
+/**
+ * @brief Wakes the caller of the engine up.
+ *
+ * @param engine The engine.
+ */
+void notify(struct read_engine* engine);
+
+#ifdef PICTDB_IO_URING
+/**
+ * @brief Sets an io_uring up, if the kernel can read through it.
+ *
+ * @param ring    The ring to set up.
+ * @param entries The number of entries of its submission queue.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int uring_setup(struct uring* ring, unsigned int entries);
+
+/**
+ * @brief Tells whether the kernel supports an operation of io_uring.
+ *        Kernels older than the probe, before Linux 5.6, support none of
+ *        the operations added with it, such as IORING_OP_READ.
+ *
+ * @param fd     The file descriptor of the ring.
+ * @param opcode The operation.
+ * @return 1 if it is supported, 0 otherwise.
+ */
+int uring_supports(int fd, unsigned int opcode);
+
+/**
+ * @brief Unmaps and closes an io_uring.
+ *
+ * @param ring The ring.
+ */
+void uring_free(struct uring* ring);
+
+/**
+ * @brief Submits requests to an io_uring and/or waits for completions,
+ *        retrying when interrupted by a signal.
+ *
+ * @param ring      The ring.
+ * @param to_submit The number of requests to submit.
+ * @param min       The number of completions to wait for.
+ * @param flags     The flags of io_uring_enter(2).
+ * @return The result of io_uring_enter(2).
+ */
+int uring_enter(struct uring* ring, unsigned int to_submit, unsigned int min,
+                unsigned int flags);
+
+/**
+ * @brief Moves as many queued reads as there are free entries into the
+ *        io_uring, and submits them with a single system call. The reads
+ *        the kernel does not take are completed with ERR_IO. Must be called
+ *        with the lock held.
+ *
+ * @param engine The engine.
+ * @return Whether the caller must be notified, once the lock is released.
+ */
+int uring_submit_locked(struct read_engine* engine);
+
+/**
+ * @brief Body of the thread reaping the completions of the io_uring.
+ *
+ * @param arg The engine.
+ * @return NULL.
+ */
+void* uring_reaper(void* arg);
+#endif
+
+
+int read_engine_start(unsigned int nb_threads, int notify,
+                      struct read_engine** engine)
+{
+    if (engine == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct read_engine* new_engine = calloc(1, sizeof(struct read_engine));
+    if (new_engine == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_init(&new_engine->lock, NULL);
+    pthread_cond_init(&new_engine->wake, NULL);
+    pthread_cond_init(&new_engine->idle, NULL);
+    new_engine->notify = notify;
+
+    nb_threads = nb_threads == 0 ? READ_THREADS : nb_threads;
+    nb_threads = nb_threads > MAX_READ_THREADS ? MAX_READ_THREADS : nb_threads;
+    void* (*body)(void*) = read_worker;
+
+#ifdef PICTDB_IO_URING
+    // A single thread reaps the completions of the ring
+    new_engine->ring = malloc(sizeof(struct uring));
+    if (new_engine->ring != NULL
+        && uring_setup(new_engine->ring, RING_ENTRIES) == 0) {
+        nb_threads = 1;
+        body = uring_reaper;
+    } else {
+        free(new_engine->ring);
+        new_engine->ring = NULL;
+    }
+#endif
+
+    int ret = 0;
+    while (ret == 0 && new_engine->nb_threads < nb_threads) {
+        if (pthread_create(&new_engine->threads[new_engine->nb_threads], NULL,
+                           body, new_engine) != 0) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            ++new_engine->nb_threads;
+        }
+    }
+
+    if (ret != 0) {
+        free(read_engine_stop(new_engine));
+    } else {
+        *engine = new_engine;
+    }
+    return ret;
+}
+
+int read_engine_submit(struct read_engine* engine, struct blob_read* reads)
+{
+    if (engine == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // Allocate every buffer before queuing anything
+    struct blob_read* last = NULL;
+    size_t count = 0;
+    for (struct blob_read* read = reads; read != NULL; read = read->next) {
+        read->error = 0;
+        read->data = malloc(read->size > 0 ? read->size : 1);
+        if (read->data == NULL) {
+            for (struct blob_read* done = reads; done != read;
+                 done = done->next) {
+                free(done->data);
+                done->data = NULL;
+            }
+            return ERR_OUT_OF_MEMORY;
+        }
+        last = read;
+        ++count;
+    }
+    if (last == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    if (engine->queued_last == NULL) {
+        engine->queued = reads;
+    } else {
+        engine->queued_last->next = reads;
+    }
+    engine->queued_last = last;
+    engine->pending += count;
+    int wake = 0;
+#ifdef PICTDB_IO_URING
+    if (engine->ring != NULL) {
+        wake = uring_submit_locked(engine);
+    }
+#endif
+    pthread_cond_broadcast(&engine->wake);
+    pthread_mutex_unlock(&engine->lock);
+    if (wake) {
+        notify(engine);
+    }
+    return 0;
+}
+
+struct blob_read* read_engine_completed(struct read_engine* engine)
+{
+    if (engine == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    struct blob_read* completed = engine->completed;
+    engine->completed = NULL;
+    pthread_mutex_unlock(&engine->lock);
+    return completed;
+}
+
+size_t read_engine_pending(struct read_engine* engine)
+{
+    if (engine == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    const size_t pending = engine->pending;
+    pthread_mutex_unlock(&engine->lock);
+    return pending;
+}
+
+const char* read_engine_backend(const struct read_engine* engine)
+{
+#ifdef PICTDB_IO_URING
+    if (engine != NULL && engine->ring != NULL) {
+        return "io_uring";
+    }
+#else
+    (void) engine;
+#endif
+    return "threads";
+}
+
+struct blob_read* read_engine_stop(struct read_engine* engine)
+{
+    if (engine == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->pending > 0 && engine->nb_threads > 0) {
+        pthread_cond_wait(&engine->idle, &engine->lock);
+    }
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->wake);
+#ifdef PICTDB_IO_URING
+    // A request without read wakes the reaper up for it to stop
+    if (engine->ring != NULL && engine->nb_threads > 0) {
+        struct uring* ring = engine->ring;
+        const unsigned int tail = *ring->sq_tail;
+        const unsigned int index = tail & *ring->sq_mask;
+        memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+        ring->sqes[index].opcode = IORING_OP_NOP;
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        uring_enter(ring, 1, 0, 0);
+    }
+#endif
+    pthread_mutex_unlock(&engine->lock);
+
+    for (unsigned int i = 0; i < engine->nb_threads; ++i) {
+        pthread_join(engine->threads[i], NULL);
+    }
+
+#ifdef PICTDB_IO_URING
+    if (engine->ring != NULL) {
+        uring_free(engine->ring);
+        free(engine->ring);
+    }
+#endif
+    struct blob_read* completed = engine->completed;
+    pthread_cond_destroy(&engine->idle);
+    pthread_cond_destroy(&engine->wake);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+    return completed;
+}
+
+void* read_worker(void* arg)
+{
+    struct read_engine* engine = arg;
+
+    pthread_mutex_lock(&engine->lock);
+    while (!engine->stopping) {
+        struct blob_read* read = engine->queued;
+        if (read == NULL) {
+            pthread_cond_wait(&engine->wake, &engine->lock);
+            continue;
+        }
+        engine->queued = read->next;
+        if (engine->queued == NULL) {
+            engine->queued_last = NULL;
+        }
+        pthread_mutex_unlock(&engine->lock);
+
+        run_read(read);
+
+        pthread_mutex_lock(&engine->lock);
+        const int wake = complete_locked(engine, read);
+        pthread_mutex_unlock(&engine->lock);
+        if (wake) {
+            notify(engine);
+        }
+        pthread_mutex_lock(&engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+void run_read(struct blob_read* read)
+{
+    TRACE_BEGIN(span);
+    size_t done = 0;
+    while (done < read->size) {
+        const ssize_t n = pread(read->fd, read->data + done, read->size - done,
+                                (off_t)(read->offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t) n;
+    }
+    read->error = done == read->size ? 0 : ERR_IO;
+    TRACE_END(span, "read.blob");
+}
+
+int complete_locked(struct read_engine* engine, struct blob_read* read)
+{
+    const int was_empty = engine->completed == NULL;
+    read->next = engine->completed;
+    engine->completed = read;
+    if (--engine->pending == 0) {
+        pthread_cond_broadcast(&engine->idle);
+    }
+    return was_empty;
+}
+
+void notify(struct read_engine* engine)
+{
+    // A full socket already holds a notification
+    const char byte = 0;
+    if (send(engine->notify, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+        && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("send");
+    }
+}
+
+#ifdef PICTDB_IO_URING
+int uring_setup(struct uring* ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(struct uring));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return ERR_IO;
+    }
+    if (!uring_supports(ring->fd, IORING_OP_READ)) {
+        close(ring->fd);
+        return NOT_IMPLEMENTED;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array
+                         + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes
+                         + params.cq_entries * sizeof(struct io_uring_cqe);
+    const int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = single ? ring->sq_ring
+                    : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+        || ring->sqes == MAP_FAILED) {
+        uring_free(ring);
+        return ERR_IO;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+int uring_supports(int fd, unsigned int opcode)
+{
+    struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe)
+                                          + PROBE_OPS
+                                          * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        return 0;
+    }
+    const int supported = syscall(__NR_io_uring_register, fd,
+                                  IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0
+                          && opcode <= probe->last_op
+                          && (probe->ops[opcode].flags
+                              & IO_URING_OP_SUPPORTED) != 0;
+    free(probe);
+    return supported;
+}
+
+void uring_free(struct uring* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED
+        && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+int uring_enter(struct uring* ring, unsigned int to_submit, unsigned int min,
+                unsigned int flags)
+{
+    int ret = 0;
+    do {
+        ret = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, min,
+                            flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int uring_submit_locked(struct read_engine* engine)
+{
+    struct uring* ring = engine->ring;
+    const unsigned int first = *ring->sq_tail;
+    unsigned int tail = first;
+    unsigned int submitted = 0;
+
+    // Never more reads in flight than entries, so the completions fit
+    while (engine->queued != NULL && ring->in_flight < ring->entries) {
+        struct blob_read* read = engine->queued;
+        engine->queued = read->next;
+        if (engine->queued == NULL) {
+            engine->queued_last = NULL;
+        }
+
+        const unsigned int index = tail & *ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = read->fd;
+        sqe->off = read->offset;
+        sqe->addr = (uint64_t)(uintptr_t) read->data;
+        sqe->len = read->size;
+        sqe->user_data = (uint64_t)(uintptr_t) read;
+        ring->sq_array[index] = index;
+
+        ++tail;
+        ++ring->in_flight;
+        ++submitted;
+    }
+
+    int wake = 0;
+    if (submitted > 0) {
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        const int ret = uring_enter(ring, submitted, 0, 0);
+        if (ret < 0) {
+            perror("io_uring_enter");
+        }
+        // The kernel did not take the last entries: take them back and
+        // fail their reads, which would never complete otherwise
+        const unsigned int taken = ret < 0 ? 0 : (unsigned int) ret;
+        for (unsigned int i = taken; i < submitted; ++i) {
+            const unsigned int index = (first + i) & *ring->sq_mask;
+            struct blob_read* read = (struct blob_read*)(uintptr_t)
+                                     ring->sqes[index].user_data;
+            read->error = ERR_IO;
+            --ring->in_flight;
+            wake |= complete_locked(engine, read);
+        }
+        if (taken < submitted) {
+            __atomic_store_n(ring->sq_tail, first + taken, __ATOMIC_RELEASE);
+        }
+    }
+    return wake;
+}
+
+void* uring_reaper(void* arg)
+{
+    struct read_engine* engine = arg;
+    struct uring* ring = engine->ring;
+
+    int stop = 0;
+    while (!stop) {
+        if (uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            perror("io_uring_enter");
+            return NULL;
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        unsigned int head = *ring->cq_head;
+        const unsigned int tail = __atomic_load_n(ring->cq_tail,
+                                                  __ATOMIC_ACQUIRE);
+        int wake = 0;
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            struct blob_read* read = (struct blob_read*)(uintptr_t)
+                                     cqe->user_data;
+            if (read == NULL) {
+                stop = 1;
+                continue;
+            }
+            --ring->in_flight;
+            if (cqe->res >= 0 && (uint32_t) cqe->res == read->size) {
+                read->error = 0;
+            } else if (cqe->res >= 0) {
+                // A short read is finished the slow way
+                run_read(read);
+            } else {
+                read->error = ERR_IO;
+            }
+            wake |= complete_locked(engine, read);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        // Entries were freed: move the reads waiting for them into the ring
+        wake |= uring_submit_locked(engine);
+        pthread_mutex_unlock(&engine->lock);
+
+        if (wake) {
+            notify(engine);
+        }
+    }
+    return NULL;
+}
+#endif
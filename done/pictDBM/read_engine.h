@@ -0,0 +1,110 @@
+/**
+ * @file read_engine.h
+ * @brief Header file for the asynchronous reads of blobs of a database.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_READ_ENGINE_H
+#define PICTDBPRJ_READ_ENGINE_H
+
+#include "pictDB.h"
+
+#define READ_THREADS     16  // Default number of reading threads
+#define MAX_READ_THREADS 256 // Maximal number of reading threads
+
+/**
+ * @brief A read of a blob of a file, run asynchronously.
+ */
+struct blob_read {
+    /**
+     * @brief File descriptor to read from, at an explicit offset so that
+     *        the position of its stream does not matter.
+     */
+    int fd;
+    uint64_t offset;
+    uint32_t size;
+    /**
+     * @brief The bytes read, allocated by the engine with malloc and to be
+     *        freed by the caller once the read completed.
+     */
+    char* data;
+    /**
+     * @brief 0 if the read succeeded, an error code otherwise.
+     */
+    int error;
+    /**
+     * @brief Data of the caller, untouched by the engine.
+     */
+    void* arg;
+    /**
+     * @brief Next read of a list, used by the engine once submitted.
+     */
+    struct blob_read* next;
+};
+
+/**
+ * @brief Reads blobs in the background and queues them once completed.
+ */
+struct read_engine;
+
+/**
+ * @brief Starts an engine. It uses io_uring when built with IO_URING=1 and
+ *        supported by the kernel, a pool of threads otherwise.
+ *
+ * @param nb_threads The number of reading threads, at most
+ *                   MAX_READ_THREADS; 0 uses READ_THREADS. Unused with
+ *                   io_uring.
+ * @param notify     A socket to which a byte is sent when completed reads
+ *                   are queued while none were, e.g. to wake an event loop.
+ * @param engine     Location where the engine will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int read_engine_start(unsigned int nb_threads, int notify,
+                      struct read_engine** engine);
+
+/**
+ * @brief Submits a list of reads, linked by their next field, at once.
+ *
+ * @param engine The engine.
+ * @param reads  The reads, owned by the engine until they are completed.
+ * @return 0 in case of success, an error code otherwise (no read is then
+ *         submitted).
+ */
+int read_engine_submit(struct read_engine* engine, struct blob_read* reads);
+
+/**
+ * @brief Takes the reads completed since the last call.
+ *
+ * @param engine The engine.
+ * @return The list of completed reads, linked by their next field.
+ */
+struct blob_read* read_engine_completed(struct read_engine* engine);
+
+/**
+ * @brief Gives the number of reads submitted and not completed yet.
+ *
+ * @param engine The engine.
+ * @return The number of reads.
+ */
+size_t read_engine_pending(struct read_engine* engine);
+
+/**
+ * @brief Names the way an engine reads blobs.
+ *
+ * @param engine The engine.
+ * @return "io_uring" or "threads".
+ */
+const char* read_engine_backend(const struct read_engine* engine);
+
+/**
+ * @brief Waits for the submitted reads to complete, then stops and frees an
+ *        engine.
+ *
+ * @param engine The engine.
+ * @return The completed reads not taken yet.
+ */
+struct blob_read* read_engine_stop(struct read_engine* engine);
+
+#endif
@@ -0,0 +1,415 @@
+/**
+ * @file resize_cache.c
+ * @brief Implements the cache of the images resized on demand.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _DEFAULT_SOURCE // for O_CLOEXEC
+
+#include "resize_cache.h"
+#include "image_content.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESIZE_EXT_MAX 4 // Longest extension of a format
+
+// "<prefix>-<sha>-<width>x<height>-<fit>-q<quality>f<flags>.<extension>"
+#define RESIZE_NAME_MAX (20 + 1 + 2 * SHA256_DIGEST_LENGTH + 1 + 5 + 1 + 5 \
+                         + 1 + 11 + 2 + 3 + 1 + 3 + 1 + RESIZE_EXT_MAX)
+
+/**
+ * @brief Gives the bucket of the index holding an image, if it is cached.
+ *
+ * @param cache    The cache, with at least one bucket.
+ * @param sha      The SHA of the original image.
+ * @param width    The width of the resized image.
+ * @param height   The height of the resized image.
+ * @param fit      How it was fitted to them.
+ * @param format   Its encoding.
+ * @param encoding The options of its encoder.
+ * @return The bucket.
+ */
+struct resize_entry** resize_bucket(const struct resize_cache* cache,
+                                    const unsigned char* sha, uint16_t width,
+                                    uint16_t height, int fit, int format,
+                                    const struct pictdb_encoding* encoding);
+
+/**
+ * @brief Gives the location of the pointer to an image in the index.
+ *
+ * @param cache    The cache.
+ * @param sha      The SHA of the original image.
+ * @param width    The width of the resized image.
+ * @param height   The height of the resized image.
+ * @param fit      How it was fitted to them.
+ * @param format   Its encoding.
+ * @param encoding The options of its encoder.
+ * @return The location, pointing to NULL if the image is not cached.
+ */
+struct resize_entry** resize_lookup(const struct resize_cache* cache,
+                                    const unsigned char* sha, uint16_t width,
+                                    uint16_t height, int fit, int format,
+                                    const struct pictdb_encoding* encoding);
+
+/**
+ * @brief Writes the path of the file of an image.
+ *
+ * @param cache The cache.
+ * @param entry The image.
+ * @param path  Location where the path will be stored, of
+ *              strlen(cache->dir) + RESIZE_NAME_MAX + 1 chars.
+ */
+void resize_path(const struct resize_cache* cache,
+                 const struct resize_entry* entry, char* path);
+
+/**
+ * @brief Removes an image from the index, from the list of uses and from
+ *        the directory, and frees it.
+ *
+ * @param cache The cache.
+ * @param entry The image.
+ */
+void resize_evict(struct resize_cache* cache, struct resize_entry* entry);
+
+/**
+ * @brief Moves an image to the newest end of the list of uses.
+ *
+ * @param cache The cache.
+ * @param entry The image, which may not be in the list yet.
+ * @param known Whether the image is in the list.
+ */
+void resize_touch(struct resize_cache* cache, struct resize_entry* entry,
+                  int known);
+
+/**
+ * @brief Doubles the number of buckets of the index once it holds as many
+ *        images.
+ *
+ * @param cache The cache.
+ * @return 0 if no errors occur, ERR_OUT_OF_MEMORY otherwise.
+ */
+int resize_grow(struct resize_cache* cache);
+
+/**
+ * @brief Writes a buffer to a file descriptor.
+ *
+ * @param fd   The file descriptor.
+ * @param data The buffer.
+ * @param size The size of the buffer.
+ * @return 0 if no errors occur, ERR_IO otherwise.
+ */
+int write_all(int fd, const void* data, size_t size);
+
+
+int resize_cache_clear(const char* dir)
+{
+    if (dir == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return ERR_IO;
+    }
+    DIR* stream = opendir(dir);
+    if (stream == NULL) {
+        return ERR_IO;
+    }
+
+    // Only the files named as those of a cache are removed
+    const size_t dir_len = strlen(dir);
+    char path[dir_len + RESIZE_NAME_MAX + 2];
+    struct dirent* file = NULL;
+    while ((file = readdir(stream)) != NULL) {
+        unsigned long prefix = 0;
+        char sha[2 * SHA256_DIGEST_LENGTH + 1];
+        unsigned int width = 0;
+        unsigned int height = 0;
+        int fit = 0;
+        unsigned int quality = 0;
+        unsigned int flags = 0;
+        char extension[RESIZE_EXT_MAX + 1];
+        int end = 0;
+        // Also those named before the encoding was part of the name
+        if (strlen(file->d_name) <= RESIZE_NAME_MAX
+            && (sscanf(file->d_name,
+                       "%lu-%64[0-9a-f]-%ux%u-%d-q%uf%u.%4[a-z]%n",
+                       &prefix, sha, &width, &height, &fit, &quality, &flags,
+                       extension, &end) == 8
+                || sscanf(file->d_name, "%lu-%64[0-9a-f]-%ux%u-%d.%4[a-z]%n",
+                          &prefix, sha, &width, &height, &fit, extension,
+                          &end) == 6)
+            && file->d_name[end] == '\0') {
+            snprintf(path, sizeof(path), "%s/%s", dir, file->d_name);
+            unlink(path);
+        }
+    }
+    closedir(stream);
+    return 0;
+}
+
+int resize_cache_open(struct resize_cache* cache, const char* dir,
+                      unsigned long prefix, uint64_t budget)
+{
+    if (cache == NULL || dir == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(cache, 0, sizeof(struct resize_cache));
+    cache->dir = malloc(strlen(dir) + 1);
+    cache->buckets = calloc(RESIZE_CACHE_MIN_BUCKETS,
+                            sizeof(struct resize_entry*));
+    if (cache->dir == NULL || cache->buckets == NULL) {
+        free(cache->dir);
+        free(cache->buckets);
+        cache->dir = NULL;
+        cache->buckets = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    strcpy(cache->dir, dir);
+    cache->prefix = prefix;
+    cache->budget = budget;
+    cache->nb_buckets = RESIZE_CACHE_MIN_BUCKETS;
+    return 0;
+}
+
+void resize_cache_close(struct resize_cache* cache)
+{
+    if (cache == NULL || cache->dir == NULL) {
+        return;
+    }
+    while (cache->oldest != NULL) {
+        resize_evict(cache, cache->oldest);
+    }
+    free(cache->buckets);
+    free(cache->dir);
+    memset(cache, 0, sizeof(struct resize_cache));
+}
+
+int resize_cache_find(struct resize_cache* cache, const unsigned char* sha,
+                      uint16_t width, uint16_t height, int fit, int format,
+                      const struct pictdb_encoding* encoding, int* fd,
+                      uint32_t* size)
+{
+    if (cache == NULL || cache->dir == NULL || sha == NULL || fd == NULL
+        || size == NULL || format < 0 || format >= NB_FORMATS
+        || encoding == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct resize_entry* entry = *resize_lookup(cache, sha, width, height,
+                                 fit, format, encoding);
+    if (entry == NULL) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    char path[strlen(cache->dir) + RESIZE_NAME_MAX + 2];
+    resize_path(cache, entry, path);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        // Removed behind our back: resized again
+        resize_evict(cache, entry);
+        return ERR_FILE_NOT_FOUND;
+    }
+    *size = entry->size;
+    resize_touch(cache, entry, 1);
+    return 0;
+}
+
+int resize_cache_add(struct resize_cache* cache, const unsigned char* sha,
+                     uint16_t width, uint16_t height, int fit, int format,
+                     const struct pictdb_encoding* encoding,
+                     const void* data, uint32_t size)
+{
+    if (cache == NULL || cache->dir == NULL || sha == NULL || data == NULL
+        || format < 0 || format >= NB_FORMATS || encoding == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (size > cache->budget
+        || *resize_lookup(cache, sha, width, height, fit, format,
+                          encoding) != NULL) {
+        return 0;
+    }
+    if (cache->count >= cache->nb_buckets && resize_grow(cache) != 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    while (cache->used + size > cache->budget) {
+        resize_evict(cache, cache->oldest);
+    }
+
+    struct resize_entry* entry = calloc(1, sizeof(struct resize_entry));
+    if (entry == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(entry->sha, sha, SHA256_DIGEST_LENGTH);
+    entry->width = width;
+    entry->height = height;
+    entry->fit = fit;
+    entry->format = format;
+    entry->encoding.quality = encoding->quality;
+    entry->encoding.flags = encoding->flags;
+    entry->size = size;
+
+    // A file of the same name may only be left by a former process
+    char path[strlen(cache->dir) + RESIZE_NAME_MAX + 2];
+    resize_path(cache, entry, path);
+    unlink(path);
+    const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int ret = fd < 0 ? ERR_IO : write_all(fd, data, size);
+    if (fd >= 0 && close(fd) != 0) {
+        ret = ERR_IO;
+    }
+    if (ret != 0) {
+        if (fd >= 0) {
+            unlink(path);
+        }
+        free(entry);
+        return ret;
+    }
+
+    struct resize_entry** bucket = resize_bucket(cache, sha, width, height,
+                                   fit, format, encoding);
+    entry->chain = *bucket;
+    *bucket = entry;
+    ++cache->count;
+    cache->used += size;
+    resize_touch(cache, entry, 0);
+    return 0;
+}
+
+struct resize_entry** resize_bucket(const struct resize_cache* cache,
+                                    const unsigned char* sha, uint16_t width,
+                                    uint16_t height, int fit, int format,
+                                    const struct pictdb_encoding* encoding)
+{
+    const uint64_t hash = sha_key_hash(sha, (uint64_t) encoding->flags << 56
+                                       | (uint64_t) encoding->quality << 48
+                                       | (uint64_t) width << 32
+                                       | (uint64_t) height << 16
+                                       | (uint64_t) fit << 8
+                                       | (uint64_t) format);
+    return &cache->buckets[hash & (cache->nb_buckets - 1)];
+}
+
+struct resize_entry** resize_lookup(const struct resize_cache* cache,
+                                    const unsigned char* sha, uint16_t width,
+                                    uint16_t height, int fit, int format,
+                                    const struct pictdb_encoding* encoding)
+{
+    struct resize_entry** link = resize_bucket(cache, sha, width, height,
+                                 fit, format, encoding);
+    while (*link != NULL
+           && ((*link)->width != width || (*link)->height != height
+               || (*link)->fit != fit || (*link)->format != format
+               || (*link)->encoding.quality != encoding->quality
+               || (*link)->encoding.flags != encoding->flags
+               || hashcmp((*link)->sha, (unsigned char*) sha) != 0)) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+void resize_path(const struct resize_cache* cache,
+                 const struct resize_entry* entry, char* path)
+{
+    char sha[2 * SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(entry->sha, sha);
+    sprintf(path, "%s/%lu-%s-%ux%u-%d-q%uf%u.%s", cache->dir, cache->prefix,
+            sha, (unsigned int) entry->width, (unsigned int) entry->height,
+            entry->fit, (unsigned int) entry->encoding.quality,
+            (unsigned int) entry->encoding.flags,
+            FORMAT_EXTENSIONS[entry->format]);
+}
+
+void resize_evict(struct resize_cache* cache, struct resize_entry* entry)
+{
+    *resize_lookup(cache, entry->sha, entry->width, entry->height,
+                   entry->fit, entry->format, &entry->encoding) = entry->chain;
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    --cache->count;
+    cache->used -= entry->size;
+
+    // Readers of the file keep it until they close it
+    char path[strlen(cache->dir) + RESIZE_NAME_MAX + 2];
+    resize_path(cache, entry, path);
+    unlink(path);
+    free(entry);
+}
+
+void resize_touch(struct resize_cache* cache, struct resize_entry* entry,
+                  int known)
+{
+    if (known) {
+        if (entry == cache->newest) {
+            return;
+        }
+        if (entry->older != NULL) {
+            entry->older->newer = entry->newer;
+        } else {
+            cache->oldest = entry->newer;
+        }
+        entry->newer->older = entry->older;
+    }
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest != NULL) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+int resize_grow(struct resize_cache* cache)
+{
+    const size_t old_nb_buckets = cache->nb_buckets;
+    struct resize_entry** old = cache->buckets;
+    cache->buckets = calloc(old_nb_buckets * 2, sizeof(struct resize_entry*));
+    if (cache->buckets == NULL) {
+        cache->buckets = old;
+        return ERR_OUT_OF_MEMORY;
+    }
+    cache->nb_buckets = old_nb_buckets * 2;
+    for (size_t i = 0; i < old_nb_buckets; ++i) {
+        while (old[i] != NULL) {
+            struct resize_entry* entry = old[i];
+            old[i] = entry->chain;
+            struct resize_entry** bucket = resize_bucket(cache, entry->sha,
+                                           entry->width, entry->height,
+                                           entry->fit, entry->format,
+                                           &entry->encoding);
+            entry->chain = *bucket;
+            *bucket = entry;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+int write_all(int fd, const void* data, size_t size)
+{
+    const char* bytes = data;
+    while (size > 0) {
+        const ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return ERR_IO;
+        }
+        bytes += written;
+        size -= (size_t) written;
+    }
+    return 0;
+}
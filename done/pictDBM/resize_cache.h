@@ -0,0 +1,145 @@
+/**
+ * @file resize_cache.h
+ * @brief Header file for the cache of the images resized on demand to any
+ *        width and height.
+ *
+ * Unlike the resolutions of a database, these images are not kept forever:
+ * each one is a file of a directory, and the least recently used ones are
+ * removed once their total size exceeds the budget of the cache. A file
+ * removed while it is being read stays readable until it is closed.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_RESIZE_CACHE_H
+#define PICTDBPRJ_RESIZE_CACHE_H
+
+#include "pictDB.h"
+
+#define RESIZE_CACHE_SUFFIX ".resized"
+#define RESIZE_CACHE_MIN_BUCKETS 64
+
+/**
+ * @brief An image of the cache, in its index and in its list of uses.
+ */
+struct resize_entry {
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint16_t width;
+    uint16_t height;
+    int fit;
+    int format;
+    struct pictdb_encoding encoding;
+    uint32_t size;
+    /**
+     * @brief Next image of the same bucket of the index.
+     */
+    struct resize_entry* chain;
+    /**
+     * @brief Images used just before and just after this one.
+     */
+    struct resize_entry* older;
+    struct resize_entry* newer;
+};
+
+/**
+ * @brief A directory of resized images and its index.
+ */
+struct resize_cache {
+    /**
+     * @brief The directory, and the prefix of the files of this cache in it,
+     *        so that the workers of a server may share the directory.
+     */
+    char* dir;
+    unsigned long prefix;
+    /**
+     * @brief Maximal and current total size of the images, in bytes.
+     */
+    uint64_t budget;
+    uint64_t used;
+    /**
+     * @brief Hash table of the images, of a power of two number of buckets.
+     */
+    struct resize_entry** buckets;
+    size_t nb_buckets;
+    size_t count;
+    /**
+     * @brief Least and most recently used images.
+     */
+    struct resize_entry* oldest;
+    struct resize_entry* newest;
+};
+
+/**
+ * @brief Removes the images left in a directory, e.g. by a server which
+ *        was killed, creating the directory if need be.
+ *
+ * @param dir The directory.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int resize_cache_clear(const char* dir);
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param cache  The cache to initialize.
+ * @param dir    The directory of the images, which must exist.
+ * @param prefix The prefix of the files of the cache, unique among the
+ *               caches sharing the directory.
+ * @param budget The maximal total size of the images, in bytes.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int resize_cache_open(struct resize_cache* cache, const char* dir,
+                      unsigned long prefix, uint64_t budget);
+
+/**
+ * @brief Removes the images of a cache and frees its index.
+ *
+ * @param cache The cache.
+ */
+void resize_cache_close(struct resize_cache* cache);
+
+/**
+ * @brief Looks for a resized image and opens its file, making it the most
+ *        recently used one.
+ *
+ * @param cache    The cache.
+ * @param sha      The SHA of the original image.
+ * @param width    The width it was resized to, 0 if unbounded.
+ * @param height   The height it was resized to, 0 if unbounded.
+ * @param fit      How it was fitted to them, a resize_fit.
+ * @param format   Its encoding, an image_format.
+ * @param encoding The options of its encoder.
+ * @param fd       Location where the file descriptor of the image, to be
+ *                 closed by the caller, will be stored.
+ * @param size     Location where the size of the image will be stored.
+ * @return 0 if the image was found, ERR_FILE_NOT_FOUND if it is not cached,
+ *         another int coded in error.h in case of errors
+ */
+int resize_cache_find(struct resize_cache* cache, const unsigned char* sha,
+                      uint16_t width, uint16_t height, int fit, int format,
+                      const struct pictdb_encoding* encoding, int* fd,
+                      uint32_t* size);
+
+/**
+ * @brief Writes a resized image to the cache, first removing the least
+ *        recently used images to keep the cache within its budget. An image
+ *        larger than the budget is not cached.
+ *
+ * @param cache    The cache.
+ * @param sha      The SHA of the original image.
+ * @param width    The width it was resized to, 0 if unbounded.
+ * @param height   The height it was resized to, 0 if unbounded.
+ * @param fit      How it was fitted to them, a resize_fit.
+ * @param format   Its encoding, an image_format.
+ * @param encoding The options of its encoder.
+ * @param data     The bytes of the image.
+ * @param size     The size of the image.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int resize_cache_add(struct resize_cache* cache, const unsigned char* sha,
+                     uint16_t width, uint16_t height, int fit, int format,
+                     const struct pictdb_encoding* encoding,
+                     const void* data, uint32_t size);
+
+#endif
@@ -0,0 +1,534 @@
+/**
+ * @file bench.c
+ * @brief Microbenchmarks of the pictDB library.
+ *
+ * For each database size and fill ratio, creates a database, fills it with
+ * distinct images and times do_read (stored and lazily resized variants),
+ * do_list, do_insert, do_delete and do_gbcollect on it. The results are
+ * written as JSON so that they can be compared run over run.
+ *
+ * The images are copies of a single JPEG, each with a comment segment
+ * numbering it so that none is deduplicated.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#include "pictDB.h"
+#include "pictDBM_tools.h"
+#include "bench_util.h"
+#include <time.h>
+#include <vips/vips.h>
+
+#define BENCH_DB      "bench.pictdb" // Database used by the benchmarks
+#define BENCH_TMP     "bench.tmp"    // Temporary database of do_gbcollect
+#define BENCH_OUTPUT  "bench.json"   // Default file of the results
+#define BENCH_OPS     1000   // Default number of timed calls per operation
+#define LIST_RUNS     10     // Number of timed calls of do_list
+#define MAX_CONFIGS   16     // Maximal number of sizes or of fill ratios
+#define IMAGE_WIDTH   320    // Size of the generated image
+#define IMAGE_HEIGHT  240
+#define THUMB_RES     64     // Resolutions of the benchmarked databases
+#define SMALL_RES     256
+#define BENCH_SEED    0x9e3779b97f4a7c15ULL // Fixed, so that runs compare
+
+/**
+ * @brief Parameters of a run.
+ */
+struct bench_options {
+    /**
+     * @brief Numbers of slots of the databases.
+     */
+    uint32_t sizes[MAX_CONFIGS];
+    size_t nb_sizes;
+    /**
+     * @brief Fractions of the slots filled before timing.
+     */
+    double fills[MAX_CONFIGS];
+    size_t nb_fills;
+    /**
+     * @brief Number of timed calls per operation.
+     */
+    uint32_t ops;
+    /**
+     * @brief JPEG the images are copied from, NULL to generate one.
+     */
+    const char* image;
+    const char* output;
+};
+
+/**
+ * @brief The images inserted: a JPEG and a copy of it with a comment
+ *        segment after its start of image marker.
+ */
+struct corpus {
+    char* base;
+    size_t base_size;
+    char* image;
+    size_t size;
+};
+
+/**
+ * @brief Durations of the calls of an operation.
+ */
+struct timings {
+    uint64_t* ns;
+    size_t count;
+};
+
+/**
+ * @brief The JSON output of a run.
+ */
+struct report {
+    FILE* out;
+    int first;
+};
+
+/**
+ * @brief Parses the command line options.
+ *
+ * @param argc    The number of arguments.
+ * @param argv    The arguments.
+ * @param options Location where the options will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_options(int argc, char* argv[], struct bench_options* options);
+
+/**
+ * @brief Parses a comma separated list of numbers of slots.
+ *
+ * @param str     The list.
+ * @param options The options whose sizes are set.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_sizes(const char* str, struct bench_options* options);
+
+/**
+ * @brief Parses a comma separated list of fill ratios, between 0 and 1.
+ *
+ * @param str     The list.
+ * @param options The options whose fill ratios are set.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_fills(const char* str, struct bench_options* options);
+
+/**
+ * @brief Reads the JPEG the images are copied from, or generates a gradient
+ *        if none is given.
+ *
+ * @param path   The file of the image, NULL to generate it.
+ * @param corpus The corpus whose base image is set.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int load_corpus(const char* path, struct corpus* corpus);
+
+/**
+ * @brief Runs the benchmarks on a database of a given size and fill ratio.
+ *
+ * @param report  The output of the results.
+ * @param options The options of the run.
+ * @param corpus  The images.
+ * @param slots   The number of slots of the database.
+ * @param fill    The fraction of the slots filled.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int bench_database(struct report* report, const struct bench_options* options,
+                   struct corpus* corpus, uint32_t slots, double fill);
+
+/**
+ * @brief Inserts numbered images.
+ *
+ * @param db_file The database.
+ * @param corpus  The images.
+ * @param prefix  The prefix of the IDs of the images.
+ * @param first   The number of the first image.
+ * @param count   The number of images.
+ * @param timings Location where the durations will be stored, NULL if they
+ *                are not measured.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int insert_images(struct pictdb_file* db_file, struct corpus* corpus,
+                  const char* prefix, uint32_t first, uint32_t count,
+                  struct timings* timings);
+
+/**
+ * @brief Reads images in a resolution.
+ *
+ * @param db_file    The database.
+ * @param indices    The numbers of the images, inserted with prefix "i".
+ * @param count      The number of reads.
+ * @param resolution The resolution.
+ * @param timings    Location where the durations will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int read_images(struct pictdb_file* db_file, const uint32_t* indices,
+                uint32_t count, int resolution, struct timings* timings);
+
+/**
+ * @brief Writes the statistics of an operation to the report.
+ *
+ * @param report  The report.
+ * @param op      The name of the operation.
+ * @param slots   The number of slots of the database.
+ * @param fill    The fill ratio of the database.
+ * @param images  The number of images in the database when timed.
+ * @param timings The durations of the calls, sorted by this function.
+ */
+void report_timings(struct report* report, const char* op, uint32_t slots,
+                    double fill, uint32_t images, struct timings* timings);
+
+/**
+ * @brief Prints the usage of the benchmarks.
+ */
+void help(void);
+
+
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("Unable to start VIPS");
+    }
+
+    struct bench_options options;
+    int ret = parse_options(argc - 1, argv + 1, &options);
+    struct corpus corpus = {.base = NULL, .image = NULL};
+    ret = ret == 0 ? load_corpus(options.image, &corpus) : ret;
+
+    FILE* out = NULL;
+    if (ret == 0) {
+        out = fopen(options.output, "w");
+        ret = out == NULL ? ERR_IO : 0;
+    }
+
+    if (ret == 0) {
+        time_t now = time(NULL);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+        fprintf(out, "{\"date\":\"%s\",\"image_size\":%zu,\"ops\":%" PRIu32
+                ",\"results\":[", date, corpus.size, options.ops);
+
+        struct report report = {.out = out, .first = 1};
+        for (size_t s = 0; ret == 0 && s < options.nb_sizes; ++s) {
+            for (size_t f = 0; ret == 0 && f < options.nb_fills; ++f) {
+                ret = bench_database(&report, &options, &corpus,
+                                     options.sizes[s], options.fills[f]);
+            }
+        }
+        fprintf(out, "\n]}\n");
+        if (fclose(out) != 0 && ret == 0) {
+            ret = ERR_IO;
+        }
+    }
+
+    free(corpus.base);
+    free(corpus.image);
+    remove(BENCH_DB);
+    remove(BENCH_TMP);
+
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+        if (ret == ERR_INVALID_ARGUMENT || ret == ERR_NOT_ENOUGH_ARGUMENTS) {
+            help();
+        }
+    } else {
+        fprintf(stderr, "Results written to %s\n", options.output);
+    }
+
+    vips_shutdown();
+    return ret;
+}
+
+int parse_options(int argc, char* argv[], struct bench_options* options)
+{
+    memset(options, 0, sizeof(struct bench_options));
+    options->ops = BENCH_OPS;
+    options->output = BENCH_OUTPUT;
+    int ret = parse_sizes("1000,10000,100000", options);
+    ret = ret == 0 ? parse_fills("0.1,0.5,0.9", options) : ret;
+
+    for (int i = 0; ret == 0 && i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if (strcmp(argv[i], "-sizes") == 0) {
+            ret = parse_sizes(argv[i + 1], options);
+        } else if (strcmp(argv[i], "-fills") == 0) {
+            ret = parse_fills(argv[i + 1], options);
+        } else if (strcmp(argv[i], "-ops") == 0) {
+            options->ops = atouint32(argv[i + 1]);
+            ret = options->ops == 0 ? ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[i], "-image") == 0) {
+            options->image = argv[i + 1];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            options->output = argv[i + 1];
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+    return ret;
+}
+
+int parse_sizes(const char* str, struct bench_options* options)
+{
+    options->nb_sizes = 0;
+    while (*str != '\0') {
+        char* end = NULL;
+        unsigned long size = strtoul(str, &end, 10);
+        if (end == str || (*end != ',' && *end != '\0') || size == 0
+            || size > MAX_MAX_FILES || options->nb_sizes == MAX_CONFIGS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        options->sizes[options->nb_sizes++] = (uint32_t) size;
+        str = *end == ',' ? end + 1 : end;
+    }
+    return options->nb_sizes == 0 ? ERR_INVALID_ARGUMENT : 0;
+}
+
+int parse_fills(const char* str, struct bench_options* options)
+{
+    options->nb_fills = 0;
+    while (*str != '\0') {
+        char* end = NULL;
+        double fill = strtod(str, &end);
+        if (end == str || (*end != ',' && *end != '\0') || !(fill >= 0)
+            || fill > 1 || options->nb_fills == MAX_CONFIGS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        options->fills[options->nb_fills++] = fill;
+        str = *end == ',' ? end + 1 : end;
+    }
+    return options->nb_fills == 0 ? ERR_INVALID_ARGUMENT : 0;
+}
+
+int load_corpus(const char* path, struct corpus* corpus)
+{
+    int ret = 0;
+    if (path != NULL) {
+        FILE* file = fopen(path, "rb");
+        if (file == NULL) {
+            return ERR_FILE_NOT_FOUND;
+        }
+        long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+        corpus->base = size > 0 ? malloc((size_t) size) : NULL;
+        if (corpus->base == NULL) {
+            ret = size > 0 ? ERR_OUT_OF_MEMORY : ERR_IO;
+        } else if (fseek(file, 0, SEEK_SET) != 0
+                   || fread(corpus->base, (size_t) size, 1, file) != 1) {
+            ret = ERR_IO;
+        }
+        corpus->base_size = (size_t) size;
+        fclose(file);
+    } else {
+        // A gray gradient, as smooth photographs compress
+        VipsObject* context = VIPS_OBJECT(vips_image_new());
+        VipsImage** images = (VipsImage**) vips_object_local_array(context, 4);
+        void* buffer = NULL;
+        if (vips_xyz(&images[0], IMAGE_WIDTH, IMAGE_HEIGHT, NULL)
+            || vips_extract_band(images[0], &images[1], 0, NULL)
+            || vips_linear1(images[1], &images[2], 255.0 / IMAGE_WIDTH, 0.0,
+                            NULL)
+            || vips_cast_uchar(images[2], &images[3], NULL)
+            || vips_jpegsave_buffer(images[3], &buffer, &corpus->base_size,
+                                    NULL)) {
+            ret = ERR_VIPS;
+        }
+        g_object_unref(context);
+        if (ret == 0) {
+            corpus->base = malloc(corpus->base_size);
+            ret = corpus->base == NULL ? ERR_OUT_OF_MEMORY : 0;
+        }
+        if (ret == 0) {
+            memcpy(corpus->base, buffer, corpus->base_size);
+        }
+        g_free(buffer);
+    }
+
+    return ret == 0 ? tag_copy(corpus->base, corpus->base_size, &corpus->image,
+                               &corpus->size) : ret;
+}
+
+int bench_database(struct report* report, const struct bench_options* options,
+                   struct corpus* corpus, uint32_t slots, double fill)
+{
+    uint32_t images = (uint32_t)(fill * slots + 0.5);
+    images = images < slots ? images : slots;
+    // The timed inserts need free slots; deletes remove what they inserted
+    const uint32_t free_slots = slots - images;
+    const uint32_t inserts = options->ops < free_slots ? options->ops :
+                             free_slots;
+    const uint32_t resizes = options->ops < images ? options->ops : images;
+    fprintf(stderr, "%" PRIu32 " slots, %" PRIu32 " images...\n", slots,
+            images);
+
+    // Each operation is reported, and its timings dropped, before the next
+    const uint32_t calls = options->ops > LIST_RUNS ? options->ops : LIST_RUNS;
+    struct timings timings = {.ns = calloc(calls, sizeof(uint64_t))};
+    uint32_t* indices = calloc(calls > images ? calls : images,
+                               sizeof(uint32_t));
+    if (timings.ns == NULL || indices == NULL) {
+        free(timings.ns);
+        free(indices);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    struct pictdb_file db_file = {
+        .fpdb = NULL, .metadata = NULL,
+        .header = {
+            .max_files = slots,
+            .res_resized = { THUMB_RES, THUMB_RES, SMALL_RES, SMALL_RES }
+        }
+    };
+    remove(BENCH_DB);
+    int ret = do_create(BENCH_DB, &db_file);
+    ret = ret == 0 ? insert_images(&db_file, corpus, "i", 0, images, NULL) :
+          ret;
+
+    uint64_t random = BENCH_SEED;
+    if (ret == 0 && images > 0) {
+        // Stored variants, from anywhere in the database
+        for (uint32_t i = 0; i < options->ops; ++i) {
+            indices[i] = (uint32_t)(next_random(&random) % images);
+        }
+        ret = read_images(&db_file, indices, options->ops, RES_ORIG, &timings);
+    }
+    if (ret == 0 && images > 0) {
+        report_timings(report, "read_stored", slots, fill, images, &timings);
+    }
+    if (ret == 0 && images > 0) {
+        // Variants resized on their first read: distinct images
+        for (uint32_t i = 0; i < images; ++i) {
+            indices[i] = i;
+        }
+        for (uint32_t i = 0; i < resizes; ++i) {
+            uint32_t j = i + (uint32_t)(next_random(&random) % (images - i));
+            uint32_t swap = indices[i];
+            indices[i] = indices[j];
+            indices[j] = swap;
+        }
+        ret = read_images(&db_file, indices, resizes, RES_SMALL, &timings);
+    }
+    if (ret == 0 && images > 0) {
+        report_timings(report, "read_resize", slots, fill, images, &timings);
+    }
+    for (uint32_t i = 0; ret == 0 && i < LIST_RUNS; ++i) {
+        uint64_t start = now_ns();
+        char* list = do_list(&db_file, JSON);
+        timings.ns[timings.count++] = now_ns() - start;
+        ret = list == NULL ? ERR_OUT_OF_MEMORY : 0;
+        free(list);
+    }
+    if (ret == 0) {
+        report_timings(report, "list", slots, fill, images, &timings);
+    }
+    if (ret == 0 && inserts > 0) {
+        ret = insert_images(&db_file, corpus, "n", images, inserts, &timings);
+    }
+    if (ret == 0 && inserts > 0) {
+        report_timings(report, "insert", slots, fill, images, &timings);
+    }
+    for (uint32_t i = 0; ret == 0 && i < inserts; ++i) {
+        char pict_id[MAX_PIC_ID + 1];
+        snprintf(pict_id, sizeof(pict_id), "n%" PRIu32, images + i);
+        uint64_t start = now_ns();
+        ret = do_delete(&db_file, pict_id);
+        timings.ns[timings.count++] = now_ns() - start;
+    }
+    if (ret == 0 && inserts > 0) {
+        report_timings(report, "delete", slots, fill, images, &timings);
+    }
+    if (ret == 0) {
+        // Collects the holes left by the deletes; closes the database
+        uint64_t start = now_ns();
+        ret = do_gbcollect(&db_file, BENCH_DB, BENCH_TMP);
+        timings.ns[timings.count++] = now_ns() - start;
+        if (ret == 0) {
+            report_timings(report, "gbcollect", slots, fill, images,
+                           &timings);
+        }
+    } else {
+        do_close(&db_file);
+    }
+
+    free(timings.ns);
+    free(indices);
+    return ret;
+}
+
+int insert_images(struct pictdb_file* db_file, struct corpus* corpus,
+                  const char* prefix, uint32_t first, uint32_t count,
+                  struct timings* timings)
+{
+    int ret = 0;
+    for (uint32_t i = first; ret == 0 && i < first + count; ++i) {
+        char pict_id[MAX_PIC_ID + 1];
+        snprintf(pict_id, sizeof(pict_id), "%s%" PRIu32, prefix, i);
+        tag_image(corpus->image, i);
+        uint64_t start = now_ns();
+        ret = do_insert(corpus->image, corpus->size, pict_id, db_file);
+        if (timings != NULL) {
+            timings->ns[timings->count++] = now_ns() - start;
+        }
+    }
+    return ret;
+}
+
+int read_images(struct pictdb_file* db_file, const uint32_t* indices,
+                uint32_t count, int resolution, struct timings* timings)
+{
+    int ret = 0;
+    for (uint32_t i = 0; ret == 0 && i < count; ++i) {
+        char pict_id[MAX_PIC_ID + 1];
+        snprintf(pict_id, sizeof(pict_id), "i%" PRIu32, indices[i]);
+        char* image = NULL;
+        uint32_t size = 0;
+        uint64_t start = now_ns();
+        ret = do_read(pict_id, resolution, &image, &size, db_file);
+        timings->ns[timings->count++] = now_ns() - start;
+        free(image);
+    }
+    return ret;
+}
+
+void report_timings(struct report* report, const char* op, uint32_t slots,
+                    double fill, uint32_t images, struct timings* timings)
+{
+    const size_t n = timings->count;
+    qsort(timings->ns, n, sizeof(uint64_t), compare_ns);
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        total += timings->ns[i];
+    }
+
+    // Nearest rank percentiles
+#define PERCENTILE(p) timings->ns[(size_t)((p) * (n - 1) + 0.5)]
+    fprintf(report->out, "%s\n{\"op\":\"%s\",\"slots\":%" PRIu32
+            ",\"fill\":%g,\"images\":%" PRIu32 ",\"calls\":%zu"
+            ",\"total_ns\":%" PRIu64 ",\"mean_ns\":%" PRIu64
+            ",\"min_ns\":%" PRIu64 ",\"p50_ns\":%" PRIu64
+            ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+            ",\"max_ns\":%" PRIu64 "}", report->first ? "" : ",", op, slots,
+            fill, images, n, total, total / n, timings->ns[0],
+            PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99),
+            timings->ns[n - 1]);
+#undef PERCENTILE
+    fflush(report->out);
+    report->first = 0;
+
+    fprintf(stderr, "  %-12s %8zu calls, mean %10.1f us, p99 %10.1f us\n", op,
+            n, total / n / 1e3, timings->ns[(size_t)(0.99 * (n - 1) + 0.5)]
+            / 1e3);
+    timings->count = 0;
+}
+
+void help(void)
+{
+    printf("pictDB_bench [-sizes <N1,N2,...>] [-fills <F1,F2,...>] [-ops <N>]\n"
+           "             [-image <JPEG>] [-o <FILE>]\n"
+           "  Times the library on databases of each size (number of slots,\n"
+           "  default 1000,10000,100000), filled at each ratio (default\n"
+           "  0.1,0.5,0.9) with copies of the image (default: a generated\n"
+           "  %dx%d gradient). -ops is the number of timed calls per\n"
+           "  operation (default %d). Writes JSON to FILE (default %s).\n"
+           "  The databases are created in the current directory.\n",
+           IMAGE_WIDTH, IMAGE_HEIGHT, BENCH_OPS, BENCH_OUTPUT);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file bench_util.c
+ * @brief Helpers shared by the benchmark, load and corpus tools.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
+
+#include "bench_util.h"
+#include "error.h"
+#include <inttypes.h> // for PRIx32
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+int compare_ns(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+int tag_copy(const char* base, size_t base_size, char** image, size_t* size)
+{
+    // Only JPEGs can be numbered, after their start of image marker
+    if (base_size < 2 || (unsigned char) base[0] != 0xFF
+        || (unsigned char) base[1] != 0xD8) {
+        return ERR_VIPS;
+    }
+    *size = base_size + TAG_LEN;
+    *image = malloc(*size);
+    if (*image == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    // Marker, then the length of the segment: itself and 8 digits
+    const char segment[] = { '\xFF', '\xD8', '\xFF', '\xFE', 0, 10 };
+    memcpy(*image, segment, sizeof(segment));
+    memcpy(*image + TAG_LEN + 2, base + 2, base_size - 2);
+    return 0;
+}
+
+void tag_image(char* image, uint32_t number)
+{
+    char digits[9];
+    snprintf(digits, sizeof(digits), "%08" PRIx32, number);
+    memcpy(image + 6, digits, 8);
+}
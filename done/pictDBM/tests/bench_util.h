@@ -0,0 +1,56 @@
+/**
+ * @file bench_util.h
+ * @brief Helpers shared by the benchmark, load and corpus tools.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_BENCH_UTIL_H
+#define PICTDBPRJ_BENCH_UTIL_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#define TAG_LEN 12 // Size of the comment segment numbering an image
+
+/**
+ * @brief Reads a monotonic clock.
+ *
+ * @return The time, in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+/**
+ * @brief Draws a pseudo random number, the same sequence for a same state.
+ *
+ * @param state The state of the generator.
+ * @return The number, uniform in [0, 2^64).
+ */
+uint64_t next_random(uint64_t* state);
+
+/**
+ * @brief Compares two durations, for qsort.
+ */
+int compare_ns(const void* a, const void* b);
+
+/**
+ * @brief Copies a JPEG, with room for a comment segment numbering it.
+ *
+ * @param base The JPEG.
+ * @param base_size Its size.
+ * @param image Set to the copy, to be freed by the caller.
+ * @param size Set to its size, TAG_LEN more than base_size.
+ * @return 0 on success, ERR_VIPS if base is not a JPEG.
+ */
+int tag_copy(const char* base, size_t base_size, char** image, size_t* size);
+
+/**
+ * @brief Numbers a copy made by tag_copy.
+ *
+ * @param image The copy.
+ * @param number The number written in its comment segment.
+ */
+void tag_image(char* image, uint32_t number);
+
+#endif
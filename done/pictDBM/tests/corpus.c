@@ -0,0 +1,529 @@
+/**
+ * @file corpus.c
+ * @brief Generator of synthetic JPEG corpora for the benchmarks.
+ *
+ * The pixels of each image are computed from a pseudo random generator
+ * seeded by the seed of the corpus and the number of the image: smooth
+ * waves over a base color, plus noise whose amplitude (the detail) drives
+ * the size of the file like the quality does. vips only encodes them, so
+ * that a corpus is the same on every machine with the same libjpeg. A
+ * fraction of the images are byte for byte copies of earlier ones, to
+ * exercise deduplication.
+ *
+ * The images are written to a directory with a manifest.json describing
+ * each of them: its file, resolution, quality, detail, size, SHA-256 and
+ * the image it duplicates if any.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _DEFAULT_SOURCE // for M_PI
+
+#include "pictDB.h"
+#include "pictDBM_tools.h"
+#include "bench_util.h"
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <vips/vips.h>
+
+#define CORPUS_COUNT      100
+#define CORPUS_DIR        "corpus"
+#define CORPUS_RES        "320x240:2,640x480:4,1280x960:3,2592x1944:1"
+#define CORPUS_QUALITY    "75-90"
+#define CORPUS_DETAIL     "2-12"
+#define MAX_RESOLUTIONS   16     // Maximal number of resolutions of a corpus
+#define MAX_RES           8192   // Maximal width or height
+#define MAX_PATH          1024   // Maximal size of the path of a file
+#define NB_CHANNELS       3
+
+/**
+ * @brief A range of integers, from which values are drawn uniformly.
+ */
+struct range {
+    uint32_t min;
+    uint32_t max;
+};
+
+/**
+ * @brief Parameters of an image.
+ */
+struct image_params {
+    uint32_t width;
+    uint32_t height;
+    uint32_t quality;
+    uint32_t detail;
+};
+
+/**
+ * @brief Parameters of a corpus.
+ */
+struct corpus_options {
+    uint32_t count;
+    /**
+     * @brief Resolutions of the images, with their relative frequencies.
+     */
+    uint32_t widths[MAX_RESOLUTIONS];
+    uint32_t heights[MAX_RESOLUTIONS];
+    uint32_t weights[MAX_RESOLUTIONS];
+    size_t nb_resolutions;
+    /**
+     * @brief JPEG quality of the images.
+     */
+    struct range quality;
+    /**
+     * @brief Amplitude of the noise of the images, 0 for smooth ones.
+     */
+    struct range detail;
+    /**
+     * @brief Fraction of the images that are copies of earlier ones.
+     */
+    double duplicates;
+    uint64_t seed;
+    const char* dir;
+};
+
+/**
+ * @brief Parses the command line options.
+ *
+ * @param argc    The number of arguments.
+ * @param argv    The arguments.
+ * @param options Location where the options will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_options(int argc, char* argv[], struct corpus_options* options);
+
+/**
+ * @brief Parses a comma separated list of WIDTHxHEIGHT[:WEIGHT].
+ *
+ * @param str     The list.
+ * @param options The options whose resolutions are set.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_resolutions(const char* str, struct corpus_options* options);
+
+/**
+ * @brief Parses a range MIN-MAX, or a single value.
+ *
+ * @param str   The range.
+ * @param max   The maximal value allowed.
+ * @param range Location where the range will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_range(const char* str, uint32_t max, struct range* range);
+
+/**
+ * @brief Generates an image.
+ *
+ * @param random The generator of the image.
+ * @param params The parameters of the image.
+ * @param jpeg   Location where the JPEG, to be freed with g_free, will be
+ *               stored.
+ * @param size   Location where its size will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int generate_image(uint64_t* random, const struct image_params* params,
+                   void** jpeg, size_t* size);
+
+/**
+ * @brief Reads a file.
+ *
+ * @param path Its path.
+ * @param data Location where its bytes, to be freed, will be stored.
+ * @param size Location where its size will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int read_file(const char* path, char** data, size_t* size);
+
+/**
+ * @brief Writes a file.
+ *
+ * @param path Its path.
+ * @param data Its bytes.
+ * @param size Its size.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int write_file(const char* path, const void* data, size_t size);
+
+/**
+ * @brief Draws a pseudo random number in a range.
+ *
+ * @param state The state of the generator.
+ * @param range The range.
+ * @return The number.
+ */
+uint32_t random_in(uint64_t* state, struct range range);
+
+/**
+ * @brief Draws a pseudo random number in [0, 1).
+ *
+ * @param state The state of the generator.
+ * @return The number.
+ */
+double random_unit(uint64_t* state);
+
+/**
+ * @brief Prints the usage of the generator.
+ */
+void help(void);
+
+
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("Unable to start VIPS");
+    }
+
+    struct corpus_options options;
+    int ret = parse_options(argc - 1, argv + 1, &options);
+    if (ret == 0 && mkdir(options.dir, 0755) != 0 && errno != EEXIST) {
+        ret = ERR_IO;
+    }
+
+    char path[MAX_PATH];
+    FILE* manifest = NULL;
+    if (ret == 0) {
+        ret = snprintf(path, sizeof(path), "%s/manifest.json", options.dir)
+              < (int) sizeof(path) ? 0 : ERR_INVALID_FILENAME;
+    }
+    if (ret == 0) {
+        manifest = fopen(path, "w");
+        ret = manifest == NULL ? ERR_IO : 0;
+    }
+
+    // The images that are no copies, from which the copies are drawn
+    uint32_t* originals = NULL;
+    struct image_params* params = NULL;
+    if (ret == 0) {
+        originals = calloc(options.count, sizeof(uint32_t));
+        params = calloc(options.count, sizeof(struct image_params));
+        ret = originals == NULL || params == NULL ? ERR_OUT_OF_MEMORY : 0;
+    }
+    if (ret == 0) {
+        fprintf(manifest, "{\"seed\":%" PRIu64 ",\"count\":%" PRIu32
+                ",\"duplicates\":%g,\"images\":[", options.seed,
+                options.count, options.duplicates);
+    }
+
+    uint32_t nb_originals = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; ret == 0 && i < options.count; ++i) {
+        // Each image has its own generator: the first ones of a larger
+        // corpus are the same
+        uint64_t random = options.seed ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+        next_random(&random);
+
+        uint64_t pick = 0;
+        for (size_t r = 0; r < options.nb_resolutions; ++r) {
+            pick += options.weights[r];
+        }
+        pick = next_random(&random) % pick;
+        size_t res = 0;
+        while (pick >= options.weights[res]) {
+            pick -= options.weights[res++];
+        }
+        params[i].width = options.widths[res];
+        params[i].height = options.heights[res];
+        params[i].quality = random_in(&random, options.quality);
+        params[i].detail = random_in(&random, options.detail);
+        const int duplicate = nb_originals > 0
+                              && random_unit(&random) < options.duplicates;
+        const uint32_t pick_original = duplicate ?
+                                       next_random(&random) % nb_originals : 0;
+        const uint32_t original = duplicate ? originals[pick_original] : i;
+
+        char* data = NULL;
+        size_t size = 0;
+        void* jpeg = NULL;
+        if (duplicate) {
+            snprintf(path, sizeof(path), "%s/%06" PRIu32 ".jpg", options.dir,
+                     original);
+            ret = read_file(path, &data, &size);
+            params[i] = params[original];
+        } else {
+            ret = generate_image(&random, &params[i], &jpeg, &size);
+            data = jpeg;
+            originals[nb_originals++] = i;
+        }
+
+        unsigned char sha[SHA256_DIGEST_LENGTH];
+        char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+        if (ret == 0) {
+            snprintf(path, sizeof(path), "%s/%06" PRIu32 ".jpg", options.dir,
+                     i);
+            ret = write_file(path, data, size);
+        }
+        ret = ret == 0 ? compute_sha(data, size, sha) : ret;
+        if (ret == 0) {
+            sha_to_string(sha, sha_string);
+            fprintf(manifest, "%s\n{\"file\":\"%06" PRIu32 ".jpg\",\"pict_id\":"
+                    "\"%06" PRIu32 "\",\"width\":%" PRIu32 ",\"height\":%"
+                    PRIu32 ",\"quality\":%" PRIu32 ",\"detail\":%" PRIu32
+                    ",\"size\":%zu,\"sha256\":\"%s\",", i == 0 ? "" : ",", i,
+                    i, params[i].width, params[i].height, params[i].quality,
+                    params[i].detail, size, sha_string);
+            if (duplicate) {
+                fprintf(manifest, "\"duplicate_of\":\"%06" PRIu32 ".jpg\"}",
+                        original);
+            } else {
+                fprintf(manifest, "\"duplicate_of\":null}");
+            }
+            total += size;
+        }
+        if (duplicate) {
+            free(data);
+        } else {
+            g_free(jpeg);
+        }
+    }
+
+    if (manifest != NULL) {
+        fprintf(manifest, "\n]}\n");
+        if (fclose(manifest) != 0 && ret == 0) {
+            ret = ERR_IO;
+        }
+    }
+    free(originals);
+    free(params);
+
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+        if (ret == ERR_INVALID_ARGUMENT || ret == ERR_NOT_ENOUGH_ARGUMENTS) {
+            help();
+        }
+    } else {
+        printf("%" PRIu32 " images (%" PRIu32 " copies), %.1f MB in %s\n",
+               options.count, options.count - nb_originals, total / 1e6,
+               options.dir);
+    }
+
+    vips_shutdown();
+    return ret;
+}
+
+int parse_options(int argc, char* argv[], struct corpus_options* options)
+{
+    memset(options, 0, sizeof(struct corpus_options));
+    options->count = CORPUS_COUNT;
+    options->dir = CORPUS_DIR;
+    options->seed = 1;
+    int ret = parse_resolutions(CORPUS_RES, options);
+    ret = ret == 0 ? parse_range(CORPUS_QUALITY, 100, &options->quality) : ret;
+    ret = ret == 0 ? parse_range(CORPUS_DETAIL, 255, &options->detail) : ret;
+
+    for (int i = 0; ret == 0 && i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            options->count = atouint32(argv[i + 1]);
+            ret = options->count == 0 || options->count > MAX_MAX_FILES ?
+                  ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[i], "-res") == 0) {
+            ret = parse_resolutions(argv[i + 1], options);
+        } else if (strcmp(argv[i], "-quality") == 0) {
+            ret = parse_range(argv[i + 1], 100, &options->quality);
+            ret = ret == 0 && options->quality.min == 0 ?
+                  ERR_INVALID_ARGUMENT : ret;
+        } else if (strcmp(argv[i], "-detail") == 0) {
+            ret = parse_range(argv[i + 1], 255, &options->detail);
+        } else if (strcmp(argv[i], "-dup") == 0) {
+            char* end = NULL;
+            options->duplicates = strtod(argv[i + 1], &end);
+            ret = *end != '\0' || !(options->duplicates >= 0)
+                  || options->duplicates >= 1 ? ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            char* end = NULL;
+            options->seed = strtoull(argv[i + 1], &end, 10);
+            ret = end == argv[i + 1] || *end != '\0' ? ERR_INVALID_ARGUMENT :
+                  0;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            options->dir = argv[i + 1];
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+    return ret;
+}
+
+int parse_resolutions(const char* str, struct corpus_options* options)
+{
+    options->nb_resolutions = 0;
+    while (*str != '\0') {
+        const size_t i = options->nb_resolutions;
+        char* end = NULL;
+        unsigned long width = strtoul(str, &end, 10);
+        unsigned long height = 0;
+        unsigned long weight = 1;
+        if (*end == 'x') {
+            str = end + 1;
+            height = strtoul(str, &end, 10);
+        }
+        if (end != str && *end == ':') {
+            str = end + 1;
+            weight = strtoul(str, &end, 10);
+        }
+        if (end == str || (*end != ',' && *end != '\0') || width == 0
+            || width > MAX_RES || height == 0 || height > MAX_RES
+            || weight == 0 || weight > UINT16_MAX || i == MAX_RESOLUTIONS) {
+            return ERR_RESOLUTIONS;
+        }
+        options->widths[i] = (uint32_t) width;
+        options->heights[i] = (uint32_t) height;
+        options->weights[i] = (uint32_t) weight;
+        ++options->nb_resolutions;
+        str = *end == ',' ? end + 1 : end;
+    }
+    return options->nb_resolutions == 0 ? ERR_RESOLUTIONS : 0;
+}
+
+int parse_range(const char* str, uint32_t max, struct range* range)
+{
+    char* end = NULL;
+    unsigned long min = strtoul(str, &end, 10);
+    unsigned long top = min;
+    if (end != str && *end == '-') {
+        str = end + 1;
+        top = strtoul(str, &end, 10);
+    }
+    if (end == str || *end != '\0' || min > top || top > max) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    range->min = (uint32_t) min;
+    range->max = (uint32_t) top;
+    return 0;
+}
+
+int generate_image(uint64_t* random, const struct image_params* params,
+                   void** jpeg, size_t* size)
+{
+    const uint32_t width = params->width;
+    const uint32_t height = params->height;
+    const uint32_t detail = params->detail;
+    const size_t row = (size_t) width * NB_CHANNELS;
+    unsigned char* pixels = malloc(row * height);
+    double* waves = calloc(((size_t) width + height) * NB_CHANNELS,
+                           sizeof(double));
+    if (pixels == NULL || waves == NULL) {
+        free(pixels);
+        free(waves);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Per channel, a base color and a wave along each axis
+    double base[NB_CHANNELS];
+    double* along_x = waves;
+    double* along_y = waves + (size_t) width * NB_CHANNELS;
+    for (int c = 0; c < NB_CHANNELS; ++c) {
+        base[c] = 40 + 175 * random_unit(random);
+        for (int axis = 0; axis < 2; ++axis) {
+            const uint32_t len = axis == 0 ? width : height;
+            double* wave = axis == 0 ? along_x : along_y;
+            const double amplitude = 10 + 30 * random_unit(random);
+            const double periods = 0.5 + 3.5 * random_unit(random);
+            const double phase = 2 * M_PI * random_unit(random);
+            for (uint32_t i = 0; i < len; ++i) {
+                wave[i * NB_CHANNELS + c] =
+                    amplitude * sin(2 * M_PI * periods * i / len + phase);
+            }
+        }
+    }
+
+    for (uint32_t y = 0; y < height; ++y) {
+        unsigned char* pixel = pixels + y * row;
+        for (uint32_t x = 0; x < width; ++x) {
+            // One draw gives the noise of the three channels
+            uint64_t noise = next_random(random);
+            for (int c = 0; c < NB_CHANNELS; ++c) {
+                double value = base[c] + along_x[x * NB_CHANNELS + c]
+                               + along_y[y * NB_CHANNELS + c];
+                if (detail > 0) {
+                    value += (double)((noise & 0xFFFF) % (2 * detail + 1))
+                             - detail;
+                    noise >>= 16;
+                }
+                *pixel++ = (unsigned char)(value < 0 ? 0 :
+                                           value > 255 ? 255 : value + 0.5);
+            }
+        }
+    }
+    free(waves);
+
+    int ret = 0;
+    VipsImage* image = vips_image_new_from_memory(pixels, row * height,
+                                                  (int) width, (int) height,
+                                                  NB_CHANNELS,
+                                                  VIPS_FORMAT_UCHAR);
+    if (image == NULL
+        || vips_jpegsave_buffer(image, jpeg, size, "Q", (int) params->quality,
+                                 NULL)) {
+        ret = ERR_VIPS;
+    }
+    if (image != NULL) {
+        g_object_unref(image);
+    }
+    free(pixels);
+    return ret;
+}
+
+int read_file(const char* path, char** data, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    int ret = 0;
+    long len = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    *data = len > 0 ? malloc((size_t) len) : NULL;
+    if (*data == NULL) {
+        ret = len > 0 ? ERR_OUT_OF_MEMORY : ERR_IO;
+    } else if (fseek(file, 0, SEEK_SET) != 0
+               || fread(*data, (size_t) len, 1, file) != 1) {
+        ret = ERR_IO;
+    }
+    *size = (size_t) len;
+    fclose(file);
+    return ret;
+}
+
+int write_file(const char* path, const void* data, size_t size)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+    int ret = fwrite(data, size, 1, file) == 1 ? 0 : ERR_IO;
+    if (fclose(file) != 0) {
+        ret = ERR_IO;
+    }
+    return ret;
+}
+
+uint32_t random_in(uint64_t* state, struct range range)
+{
+    return range.min + (uint32_t)(next_random(state)
+                                  % ((uint64_t) range.max - range.min + 1));
+}
+
+double random_unit(uint64_t* state)
+{
+    return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+void help(void)
+{
+    printf("pictDB_corpus [-n <COUNT>] [-res <WxH[:WEIGHT],...>]\n"
+           "              [-quality <MIN-MAX>] [-detail <MIN-MAX>]\n"
+           "              [-dup <RATIO>] [-seed <SEED>] [-o <DIR>]\n"
+           "  Generates COUNT JPEGs (default %d) in DIR (default %s), with a\n"
+           "  manifest.json. Resolutions are drawn with their weights\n"
+           "  (default %s),\n"
+           "  quality (default %s) and detail, the amplitude of the noise\n"
+           "  (0-255, default %s), uniformly: larger details and qualities\n"
+           "  give larger files. A RATIO of the images (default 0) are\n"
+           "  copies of earlier ones. The same SEED (default 1) gives the\n"
+           "  same corpus.\n",
+           CORPUS_COUNT, CORPUS_DIR, CORPUS_RES, CORPUS_QUALITY,
+           CORPUS_DETAIL);
+}
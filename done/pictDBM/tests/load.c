@@ -0,0 +1,1017 @@
+/**
+ * @file load.c
+ * @brief Load generator for pictDB_server.
+ *
+ * Each connection is driven by a thread sending one request at a time over
+ * a kept alive HTTP/1.1 connection, picking the operation of each request
+ * at random in a weighted mix. Reads pick their image among those listed
+ * by the server at start, with a Zipfian popularity. Inserts send numbered
+ * copies of an image, which the deletes then remove; those left are deleted
+ * at the end of the run. The latency of every request is kept, to report
+ * exact percentiles.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getaddrinfo
+
+#include "pictDB.h"
+#include "pictDBM_tools.h"
+#include "bench_util.h"
+#include <ctype.h>  // for isalnum
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <strings.h> // for strncasecmp
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_CONNECTIONS 16     // Default number of connections
+#define MAX_CONNECTIONS  4096   // Maximal number of connections
+#define LOAD_DURATION    10     // Default duration of a run, in seconds
+#define LOAD_ZIPF        0.99   // Default exponent of the popularity
+#define LOAD_MIX         "thumb=50,small=25,orig=15,list=4,insert=3,delete=3"
+#define RECV_BUFFER      65536  // Size of the buffer of a connection
+#define MAX_REQUEST      512    // Maximal size of the headers of a request
+#define BOUNDARY         "pictDBloadBoundary"
+#define LOAD_SEED        0x9e3779b97f4a7c15ULL
+
+/**
+ * @brief The operations of the mix.
+ */
+enum load_op {
+    OP_LIST,
+    OP_THUMB,
+    OP_SMALL,
+    OP_ORIG,
+    OP_INSERT,
+    OP_DELETE,
+    NB_OPS
+};
+
+static const char* const OP_NAMES[NB_OPS] = {
+    "list", "thumb", "small", "orig", "insert", "delete"
+};
+
+/**
+ * @brief Parameters of a run.
+ */
+struct load_options {
+    const char* host;
+    const char* port;
+    uint32_t connections;
+    /**
+     * @brief Duration of the run, in seconds.
+     */
+    uint32_t duration;
+    /**
+     * @brief Relative frequencies of the operations.
+     */
+    uint32_t weights[NB_OPS];
+    /**
+     * @brief Exponent of the Zipfian popularity of the images read, 0 for
+     *        a uniform one.
+     */
+    double zipf;
+    /**
+     * @brief JPEG inserted, needed if the mix has inserts.
+     */
+    const char* image;
+    /**
+     * @brief File of the JSON results, NULL for none.
+     */
+    const char* output;
+};
+
+/**
+ * @brief The images read, from the most to the least popular.
+ */
+struct population {
+    char** ids;
+    uint32_t count;
+    /**
+     * @brief Cumulated probabilities of the images.
+     */
+    double* cdf;
+};
+
+/**
+ * @brief Latencies of the requests of an operation.
+ */
+struct samples {
+    uint64_t* ns;
+    size_t count;
+    size_t size;
+};
+
+/**
+ * @brief A connection and its thread.
+ */
+struct worker {
+    pthread_t thread;
+    uint32_t number;
+    const struct load_options* options;
+    const struct population* population;
+    const struct sockaddr* address;
+    socklen_t address_len;
+    int sock;
+    /**
+     * @brief The start of the body of the last response.
+     */
+    char* buffer;
+    size_t buffer_size;
+    /**
+     * @brief Copy of the inserted JPEG, with a comment segment numbering it.
+     */
+    char* image;
+    size_t image_size;
+    /**
+     * @brief Numbers of the next image inserted and of the next deleted:
+     *        the images in between are in the database.
+     */
+    uint32_t next_insert;
+    uint32_t next_delete;
+    /**
+     * @brief The X-Next-Cursor of the last response, UINT32_MAX if none.
+     */
+    uint32_t next_cursor;
+    uint64_t random;
+    struct samples samples[NB_OPS];
+    uint64_t errors[NB_OPS];
+    /**
+     * @brief Number of bytes of the bodies received.
+     */
+    uint64_t bytes;
+};
+
+/**
+ * @brief Statistics of an operation, over all the connections.
+ */
+struct op_stats {
+    uint64_t requests;
+    uint64_t errors;
+    double mean_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+
+volatile int s_stop = 0;   // Set when the run is over
+char s_run[16] = "";       // Identifies the images inserted by this run
+char* s_base_image = NULL; // The inserted JPEG
+size_t s_base_size = 0;
+
+/**
+ * @brief Parses the command line options.
+ *
+ * @param argc    The number of arguments.
+ * @param argv    The arguments.
+ * @param options Location where the options will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_options(int argc, char* argv[], struct load_options* options);
+
+/**
+ * @brief Parses a mix, a comma separated list of op=weight.
+ *
+ * @param str     The mix.
+ * @param weights Location where the weights will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int parse_mix(const char* str, uint32_t* weights);
+
+/**
+ * @brief Reads the inserted JPEG.
+ *
+ * @param path The file of the image.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int load_image(const char* path);
+
+/**
+ * @brief Lists the images of the server, a page at a time, and sets their
+ *        popularity.
+ *
+ * @param worker     A worker, whose connection is used.
+ * @param zipf       The exponent of the popularity.
+ * @param population Location where the images will be stored.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int list_population(struct worker* worker, double zipf,
+                    struct population* population);
+
+/**
+ * @brief Adds to a population the images of a page of a binary list.
+ *
+ * @param population The population.
+ * @param data       The page.
+ * @param size       Its size.
+ * @return 0 in case of success, an error code otherwise.
+ */
+int add_population(struct population* population, const unsigned char* data,
+                   size_t size);
+
+/**
+ * @brief Frees the images of a population.
+ *
+ * @param population The population.
+ */
+void free_population(struct population* population);
+
+/**
+ * @brief Sends requests until the end of the run, then deletes the images
+ *        it inserted.
+ *
+ * @param arg The worker.
+ * @return NULL.
+ */
+void* run_worker(void* arg);
+
+/**
+ * @brief Sends a request of an operation and waits for its response.
+ *
+ * @param worker The worker.
+ * @param op     The operation.
+ * @return 0 if a successful response was received, an error code otherwise.
+ */
+int send_op(struct worker* worker, enum load_op op);
+
+/**
+ * @brief Sends a request, connecting first if need be, and receives the
+ *        body of its response in the buffer of the worker.
+ *
+ * @param worker   The worker.
+ * @param request  The headers of the request.
+ * @param len      The size of the headers.
+ * @param body     The body of the request, NULL if none.
+ * @param body_len The size of the body.
+ * @param status   Location where the status of the response will be stored.
+ * @param size     Location where the size of its body will be stored; only
+ *                 its first buffer_size bytes are kept.
+ * @return 0 if a response was received, an error code otherwise (the
+ *         connection is then closed).
+ */
+int exchange(struct worker* worker, const char* request, size_t len,
+             const char* body, size_t body_len, int* status, size_t* size);
+
+/**
+ * @brief Sends all the bytes of a buffer.
+ *
+ * @param sock The socket.
+ * @param data The bytes.
+ * @param len  The number of bytes.
+ * @return 0 in case of success, ERR_IO otherwise.
+ */
+int send_all(int sock, const char* data, size_t len);
+
+/**
+ * @brief Closes the connection of a worker, if open.
+ *
+ * @param worker The worker.
+ */
+void disconnect(struct worker* worker);
+
+/**
+ * @brief Records the latency of a request.
+ *
+ * @param samples The latencies of its operation.
+ * @param ns      The latency, in nanoseconds.
+ * @return 0 in case of success, ERR_OUT_OF_MEMORY otherwise.
+ */
+int record(struct samples* samples, uint64_t ns);
+
+/**
+ * @brief Merges the latencies of an operation of all the workers and
+ *        computes their statistics.
+ *
+ * @param workers The workers.
+ * @param count   The number of workers.
+ * @param op      The operation, NB_OPS for all of them.
+ * @param stats   Location where the statistics will be stored.
+ * @return 0 in case of success, ERR_OUT_OF_MEMORY otherwise.
+ */
+int merge_stats(const struct worker* workers, uint32_t count, int op,
+                struct op_stats* stats);
+
+/**
+ * @brief Prints the statistics of an operation, and adds them to the JSON
+ *        results if any.
+ *
+ * @param name     The name of the operation.
+ * @param stats    Its statistics.
+ * @param duration The duration of the run, in seconds.
+ * @param json     The JSON results, NULL if none.
+ * @param first    Whether these are the first JSON results.
+ */
+void print_stats(const char* name, const struct op_stats* stats,
+                 double duration, FILE* json, int first);
+
+/**
+ * @brief Prints the usage of the load generator.
+ */
+void help(void);
+
+
+int main(int argc, char* argv[])
+{
+    struct load_options options;
+    int ret = parse_options(argc - 1, argv + 1, &options);
+    if (ret == 0 && options.image != NULL) {
+        ret = load_image(options.image);
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo* address = NULL;
+    if (ret == 0 && getaddrinfo(options.host, options.port, &hints,
+                                &address) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", options.host, options.port);
+        ret = ERR_INVALID_ARGUMENT;
+    }
+
+    struct worker* workers = NULL;
+    if (ret == 0) {
+        workers = calloc(options.connections, sizeof(struct worker));
+        ret = workers == NULL ? ERR_OUT_OF_MEMORY : 0;
+    }
+    uint32_t started = 0;
+    for (uint32_t i = 0; ret == 0 && i < options.connections; ++i) {
+        struct worker* worker = &workers[i];
+        worker->number = i;
+        worker->options = &options;
+        worker->address = address->ai_addr;
+        worker->address_len = address->ai_addrlen;
+        worker->sock = -1;
+        worker->random = LOAD_SEED + i;
+        worker->buffer_size = RECV_BUFFER;
+        worker->buffer = malloc(worker->buffer_size + 1);
+        ret = worker->buffer == NULL ? ERR_OUT_OF_MEMORY : 0;
+        if (ret == 0 && s_base_image != NULL) {
+            ret = tag_copy(s_base_image, s_base_size, &worker->image,
+                           &worker->image_size);
+        }
+    }
+
+    struct population population = {.ids = NULL, .count = 0, .cdf = NULL};
+    ret = ret == 0 ? list_population(&workers[0], options.zipf, &population) :
+          ret;
+    if (ret == 0 && population.count == 0
+        && (options.weights[OP_THUMB] != 0 || options.weights[OP_SMALL] != 0
+            || options.weights[OP_ORIG] != 0)) {
+        fprintf(stderr, "The database has no image to read\n");
+        ret = ERR_FILE_NOT_FOUND;
+    }
+
+    uint64_t start = now_ns();
+    if (ret == 0) {
+        snprintf(s_run, sizeof(s_run), "%lx", (unsigned long) time(NULL));
+        printf("%" PRIu32 " connections to %s:%s for %" PRIu32 " s, %" PRIu32
+               " images, zipf %g\n", options.connections, options.host,
+               options.port, options.duration, population.count, options.zipf);
+        fflush(stdout);
+        for (; started < options.connections; ++started) {
+            workers[started].population = &population;
+            if (pthread_create(&workers[started].thread, NULL, run_worker,
+                               &workers[started]) != 0) {
+                ret = ERR_OUT_OF_MEMORY;
+                break;
+            }
+        }
+    }
+    if (ret == 0) {
+        struct timespec duration = {.tv_sec = options.duration};
+        while (nanosleep(&duration, &duration) != 0) {
+            // Interrupted: sleep the rest
+        }
+    }
+    s_stop = 1;
+    const uint64_t end = now_ns();
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (ret == 0) {
+        FILE* json = NULL;
+        if (options.output != NULL) {
+            json = fopen(options.output, "w");
+            ret = json == NULL ? ERR_IO : 0;
+        }
+        const double duration = (end - start) / 1e9;
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < options.connections; ++i) {
+            bytes += workers[i].bytes;
+        }
+        if (json != NULL) {
+            fprintf(json, "{\"connections\":%" PRIu32 ",\"duration\":%.3f"
+                    ",\"images\":%" PRIu32 ",\"zipf\":%g,\"bytes\":%" PRIu64
+                    ",\"results\":[", options.connections, duration,
+                    population.count, options.zipf, bytes);
+        }
+
+        printf("%-8s %10s %8s %10s %9s %9s %9s %9s %9s\n", "op", "requests",
+               "errors", "req/s", "mean ms", "p50 ms", "p99 ms", "p999 ms",
+               "max ms");
+        int first = 1;
+        for (int op = 0; ret == 0 && op <= NB_OPS; ++op) {
+            struct op_stats stats;
+            if (op < NB_OPS && options.weights[op] == 0) {
+                continue;
+            }
+            ret = merge_stats(workers, options.connections, op, &stats);
+            if (ret == 0) {
+                print_stats(op < NB_OPS ? OP_NAMES[op] : "all", &stats,
+                            duration, json, first);
+                first = 0;
+            }
+        }
+        printf("%.1f MB/s received\n", bytes / duration / 1e6);
+
+        if (json != NULL) {
+            fprintf(json, "]}\n");
+            if (fclose(json) != 0 && ret == 0) {
+                ret = ERR_IO;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; workers != NULL && i < options.connections; ++i) {
+        disconnect(&workers[i]);
+        free(workers[i].buffer);
+        free(workers[i].image);
+        for (int op = 0; op < NB_OPS; ++op) {
+            free(workers[i].samples[op].ns);
+        }
+    }
+    free(workers);
+    free_population(&population);
+    free(s_base_image);
+    if (address != NULL) {
+        freeaddrinfo(address);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+        if (ret == ERR_INVALID_ARGUMENT || ret == ERR_NOT_ENOUGH_ARGUMENTS) {
+            help();
+        }
+    }
+    return ret;
+}
+
+int parse_options(int argc, char* argv[], struct load_options* options)
+{
+    memset(options, 0, sizeof(struct load_options));
+    options->host = "127.0.0.1";
+    options->port = "8000";
+    options->connections = LOAD_CONNECTIONS;
+    options->duration = LOAD_DURATION;
+    options->zipf = LOAD_ZIPF;
+    int ret = parse_mix(LOAD_MIX, options->weights);
+    int mix = 0;
+
+    for (int i = 0; ret == 0 && i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if (strcmp(argv[i], "-host") == 0) {
+            options->host = argv[i + 1];
+        } else if (strcmp(argv[i], "-port") == 0) {
+            options->port = argv[i + 1];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            options->connections = atouint32(argv[i + 1]);
+            ret = options->connections == 0
+                  || options->connections > MAX_CONNECTIONS ?
+                  ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            options->duration = atouint32(argv[i + 1]);
+            ret = options->duration == 0 ? ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[i], "-mix") == 0) {
+            ret = parse_mix(argv[i + 1], options->weights);
+            mix = 1;
+        } else if (strcmp(argv[i], "-zipf") == 0) {
+            char* end = NULL;
+            options->zipf = strtod(argv[i + 1], &end);
+            ret = *end != '\0' || !(options->zipf >= 0) ?
+                  ERR_INVALID_ARGUMENT : 0;
+        } else if (strcmp(argv[i], "-image") == 0) {
+            options->image = argv[i + 1];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            options->output = argv[i + 1];
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    // Without an image, the default mix only reads
+    if (ret == 0 && !mix && options->image == NULL) {
+        options->weights[OP_INSERT] = options->weights[OP_DELETE] = 0;
+    }
+    // Deletes remove the images inserted
+    if (ret == 0 && options->weights[OP_DELETE] != 0
+        && options->weights[OP_INSERT] == 0) {
+        ret = ERR_INVALID_ARGUMENT;
+    }
+    if (ret == 0 && options->weights[OP_INSERT] != 0
+        && options->image == NULL) {
+        fprintf(stderr, "Inserts need an image (-image)\n");
+        ret = ERR_INVALID_ARGUMENT;
+    }
+    return ret;
+}
+
+int parse_mix(const char* str, uint32_t* weights)
+{
+    memset(weights, 0, NB_OPS * sizeof(uint32_t));
+    uint64_t total = 0;
+    while (*str != '\0') {
+        const size_t len = strcspn(str, "=");
+        int op = 0;
+        while (op < NB_OPS && (strlen(OP_NAMES[op]) != len
+                               || strncmp(str, OP_NAMES[op], len) != 0)) {
+            ++op;
+        }
+        if (op == NB_OPS || str[len] != '=') {
+            return ERR_INVALID_ARGUMENT;
+        }
+        char* end = NULL;
+        unsigned long weight = strtoul(str + len + 1, &end, 10);
+        if (end == str + len + 1 || (*end != ',' && *end != '\0')
+            || weight > UINT16_MAX) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        weights[op] = (uint32_t) weight;
+        total += weight;
+        str = *end == ',' ? end + 1 : end;
+    }
+    return total == 0 ? ERR_INVALID_ARGUMENT : 0;
+}
+
+int load_image(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    int ret = 0;
+    long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    s_base_image = size > 0 ? malloc((size_t) size) : NULL;
+    if (s_base_image == NULL) {
+        ret = size > 0 ? ERR_OUT_OF_MEMORY : ERR_IO;
+    } else if (fseek(file, 0, SEEK_SET) != 0
+               || fread(s_base_image, (size_t) size, 1, file) != 1) {
+        ret = ERR_IO;
+    }
+    fclose(file);
+    s_base_size = (size_t) size;
+    return ret;
+}
+
+int list_population(struct worker* worker, double zipf,
+                    struct population* population)
+{
+    // The server lists a page at a time: follow its next cursor
+    uint32_t cursor = 0;
+    int status = 0;
+    int ret = 0;
+    do {
+        char request[MAX_REQUEST];
+        const int len = snprintf(request, sizeof(request),
+                                 "GET /pictDB/list?format=binary&fields=id"
+                                 "&cursor=%" PRIu32 " HTTP/1.1\r\n"
+                                 "Host: pictDB\r\n\r\n", cursor);
+        size_t size = 0;
+        ret = exchange(worker, request, len, NULL, 0, &status, &size);
+        if (ret == 0 && status == 200 && size > worker->buffer_size) {
+            // Ask again with a buffer large enough for the whole page
+            char* buffer = realloc(worker->buffer, size + 1);
+            if (buffer == NULL) {
+                return ERR_OUT_OF_MEMORY;
+            }
+            worker->buffer = buffer;
+            worker->buffer_size = size;
+            ret = exchange(worker, request, len, NULL, 0, &status, &size);
+        }
+        if (ret == 0 && (status != 200 || size > worker->buffer_size
+                         || size < 5
+                         || memcmp(worker->buffer, "PDBL", 4) != 0)) {
+            ret = ERR_IO;
+        }
+        ret = ret == 0 ? add_population(population, (const unsigned char*)
+                                        worker->buffer, size) : ret;
+        cursor = worker->next_cursor;
+    } while (ret == 0 && cursor != UINT32_MAX);
+    disconnect(worker);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot list the images of the server (status %d)\n",
+                status);
+        return ret;
+    }
+
+    population->cdf = calloc(population->count + 1, sizeof(double));
+    if (population->cdf == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Random ranks, so that popularity does not follow the slots
+    uint64_t random = LOAD_SEED;
+    for (uint32_t i = population->count; i > 1; --i) {
+        uint32_t j = (uint32_t)(next_random(&random) % i);
+        char* swap = population->ids[i - 1];
+        population->ids[i - 1] = population->ids[j];
+        population->ids[j] = swap;
+    }
+    double total = 0;
+    for (uint32_t i = 0; i < population->count; ++i) {
+        total += 1.0 / pow(i + 1.0, zipf);
+        population->cdf[i] = total;
+    }
+    for (uint32_t i = 0; i < population->count; ++i) {
+        population->cdf[i] /= total;
+    }
+    return 0;
+}
+
+int add_population(struct population* population, const unsigned char* data,
+                   size_t size)
+{
+    // Records of a 1, the length of the ID and the ID
+    uint32_t count = 0;
+    for (size_t i = 5; i + 1 < size && data[i] == 1; i += 2 + data[i + 1]) {
+        ++count;
+    }
+    char** ids = realloc(population->ids,
+                         (population->count + count + 1) * sizeof(char*));
+    if (ids == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    population->ids = ids;
+    for (size_t i = 5; i + 1 < size && data[i] == 1; i += 2 + data[i + 1]) {
+        const size_t len = data[i + 1];
+        // The server does not decode the query: skip IDs needing escapes
+        const char* id = (const char*) data + i + 2;
+        size_t safe = 0;
+        while (safe < len && (isalnum((unsigned char) id[safe])
+                              || strchr("-._~", id[safe]) != NULL)) {
+            ++safe;
+        }
+        if (safe == len && len > 0 && i + 2 + len <= size) {
+            char* copy = strndup(id, len);
+            if (copy == NULL) {
+                return ERR_OUT_OF_MEMORY;
+            }
+            population->ids[population->count++] = copy;
+        }
+    }
+    return 0;
+}
+
+void free_population(struct population* population)
+{
+    for (uint32_t i = 0; population->ids != NULL && i < population->count;
+         ++i) {
+        free(population->ids[i]);
+    }
+    free(population->ids);
+    free(population->cdf);
+}
+
+void* run_worker(void* arg)
+{
+    struct worker* worker = arg;
+    const uint32_t* weights = worker->options->weights;
+    uint64_t total = 0;
+    for (int op = 0; op < NB_OPS; ++op) {
+        total += weights[op];
+    }
+
+    while (!s_stop) {
+        uint64_t pick = next_random(&worker->random) % total;
+        int op = 0;
+        while (pick >= weights[op]) {
+            pick -= weights[op++];
+        }
+        // Deletes remove the images inserted: without any, insert one
+        if (op == OP_DELETE && worker->next_delete == worker->next_insert) {
+            op = OP_INSERT;
+        }
+
+        const uint64_t start = now_ns();
+        int ret = send_op(worker, op);
+        if (ret == 0) {
+            ret = record(&worker->samples[op], now_ns() - start);
+        } else {
+            ++worker->errors[op];
+        }
+        if (ret == ERR_OUT_OF_MEMORY) {
+            break;
+        }
+    }
+
+    // Leave the database as it was found
+    while (worker->next_delete != worker->next_insert
+           && send_op(worker, OP_DELETE) == 0) {
+        ;
+    }
+    return NULL;
+}
+
+int send_op(struct worker* worker, enum load_op op)
+{
+    static const char* const resolutions[] = { "thumb", "small", "orig" };
+    char request[MAX_REQUEST];
+    char pict_id[MAX_PIC_ID + 1];
+    const char* body = NULL;
+    size_t body_len = 0;
+    int len = 0;
+
+    switch (op) {
+    case OP_LIST:
+        len = snprintf(request, sizeof(request), "GET /pictDB/list HTTP/1.1"
+                       "\r\nHost: pictDB\r\n\r\n");
+        break;
+    case OP_THUMB:
+    case OP_SMALL:
+    case OP_ORIG: {
+        // The first image with a cumulated probability above a uniform one
+        const struct population* population = worker->population;
+        const double u = (next_random(&worker->random) >> 11) * 0x1.0p-53;
+        uint32_t low = 0;
+        uint32_t high = population->count - 1;
+        while (low < high) {
+            const uint32_t middle = low + (high - low) / 2;
+            if (population->cdf[middle] <= u) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        len = snprintf(request, sizeof(request), "GET /pictDB/read?res=%s"
+                       "&pict_id=%s HTTP/1.1\r\nHost: pictDB\r\n\r\n",
+                       resolutions[op - OP_THUMB], population->ids[low]);
+        break;
+    }
+    case OP_INSERT: {
+        snprintf(pict_id, sizeof(pict_id), "load-%s-%" PRIu32 "-%" PRIu32,
+                 s_run, worker->number, worker->next_insert);
+        // Distinct images, so that none is deduplicated
+        tag_image(worker->image,
+                  worker->number * 0x10000 + worker->next_insert);
+
+        // A multipart form, the image being its file
+        const char* part_start = "--" BOUNDARY "\r\nContent-Disposition: "
+                                 "form-data; name=\"up_file\"; filename=\"";
+        const char* part_end = "\"\r\nContent-Type: image/jpeg\r\n\r\n";
+        const char* form_end = "\r\n--" BOUNDARY "--\r\n";
+        const size_t total = strlen(part_start) + strlen(pict_id)
+                             + strlen(part_end) + worker->image_size
+                             + strlen(form_end);
+        len = snprintf(request, sizeof(request), "POST /pictDB/insert "
+                       "HTTP/1.1\r\nHost: pictDB\r\nContent-Type: multipart/"
+                       "form-data; boundary=" BOUNDARY "\r\nContent-Length: "
+                       "%zu\r\n\r\n%s%s%s", total, part_start, pict_id,
+                       part_end);
+        // The image and the end of the form are sent as the body
+        const size_t tail = worker->image_size + strlen(form_end);
+        char* form = malloc(tail);
+        if (form == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        memcpy(form, worker->image, worker->image_size);
+        memcpy(form + worker->image_size, form_end, strlen(form_end));
+        int status = 0;
+        size_t size = 0;
+        int ret = len > 0 && (size_t) len < sizeof(request) ?
+                  exchange(worker, request, len, form, tail, &status, &size) :
+                  ERR_INVALID_ARGUMENT;
+        free(form);
+        if (ret == 0 && status == 302) {
+            ++worker->next_insert;
+        }
+        return ret != 0 ? ret : status == 302 ? 0 : ERR_IO;
+    }
+    case OP_DELETE:
+        snprintf(pict_id, sizeof(pict_id), "load-%s-%" PRIu32 "-%" PRIu32,
+                 s_run, worker->number, worker->next_delete++);
+        len = snprintf(request, sizeof(request), "GET /pictDB/delete?pict_id="
+                       "%s HTTP/1.1\r\nHost: pictDB\r\n\r\n", pict_id);
+        break;
+    default:
+        return ERR_INVALID_COMMAND;
+    }
+
+    if (len <= 0 || (size_t) len >= sizeof(request)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int status = 0;
+    size_t size = 0;
+    int ret = exchange(worker, request, len, body, body_len, &status, &size);
+    if (ret == 0) {
+        ret = status == 200 || status == 302 ? 0 : ERR_IO;
+    }
+    return ret;
+}
+
+int exchange(struct worker* worker, const char* request, size_t len,
+             const char* body, size_t body_len, int* status, size_t* size)
+{
+    if (worker->sock < 0) {
+        worker->sock = socket(worker->address->sa_family, SOCK_STREAM, 0);
+        const int on = 1;
+        if (worker->sock < 0
+            || connect(worker->sock, worker->address,
+                       worker->address_len) != 0
+            || setsockopt(worker->sock, IPPROTO_TCP, TCP_NODELAY, &on,
+                          sizeof(on)) != 0) {
+            disconnect(worker);
+            return ERR_IO;
+        }
+    }
+
+    int ret = send_all(worker->sock, request, len);
+    if (ret == 0 && body != NULL) {
+        ret = send_all(worker->sock, body, body_len);
+    }
+
+    // Receive the headers, then the body they announce
+    size_t received = 0;
+    char* end = NULL;
+    while (ret == 0 && end == NULL) {
+        ssize_t n = received < worker->buffer_size ?
+                    recv(worker->sock, worker->buffer + received,
+                         worker->buffer_size - received, 0) : -1;
+        if (n <= 0) {
+            ret = ERR_IO;
+        } else {
+            received += (size_t) n;
+            worker->buffer[received] = '\0';
+            end = strstr(worker->buffer, "\r\n\r\n");
+        }
+    }
+
+    int close_after = 0;
+    size_t length = 0;
+    worker->next_cursor = UINT32_MAX;
+    if (ret == 0 && sscanf(worker->buffer, "HTTP/1.%*d %d", status) != 1) {
+        ret = ERR_IO;
+    }
+    for (char* line = strstr(worker->buffer, "\r\n"); ret == 0 && line < end;
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            length = strtoull(line + 17, NULL, 10);
+        } else if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+            close_after = 1;
+        } else if (strncasecmp(line + 2, "X-Next-Cursor:", 14) == 0) {
+            worker->next_cursor = (uint32_t) strtoul(line + 16, NULL, 10);
+        }
+    }
+
+    if (ret == 0) {
+        // Keep the start of the body at the start of the buffer
+        const size_t headers = (size_t)(end + 4 - worker->buffer);
+        size_t have = received - headers;
+        memmove(worker->buffer, end + 4, have);
+        while (have < length) {
+            // Beyond the buffer, the body is only counted
+            const size_t kept = have < worker->buffer_size ? have : 0;
+            ssize_t n = recv(worker->sock, worker->buffer + kept,
+                             worker->buffer_size - kept, 0);
+            if (n <= 0) {
+                ret = ERR_IO;
+                break;
+            }
+            have += (size_t) n;
+        }
+        *size = length;
+        worker->bytes += length;
+    }
+
+    if (ret != 0 || close_after) {
+        disconnect(worker);
+    }
+    return ret;
+}
+
+int send_all(int sock, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+void disconnect(struct worker* worker)
+{
+    if (worker->sock >= 0) {
+        close(worker->sock);
+        worker->sock = -1;
+    }
+}
+
+int record(struct samples* samples, uint64_t ns)
+{
+    if (samples->count == samples->size) {
+        const size_t size = samples->size == 0 ? 1024 : 2 * samples->size;
+        uint64_t* grown = realloc(samples->ns, size * sizeof(uint64_t));
+        if (grown == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        samples->ns = grown;
+        samples->size = size;
+    }
+    samples->ns[samples->count++] = ns;
+    return 0;
+}
+
+int merge_stats(const struct worker* workers, uint32_t count, int op,
+                struct op_stats* stats)
+{
+    memset(stats, 0, sizeof(struct op_stats));
+    const int first = op < NB_OPS ? op : 0;
+    const int last = op < NB_OPS ? op : NB_OPS - 1;
+    size_t total = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        for (int o = first; o <= last; ++o) {
+            total += workers[i].samples[o].count;
+            stats->errors += workers[i].errors[o];
+        }
+    }
+    stats->requests = total;
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t* all = malloc(total * sizeof(uint64_t));
+    if (all == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t n = 0;
+    double sum = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        for (int o = first; o <= last; ++o) {
+            const struct samples* samples = &workers[i].samples[o];
+            memcpy(all + n, samples->ns, samples->count * sizeof(uint64_t));
+            n += samples->count;
+        }
+    }
+    qsort(all, total, sizeof(uint64_t), compare_ns);
+    for (size_t i = 0; i < total; ++i) {
+        sum += all[i];
+    }
+
+    // Nearest rank percentiles
+    stats->mean_ns = sum / total;
+    stats->p50_ns = all[(size_t) ceil(0.5 * total) - 1];
+    stats->p99_ns = all[(size_t) ceil(0.99 * total) - 1];
+    stats->p999_ns = all[(size_t) ceil(0.999 * total) - 1];
+    stats->max_ns = all[total - 1];
+    free(all);
+    return 0;
+}
+
+void print_stats(const char* name, const struct op_stats* stats,
+                 double duration, FILE* json, int first)
+{
+    printf("%-8s %10" PRIu64 " %8" PRIu64 " %10.1f %9.3f %9.3f %9.3f %9.3f "
+           "%9.3f\n", name, stats->requests, stats->errors,
+           stats->requests / duration, stats->mean_ns / 1e6,
+           stats->p50_ns / 1e6, stats->p99_ns / 1e6, stats->p999_ns / 1e6,
+           stats->max_ns / 1e6);
+    if (json != NULL) {
+        fprintf(json, "%s\n{\"op\":\"%s\",\"requests\":%" PRIu64
+                ",\"errors\":%" PRIu64 ",\"throughput\":%.1f"
+                ",\"mean_ns\":%.0f,\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+                ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}",
+                first ? "" : ",", name, stats->requests, stats->errors,
+                stats->requests / duration, stats->mean_ns, stats->p50_ns,
+                stats->p99_ns, stats->p999_ns, stats->max_ns);
+    }
+}
+
+void help(void)
+{
+    printf("pictDB_load [-host <HOST>] [-port <PORT>] [-c <CONNECTIONS>]\n"
+           "            [-d <SECONDS>] [-mix <OP=WEIGHT,...>] [-zipf <S>]\n"
+           "            [-image <JPEG>] [-o <FILE>]\n"
+           "  Sends requests to pictDB_server (default 127.0.0.1:8000) over\n"
+           "  CONNECTIONS kept alive connections (default %d) for SECONDS\n"
+           "  (default %d), then prints the throughput and the latencies.\n"
+           "  OP is list, thumb, small, orig (reads), insert or delete;\n"
+           "  default %s,\n"
+           "  without inserts nor deletes if no image is given.\n"
+           "  Reads pick the images listed at start with a Zipfian\n"
+           "  popularity of exponent S (default %g, 0 for uniform).\n"
+           "  Inserts send numbered copies of the JPEG, deletes remove them.\n"
+           "  -o also writes the results as JSON to FILE.\n",
+           LOAD_CONNECTIONS, LOAD_DURATION, LOAD_MIX, LOAD_ZIPF);
+}
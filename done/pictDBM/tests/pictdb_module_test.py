@@ -0,0 +1,97 @@
+import os
+import sys
+from sys import argv
+import random
+
+# The pictdb module is built by make python
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                "..", "python"))
+import pictdb
+
+pics_path = argv[1]
+db_name = "dbMODULE"
+
+allpics = [pics_path + "/" + filename for filename in os.listdir(pics_path) if filename.endswith(".jpg")]
+
+def load(filename):
+    with open(filename, "rb") as f:
+        return f.read()
+
+def createdb(name):
+    try:
+        db = pictdb.create(name, max_files=10000)
+    except pictdb.Error as e:
+        raise AssertionError("Could not create new database: " + str(e))
+    print("Database created")
+    return db
+
+def insert_cmd(db, pict_id, filename):
+    try:
+        db.insert(pict_id, load(filename))
+        return 0
+    except pictdb.Error as e:
+        return e.code
+
+def read_cmd(db, pict_id, resolution):
+    try:
+        db.read(pict_id, resolution)
+        return 0
+    except pictdb.Error as e:
+        return e.code
+
+def delete_cmd(db, pict_id):
+    try:
+        db.delete(pict_id)
+        return 0
+    except pictdb.Error as e:
+        return e.code
+
+def add_all(db, pics):
+    # Hashed in parallel, inserted in order
+    results = db.insert_many([(str(index), load(image)) for index, image in enumerate(pics)])
+    for index, (image, exit_code) in enumerate(zip(pics, results)):
+        assert exit_code == 0, \
+                "Could not add "+ image + " with id " + str(index) + " error code: " + str(exit_code)
+    print("Added all pictures in folder correctly")
+
+def resize_all(db, allpics):
+    for index, image in enumerate(allpics):
+        for resolution in ["thumb", "small"]:
+            exit_code = read_cmd(db, str(index), resolution)
+            assert exit_code == 0, "Could not read " + str(index) + " from db, exit code: " + str(exit_code)
+    print("Resized all pictures to all resolutions correctly")
+
+def add_already_present_id(db, allpics):
+    for i in range(0, random.randint(0, len(allpics))):
+        assert insert_cmd(db, str(random.randint(0, len(allpics) - 1)), random.choice(allpics)) != 0,\
+                "Error: dded image with id already in db!"
+    print("Inserting a random number of already present id returns error")
+
+def add_already_present_image(db, pics):
+    l = len(pics)
+    for i in range(1, random.randint(1, 20)):
+        length_before_add = os.stat(db_name).st_size
+        random_pic = random.choice(pics)
+        output = insert_cmd(db, str(l + 1 + i), random_pic)
+        assert output == 0, "Error: adding already present image returns error, exit code: " + str(output)
+        assert os.stat(db_name).st_size < length_before_add + os.stat(random_pic).st_size
+    print("Adding already present image does not return error")
+    print("Adding already present image deduplicates")
+
+def delete_all(db, ids):
+    for pict_id in ids:
+        assert delete_cmd(db, pict_id) == 0, "Could not delete " + pict_id
+    print("Deleted all pictures with given id")
+
+
+db = createdb(db_name)
+add_all(db, allpics)
+resize_all(db, allpics)
+add_already_present_id(db, allpics)
+add_already_present_image(db, allpics)
+to_delete = random.sample([str(i) for i in range(len(allpics))], random.randint(1, len(allpics)))
+print("Deleting " + str(len(to_delete)))
+delete_all(db, to_delete)
+remaining = set(m.pict_id for m in db)
+assert not remaining & set(to_delete), "Deleted pictures are still listed"
+db.close()
@@ -0,0 +1,271 @@
+/**
+ * @file trace.c
+ * @brief Tracing of the phases of the hot paths.
+ *
+ * Each thread records its spans into its own ring, allocated on its first
+ * span: recording takes no lock and costs two reads of the cycle counter.
+ * The ticks are converted to microseconds only when dumping, by comparing
+ * the elapsed ticks and nanoseconds since the start of the process.
+ *
+ * The dump reads the rings while their threads may keep recording: an event
+ * being overwritten at that moment may come out torn, which is acceptable
+ * for a diagnostic.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and sigaction
+
+#include "trace.h"
+
+#ifdef PICTDB_TRACE
+
+#include "pictDB.h"
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_FILENAME_LENGTH 64
+
+/**
+ * @brief A span recorded by a thread.
+ */
+struct trace_event {
+    /**
+     * @brief The name of the span, a string literal.
+     */
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * @brief The ring of the spans of a thread.
+ */
+struct trace_ring {
+    /**
+     * @brief The next ring of the list of all the rings.
+     */
+    struct trace_ring* next;
+    /**
+     * @brief Number of the thread, in the order of their first span.
+     */
+    uint32_t tid;
+    /**
+     * @brief Number of events ever recorded, the last TRACE_EVENTS of which
+     *        are kept.
+     */
+    uint64_t count;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+struct trace_ring* s_rings = NULL;
+uint32_t s_nb_rings = 0;
+pthread_mutex_t s_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t s_ring_key;
+volatile sig_atomic_t s_dump_requested = 0;
+
+// Calibration of the ticks: their value and the time at the start
+uint64_t s_origin_ticks = 0;
+uint64_t s_origin_ns = 0;
+
+/**
+ * @brief Installs the key of the rings, the dump at exit and on SIGUSR1.
+ *
+ * Run before main, so that SIGUSR1 never kills a process which did not
+ * record any span yet.
+ */
+void trace_init(void) __attribute__((constructor));
+
+/**
+ * @brief Gives the ring of the calling thread, allocating it if needed.
+ *
+ * @return The ring, NULL if it could not be allocated.
+ */
+struct trace_ring* trace_ring(void);
+
+/**
+ * @brief Gives the time of CLOCK_MONOTONIC.
+ *
+ * @return The time, in nanoseconds.
+ */
+uint64_t monotonic_ns(void);
+
+/**
+ * @brief Requests a dump, done by the next span recorded.
+ *
+ * @param sig_num The signal received.
+ */
+void trace_signal_handler(int sig_num);
+
+/**
+ * @brief Dumps the rings at exit.
+ */
+void trace_exit(void);
+
+/**
+ * @brief Takes the lock of the rings around fork.
+ */
+void trace_prefork(void);
+
+/**
+ * @brief Releases the lock of the rings in the parent after fork.
+ */
+void trace_postfork(void);
+
+/**
+ * @brief Empties the rings in the child after fork, so that it does not
+ *        dump the spans of its parent, and releases their lock.
+ */
+void trace_forked(void);
+
+
+uint64_t trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+void trace_record(const char* name, uint64_t start)
+{
+    const uint64_t end = trace_now();
+    struct trace_ring* ring = trace_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    const uint64_t count = ring->count;
+    struct trace_event* event = &ring->events[count % TRACE_EVENTS];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    __atomic_store_n(&ring->count, count + 1, __ATOMIC_RELEASE);
+
+    if (s_dump_requested) {
+        s_dump_requested = 0;
+        trace_dump();
+    }
+}
+
+int trace_dump(void)
+{
+    if (s_rings == NULL) {
+        return 0; // No span recorded, no file
+    }
+
+    char filename[TRACE_FILENAME_LENGTH];
+    snprintf(filename, TRACE_FILENAME_LENGTH, "pictdb_trace.%d.json",
+             (int) getpid());
+    FILE* output = fopen(filename, "w");
+    if (output == NULL) {
+        return ERR_IO;
+    }
+
+    // Ticks per nanosecond, measured over the whole life of the traces
+    const uint64_t ticks = trace_now() - s_origin_ticks;
+    const uint64_t ns = monotonic_ns() - s_origin_ns;
+    const double rate = ticks == 0 || ns == 0 ? 1 : (double) ticks / ns;
+    const double origin_us = s_origin_ns / 1e3;
+
+    fprintf(output, "{\"traceEvents\":[");
+    const char* separator = "";
+    pthread_mutex_lock(&s_rings_lock);
+    for (struct trace_ring* ring = s_rings; ring != NULL; ring = ring->next) {
+        const uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        const uint64_t first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+        for (uint64_t i = first; i < count; ++i) {
+            const struct trace_event* event = &ring->events[i % TRACE_EVENTS];
+            const double start = (double)(event->start - s_origin_ticks);
+            const double duration = (double)(event->end - event->start);
+            fprintf(output, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"pid\":%d,\"tid\":%" PRIu32 "}",
+                    separator, event->name,
+                    origin_us + start / rate / 1e3, duration / rate / 1e3,
+                    (int) getpid(), ring->tid);
+            separator = ",";
+        }
+    }
+    pthread_mutex_unlock(&s_rings_lock);
+    fprintf(output, "\n]}\n");
+
+    return fclose(output) == 0 ? 0 : ERR_IO;
+}
+
+void trace_init(void)
+{
+    if (pthread_key_create(&s_ring_key, NULL) != 0) {
+        return;
+    }
+    s_origin_ns = monotonic_ns();
+    s_origin_ticks = trace_now();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+    pthread_atfork(trace_prefork, trace_postfork, trace_forked);
+    atexit(trace_exit);
+}
+
+struct trace_ring* trace_ring(void)
+{
+    struct trace_ring* ring = pthread_getspecific(s_ring_key);
+    if (ring == NULL) {
+        // Never freed: the spans of a thread outlive it until the dump
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&s_rings_lock);
+        ring->tid = s_nb_rings++;
+        ring->next = s_rings;
+        s_rings = ring;
+        pthread_mutex_unlock(&s_rings_lock);
+        pthread_setspecific(s_ring_key, ring);
+    }
+    return ring;
+}
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+void trace_signal_handler(int sig_num)
+{
+    (void) sig_num;
+    s_dump_requested = 1;
+}
+
+void trace_exit(void)
+{
+    trace_dump();
+}
+
+void trace_prefork(void)
+{
+    pthread_mutex_lock(&s_rings_lock);
+}
+
+void trace_postfork(void)
+{
+    pthread_mutex_unlock(&s_rings_lock);
+}
+
+void trace_forked(void)
+{
+    for (struct trace_ring* ring = s_rings; ring != NULL; ring = ring->next) {
+        ring->count = 0;
+    }
+    pthread_mutex_unlock(&s_rings_lock);
+}
+
+#endif
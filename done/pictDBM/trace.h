@@ -0,0 +1,68 @@
+/**
+ * @file trace.h
+ * @brief Header file for the tracing of the phases of the hot paths.
+ *
+ * Built only with make TRACE=1, which defines PICTDB_TRACE. Otherwise the
+ * macros expand to nothing and the hot paths are left untouched.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_TRACE_H
+#define PICTDBPRJ_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_EVENTS 65536 // Events kept per thread, the oldest overwritten
+
+#ifdef PICTDB_TRACE
+
+/**
+ * @brief Starts a span, named by a local variable holding its start time.
+ */
+#define TRACE_BEGIN(span) const uint64_t span = trace_now()
+
+/**
+ * @brief Ends a span, recording it under the given name.
+ *
+ * The name must be a string literal: only the pointer is kept.
+ */
+#define TRACE_END(span, name) trace_record(name, span)
+
+/**
+ * @brief Gives the current time, in ticks of the cycle counter on x86-64
+ *        and in nanoseconds elsewhere.
+ *
+ * @return The current time.
+ */
+uint64_t trace_now(void);
+
+/**
+ * @brief Records a span in the ring of the calling thread.
+ *
+ * At exit, and whenever SIGUSR1 is received, the rings are written as a
+ * Chrome trace (to be opened in chrome://tracing or Perfetto) in
+ * pictdb_trace.<pid>.json. The signal only raises a flag: the dump is done
+ * by the next span recorded.
+ *
+ * @param name  The name of the span.
+ * @param start The start time of the span, given by trace_now.
+ */
+void trace_record(const char* name, uint64_t start);
+
+/**
+ * @brief Writes the rings of all threads to pictdb_trace.<pid>.json.
+ *
+ * @return 0 in case of success, an error code otherwise.
+ */
+int trace_dump(void);
+
+#else
+
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name)
+
+#endif
+
+#endif
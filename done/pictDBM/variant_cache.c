@@ -0,0 +1,298 @@
+/**
+ * @file variant_cache.c
+ * @brief Implements the cache of the resized images of a database opened
+ *        read-only.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#define _DEFAULT_SOURCE // for flock, ftruncate, pread and pwrite
+
+#include "variant_cache.h"
+#include <fcntl.h>
+#include <sys/file.h> // for flock
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VARIANT_CACHE_MIN_CAPACITY 64
+
+/**
+ * @brief Gives the slot of the index holding an image, or the empty slot
+ *        where it would be stored.
+ *
+ * @param cache The cache, whose index has at least one empty slot.
+ * @param sha   The SHA of the original image.
+ * @param max_x The maximal width of the resized image.
+ * @param max_y The maximal height of the resized image.
+ * @param encoding How the resized image is encoded.
+ * @return The slot.
+ */
+struct variant_entry* variant_slot(const struct variant_cache* cache,
+                                   const unsigned char* sha, uint16_t max_x,
+                                   uint16_t max_y,
+                                   const struct pictdb_encoding* encoding);
+
+/**
+ * @brief Adds an image to the index, growing it if need be.
+ *
+ * @param cache  The cache.
+ * @param record The header of the image in the file.
+ * @param offset The offset of the bytes of the image.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int variant_index(struct variant_cache* cache,
+                  const struct variant_record* record, uint64_t offset);
+
+/**
+ * @brief Indexes the images appended to the file since the last scan. The
+ *        caller holds a lock on the file.
+ *
+ * @param cache The cache.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int variant_scan(struct variant_cache* cache);
+
+
+int variant_cache_open(struct variant_cache* cache, const char* filename)
+{
+    if (cache == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    cache->scanned = 0;
+    cache->entries = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+    if (filename == NULL) {
+        cache->file = tmpfile();
+    } else {
+        const int fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        cache->file = fd < 0 ? NULL : fdopen(fd, "rb+");
+        if (cache->file == NULL && fd >= 0) {
+            close(fd);
+        }
+    }
+    if (cache->file == NULL) {
+        return ERR_IO;
+    }
+
+    // The first process to open the file writes its magic number
+    const int fd = fileno(cache->file);
+    if (flock(fd, LOCK_EX) != 0) {
+        variant_cache_close(cache);
+        return ERR_IO;
+    }
+    struct stat st;
+    char magic[sizeof(VARIANT_CACHE_MAGIC) - 1];
+    int ret = fstat(fd, &st) == 0 ? 0 : ERR_IO;
+    if (ret == 0 && st.st_size == 0) {
+        ret = pwrite(fd, VARIANT_CACHE_MAGIC, sizeof(magic), 0)
+              == (ssize_t) sizeof(magic) ? 0 : ERR_IO;
+    } else if (ret == 0) {
+        ret = pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)
+              && (memcmp(magic, VARIANT_CACHE_MAGIC, sizeof(magic)) == 0
+                  || memcmp(magic, VARIANT_CACHE_V1, sizeof(magic)) == 0) ?
+              0 : ERR_CORRUPTED;
+        // Its images do not tell how they were encoded: start over
+        if (ret == 0 && memcmp(magic, VARIANT_CACHE_V1, sizeof(magic)) == 0) {
+            ret = ftruncate(fd, 0) == 0
+                  && pwrite(fd, VARIANT_CACHE_MAGIC, sizeof(magic), 0)
+                  == (ssize_t) sizeof(magic) ? 0 : ERR_IO;
+        }
+    }
+    cache->scanned = sizeof(magic);
+    ret = ret == 0 ? variant_scan(cache) : ret;
+    flock(fd, LOCK_UN);
+    if (ret != 0) {
+        variant_cache_close(cache);
+    }
+    return ret;
+}
+
+void variant_cache_close(struct variant_cache* cache)
+{
+    if (cache != NULL) {
+        if (cache->file != NULL) {
+            fclose(cache->file);
+            cache->file = NULL;
+        }
+        free(cache->entries);
+        cache->entries = NULL;
+        cache->capacity = 0;
+        cache->count = 0;
+    }
+}
+
+int variant_cache_find(struct variant_cache* cache, const unsigned char* sha,
+                       uint16_t max_x, uint16_t max_y,
+                       const struct pictdb_encoding* encoding,
+                       uint64_t* offset, uint32_t* size)
+{
+    if (cache == NULL || cache->file == NULL || sha == NULL
+        || encoding == NULL || offset == NULL || size == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (cache->capacity > 0) {
+            const struct variant_entry* entry =
+                variant_slot(cache, sha, max_x, max_y, encoding);
+            if (entry->offset != 0) {
+                *offset = entry->offset;
+                *size = entry->size;
+                return 0;
+            }
+        }
+        // Missed: index what the other processes appended, then retry
+        if (pass == 0) {
+            const int fd = fileno(cache->file);
+            if (flock(fd, LOCK_SH) != 0) {
+                return ERR_IO;
+            }
+            const int ret = variant_scan(cache);
+            flock(fd, LOCK_UN);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+int variant_cache_add(struct variant_cache* cache, const unsigned char* sha,
+                      uint16_t max_x, uint16_t max_y,
+                      const struct pictdb_encoding* encoding,
+                      const void* data, uint32_t size, uint64_t* offset)
+{
+    if (cache == NULL || cache->file == NULL || sha == NULL
+        || encoding == NULL || data == NULL || offset == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const int fd = fileno(cache->file);
+    if (flock(fd, LOCK_EX) != 0) {
+        return ERR_IO;
+    }
+
+    // Index everything up to the end of the valid images, then ours
+    int ret = variant_scan(cache);
+    const struct variant_entry* entry = NULL;
+    if (ret == 0 && cache->capacity > 0) {
+        entry = variant_slot(cache, sha, max_x, max_y, encoding);
+    }
+    if (entry != NULL && entry->offset != 0) {
+        *offset = entry->offset;
+    } else if (ret == 0) {
+        struct variant_record record = {
+            .magic = VARIANT_RECORD_MAGIC, .max_x = max_x, .max_y = max_y,
+            .size = size, .encoding = {
+                .quality = encoding->quality, .flags = encoding->flags
+            }
+        };
+        memcpy(record.sha, sha, SHA256_DIGEST_LENGTH);
+        // The header is written last: until then, the image is torn
+        const uint64_t end = cache->scanned;
+        if (pwrite(fd, data, size, end + sizeof(record)) != (ssize_t) size
+            || pwrite(fd, &record, sizeof(record), end)
+            != (ssize_t) sizeof(record)) {
+            ret = ERR_IO;
+        } else {
+            cache->scanned = end + sizeof(record) + size;
+            *offset = end + sizeof(record);
+            ret = variant_index(cache, &record, *offset);
+        }
+    }
+    flock(fd, LOCK_UN);
+    return ret;
+}
+
+struct variant_entry* variant_slot(const struct variant_cache* cache,
+                                   const unsigned char* sha, uint16_t max_x,
+                                   uint16_t max_y,
+                                   const struct pictdb_encoding* encoding)
+{
+    const uint64_t hash = sha_key_hash(sha, (uint64_t) encoding->flags << 40
+                                       | (uint64_t) encoding->quality << 32
+                                       | (uint64_t) max_x << 16 | max_y);
+
+    const size_t mask = cache->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct variant_entry* entry = &cache->entries[i];
+        if (entry->offset == 0
+            || (entry->max_x == max_x && entry->max_y == max_y
+                && entry->encoding.quality == encoding->quality
+                && entry->encoding.flags == encoding->flags
+                && hashcmp(entry->sha, (unsigned char*) sha) == 0)) {
+            return entry;
+        }
+    }
+}
+
+int variant_index(struct variant_cache* cache,
+                  const struct variant_record* record, uint64_t offset)
+{
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        const size_t capacity = cache->capacity == 0 ?
+                                VARIANT_CACHE_MIN_CAPACITY :
+                                cache->capacity * 2;
+        struct variant_entry* old = cache->entries;
+        const size_t old_capacity = cache->capacity;
+        cache->entries = calloc(capacity, sizeof(struct variant_entry));
+        if (cache->entries == NULL) {
+            cache->entries = old;
+            return ERR_OUT_OF_MEMORY;
+        }
+        cache->capacity = capacity;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].offset != 0) {
+                *variant_slot(cache, old[i].sha, old[i].max_x,
+                              old[i].max_y, &old[i].encoding) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct variant_entry* entry = variant_slot(cache, record->sha,
+                                  record->max_x, record->max_y,
+                                  &record->encoding);
+    if (entry->offset == 0) {
+        memcpy(entry->sha, record->sha, SHA256_DIGEST_LENGTH);
+        entry->max_x = record->max_x;
+        entry->max_y = record->max_y;
+        entry->encoding = record->encoding;
+        entry->size = record->size;
+        entry->offset = offset;
+        ++cache->count;
+    }
+    return 0;
+}
+
+int variant_scan(struct variant_cache* cache)
+{
+    struct stat st;
+    const int fd = fileno(cache->file);
+    if (fstat(fd, &st) != 0) {
+        return ERR_IO;
+    }
+
+    int ret = 0;
+    const uint64_t end = (uint64_t) st.st_size;
+    struct variant_record record;
+    while (ret == 0 && cache->scanned + sizeof(record) <= end) {
+        if (pread(fd, &record, sizeof(record), cache->scanned)
+            != (ssize_t) sizeof(record)) {
+            ret = ERR_IO;
+        } else if (memcmp(record.magic, VARIANT_RECORD_MAGIC,
+                          sizeof(record.magic)) != 0
+                   || cache->scanned + sizeof(record) + record.size > end) {
+            // Torn by a process which died writing it: the next image
+            // added is written over it
+            break;
+        } else {
+            ret = variant_index(cache, &record,
+                                cache->scanned + sizeof(record));
+            cache->scanned += sizeof(record) + record.size;
+        }
+    }
+    return ret;
+}
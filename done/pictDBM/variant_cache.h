@@ -0,0 +1,131 @@
+/**
+ * @file variant_cache.h
+ * @brief Header file for the cache of the resized images of a database
+ *        opened read-only.
+ *
+ * The images resized for such a database cannot be written to it: they are
+ * appended to a sidecar file instead, named after the database with the
+ * VARIANT_CACHE_SUFFIX suffix. The file is only ever appended to, under an
+ * exclusive lock, so that many processes may share it; they see the images
+ * added by the others when they miss one.
+ *
+ * @author Vincenzo Bazzucchi
+ * @author Nicolas Phan Van
+ */
+
+#ifndef PICTDBPRJ_VARIANT_CACHE_H
+#define PICTDBPRJ_VARIANT_CACHE_H
+
+#include "pictDB.h"
+
+#define VARIANT_CACHE_SUFFIX ".variants"
+#define VARIANT_CACHE_MAGIC  "PDBV2\n\0\0" // First 8 bytes of the file
+#define VARIANT_CACHE_V1     "PDBV1\n\0\0" // Those of a file without encodings
+#define VARIANT_RECORD_MAGIC "PDBR"
+
+/**
+ * @brief Header of an image in the cache file, followed by its bytes.
+ *
+ * The images are keyed by the SHA of the original image, the maximal
+ * dimensions they were resized to and their encoding, so that databases
+ * holding the same images may share a cache, and that images encoded again
+ * by reencode are not served as they were.
+ */
+struct variant_record {
+    char magic[4];
+    uint16_t max_x;
+    uint16_t max_y;
+    uint32_t size;
+    struct pictdb_encoding encoding;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+};
+
+/**
+ * @brief An image of the cache file, in the in memory index.
+ */
+struct variant_entry {
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint16_t max_x;
+    uint16_t max_y;
+    uint32_t size;
+    struct pictdb_encoding encoding;
+    /**
+     * @brief Offset of the bytes of the image, 0 for an empty slot.
+     */
+    uint64_t offset;
+};
+
+/**
+ * @brief A cache file and its index.
+ */
+struct variant_cache {
+    FILE* file;
+    /**
+     * @brief Size of the part of the file already indexed.
+     */
+    uint64_t scanned;
+    /**
+     * @brief Open addressing hash table of the images, of a power of two
+     *        capacity.
+     */
+    struct variant_entry* entries;
+    size_t capacity;
+    size_t count;
+};
+
+/**
+ * @brief Opens a cache file, creating it if need be, and indexes it.
+ *
+ * @param cache    The cache to initialize.
+ * @param filename The cache file, or NULL for a temporary file private to
+ *                 the process.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int variant_cache_open(struct variant_cache* cache, const char* filename);
+
+/**
+ * @brief Closes a cache file and frees its index.
+ *
+ * @param cache    The cache.
+ */
+void variant_cache_close(struct variant_cache* cache);
+
+/**
+ * @brief Looks for a resized image, first in the index, then in what the
+ *        other processes appended since the last look.
+ *
+ * @param cache    The cache.
+ * @param sha      The SHA of the original image.
+ * @param max_x    The maximal width of the resized image.
+ * @param max_y    The maximal height of the resized image.
+ * @param encoding How the resized image is encoded.
+ * @param offset   Location where the offset of the image will be stored.
+ * @param size     Location where the size of the image will be stored.
+ * @return 0 if the image was found, ERR_FILE_NOT_FOUND if it is not cached,
+ *         another int coded in error.h in case of errors
+ */
+int variant_cache_find(struct variant_cache* cache, const unsigned char* sha,
+                       uint16_t max_x, uint16_t max_y,
+                       const struct pictdb_encoding* encoding,
+                       uint64_t* offset, uint32_t* size);
+
+/**
+ * @brief Appends a resized image to a cache file. If another process added
+ *        the same one in the meantime, its copy is used instead.
+ *
+ * @param cache    The cache.
+ * @param sha      The SHA of the original image.
+ * @param max_x    The maximal width of the resized image.
+ * @param max_y    The maximal height of the resized image.
+ * @param encoding How the resized image is encoded.
+ * @param data     The bytes of the image.
+ * @param size     The size of the image.
+ * @param offset   Location where the offset of the image will be stored.
+ * @return 0 if no errors occur, an int coded in error.h in case of errors
+ */
+int variant_cache_add(struct variant_cache* cache, const unsigned char* sha,
+                      uint16_t max_x, uint16_t max_y,
+                      const struct pictdb_encoding* encoding,
+                      const void* data, uint32_t size, uint64_t* offset);
+
+#endif